@@ -42,6 +42,26 @@
 */
 /* #define FZ_ENABLE_JS 1 */
 
+/*
+	Choose whether to memory map files opened with fz_open_file.
+	By default files are read with stdio. Enabling this on POSIX
+	systems maps regular files instead, so that seeking and reading
+	are done directly from the page cache. Only enable it if files
+	are never truncated while open (for instance, not in a viewer
+	that reloads files as they are rewritten), as touching a mapping
+	past the end of a truncated file raises SIGBUS.
+*/
+/* #define FZ_ENABLE_MMAP 1 */
+
+/*
+	Choose whether to use atomic reference counting.
+	By default reference counts are protected by the allocation
+	lock. Enable this to use compiler atomics (gcc and clang only)
+	for objects that are not held in the store instead, reducing
+	lock contention when rendering with several threads.
+*/
+/* #define FZ_ATOMIC_REFS */
+
 /*
 	Choose which fonts to include.
 	By default we include the base 14 PDF fonts,
@@ -149,6 +169,15 @@
 #define FZ_ENABLE_JS 1
 #endif /* FZ_ENABLE_JS */
 
+#ifndef FZ_ENABLE_MMAP
+#define FZ_ENABLE_MMAP 0
+#endif /* FZ_ENABLE_MMAP */
+
+#if defined(_WIN32) || defined(_WIN64)
+#undef FZ_ENABLE_MMAP
+#define FZ_ENABLE_MMAP 0
+#endif
+
 /* If Epub and HTML are both disabled, disable SIL fonts */
 #if FZ_ENABLE_HTML == 0 && FZ_ENABLE_EPUB == 0
 #undef TOFU_SIL
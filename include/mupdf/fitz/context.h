@@ -24,6 +24,8 @@ typedef struct fz_locks_context_s fz_locks_context;
 typedef struct fz_tuning_context_s fz_tuning_context;
 typedef struct fz_store_s fz_store;
 typedef struct fz_glyph_cache_s fz_glyph_cache;
+typedef struct fz_glyph_front_s fz_glyph_front;
+typedef struct fz_disk_store_s fz_disk_store;
 typedef struct fz_document_handler_context_s fz_document_handler_context;
 typedef struct fz_output_context_s fz_output_context;
 typedef struct fz_context_s fz_context;
@@ -123,9 +125,14 @@ struct fz_context_s
 	fz_style_context *style;
 	fz_store *store;
 	fz_glyph_cache *glyph_cache;
+	fz_glyph_front *glyph_front;
+	fz_disk_store *disk_store;
 	fz_tuning_context *tuning;
 	fz_document_handler_context *handler;
 	fz_output_context *output;
+
+	/* How many times this thread holds FZ_LOCK_PDF (never shared) */
+	int pdf_lock_depth;
 };
 
 /*
@@ -252,6 +259,31 @@ typedef void (fz_tune_image_decode_fn)(void *arg, int w, int h, int l2factor, fz
 */
 typedef int (fz_tune_image_scale_fn)(void *arg, int dst_w, int dst_h, int src_w, int src_h);
 
+/*
+	fz_parallel_job_fn: A piece of work that can be split into
+	independent parts.
+
+	job: The opaque job argument given to the parallel function.
+
+	index: Which part (from 0 to count-1) to do.
+*/
+typedef void (fz_parallel_job_fn)(void *job, int index);
+
+/*
+	fz_tune_parallel_fn: Run count parts of a job, possibly at the
+	same time from several threads, returning once all of them have
+	completed. This is used to split heavy computations (such as
+	smooth scaling of large images) across worker threads; the parts
+	never use the calling thread's fz_context, only clones of it.
+
+	arg: The caller supplied opaque argument.
+
+	count: The number of parts to run.
+
+	fn, job: Function to call for each part, and its argument.
+*/
+typedef void (fz_tune_parallel_fn)(void *arg, int count, fz_parallel_job_fn *fn, void *job);
+
 /*
 	fz_tune_image_decode: Set the tuning function to use for
 	image decode.
@@ -272,6 +304,20 @@ void fz_tune_image_decode(fz_context *ctx, fz_tune_image_decode_fn *image_decode
 */
 void fz_tune_image_scale(fz_context *ctx, fz_tune_image_scale_fn *image_scale, void *arg);
 
+/*
+	fz_tune_parallel: Set the function to use for splitting work
+	across threads.
+
+	parallel: Function to use, or NULL to do all work in the calling
+	thread (the default).
+
+	arg: Opaque argument to be passed to parallel function.
+
+	threads: The number of threads the parallel function can run
+	at once; work is only split if this is greater than 1.
+*/
+void fz_tune_parallel(fz_context *ctx, fz_tune_parallel_fn *parallel, void *arg, int threads);
+
 /*
 	fz_aa_level: Get the number of bits of antialiasing we are
 	using (for graphics). Between 0 and 8.
@@ -385,6 +431,9 @@ enum {
 	FZ_LOCK_ALLOC = 0,
 	FZ_LOCK_FREETYPE,
 	FZ_LOCK_GLYPHCACHE,
+	FZ_LOCK_GLYPHCACHE_LAST = FZ_LOCK_GLYPHCACHE + 3, /* one per glyph cache shard */
+	FZ_LOCK_JPX,
+	FZ_LOCK_PDF,
 	FZ_LOCK_MAX
 };
 
@@ -597,12 +646,35 @@ fz_unlock(fz_context *ctx, int lock)
 	ctx->locks->unlock(ctx->locks->user, lock);
 }
 
+/*
+	Reference counting for objects that are not in the store.
+
+	By default the counts are protected by FZ_LOCK_ALLOC. Building
+	with FZ_ATOMIC_REFS defined (see config.h) uses lock free
+	compare and swap instead, so that threads keeping and dropping
+	shared objects (fonts, paths, pdf objects etc) do not serialise
+	on the allocator lock. Negative counts mark static objects and
+	are never changed.
+*/
+#if defined(FZ_ATOMIC_REFS) && (defined(__GNUC__) || defined(__clang__))
+#define FZ_USE_ATOMIC_REFS
+#endif
+
 static inline void *
 fz_keep_imp(fz_context *ctx, void *p, int *refs)
 {
 	if (p)
 	{
 		(void)Memento_checkIntPointerOrNull(refs);
+#ifdef FZ_USE_ATOMIC_REFS
+		{
+			int old = __atomic_load_n(refs, __ATOMIC_RELAXED);
+			while (old > 0 && !__atomic_compare_exchange_n(refs, &old, old + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				;
+			if (old > 0)
+				(void)Memento_takeRef(p);
+		}
+#else
 		fz_lock(ctx, FZ_LOCK_ALLOC);
 		if (*refs > 0)
 		{
@@ -610,6 +682,7 @@ fz_keep_imp(fz_context *ctx, void *p, int *refs)
 			++*refs;
 		}
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
+#endif
 	}
 	return p;
 }
@@ -620,6 +693,15 @@ fz_keep_imp8(fz_context *ctx, void *p, int8_t *refs)
 	if (p)
 	{
 		(void)Memento_checkBytePointerOrNull(refs);
+#ifdef FZ_USE_ATOMIC_REFS
+		{
+			int8_t old = __atomic_load_n(refs, __ATOMIC_RELAXED);
+			while (old > 0 && !__atomic_compare_exchange_n(refs, &old, old + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				;
+			if (old > 0)
+				(void)Memento_takeRef(p);
+		}
+#else
 		fz_lock(ctx, FZ_LOCK_ALLOC);
 		if (*refs > 0)
 		{
@@ -627,6 +709,7 @@ fz_keep_imp8(fz_context *ctx, void *p, int8_t *refs)
 			++*refs;
 		}
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
+#endif
 	}
 	return p;
 }
@@ -637,6 +720,15 @@ fz_keep_imp16(fz_context *ctx, void *p, int16_t *refs)
 	if (p)
 	{
 		(void)Memento_checkShortPointerOrNull(refs);
+#ifdef FZ_USE_ATOMIC_REFS
+		{
+			int16_t old = __atomic_load_n(refs, __ATOMIC_RELAXED);
+			while (old > 0 && !__atomic_compare_exchange_n(refs, &old, old + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				;
+			if (old > 0)
+				(void)Memento_takeRef(p);
+		}
+#else
 		fz_lock(ctx, FZ_LOCK_ALLOC);
 		if (*refs > 0)
 		{
@@ -644,6 +736,7 @@ fz_keep_imp16(fz_context *ctx, void *p, int16_t *refs)
 			++*refs;
 		}
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
+#endif
 	}
 	return p;
 }
@@ -655,6 +748,16 @@ fz_drop_imp(fz_context *ctx, void *p, int *refs)
 	{
 		int drop;
 		(void)Memento_checkIntPointerOrNull(refs);
+#ifdef FZ_USE_ATOMIC_REFS
+		{
+			int old = __atomic_load_n(refs, __ATOMIC_RELAXED);
+			while (old > 0 && !__atomic_compare_exchange_n(refs, &old, old - 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+				;
+			if (old > 0)
+				(void)Memento_dropIntRef(p);
+			drop = (old == 1);
+		}
+#else
 		fz_lock(ctx, FZ_LOCK_ALLOC);
 		if (*refs > 0)
 		{
@@ -664,6 +767,7 @@ fz_drop_imp(fz_context *ctx, void *p, int *refs)
 		else
 			drop = 0;
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
+#endif
 		return drop;
 	}
 	return 0;
@@ -676,6 +780,16 @@ fz_drop_imp8(fz_context *ctx, void *p, int8_t *refs)
 	{
 		int drop;
 		(void)Memento_checkBytePointerOrNull(refs);
+#ifdef FZ_USE_ATOMIC_REFS
+		{
+			int8_t old = __atomic_load_n(refs, __ATOMIC_RELAXED);
+			while (old > 0 && !__atomic_compare_exchange_n(refs, &old, old - 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+				;
+			if (old > 0)
+				(void)Memento_dropByteRef(p);
+			drop = (old == 1);
+		}
+#else
 		fz_lock(ctx, FZ_LOCK_ALLOC);
 		if (*refs > 0)
 		{
@@ -685,6 +799,7 @@ fz_drop_imp8(fz_context *ctx, void *p, int8_t *refs)
 		else
 			drop = 0;
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
+#endif
 		return drop;
 	}
 	return 0;
@@ -697,6 +812,16 @@ fz_drop_imp16(fz_context *ctx, void *p, int16_t *refs)
 	{
 		int drop;
 		(void)Memento_checkShortPointerOrNull(refs);
+#ifdef FZ_USE_ATOMIC_REFS
+		{
+			int16_t old = __atomic_load_n(refs, __ATOMIC_RELAXED);
+			while (old > 0 && !__atomic_compare_exchange_n(refs, &old, old - 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+				;
+			if (old > 0)
+				(void)Memento_dropShortRef(p);
+			drop = (old == 1);
+		}
+#else
 		fz_lock(ctx, FZ_LOCK_ALLOC);
 		if (*refs > 0)
 		{
@@ -706,6 +831,7 @@ fz_drop_imp16(fz_context *ctx, void *p, int16_t *refs)
 		else
 			drop = 0;
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
+#endif
 		return drop;
 	}
 	return 0;
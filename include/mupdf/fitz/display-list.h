@@ -5,6 +5,7 @@
 #include "mupdf/fitz/context.h"
 #include "mupdf/fitz/geometry.h"
 #include "mupdf/fitz/device.h"
+#include "mupdf/fitz/buffer.h"
 
 /*
 	Display list device -- record and play back device commands.
@@ -112,4 +113,39 @@ fz_image *fz_new_image_from_display_list(fz_context *ctx, float w, float h, fz_d
 */
 int fz_display_list_is_empty(fz_context *ctx, const fz_display_list *list);
 
+/*
+	fz_serialize_display_list: Write a display list to a buffer in
+	a compact binary form that can be reloaded without the document
+	it came from.
+
+	Fonts, images, shadings and colorspaces are stored once and
+	shared by every use within the list. Colors, images and shadings
+	in colorspaces that cannot be stored (Separation, DeviceN and
+	Cal spaces) are converted to RGB; mesh shadings in such spaces
+	are dropped with a warning.
+
+	The format is private to this version of the library.
+*/
+fz_buffer *fz_serialize_display_list(fz_context *ctx, fz_display_list *list);
+
+/*
+	fz_save_display_list: Serialize a display list to a file.
+*/
+void fz_save_display_list(fz_context *ctx, fz_display_list *list, const char *filename);
+
+/*
+	fz_new_display_list_from_buffer: Recreate a display list from
+	the data written by fz_serialize_display_list.
+
+	The buffer is not referenced once this returns.
+*/
+fz_display_list *fz_new_display_list_from_buffer(fz_context *ctx, fz_buffer *buf);
+
+/*
+	fz_load_display_list: Recreate a display list from a file
+	written by fz_save_display_list. The file is mapped into memory
+	while it is read where the platform allows.
+*/
+fz_display_list *fz_load_display_list(fz_context *ctx, const char *filename);
+
 #endif
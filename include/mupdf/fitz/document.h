@@ -98,6 +98,13 @@ typedef fz_page *(fz_document_load_page_fn)(fz_context *ctx, fz_document *doc, i
 */
 typedef int (fz_document_lookup_metadata_fn)(fz_context *ctx, fz_document *doc, const char *key, char *buf, int size);
 
+/*
+	fz_document_fingerprint_fn: Type for a function to identify
+	the file a document was opened from. See fz_document_fingerprint
+	for more information.
+*/
+typedef int (fz_document_fingerprint_fn)(fz_context *ctx, fz_document *doc, unsigned char digest[16]);
+
 /*
 	fz_document_output_intent_fn: Return output intent color space if it exists
 */
@@ -236,6 +243,7 @@ struct fz_document_s
 	fz_document_load_page_fn *load_page;
 	fz_document_lookup_metadata_fn *lookup_metadata;
 	fz_document_output_intent_fn *get_output_intent;
+	fz_document_fingerprint_fn *fingerprint;
 	int did_layout;
 	int is_reflowable;
 };
@@ -588,6 +596,19 @@ int fz_has_permission(fz_context *ctx, fz_document *doc, fz_permission p);
 */
 int fz_lookup_metadata(fz_context *ctx, fz_document *doc, const char *key, char *buf, int size);
 
+/*
+	fz_document_fingerprint: Identify the file a document was opened
+	from, so that results made from it can be kept between runs (as
+	in the disk store) and found again when the same file is opened.
+
+	digest: Filled in with the fingerprint.
+
+	Returns non zero if the document could be identified; zero if the
+	format does not support it, or the document has been changed
+	since it was opened.
+*/
+int fz_document_fingerprint(fz_context *ctx, fz_document *doc, unsigned char digest[16]);
+
 #define FZ_META_FORMAT "format"
 #define FZ_META_ENCRYPTION "encryption"
 
@@ -7,6 +7,15 @@
 #include "mupdf/fitz/pixmap.h"
 
 void fz_purge_glyph_cache(fz_context *ctx);
+
+/*
+	fz_set_glyph_cache_size: Set the maximum number of bytes of rendered
+	glyphs kept in the shared glyph cache. The limit is split evenly
+	between the shards of the cache, and the least recently used glyphs
+	of a shard are evicted first. The default is 1Mb.
+*/
+void fz_set_glyph_cache_size(fz_context *ctx, size_t size);
+
 fz_pixmap *fz_render_glyph_pixmap(fz_context *ctx, fz_font*, int, fz_matrix *, const fz_irect *scissor, int aa);
 void fz_render_t3_glyph_direct(fz_context *ctx, fz_device *dev, fz_font *font, int gid, const fz_matrix *trm, void *gstate, int nestedDepth);
 void fz_prepare_t3_glyph(fz_context *ctx, fz_font *font, int gid, int nestedDepth);
@@ -287,6 +287,19 @@ void fz_load_pnm_info(fz_context *ctx, const unsigned char *data, size_t size, i
 int fz_load_tiff_subimage_count(fz_context *ctx, const unsigned char *buf, size_t len);
 fz_pixmap *fz_load_tiff_subimage(fz_context *ctx, const unsigned char *buf, size_t len, int subimage);
 
+/*
+	fz_load_jpx_subarea: Decode part of a JPEG 2000 image, at a
+	reduced resolution if the codestream allows it.
+
+	subarea: The area of the full size image wanted, or NULL for
+	the whole image. Updated to the area actually decoded.
+
+	l2factor: The log2 of the wanted downscale, or NULL for full
+	resolution. Updated to the amount of downscaling still to be
+	done on the returned pixmap.
+*/
+fz_pixmap *fz_load_jpx_subarea(fz_context *ctx, const unsigned char *data, size_t size, fz_colorspace *cs, fz_irect *subarea, int *l2factor);
+
 /*
 	fz_image_resolution: Request the natural resolution
 	of an image.
@@ -21,12 +21,65 @@ void fz_save_pixmap_as_png(fz_context *ctx, fz_pixmap *pixmap, const char *filen
 */
 void fz_write_pixmap_as_png(fz_context *ctx, fz_output *out, const fz_pixmap *pixmap);
 
+/*
+	PNG output options.
+
+	compression: deflate level, from FZ_DEFLATE_NONE to
+	FZ_DEFLATE_BEST, or FZ_DEFLATE_DEFAULT.
+
+	filter: the row filter to use for every row (one of the
+	FZ_PNG_FILTER_* values).
+*/
+typedef struct fz_png_options_s fz_png_options;
+
+enum
+{
+	FZ_PNG_FILTER_NONE = 0,
+	FZ_PNG_FILTER_SUB = 1,
+	FZ_PNG_FILTER_UP = 2,
+	FZ_PNG_FILTER_AVERAGE = 3,
+	FZ_PNG_FILTER_PAETH = 4
+};
+
+struct fz_png_options_s
+{
+	int compression;
+	int filter;
+};
+
+/*
+	fz_parse_png_options: Parse PNG options, filling in the defaults
+	(default compression, sub filter) for any that are not given.
+
+	Currently defined options and values are as follows:
+
+		compression=n: Deflate level, 0 (none) to 9 (best)
+		filter=none: No row filter
+		filter=sub: Difference from the pixel to the left (default)
+		filter=up: Difference from the pixel above
+		filter=average: Difference from the average of those two
+		filter=paeth: Paeth predictor
+*/
+fz_png_options *fz_parse_png_options(fz_context *ctx, fz_png_options *opts, const char *args);
+
 /*
 	fz_new_png_band_writer: Obtain a fz_band_writer instance
 	for producing PNG output.
 */
 fz_band_writer *fz_new_png_band_writer(fz_context *ctx, fz_output *out);
 
+/*
+	fz_new_png_band_writer_with_options: As fz_new_png_band_writer,
+	but with the given options (NULL for the defaults).
+
+	If a parallel function has been set with fz_tune_parallel, large
+	images are deflated in blocks of rows at the same time. Each block
+	ends on a byte boundary and is primed with the previous 32K of
+	data, so the result is a single zlib stream, a little larger than
+	one deflated in one go.
+*/
+fz_band_writer *fz_new_png_band_writer_with_options(fz_context *ctx, fz_output *out, const fz_png_options *options);
+
 /*
 	Create a new buffer containing the image/pixmap in PNG format.
 */
@@ -388,6 +388,15 @@ void fz_unpack_tile(fz_context *ctx, fz_pixmap *dst, unsigned char * restrict sr
 typedef void (fz_pixmap_converter)(fz_context *ctx, fz_pixmap *dp, fz_pixmap *sp, fz_colorspace *prf, const fz_default_colorspaces *default_cs, const fz_color_params *color_params, int copy_spots);
 fz_pixmap_converter *fz_lookup_pixmap_converter(fz_context *ctx, fz_colorspace *ds, fz_colorspace *ss);
 
+/*
+	fz_run_pixmap_converter: Color convert a pixmap with a converter
+	from fz_lookup_pixmap_converter. If a parallel function has been
+	set with fz_tune_parallel, large pixmaps are split into bands of
+	rows that are converted at the same time, each band with its own
+	cloned context.
+*/
+void fz_run_pixmap_converter(fz_context *ctx, fz_pixmap_converter *pc, fz_pixmap *dst, fz_pixmap *src, fz_colorspace *prf, const fz_default_colorspaces *default_cs, const fz_color_params *color_params, int copy_spots);
+
 /*
 	fz_md5_pixmap: Return the md5 digest for a pixmap
 */
@@ -113,6 +113,10 @@ static inline int fz_key_storable_needs_reaping(fz_context *ctx, const fz_key_st
 	item in the store. We therefore provide a way to 'batch' such
 	reap passes together, using fz_defer_reap_start/fz_defer_reap_end
 	to bracket a region in which many may be triggered.
+
+	The type structure also gives a short name for the kind of value
+	stored with it (such as "font"), which is used when reporting
+	statistics about the store.
 */
 typedef struct fz_store_hash_s
 {
@@ -159,6 +163,7 @@ typedef struct fz_store_type_s
 	int (*cmp_key)(fz_context *ctx, void *a, void *b);
 	void (*format_key)(fz_context *ctx, char *buf, int size, void *key);
 	int (*needs_reap)(fz_context *ctx, void *key);
+	const char *name;
 } fz_store_type;
 
 /*
@@ -258,10 +263,123 @@ int fz_store_scavenge(fz_context *ctx, size_t size, int *phase);
 */
 int fz_shrink_store(fz_context *ctx, unsigned int percent);
 
+/*
+	fz_set_store_soft_limit: Set a size for the store to be trimmed
+	back towards, below its hard maximum. Storing an item above the
+	soft limit evicts only a few items, so that the cost of keeping
+	to the limit is spread out rather than paid in long pauses.
+
+	soft_max: The soft limit in bytes, or FZ_STORE_UNLIMITED for none
+	(the default).
+*/
+void fz_set_store_soft_limit(fz_context *ctx, size_t soft_max);
+
+/*
+	fz_trim_store: Evict unused items until the store is within its
+	soft limit. Intended to be called when idle, or periodically from
+	a background thread (with its own cloned context).
+
+	Returns non zero if the store is within its soft limit.
+*/
+int fz_trim_store(fz_context *ctx);
+
+/*
+	fz_store_type_stats: Usage of the store by one type of item.
+
+	items, size: The number of items of this type in the store, and
+	their total size in bytes.
+
+	hits, misses: The number of lookups that did, and did not, find
+	an item.
+
+	evictions: The number of items evicted to make space.
+*/
+typedef struct fz_store_type_stats_s
+{
+	size_t items;
+	size_t size;
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+} fz_store_type_stats;
+
+/*
+	fz_lookup_store_type_stats: Get the statistics kept for a given
+	type of item.
+
+	Returns zero (and zeroed stats) if no item of this type has been
+	stored or looked for.
+*/
+int fz_lookup_store_type_stats(fz_context *ctx, const fz_store_type *type, fz_store_type_stats *stats);
+
+/* The store keeps separate statistics for this many types of item. */
+#define FZ_STORE_MAX_TYPES 32
+
+/*
+	fz_store_stats: A snapshot of the usage of the store.
+
+	max, size: The maximum size of the store, and the total size of
+	the items in it.
+
+	total: The statistics for all items together.
+
+	count: The number of entries in type. Any types of item beyond the
+	first FZ_STORE_MAX_TYPES seen are counted together, under the name
+	"other".
+*/
+typedef struct fz_store_stats_s
+{
+	size_t max;
+	size_t size;
+	fz_store_type_stats total;
+	int count;
+	struct
+	{
+		const char *name;
+		fz_store_type_stats stats;
+	} type[FZ_STORE_MAX_TYPES + 1];
+} fz_store_stats;
+
+/*
+	fz_get_store_stats: Take a snapshot of the usage of the store,
+	for every type of item that has been stored or looked for since
+	the store was created.
+*/
+void fz_get_store_stats(fz_context *ctx, fz_store_stats *stats);
+
+/*
+	fz_print_store_stats: Print the usage of the store as a table,
+	with one line for each type of item, and a line for the totals.
+*/
+void fz_print_store_stats(fz_context *ctx, fz_output *out);
+
 typedef int (fz_store_filter_fn)(fz_context *ctx, void *arg, void *key);
 
 void fz_filter_store(fz_context *ctx, fz_store_filter_fn *fn, void *arg, const fz_store_type *type);
 
+/*
+	fz_enable_disk_store: Add a second level store kept as files in
+	a directory, so that expensive results (such as decoded images
+	and page display lists) can be reused by later runs and other
+	processes working on the same documents. Results are written there as they are made, and
+	looked for there whenever they are not found in the store.
+
+	This should be called before the context is cloned or used from
+	other threads. Throws if the directory cannot be created.
+
+	path: The directory to use. It is created if it does not exist.
+
+	max_size: The maximum size (in bytes) of the directory. The
+	least recently used entries are deleted to keep it below this.
+*/
+void fz_enable_disk_store(fz_context *ctx, const char *path, size_t max_size);
+
+/*
+	fz_disable_disk_store: Stop using the disk store. The directory
+	and its contents are left in place.
+*/
+void fz_disable_disk_store(fz_context *ctx);
+
 /*
 	fz_debug_store: Dump the contents of the store for debugging.
 */
@@ -64,6 +64,14 @@
 #endif
 #endif
 
+/* x86-64 SIMD code is selected at runtime, so needs gcc/clang's
+ * per-function target attributes rather than global -m flags. */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#ifndef ARCH_X86_64
+#define ARCH_X86_64
+#endif
+#endif
+
 /*
 	Some differences in libc can be smoothed over
 */
@@ -17,6 +17,20 @@ fz_display_list *fz_new_display_list_from_page_number(fz_context *ctx, fz_docume
 fz_display_list *fz_new_display_list_from_page_contents(fz_context *ctx, fz_page *page);
 fz_display_list *fz_new_display_list_from_annot(fz_context *ctx, fz_annot *annot);
 
+/*
+	fz_load_display_list_from_disk_store: Look in the disk store for
+	the display list of a page, as saved by an earlier run (or another
+	process) with fz_save_display_list_to_disk_store. Returns NULL if
+	there is no disk store, the document has no fingerprint (see
+	fz_document_fingerprint) or the list is not there.
+
+	fz_save_display_list_to_disk_store: Keep the display list of a
+	page, as made by fz_new_display_list_from_page, in the disk store.
+	Do not save lists that are incomplete because of errors.
+*/
+fz_display_list *fz_load_display_list_from_disk_store(fz_context *ctx, fz_document *doc, int number);
+void fz_save_display_list_to_disk_store(fz_context *ctx, fz_document *doc, int number, fz_display_list *list);
+
 /*
 	fz_new_pixmap_from_page: Render the page to a pixmap using the transform and colorspace.
 */
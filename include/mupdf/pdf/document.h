@@ -104,6 +104,23 @@ pdf_document *pdf_keep_document(fz_context *ctx, pdf_document *doc);
 */
 pdf_document *pdf_specifics(fz_context *ctx, fz_document *doc);
 
+/*
+	pdf_enable_threading: Allow pages of a document to be loaded and
+	run from several threads at once, each with its own clone of the
+	context. Object loading, stream reading and resource loading are
+	then serialised with FZ_LOCK_PDF, and streams are read from the
+	file in one go rather than as they are decoded.
+
+	Call this before any other thread uses the document. If the
+	cross reference table does not match the file, the document is
+	repaired first; once shared it is never repaired, and objects
+	that would need a repair fail to load instead. Appearance streams
+	for annotations that lack them are made now, since making them
+	edits the document. Once shared, the document cannot be edited:
+	creating or updating objects throws. Nor may it be saved.
+*/
+void pdf_enable_threading(fz_context *ctx, pdf_document *doc);
+
 /*
 	pdf_document_from_fz_document,
 	pdf_page_from_fz_page,
@@ -666,6 +683,13 @@ struct pdf_document_s
 	int orphans_max;
 	int orphans_count;
 	pdf_obj **orphans;
+
+	/* See pdf_fingerprint */
+	int has_fingerprint;
+	unsigned char fingerprint[16];
+
+	/* Shared between threads; see pdf_enable_threading */
+	int threaded;
 };
 
 /*
@@ -845,6 +869,7 @@ struct pdf_write_options_s
 	int do_garbage; /* Garbage collect objects before saving; 1=gc, 2=re-number, 3=de-duplicate. */
 	int do_linear; /* Write linearised. */
 	int do_clean; /* Sanitize content streams. */
+	int do_objstms; /* Pack objects into object streams and write a cross reference stream. */
 	int continue_on_error; /* If set, errors are (optionally) counted and writing continues. */
 	int *errors; /* Pointer to a place to store a count of errors */
 };
@@ -858,6 +883,7 @@ struct pdf_write_options_s
 		a: ascii hex encode
 		z: deflate
 		s: sanitize content streams
+		Z: use object streams
 */
 pdf_write_options *pdf_parse_write_options(fz_context *ctx, pdf_write_options *opts, const char *args);
 
@@ -113,6 +113,7 @@ pdf_font_desc *pdf_load_hail_mary_font(fz_context *ctx, pdf_document *doc);
 pdf_font_desc *pdf_new_font_desc(fz_context *ctx);
 pdf_font_desc *pdf_keep_font(fz_context *ctx, pdf_font_desc *fontdesc);
 void pdf_drop_font(fz_context *ctx, pdf_font_desc *font);
+void pdf_drop_font_imp(fz_context *ctx, fz_storable *fontdesc);
 
 void pdf_print_font(fz_context *ctx, fz_output *out, pdf_font_desc *fontdesc);
 
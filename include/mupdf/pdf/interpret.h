@@ -244,6 +244,8 @@ pdf_processor *pdf_new_output_processor(fz_context *ctx, fz_output *out, int ahx
 pdf_processor *pdf_new_filter_processor(fz_context *ctx, pdf_processor *chain, pdf_obj *old_res, pdf_obj *new_res);
 
 /* Functions to actually process annotations, glyphs and general stream objects */
+typedef struct pdf_content_ops_s pdf_content_ops;
+void pdf_drop_content_ops_imp(fz_context *ctx, fz_storable *ops);
 void pdf_process_contents(fz_context *ctx, pdf_processor *proc, pdf_document *doc, pdf_obj *obj, pdf_obj *res, fz_cookie *cookie);
 void pdf_process_annot(fz_context *ctx, pdf_processor *proc, pdf_document *doc, pdf_page *page, pdf_annot *annot, fz_cookie *cookie);
 void pdf_process_glyph(fz_context *ctx, pdf_processor *proc, pdf_document *doc, pdf_obj *resources, fz_buffer *contents);
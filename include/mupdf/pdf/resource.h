@@ -32,6 +32,7 @@ typedef struct pdf_function_s pdf_function;
 void pdf_eval_function(fz_context *ctx, pdf_function *func, const float *in, int inlen, float *out, int outlen);
 pdf_function *pdf_keep_function(fz_context *ctx, pdf_function *func);
 void pdf_drop_function(fz_context *ctx, pdf_function *func);
+void pdf_drop_function_imp(fz_context *ctx, fz_storable *func);
 size_t pdf_function_size(fz_context *ctx, pdf_function *func);
 pdf_function *pdf_load_function(fz_context *ctx, pdf_obj *ref, int in, int out);
 
@@ -71,6 +72,7 @@ struct pdf_pattern_s
 pdf_pattern *pdf_load_pattern(fz_context *ctx, pdf_document *doc, pdf_obj *obj);
 pdf_pattern *pdf_keep_pattern(fz_context *ctx, pdf_pattern *pat);
 void pdf_drop_pattern(fz_context *ctx, pdf_pattern *pat);
+void pdf_drop_pattern_imp(fz_context *ctx, fz_storable *pat);
 
 /*
  * XObject
@@ -89,6 +91,7 @@ pdf_xobject *pdf_load_xobject(fz_context *ctx, pdf_document *doc, pdf_obj *obj);
 pdf_obj *pdf_new_xobject(fz_context *ctx, pdf_document *doc, const fz_rect *bbox, const fz_matrix *mat);
 pdf_xobject *pdf_keep_xobject(fz_context *ctx, pdf_xobject *xobj);
 void pdf_drop_xobject(fz_context *ctx, pdf_xobject *xobj);
+void pdf_drop_xobject_imp(fz_context *ctx, fz_storable *xobj);
 void pdf_update_xobject_contents(fz_context *ctx, pdf_document *doc, pdf_xobject *form, fz_buffer *buffer);
 
 void pdf_update_appearance(fz_context *ctx, pdf_document *doc, pdf_annot *annot);
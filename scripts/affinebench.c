@@ -0,0 +1,185 @@
+/* affinebench.c -- time the affine image painters with and without SIMD */
+
+/*
+	Paints images and image masks through fz_paint_image and
+	fz_paint_image_with_color, as the draw device does, once with the
+	plain C painters and once with the SIMD ones, and reports the time
+	taken by each and whether their output differs.
+
+	Build after 'make build=release':
+
+	cc -O2 -Iinclude -o affinebench scripts/affinebench.c \
+		build/release/libmupdf.a build/release/libmupdfthird.a -lm
+
+	Usage: affinebench [repeats]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mupdf/fitz.h"
+#include "../source/fitz/fitz-imp.h"
+#include "../source/fitz/draw-imp.h"
+
+#define SRC_W 300
+#define SRC_H 200
+#define DST_W 640
+#define DST_H 480
+
+static fz_pixmap *
+new_source(fz_context *ctx, fz_colorspace *cs, int alpha)
+{
+	fz_pixmap *pix = fz_new_pixmap(ctx, cs, SRC_W, SRC_H, NULL, alpha);
+	unsigned char *s = pix->samples;
+	int i, k, n = pix->n;
+
+	for (i = 0; i < SRC_W * SRC_H; i++, s += n)
+	{
+		int a = alpha ? rand() & 255 : 255;
+		if (alpha && (i & 7) == 0)
+			a = 0;
+		else if (alpha && (i & 7) == 1)
+			a = 255;
+		for (k = 0; k < n - alpha; k++)
+			s[k] = (rand() & 255) * a / 255; /* premultiplied */
+		if (alpha)
+			s[n - 1] = a;
+	}
+	return pix;
+}
+
+static void
+fill_dest(fz_pixmap *dst)
+{
+	size_t i, len = (size_t)dst->stride * dst->h;
+	srand(1);
+	for (i = 0; i < len; i++)
+		dst->samples[i] = rand() & 255;
+	if (dst->alpha)
+	{
+		/* Keep the destination premultiplied too */
+		unsigned char *d = dst->samples;
+		int k, n = dst->n;
+		for (i = 0; i < (size_t)dst->w * dst->h; i++, d += n)
+			for (k = 0; k < n - 1; k++)
+				if (d[k] > d[n - 1])
+					d[k] = d[n - 1];
+	}
+}
+
+static double
+paint(fz_pixmap *dst, fz_pixmap *src, const fz_matrix *ctm, const unsigned char *color, int alpha, int lerp, int features, int repeats)
+{
+	fz_irect scissor = { 0, 0, DST_W, DST_H };
+	clock_t start;
+	int i;
+
+	fz_cpu_features = features;
+	fill_dest(dst);
+	start = clock();
+	for (i = 0; i < repeats; i++)
+	{
+		if (color)
+			fz_paint_image_with_color(dst, &scissor, NULL, src, ctm, color, lerp, 0);
+		else
+			fz_paint_image(dst, &scissor, NULL, src, ctm, alpha, lerp, 0);
+	}
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void
+run(fz_context *ctx, const char *what, fz_pixmap *src, fz_colorspace *dcs, int da, const fz_matrix *ctm, const unsigned char *color, int alpha, int lerp, int simd, int repeats)
+{
+	fz_pixmap *a = fz_new_pixmap(ctx, dcs, DST_W, DST_H, NULL, da);
+	fz_pixmap *b = fz_new_pixmap(ctx, dcs, DST_W, DST_H, NULL, da);
+	double tc, ts;
+
+	/* Paint once for the comparison, then again for the timing */
+	paint(a, src, ctm, color, alpha, lerp, 0, 1);
+	paint(b, src, ctm, color, alpha, lerp, simd, 1);
+	tc = paint(a, src, ctm, color, alpha, lerp, 0, repeats);
+	ts = paint(b, src, ctm, color, alpha, lerp, simd, repeats);
+
+	printf("%-34s da=%d alpha=%3d  C %7.3fs  SIMD %7.3fs  %+6.1f%%  %s\n",
+		what, da, alpha, tc, ts, (tc - ts) * 100 / tc,
+		memcmp(a->samples, b->samples, (size_t)a->stride * a->h) ? "MISMATCH" : "same");
+
+	fz_drop_pixmap(ctx, a);
+	fz_drop_pixmap(ctx, b);
+}
+
+int main(int argc, char **argv)
+{
+	static const char *kind[] = { "", "gray", "", "rgb", "cmyk" };
+	unsigned char color[5] = { 40, 120, 200, 60, 255 };
+	int repeats = argc > 1 ? atoi(argv[1]) : 50;
+	fz_matrix rotated, upright, m;
+	fz_context *ctx;
+	char what[64];
+	int n, sa, da, lerp, simd;
+
+	ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot create context\n");
+		return 1;
+	}
+	simd = fz_cpu_features;
+	if (!simd)
+		printf("warning: no SIMD support detected; both columns use C\n");
+
+	/* A page image rotated a little, as from a skewed scan */
+	fz_scale(&rotated, DST_W * 0.9f, DST_H * 0.9f);
+	fz_concat(&rotated, &rotated, fz_rotate(&m, 7));
+	fz_concat(&rotated, &rotated, fz_translate(&m, DST_W * 0.08f, 0));
+	/* An upright image, for the fa/fb == 0 paths */
+	fz_scale(&upright, DST_W * 0.9f, DST_H * 0.9f);
+	fz_concat(&upright, &upright, fz_translate(&m, 5, 5));
+
+	for (lerp = 1; lerp >= 0; lerp--)
+	{
+		for (n = 1; n <= 4; n++)
+		{
+			fz_colorspace *cs = n == 1 ? fz_device_gray(ctx) : n == 3 ? fz_device_rgb(ctx) : fz_device_cmyk(ctx);
+			if (n == 2)
+				continue;
+			for (sa = 0; sa <= 1; sa++)
+			{
+				fz_pixmap *src = new_source(ctx, cs, sa);
+				for (da = 0; da <= 1; da++)
+				{
+					sprintf(what, "%s %s image%s, rotated", lerp ? "lerp" : "near", kind[n], sa ? "+alpha" : "");
+					run(ctx, what, src, cs, da, &rotated, NULL, 255, lerp, simd, repeats);
+					run(ctx, what, src, cs, da, &rotated, NULL, 128, lerp, simd, repeats);
+					if (!lerp)
+					{
+						sprintf(what, "near %s image%s, upright", kind[n], sa ? "+alpha" : "");
+						run(ctx, what, src, cs, da, &upright, NULL, 255, lerp, simd, repeats);
+					}
+				}
+				fz_drop_pixmap(ctx, src);
+			}
+		}
+
+		for (n = 1; n <= 4; n++)
+		{
+			fz_colorspace *cs = n == 1 ? fz_device_gray(ctx) : n == 3 ? fz_device_rgb(ctx) : fz_device_cmyk(ctx);
+			fz_pixmap *mask;
+			if (n == 2)
+				continue;
+			mask = new_source(ctx, NULL, 1);
+			color[n] = 255;
+			for (da = 0; da <= 1; da++)
+			{
+				sprintf(what, "%s %s mask, rotated", lerp ? "lerp" : "near", kind[n]);
+				run(ctx, what, mask, cs, da, &rotated, color, 255, lerp, simd, repeats);
+			}
+			fz_drop_pixmap(ctx, mask);
+		}
+	}
+
+	fz_drop_context(ctx);
+	return 0;
+}
@@ -0,0 +1,202 @@
+/* jpxbench.c -- time JPEG 2000 decoding with and without banding */
+
+/*
+	Decodes a JPEG 2000 image repeatedly through fz_get_pixmap_from_image,
+	once on the calling thread only and once with the image split into
+	bands that are decoded on several threads (see fz_tune_parallel),
+	and reports the wall clock time taken by each and whether their
+	output differs.
+
+	Build after 'make build=release':
+
+	cc -O2 -Iinclude -o jpxbench scripts/jpxbench.c \
+		build/release/libmupdf.a build/release/libmupdfthird.a \
+		-lm -lpthread
+
+	Usage: jpxbench file.jp2 [threads] [repeats]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include "mupdf/fitz.h"
+
+#define MAX_THREADS 64
+
+static pthread_mutex_t mutexes[FZ_LOCK_MAX];
+
+static void
+lock_mutex(void *user, int lock)
+{
+	pthread_mutex_lock(&mutexes[lock]);
+}
+
+static void
+unlock_mutex(void *user, int lock)
+{
+	pthread_mutex_unlock(&mutexes[lock]);
+}
+
+typedef struct
+{
+	fz_parallel_job_fn *fn;
+	void *job;
+	int index, step, count;
+	pthread_t thread;
+} worker;
+
+static void *
+run_parts(void *arg)
+{
+	worker *me = arg;
+	int i;
+
+	for (i = me->index; i < me->count; i += me->step)
+		me->fn(me->job, i);
+	return NULL;
+}
+
+/* The same scheme as mudraw -J: every nthreads'th part per thread. */
+static void
+parallel(void *arg, int count, fz_parallel_job_fn *fn, void *job)
+{
+	worker workers[MAX_THREADS];
+	int started[MAX_THREADS];
+	int i, nthreads = fz_mini(count, MAX_THREADS);
+
+	for (i = 0; i < nthreads; i++)
+	{
+		workers[i].fn = fn;
+		workers[i].job = job;
+		workers[i].index = i;
+		workers[i].step = nthreads;
+		workers[i].count = count;
+		started[i] = 0;
+	}
+	for (i = 1; i < nthreads; i++)
+	{
+		if (pthread_create(&workers[i].thread, NULL, run_parts, &workers[i]) == 0)
+			started[i] = 1;
+		else
+			run_parts(&workers[i]);
+	}
+	if (nthreads > 0)
+		run_parts(&workers[0]);
+	for (i = 1; i < nthreads; i++)
+		if (started[i])
+			pthread_join(workers[i].thread, NULL);
+}
+
+static double
+now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Decode a fresh image each time, so that nothing comes from the store. */
+static fz_pixmap *
+decode(fz_context *ctx, fz_buffer *buf, int repeats, double *elapsed)
+{
+	fz_pixmap *pix = NULL;
+	double start = now();
+	int i;
+
+	fz_var(pix);
+
+	for (i = 0; i < repeats; i++)
+	{
+		fz_image *image = fz_new_image_from_buffer(ctx, buf);
+		fz_drop_pixmap(ctx, pix);
+		pix = NULL;
+		fz_try(ctx)
+			pix = fz_get_pixmap_from_image(ctx, image, NULL, NULL, NULL, NULL);
+		fz_always(ctx)
+			fz_drop_image(ctx, image);
+		fz_catch(ctx)
+			fz_rethrow(ctx);
+	}
+	*elapsed = now() - start;
+	return pix;
+}
+
+int main(int argc, char **argv)
+{
+	fz_locks_context locks;
+	fz_context *ctx;
+	fz_buffer *buf = NULL;
+	fz_pixmap *single = NULL, *banded = NULL;
+	double ts = 0, tb = 0;
+	int threads, repeats, i, same;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: jpxbench file.jp2 [threads] [repeats]\n");
+		return 1;
+	}
+	threads = argc > 2 ? atoi(argv[2]) : 4;
+	repeats = argc > 3 ? atoi(argv[3]) : 10;
+	threads = fz_clampi(threads, 1, MAX_THREADS);
+	if (repeats < 1)
+		repeats = 1;
+
+	/* Banded decoding needs locks to clone the context for each band. */
+	for (i = 0; i < FZ_LOCK_MAX; i++)
+		pthread_mutex_init(&mutexes[i], NULL);
+	locks.user = NULL;
+	locks.lock = lock_mutex;
+	locks.unlock = unlock_mutex;
+
+	ctx = fz_new_context(NULL, &locks, FZ_STORE_UNLIMITED);
+	if (!ctx)
+	{
+		fprintf(stderr, "cannot create context\n");
+		return 1;
+	}
+
+	fz_var(buf);
+	fz_var(single);
+	fz_var(banded);
+
+	fz_try(ctx)
+	{
+		buf = fz_read_file(ctx, argv[1]);
+
+		fz_tune_parallel(ctx, NULL, NULL, 1);
+		fz_drop_pixmap(ctx, decode(ctx, buf, 1, &ts)); /* warm up */
+		single = decode(ctx, buf, repeats, &ts);
+
+		fz_tune_parallel(ctx, parallel, NULL, threads);
+		fz_drop_pixmap(ctx, decode(ctx, buf, 1, &tb));
+		banded = decode(ctx, buf, repeats, &tb);
+
+		same = single->w == banded->w && single->h == banded->h &&
+			single->n == banded->n && single->stride == banded->stride &&
+			!memcmp(single->samples, banded->samples, (size_t)single->stride * single->h);
+
+		printf("%s: %dx%d n=%d, %d repeats\n", argv[1], single->w, single->h, single->n, repeats);
+		printf("1 thread   %7.3fs  %7.1f ms/image\n", ts, ts * 1000 / repeats);
+		printf("%-2d threads %7.3fs  %7.1f ms/image  %+6.1f%%  %s\n",
+			threads, tb, tb * 1000 / repeats, (ts - tb) * 100 / ts,
+			same ? "same" : "MISMATCH");
+	}
+	fz_always(ctx)
+	{
+		fz_drop_pixmap(ctx, single);
+		fz_drop_pixmap(ctx, banded);
+		fz_drop_buffer(ctx, buf);
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "error: %s\n", fz_caught_message(ctx));
+		fz_drop_context(ctx);
+		return 1;
+	}
+
+	fz_drop_context(ctx);
+	return 0;
+}
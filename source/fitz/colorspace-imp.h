@@ -48,6 +48,8 @@ struct fz_iccprofile_s
 	void *cmm_handle;
 };
 
+typedef struct fz_color_clut_s fz_color_clut;
+
 struct fz_icclink_s
 {
 	fz_storable storable;
@@ -57,6 +59,7 @@ struct fz_icclink_s
 	int copy_spots;
 	int is_identity;
 	void *cmm_handle;
+	fz_color_clut *clut; /* sampled single color conversions, built on demand */
 };
 
 struct fz_default_colorspaces_s
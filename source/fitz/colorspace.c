@@ -7,6 +7,10 @@
 #include <math.h>
 #include <string.h>
 
+#ifdef ARCH_X86_64
+#include <smmintrin.h>
+#endif
+
 /* CMM module */
 
 int
@@ -293,7 +297,8 @@ static fz_store_type fz_link_store_type =
 	fz_drop_link_key,
 	fz_cmp_link_key,
 	fz_format_link_key,
-	NULL
+	NULL,
+	"colour link"
 };
 
 static void
@@ -301,6 +306,7 @@ fz_drop_link_imp(fz_context *ctx, fz_storable *storable)
 {
 	fz_icclink *link = (fz_icclink *)storable;
 	fz_cmm_fin_link(ctx, link);
+	fz_free(ctx, link->clut);
 	fz_free(ctx, link);
 }
 
@@ -851,6 +857,156 @@ fz_default_color_params(fz_context *ctx)
 
 /* Fast pixmap color conversions */
 
+#ifdef ARCH_X86_64
+
+/*
+	SSE4.1 versions of the commonest conversions between device spaces
+	without spots, selected at run time by the fast_* converters. They
+	do whole groups of pixels with SIMD and the rest of each row in C,
+	giving exactly the same results as the C code.
+*/
+
+#define SIMD_TARGET __attribute__((target("sse4.1")))
+
+static SIMD_TARGET void
+gray_to_rgb_sse41(unsigned char *d, const unsigned char *s, size_t w, int h, int sn, int dn, ptrdiff_t d_line_inc, ptrdiff_t s_line_inc)
+{
+	const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+	const __m128i m3_0 = _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5);
+	const __m128i m3_1 = _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10);
+	const __m128i m3_2 = _mm_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15);
+	const __m128i m4_0 = _mm_setr_epi8(0, 0, 0, -1, 1, 1, 1, -1, 2, 2, 2, -1, 3, 3, 3, -1);
+	const __m128i m4_1 = _mm_setr_epi8(4, 4, 4, -1, 5, 5, 5, -1, 6, 6, 6, -1, 7, 7, 7, -1);
+	const __m128i m4_2 = _mm_setr_epi8(8, 8, 8, -1, 9, 9, 9, -1, 10, 10, 10, -1, 11, 11, 11, -1);
+	const __m128i m4_3 = _mm_setr_epi8(12, 12, 12, -1, 13, 13, 13, -1, 14, 14, 14, -1, 15, 15, 15, -1);
+	const __m128i ma_0 = _mm_setr_epi8(0, 0, 0, 1, 2, 2, 2, 3, 4, 4, 4, 5, 6, 6, 6, 7);
+	const __m128i ma_1 = _mm_setr_epi8(8, 8, 8, 9, 10, 10, 10, 11, 12, 12, 12, 13, 14, 14, 14, 15);
+	__m128i v;
+	size_t ww;
+
+	while (h--)
+	{
+		ww = w;
+		if (sn == 2)
+		{
+			for (; ww >= 8; ww -= 8)
+			{
+				v = _mm_loadu_si128((const __m128i *)s);
+				_mm_storeu_si128((__m128i *)d, _mm_shuffle_epi8(v, ma_0));
+				_mm_storeu_si128((__m128i *)(d + 16), _mm_shuffle_epi8(v, ma_1));
+				s += 16;
+				d += 32;
+			}
+		}
+		else if (dn == 4)
+		{
+			for (; ww >= 16; ww -= 16)
+			{
+				v = _mm_loadu_si128((const __m128i *)s);
+				_mm_storeu_si128((__m128i *)d, _mm_or_si128(_mm_shuffle_epi8(v, m4_0), alpha));
+				_mm_storeu_si128((__m128i *)(d + 16), _mm_or_si128(_mm_shuffle_epi8(v, m4_1), alpha));
+				_mm_storeu_si128((__m128i *)(d + 32), _mm_or_si128(_mm_shuffle_epi8(v, m4_2), alpha));
+				_mm_storeu_si128((__m128i *)(d + 48), _mm_or_si128(_mm_shuffle_epi8(v, m4_3), alpha));
+				s += 16;
+				d += 64;
+			}
+		}
+		else
+		{
+			for (; ww >= 16; ww -= 16)
+			{
+				v = _mm_loadu_si128((const __m128i *)s);
+				_mm_storeu_si128((__m128i *)d, _mm_shuffle_epi8(v, m3_0));
+				_mm_storeu_si128((__m128i *)(d + 16), _mm_shuffle_epi8(v, m3_1));
+				_mm_storeu_si128((__m128i *)(d + 32), _mm_shuffle_epi8(v, m3_2));
+				s += 16;
+				d += 48;
+			}
+		}
+		while (ww--)
+		{
+			d[0] = s[0];
+			d[1] = s[0];
+			d[2] = s[0];
+			if (dn == 4)
+				d[3] = sn == 2 ? s[1] : 255;
+			s += sn;
+			d += dn;
+		}
+		d += d_line_inc;
+		s += s_line_inc;
+	}
+}
+
+/* Gather sample o of 4 pixels sn bytes apart into the low or high four 16-bit lanes */
+#define GATHER_LO(o, sn) _mm_setr_epi8(o, -1, o+sn, -1, o+2*sn, -1, o+3*sn, -1, -1, -1, -1, -1, -1, -1, -1, -1)
+#define GATHER_HI(o, sn) _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, o, -1, o+sn, -1, o+2*sn, -1, o+3*sn, -1)
+
+static SIMD_TARGET void
+rgb_to_gray_sse41(unsigned char *d, const unsigned char *s, size_t w, int h, int sn, int dn, ptrdiff_t d_line_inc, ptrdiff_t s_line_inc)
+{
+	const __m128i r_lo = sn == 4 ? GATHER_LO(0, 4) : GATHER_LO(0, 3);
+	const __m128i r_hi = sn == 4 ? GATHER_HI(0, 4) : GATHER_HI(0, 3);
+	const __m128i g_lo = sn == 4 ? GATHER_LO(1, 4) : GATHER_LO(1, 3);
+	const __m128i g_hi = sn == 4 ? GATHER_HI(1, 4) : GATHER_HI(1, 3);
+	const __m128i b_lo = sn == 4 ? GATHER_LO(2, 4) : GATHER_LO(2, 3);
+	const __m128i b_hi = sn == 4 ? GATHER_HI(2, 4) : GATHER_HI(2, 3);
+	const __m128i a_lo = GATHER_LO(3, 4);
+	const __m128i a_hi = GATHER_HI(3, 4);
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i wr = _mm_set1_epi16(77);
+	const __m128i wg = _mm_set1_epi16(150);
+	const __m128i wb = _mm_set1_epi16(28);
+	/* The second load reads 4 bytes past the 8th pixel of RGB */
+	size_t need = sn == 4 ? 8 : 10;
+	__m128i v0, v1, r, g, b, y, a;
+	size_t ww;
+
+	while (h--)
+	{
+		ww = w;
+		for (; ww >= need; ww -= 8)
+		{
+			v0 = _mm_loadu_si128((const __m128i *)s);
+			v1 = _mm_loadu_si128((const __m128i *)(s + 4 * sn));
+			r = _mm_or_si128(_mm_shuffle_epi8(v0, r_lo), _mm_shuffle_epi8(v1, r_hi));
+			g = _mm_or_si128(_mm_shuffle_epi8(v0, g_lo), _mm_shuffle_epi8(v1, g_hi));
+			b = _mm_or_si128(_mm_shuffle_epi8(v0, b_lo), _mm_shuffle_epi8(v1, b_hi));
+			y = _mm_mullo_epi16(_mm_add_epi16(r, one), wr);
+			y = _mm_add_epi16(y, _mm_mullo_epi16(_mm_add_epi16(g, one), wg));
+			y = _mm_add_epi16(y, _mm_mullo_epi16(_mm_add_epi16(b, one), wb));
+			y = _mm_packus_epi16(_mm_srli_epi16(y, 8), _mm_setzero_si128());
+			if (dn == 1)
+				_mm_storel_epi64((__m128i *)d, y);
+			else
+			{
+				if (sn == 4)
+					a = _mm_packus_epi16(_mm_or_si128(_mm_shuffle_epi8(v0, a_lo), _mm_shuffle_epi8(v1, a_hi)), _mm_setzero_si128());
+				else
+					a = _mm_set1_epi8(-1);
+				_mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi8(y, a));
+			}
+			s += 8 * sn;
+			d += 8 * dn;
+		}
+		while (ww--)
+		{
+			d[0] = ((s[0]+1) * 77 + (s[1]+1) * 150 + (s[2]+1) * 28) >> 8;
+			if (dn == 2)
+				d[1] = sn == 4 ? s[3] : 255;
+			s += sn;
+			d += dn;
+		}
+		d += d_line_inc;
+		s += s_line_inc;
+	}
+}
+
+#undef GATHER_LO
+#undef GATHER_HI
+
+#endif /* ARCH_X86_64 */
+
 static void fast_gray_to_rgb(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src, fz_colorspace *prf, const fz_default_colorspaces *default_cs, const fz_color_params *color_params, int copy_spots)
 {
 	unsigned char *s = src->samples;
@@ -885,6 +1041,13 @@ static void fast_gray_to_rgb(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src, fz
 	if (ss == 0)
 	{
 		/* Common, no spots case */
+#ifdef ARCH_X86_64
+		if (fz_cpu_features & FZ_CPU_SSE41)
+		{
+			gray_to_rgb_sse41(d, s, w, h, sn, dn, d_line_inc, s_line_inc);
+			return;
+		}
+#endif
 		if (da)
 		{
 			if (sa)
@@ -1160,6 +1323,13 @@ static void fast_rgb_to_gray(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src, fz
 	if (ss == 0)
 	{
 		/* Common, no spots case */
+#ifdef ARCH_X86_64
+		if (fz_cpu_features & FZ_CPU_SSE41)
+		{
+			rgb_to_gray_sse41(d, s, w, h, sn, dn, d_line_inc, s_line_inc);
+			return;
+		}
+#endif
 		if (da)
 		{
 			if (sa)
@@ -2166,6 +2336,160 @@ static inline void cached_cmyk_conv(unsigned char *restrict const pr, unsigned c
 #endif
 }
 
+#if defined(ARCH_X86_64) && defined(SLOWCMYK)
+
+/* The SLOWCMYK conversion above for 4 pixels at a time in 32-bit lanes */
+#define MULC(x, k) _mm_mullo_epi32(x, _mm_set1_epi32(k))
+
+static SIMD_TARGET void
+cmyk_to_rgb_sse41(unsigned char *d, const unsigned char *s, size_t w, int h, int dn, ptrdiff_t d_line_inc, ptrdiff_t s_line_inc)
+{
+	const __m128i mask = _mm_set1_epi32(0xff);
+	const __m128i c256 = _mm_set1_epi32(256);
+	const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+	const __m128i pack3 = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	__m128i v, c, m, y, k, r, g, b, x0, x1, special, white;
+	__m128i cm, c1m, cm1, c1m1, c1m1y, c1m1y1, c1my, c1my1, cm1y, cm1y1, cmy, cmy1;
+	unsigned int C = 0, M = 0, Y = 0, K = 0;
+	unsigned char rr = 255, gg = 255, bb = 255;
+	size_t ww;
+	int t;
+
+	while (h--)
+	{
+		ww = w;
+		for (; ww >= 4; ww -= 4)
+		{
+			v = _mm_loadu_si128((const __m128i *)s);
+			c = _mm_and_si128(v, mask);
+			m = _mm_and_si128(_mm_srli_epi32(v, 8), mask);
+			y = _mm_and_si128(_mm_srli_epi32(v, 16), mask);
+			k = _mm_srli_epi32(v, 24);
+
+			/* All zero is white and full K is black */
+			white = _mm_cmpeq_epi32(v, _mm_setzero_si128());
+			special = _mm_or_si128(white, _mm_cmpeq_epi32(k, mask));
+
+			c = _mm_add_epi32(c, _mm_srli_epi32(c, 7));
+			m = _mm_add_epi32(m, _mm_srli_epi32(m, 7));
+			y = _mm_add_epi32(y, _mm_srli_epi32(y, 7));
+			k = _mm_add_epi32(k, _mm_srli_epi32(k, 7));
+			y = _mm_srli_epi32(y, 1);
+			cm = _mm_mullo_epi32(c, m);
+			c1m = _mm_sub_epi32(_mm_slli_epi32(m, 8), cm);
+			cm1 = _mm_sub_epi32(_mm_slli_epi32(c, 8), cm);
+			c1m1 = _mm_sub_epi32(_mm_slli_epi32(_mm_sub_epi32(c256, m), 8), cm1);
+			c1m1y = _mm_mullo_epi32(c1m1, y);
+			c1m1y1 = _mm_sub_epi32(_mm_slli_epi32(c1m1, 7), c1m1y);
+			c1my = _mm_mullo_epi32(c1m, y);
+			c1my1 = _mm_sub_epi32(_mm_slli_epi32(c1m, 7), c1my);
+			cm1y = _mm_mullo_epi32(cm1, y);
+			cm1y1 = _mm_sub_epi32(_mm_slli_epi32(cm1, 7), cm1y);
+			cmy = _mm_mullo_epi32(cm, y);
+			cmy1 = _mm_sub_epi32(_mm_slli_epi32(cm, 7), cmy);
+
+			x1 = _mm_mullo_epi32(c1m1y1, k);
+			x0 = _mm_sub_epi32(_mm_slli_epi32(c1m1y1, 8), x1);
+			x1 = _mm_srli_epi32(x1, 8);
+			r = _mm_add_epi32(x0, MULC(x1, 35));
+			g = _mm_add_epi32(x0, MULC(x1, 31));
+			b = _mm_add_epi32(x0, MULC(x1, 32));
+
+			x1 = _mm_mullo_epi32(c1m1y, k);
+			x0 = _mm_sub_epi32(_mm_slli_epi32(c1m1y, 8), x1);
+			x1 = _mm_srli_epi32(x1, 8);
+			r = _mm_add_epi32(r, MULC(x1, 28));
+			g = _mm_add_epi32(g, MULC(x1, 26));
+			r = _mm_add_epi32(r, x0);
+			x0 = _mm_srli_epi32(x0, 8);
+			g = _mm_add_epi32(g, MULC(x0, 243));
+
+			x1 = _mm_mullo_epi32(c1my1, k);
+			x0 = _mm_sub_epi32(_mm_slli_epi32(c1my1, 8), x1);
+			x1 = _mm_srli_epi32(x1, 8);
+			x0 = _mm_srli_epi32(x0, 8);
+			r = _mm_add_epi32(r, MULC(x1, 36));
+			r = _mm_add_epi32(r, MULC(x0, 237));
+			b = _mm_add_epi32(b, MULC(x0, 141));
+
+			x1 = _mm_mullo_epi32(c1my, k);
+			x0 = _mm_sub_epi32(_mm_slli_epi32(c1my, 8), x1);
+			x1 = _mm_srli_epi32(x1, 8);
+			x0 = _mm_srli_epi32(x0, 8);
+			r = _mm_add_epi32(r, MULC(x1, 34));
+			r = _mm_add_epi32(r, MULC(x0, 238));
+			g = _mm_add_epi32(g, MULC(x0, 28));
+			b = _mm_add_epi32(b, MULC(x0, 36));
+
+			x1 = _mm_mullo_epi32(cm1y1, k);
+			x0 = _mm_sub_epi32(_mm_slli_epi32(cm1y1, 8), x1);
+			x1 = _mm_srli_epi32(x1, 8);
+			x0 = _mm_srli_epi32(x0, 8);
+			g = _mm_add_epi32(g, MULC(x1, 15));
+			b = _mm_add_epi32(b, MULC(x1, 36));
+			g = _mm_add_epi32(g, MULC(x0, 174));
+			b = _mm_add_epi32(b, MULC(x0, 240));
+
+			x1 = _mm_mullo_epi32(cm1y, k);
+			x0 = _mm_sub_epi32(_mm_slli_epi32(cm1y, 8), x1);
+			x1 = _mm_srli_epi32(x1, 8);
+			x0 = _mm_srli_epi32(x0, 8);
+			g = _mm_add_epi32(g, MULC(x1, 19));
+			g = _mm_add_epi32(g, MULC(x0, 167));
+			b = _mm_add_epi32(b, MULC(x0, 80));
+
+			x1 = _mm_mullo_epi32(cmy1, k);
+			x0 = _mm_sub_epi32(_mm_slli_epi32(cmy1, 8), x1);
+			x1 = _mm_srli_epi32(x1, 8);
+			x0 = _mm_srli_epi32(x0, 8);
+			b = _mm_add_epi32(b, MULC(x1, 2));
+			r = _mm_add_epi32(r, MULC(x0, 46));
+			g = _mm_add_epi32(g, MULC(x0, 49));
+			b = _mm_add_epi32(b, MULC(x0, 147));
+
+			x0 = _mm_srli_epi32(_mm_mullo_epi32(cmy, _mm_sub_epi32(c256, k)), 8);
+			r = _mm_add_epi32(r, MULC(x0, 54));
+			g = _mm_add_epi32(g, MULC(x0, 54));
+			b = _mm_add_epi32(b, MULC(x0, 57));
+
+			r = _mm_srli_epi32(_mm_sub_epi32(r, _mm_srli_epi32(r, 8)), 23);
+			g = _mm_srli_epi32(_mm_sub_epi32(g, _mm_srli_epi32(g, 8)), 23);
+			b = _mm_srli_epi32(_mm_sub_epi32(b, _mm_srli_epi32(b, 8)), 23);
+
+			v = _mm_or_si128(r, _mm_or_si128(_mm_slli_epi32(g, 8), _mm_slli_epi32(b, 16)));
+			v = _mm_or_si128(_mm_andnot_si128(special, v), _mm_and_si128(white, _mm_set1_epi32(0xffffff)));
+			if (dn == 4)
+				_mm_storeu_si128((__m128i *)d, _mm_or_si128(v, alpha));
+			else
+			{
+				v = _mm_shuffle_epi8(v, pack3);
+				_mm_storel_epi64((__m128i *)d, v);
+				t = _mm_extract_epi32(v, 2);
+				memcpy(d + 8, &t, 4);
+			}
+			s += 16;
+			d += 4 * dn;
+		}
+		while (ww--)
+		{
+			cached_cmyk_conv(&rr, &gg, &bb, &C, &M, &Y, &K, s[0], s[1], s[2], s[3]);
+			d[0] = rr;
+			d[1] = gg;
+			d[2] = bb;
+			if (dn == 4)
+				d[3] = 255;
+			s += 4;
+			d += dn;
+		}
+		d += d_line_inc;
+		s += s_line_inc;
+	}
+}
+
+#undef MULC
+
+#endif /* ARCH_X86_64 && SLOWCMYK */
+
 static void fast_cmyk_to_rgb(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src, fz_colorspace *prf, const fz_default_colorspaces *default_cs, const fz_color_params *color_params, int copy_spots)
 {
 	unsigned char *s = src->samples;
@@ -2210,6 +2534,13 @@ static void fast_cmyk_to_rgb(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src, fz
 	if (ss == 0)
 	{
 		/* Common, no spots case */
+#if defined(ARCH_X86_64) && defined(SLOWCMYK)
+		if ((fz_cpu_features & FZ_CPU_SSE41) && !sa)
+		{
+			cmyk_to_rgb_sse41(d, s, w, h, dn, d_line_inc, s_line_inc);
+			return;
+		}
+#endif
 		if (da)
 		{
 			if (sa)
@@ -3014,6 +3345,109 @@ fz_source_colorspace_cm(fz_context *ctx, const fz_colorspace *cs)
 	return NULL;
 }
 
+/* Only split conversions into bands when the source is at least this big
+ * (in bytes), and give each band at least this many rows. */
+#define PARALLEL_CONVERT_MIN_SIZE (1<<21)
+#define PARALLEL_CONVERT_MIN_ROWS 16
+
+typedef struct
+{
+	fz_pixmap_converter *pc;
+	fz_pixmap *dst;
+	fz_pixmap *src;
+	fz_colorspace *prf;
+	const fz_default_colorspaces *default_cs;
+	const fz_color_params *color_params;
+	int copy_spots;
+	int bands;
+	fz_context **ctx; /* one clone per band */
+	int *failed;
+} convert_job;
+
+/* Convert one band of rows through views of the pixmaps, using the
+ * band's own context (and so its own CMM instance). */
+static void
+convert_band(void *job_, int band)
+{
+	convert_job *job = (convert_job *)job_;
+	fz_context *ctx = job->ctx[band];
+	fz_pixmap src = *job->src;
+	fz_pixmap dst = *job->dst;
+	int y0 = (int)((int64_t)src.h * band / job->bands);
+	int y1 = (int)((int64_t)src.h * (band + 1) / job->bands);
+
+	src.samples += (size_t)src.stride * y0;
+	dst.samples += (size_t)dst.stride * y0;
+	src.y += y0;
+	dst.y += y0;
+	src.h = dst.h = y1 - y0;
+
+	fz_try(ctx)
+		job->pc(ctx, &dst, &src, job->prf, job->default_cs, job->color_params, job->copy_spots);
+	fz_catch(ctx)
+		job->failed[band] = 1;
+}
+
+void
+fz_run_pixmap_converter(fz_context *ctx, fz_pixmap_converter *pc, fz_pixmap *dst, fz_pixmap *src, fz_colorspace *prf, const fz_default_colorspaces *default_cs, const fz_color_params *color_params, int copy_spots)
+{
+	convert_job job;
+	int bands = 1;
+	int i, failed = 0;
+
+	if (ctx->tuning->parallel_threads > 1 && (int64_t)src->stride * src->h >= PARALLEL_CONVERT_MIN_SIZE)
+		bands = fz_mini(ctx->tuning->parallel_threads, src->h / PARALLEL_CONVERT_MIN_ROWS);
+	if (bands <= 1)
+	{
+		pc(ctx, dst, src, prf, default_cs, color_params, copy_spots);
+		return;
+	}
+
+	job.pc = pc;
+	job.dst = dst;
+	job.src = src;
+	job.prf = prf;
+	job.default_cs = default_cs;
+	job.color_params = color_params;
+	job.copy_spots = copy_spots;
+	job.bands = bands;
+	job.ctx = fz_calloc(ctx, bands, sizeof *job.ctx);
+	job.failed = NULL;
+
+	fz_try(ctx)
+	{
+		job.failed = fz_calloc(ctx, bands, sizeof *job.failed);
+		for (i = 0; i < bands; i++)
+		{
+			/* Cloning needs locking functions; without them stay single threaded. */
+			job.ctx[i] = fz_clone_context(ctx);
+			if (!job.ctx[i])
+				break;
+		}
+		if (i == bands)
+		{
+			ctx->tuning->parallel(ctx->tuning->parallel_arg, bands, convert_band, &job);
+			for (i = 0; i < bands; i++)
+				failed |= job.failed[i];
+		}
+		else
+			failed = 1;
+	}
+	fz_always(ctx)
+	{
+		for (i = 0; i < bands; i++)
+			fz_drop_context(job.ctx[i]);
+		fz_free(ctx, job.ctx);
+		fz_free(ctx, job.failed);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	/* Redo the whole conversion here to report the error, if any. */
+	if (failed)
+		pc(ctx, dst, src, prf, default_cs, color_params, copy_spots);
+}
+
 fz_pixmap_converter *fz_lookup_pixmap_converter(fz_context *ctx, fz_colorspace *ds, fz_colorspace *ss)
 {
 	if (ds == NULL)
@@ -3499,12 +3933,178 @@ fz_expand_indexed_pixmap(fz_context *ctx, const fz_pixmap *src, int alpha)
 	return dst;
 }
 
+/*
+	Sampled color lookup tables for 3 and 4 component ICC sources.
+
+	Once a cached color converter has seen enough distinct colors, the
+	link is sampled on a regular grid (as lcms does internally when it
+	optimises a transform) and further colors are interpolated from the
+	grid: tetrahedrally for 3 components, and linearly between two
+	tetrahedral lookups along the last axis for 4 components. The table
+	is attached to the link, so it is built once and shared by every
+	converter using that link for as long as the link stays in the store.
+*/
+
+#define CLUT_MISSES 256
+#define CLUT_GRID_3 33
+#define CLUT_GRID_4 17
+
+struct fz_color_clut_s
+{
+	int in_n, out_n, grid;
+	unsigned short table[1];
+};
+
+static fz_color_clut *
+fz_new_color_clut(fz_context *ctx, fz_color_converter *cc, int in_n, int out_n)
+{
+	fz_color_clut *clut;
+	int g = in_n == 3 ? CLUT_GRID_3 : CLUT_GRID_4;
+	int size = out_n;
+	int idx[4] = { 0 };
+	float src[4], dst[FZ_MAX_COLORS];
+	unsigned short *t;
+	int i, k, n;
+
+	for (i = 0; i < in_n; i++)
+		size *= g;
+
+	clut = fz_malloc(ctx, sizeof(*clut) + (size - 1) * sizeof(unsigned short));
+	clut->in_n = in_n;
+	clut->out_n = out_n;
+	clut->grid = g;
+
+	/* Points in order of increasing index, the last component varying fastest */
+	t = clut->table;
+	for (n = size / out_n; n > 0; n--)
+	{
+		for (i = 0; i < in_n; i++)
+			src[i] = idx[i] / (float)(g - 1);
+		cc->convert(ctx, cc, dst, src);
+		for (k = 0; k < out_n; k++)
+			*t++ = fz_clamp(dst[k], 0, 1) * 65535 + 0.5f;
+		for (i = in_n - 1; i >= 0 && ++idx[i] == g; i--)
+			idx[i] = 0;
+	}
+
+	return clut;
+}
+
+/* Interpolate within the cube at t, whose far corner is at offset sx+sy+sz */
+static void
+clut_tetrahedral(const unsigned short *t, int out_n, float rx, float ry, float rz, int sx, int sy, int sz, float *dst)
+{
+	const unsigned short *v1, *v2, *v3;
+	float a, b, c;
+	int k;
+
+	/* Walk from corner to corner along the axes in order of decreasing fraction */
+	if (rx >= ry)
+	{
+		if (ry >= rz)
+			a = rx, b = ry, c = rz, v1 = t + sx, v2 = v1 + sy;
+		else if (rx >= rz)
+			a = rx, b = rz, c = ry, v1 = t + sx, v2 = v1 + sz;
+		else
+			a = rz, b = rx, c = ry, v1 = t + sz, v2 = v1 + sx;
+	}
+	else
+	{
+		if (rz >= ry)
+			a = rz, b = ry, c = rx, v1 = t + sz, v2 = v1 + sy;
+		else if (rz >= rx)
+			a = ry, b = rz, c = rx, v1 = t + sy, v2 = v1 + sz;
+		else
+			a = ry, b = rx, c = rz, v1 = t + sy, v2 = v1 + sx;
+	}
+	v3 = t + sx + sy + sz;
+
+	for (k = 0; k < out_n; k++)
+		dst[k] = t[k] + a * (v1[k] - t[k]) + b * (v2[k] - v1[k]) + c * (v3[k] - v2[k]);
+}
+
+static void
+fz_lookup_color_clut(const fz_color_clut *clut, float *dst, const float *src)
+{
+	int g = clut->grid;
+	int out_n = clut->out_n;
+	int i, k, off = 0, stride[4];
+	float r[4], lo[FZ_MAX_COLORS], hi[FZ_MAX_COLORS];
+
+	stride[clut->in_n - 1] = out_n;
+	for (i = clut->in_n - 2; i >= 0; i--)
+		stride[i] = stride[i + 1] * g;
+
+	for (i = 0; i < clut->in_n; i++)
+	{
+		float f = fz_clamp(src[i], 0, 1) * (g - 1);
+		int j = fz_mini((int)f, g - 2);
+		r[i] = f - j;
+		off += j * stride[i];
+	}
+
+	clut_tetrahedral(clut->table + off, out_n, r[0], r[1], r[2], stride[0], stride[1], stride[2], lo);
+	if (clut->in_n == 4)
+	{
+		clut_tetrahedral(clut->table + off + stride[3], out_n, r[0], r[1], r[2], stride[0], stride[1], stride[2], hi);
+		for (k = 0; k < out_n; k++)
+			lo[k] += r[3] * (hi[k] - lo[k]);
+	}
+
+	for (k = 0; k < out_n; k++)
+		dst[k] = lo[k] / 65535.0f;
+}
+
 typedef struct fz_cached_color_converter
 {
 	fz_color_converter base;
 	fz_hash_table *hash;
+	fz_color_clut *clut; /* owned by the link in base */
+	int misses; /* distinct colors seen; -1 if no table can be used */
 } fz_cached_color_converter;
 
+static void fz_clut_color_convert(fz_context *ctx, fz_color_converter *cc_, float *ds, const float *ss)
+{
+	fz_cached_color_converter *cc = cc_->opaque;
+	fz_lookup_color_clut(cc->clut, ds, ss);
+}
+
+static int fz_color_converter_can_use_clut(fz_context *ctx, fz_color_converter *cc)
+{
+	fz_icclink *link = cc->link;
+	return cc->convert == icc_conv_color && link && !link->is_identity &&
+		(cc->n == 3 || cc->n == 4) && cc->ss->n == cc->n && cc->ds->n <= 4;
+}
+
+/* Find the table for the link, building it if asked to */
+static fz_color_clut *
+fz_get_color_clut(fz_context *ctx, fz_color_converter *cc, int build)
+{
+	fz_icclink *link = cc->link;
+	fz_color_clut *clut, *old;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	clut = link->clut;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (clut || !build)
+		return clut;
+
+	clut = fz_new_color_clut(ctx, cc, cc->n, cc->ds->n);
+
+	/* Another thread may have got there first */
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	old = link->clut;
+	if (!old)
+		link->clut = clut;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (old)
+	{
+		fz_free(ctx, clut);
+		clut = old;
+	}
+	return clut;
+}
+
 static void fz_cached_color_convert(fz_context *ctx, fz_color_converter *cc_, float *ds, const float *ss)
 {
 	fz_cached_color_converter *cc = cc_->opaque;
@@ -3518,6 +4118,24 @@ static void fz_cached_color_convert(fz_context *ctx, fz_color_converter *cc_, fl
 		return;
 	}
 
+	if (cc->misses >= 0 && ++cc->misses == CLUT_MISSES)
+	{
+		/* Enough colors that sampling the link is worth it */
+		fz_try(ctx)
+			cc->clut = fz_get_color_clut(ctx, base_cc, 1);
+		fz_catch(ctx)
+		{
+			fz_warn(ctx, "cannot build color lookup table");
+			cc->misses = -1;
+		}
+		if (cc->clut)
+		{
+			cc_->convert = fz_clut_color_convert;
+			fz_lookup_color_clut(cc->clut, ds, ss);
+			return;
+		}
+	}
+
 	base_cc->convert(ctx, base_cc, ds, ss);
 	val = fz_malloc(ctx, n);
 	memcpy(val, ds, n);
@@ -3545,6 +4163,10 @@ void fz_init_cached_color_converter(fz_context *ctx, fz_color_converter *cc, fz_
 	fz_try(ctx)
 	{
 		fz_find_color_converter(ctx, &cached->base, is, cc->ds, ss, params);
+		if (!fz_color_converter_can_use_clut(ctx, &cached->base))
+			cached->misses = -1;
+		else if ((cached->clut = fz_get_color_clut(ctx, &cached->base, 0)) != NULL)
+			cc->convert = fz_clut_color_convert;
 		cached->hash = fz_new_hash_table(ctx, 256, n * sizeof(float), -1, fz_free);
 	}
 	fz_catch(ctx)
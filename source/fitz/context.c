@@ -10,6 +10,23 @@ struct fz_id_context_s
 	int id;
 };
 
+int fz_cpu_features = 0;
+
+void
+fz_init_cpu_features(void)
+{
+#ifdef ARCH_X86_64
+	int features = 0;
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.1"))
+		features |= FZ_CPU_SSE41;
+	if (__builtin_cpu_supports("avx2"))
+		features |= FZ_CPU_AVX2;
+	fz_cpu_features = features;
+#endif
+}
+
 static void
 fz_drop_id_context(fz_context *ctx)
 {
@@ -100,6 +117,7 @@ static void fz_new_tuning_context(fz_context *ctx)
 		ctx->tuning->refs = 1;
 		ctx->tuning->image_decode = fz_default_image_decode;
 		ctx->tuning->image_scale = fz_default_image_scale;
+		ctx->tuning->parallel_threads = 1;
 	}
 }
 
@@ -132,6 +150,13 @@ void fz_tune_image_scale(fz_context *ctx, fz_tune_image_scale_fn *image_scale, v
 	ctx->tuning->image_scale_arg = arg;
 }
 
+void fz_tune_parallel(fz_context *ctx, fz_tune_parallel_fn *parallel, void *arg, int threads)
+{
+	ctx->tuning->parallel = parallel;
+	ctx->tuning->parallel_arg = arg;
+	ctx->tuning->parallel_threads = parallel ? threads : 1;
+}
+
 void
 fz_drop_context(fz_context *ctx)
 {
@@ -140,7 +165,9 @@ fz_drop_context(fz_context *ctx)
 
 	/* Other finalisation calls go here (in reverse order) */
 	fz_drop_document_handler_context(ctx);
+	fz_drop_glyph_front_context(ctx);
 	fz_drop_glyph_cache_context(ctx);
+	fz_drop_disk_store_context(ctx);
 	fz_drop_store_context(ctx);
 	fz_drop_aa_context(ctx);
 	fz_drop_style_context(ctx);
@@ -184,6 +211,7 @@ new_context_phase1(const fz_alloc_context *alloc, const fz_locks_context *locks)
 	ctx->locks = locks;
 
 	ctx->glyph_cache = NULL;
+	ctx->glyph_front = NULL;
 
 	ctx->error = Memento_label(fz_malloc_no_throw(ctx, sizeof(fz_error_context)), "fz_error_context");
 	if (!ctx->error)
@@ -202,6 +230,7 @@ new_context_phase1(const fz_alloc_context *alloc, const fz_locks_context *locks)
 	fz_try(ctx)
 	{
 		fz_new_aa_context(ctx);
+		fz_new_glyph_front_context(ctx);
 	}
 	fz_catch(ctx)
 	{
@@ -233,6 +262,8 @@ fz_new_context_imp(const fz_alloc_context *alloc, const fz_locks_context *locks,
 	if (!locks)
 		locks = &fz_locks_default;
 
+	fz_init_cpu_features();
+
 	ctx = new_context_phase1(alloc, locks);
 	if (!ctx)
 		return NULL;
@@ -242,6 +273,7 @@ fz_new_context_imp(const fz_alloc_context *alloc, const fz_locks_context *locks,
 	{
 		fz_new_output_context(ctx);
 		fz_new_store_context(ctx, max_store);
+		fz_new_disk_store_context(ctx);
 		fz_new_glyph_cache_context(ctx);
 		fz_new_cmm_context(ctx);
 		fz_new_colorspace_context(ctx);
@@ -291,6 +323,8 @@ fz_clone_context_internal(fz_context *ctx)
 	new_ctx->user = ctx->user;
 	new_ctx->store = ctx->store;
 	new_ctx->store = fz_keep_store_context(new_ctx);
+	new_ctx->disk_store = ctx->disk_store;
+	new_ctx->disk_store = fz_keep_disk_store_context(new_ctx);
 	new_ctx->glyph_cache = ctx->glyph_cache;
 	new_ctx->glyph_cache = fz_keep_glyph_cache(new_ctx);
 	new_ctx->colorspace = ctx->colorspace;
@@ -9,6 +9,7 @@ extern fz_document_handler tiff_document_handler;
 extern fz_document_handler html_document_handler;
 extern fz_document_handler epub_document_handler;
 extern fz_document_handler gprf_document_handler;
+extern fz_document_handler list_document_handler;
 
 void fz_register_document_handlers(fz_context *ctx)
 {
@@ -39,4 +40,5 @@ void fz_register_document_handlers(fz_context *ctx)
 #if FZ_ENABLE_GPRF
 	fz_register_document_handler(ctx, &gprf_document_handler);
 #endif /* FZ_ENABLE_GPRF */
+	fz_register_document_handler(ctx, &list_document_handler);
 }
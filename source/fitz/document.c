@@ -296,6 +296,14 @@ fz_lookup_metadata(fz_context *ctx, fz_document *doc, const char *key, char *buf
 	return -1;
 }
 
+int
+fz_document_fingerprint(fz_context *ctx, fz_document *doc, unsigned char digest[16])
+{
+	if (doc && doc->fingerprint)
+		return doc->fingerprint(ctx, doc, digest);
+	return 0;
+}
+
 fz_colorspace *
 fz_document_output_intent(fz_context *ctx, fz_document *doc)
 {
@@ -1,9 +1,15 @@
 #include "mupdf/fitz.h"
+#include "fitz-imp.h"
 #include "draw-imp.h"
 
 #include <math.h>
 #include <float.h>
 #include <assert.h>
+#include <string.h>
+
+#ifdef ARCH_X86_64
+#include <smmintrin.h>
+#endif
 
 typedef unsigned char byte;
 
@@ -809,6 +815,402 @@ template_affine_color_N_near(byte * restrict dp, int da, const byte * restrict s
 	while (--w);
 }
 
+#ifdef ARCH_X86_64
+
+/*
+	SSE4.1 versions of the bilinear image painters and the colour
+	(mask) painters for 3 and 4 colorants, where source and destination
+	have the same colorants. Each pixel is worked on with one channel
+	per 32-bit lane, which is wide enough to reproduce lerp(),
+	fz_mul255() and FZ_BLEND() exactly. The alpha of a 4 colorant pixel
+	does not fit in the vector and is handled alongside in scalar code.
+
+	Only the cases that measure faster than the C templates are kept:
+	with one pixel per vector, grey, RGB without alpha and nearest
+	neighbour image painting are quicker in plain C.
+*/
+
+#define SIMD_TARGET __attribute__((target("sse4.1")))
+
+/* Load n bytes into 32-bit lanes; 3 byte pixels are read as 4 bytes if
+ * that does not run past end. */
+static inline SIMD_TARGET __m128i
+affine_load_sse41(const byte * restrict p, int n, const byte *end)
+{
+	int v;
+
+	switch (n)
+	{
+	case 1: v = p[0]; break;
+	case 2: v = p[0] | (p[1]<<8); break;
+	case 3:
+		if (p + 4 <= end)
+		{
+			memcpy(&v, p, 4);
+			v &= 0xffffff;
+		}
+		else
+			v = p[0] | (p[1]<<8) | (p[2]<<16);
+		break;
+	default: memcpy(&v, p, 4); break;
+	}
+	return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(v));
+}
+
+static inline SIMD_TARGET void
+affine_store_sse41(byte * restrict p, __m128i x, int n)
+{
+	int v;
+
+	/* Truncate like the byte stores in the C templates do */
+	x = _mm_and_si128(x, _mm_set1_epi32(255));
+	x = _mm_packus_epi32(x, x);
+	v = _mm_cvtsi128_si32(_mm_packus_epi16(x, x));
+	switch (n)
+	{
+	case 1: p[0] = v; break;
+	case 2: p[0] = v; p[1] = v>>8; break;
+	case 3: p[0] = v; p[1] = v>>8; p[2] = v>>16; break;
+	default: memcpy(p, &v, 4); break;
+	}
+}
+
+/* fz_mul255 for lanes holding 0..255; the products fit in 16 bits */
+static inline SIMD_TARGET __m128i
+affine_mul255_sse41(__m128i a, __m128i b)
+{
+	__m128i x = _mm_add_epi32(_mm_mullo_epi16(a, b), _mm_set1_epi32(128));
+	x = _mm_add_epi32(x, _mm_srli_epi32(x, 8));
+	return _mm_srli_epi32(x, 8);
+}
+
+static inline SIMD_TARGET __m128i
+affine_lerp_sse41(__m128i a, __m128i b, __m128i t)
+{
+	return _mm_add_epi32(a, _mm_srai_epi32(_mm_mullo_epi32(_mm_sub_epi32(b, a), t), 16));
+}
+
+/* Composite x (premultiplied, alpha in lane n1 or xe) over the destination */
+static inline SIMD_TARGET void
+affine_over_sse41(byte * restrict dp, int da, __m128i x, int xe, int n1, int alpha, byte * restrict hp)
+{
+	int lanes[4];
+	int xa, t;
+
+	if (alpha != 255)
+	{
+		x = affine_mul255_sse41(x, _mm_set1_epi32(alpha));
+		xe = fz_mul255(xe, alpha);
+	}
+	if (n1 < 4)
+	{
+		_mm_storeu_si128((__m128i *)lanes, x);
+		xa = lanes[n1];
+	}
+	else
+		xa = xe;
+	if (xa == 0)
+		return;
+
+	/* As fz_mul255(x, 0) == 0, opaque pixels simply replace the destination */
+	t = 255 - xa;
+	if (t != 0)
+		x = _mm_add_epi32(x, affine_mul255_sse41(affine_load_sse41(dp, n1 + da, dp + n1 + da), _mm_set1_epi32(t)));
+	affine_store_sse41(dp, x, n1 + da);
+	if (n1 == 4 && da)
+		dp[4] = xe + fz_mul255(dp[4], t);
+	if (hp)
+		hp[0] = xa + fz_mul255(hp[0], t);
+}
+
+/* A vector with 255 in the alpha lane, for sources without alpha */
+static inline SIMD_TARGET __m128i
+affine_opaque_sse41(int n1, int sa)
+{
+	int lanes[4] = { 0 };
+	if (n1 < 4 && !sa)
+		lanes[n1] = 255;
+	return _mm_loadu_si128((const __m128i *)lanes);
+}
+
+static inline SIMD_TARGET void
+template_affine_N_lerp_sse41(byte * restrict dp, int da, const byte * restrict sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int n1, int alpha, byte * restrict hp)
+{
+	const __m128i opaque = affine_opaque_sse41(n1, sa);
+	const byte *end = sp + ((sh>>16) - 1) * ss + (sw>>16) * (n1+sa);
+
+	do
+	{
+		if (u + 32768 >= 0 && u + 65536 < sw && v + 32768 >= 0 && v + 65536 < sh)
+		{
+			int ui = u >> 16;
+			int vi = v >> 16;
+			int uf = u & 0xffff;
+			int vf = v & 0xffff;
+			const byte *a = sample_nearest(sp, sw, sh, ss, n1+sa, ui, vi);
+			const byte *b = sample_nearest(sp, sw, sh, ss, n1+sa, ui+1, vi);
+			const byte *c = sample_nearest(sp, sw, sh, ss, n1+sa, ui, vi+1);
+			const byte *d = sample_nearest(sp, sw, sh, ss, n1+sa, ui+1, vi+1);
+			__m128i uf4 = _mm_set1_epi32(uf);
+			__m128i ab = affine_lerp_sse41(affine_load_sse41(a, n1+sa, end), affine_load_sse41(b, n1+sa, end), uf4);
+			__m128i cd = affine_lerp_sse41(affine_load_sse41(c, n1+sa, end), affine_load_sse41(d, n1+sa, end), uf4);
+			__m128i x = _mm_or_si128(affine_lerp_sse41(ab, cd, _mm_set1_epi32(vf)), opaque);
+			int xe = 255;
+			if (n1 == 4 && sa)
+				xe = bilerp(a[4], b[4], c[4], d[4], uf, vf);
+			affine_over_sse41(dp, da, x, xe, n1, alpha, hp);
+		}
+		dp += n1 + da;
+		if (hp)
+			hp++;
+		u += fa;
+		v += fb;
+	}
+	while (--w);
+}
+
+/* Blend color (with 255 in the alpha lane) over the destination by masa */
+static inline SIMD_TARGET void
+affine_blend_sse41(byte * restrict dp, int da, __m128i color4, int n1, int masa, byte * restrict hp)
+{
+	__m128i d = affine_load_sse41(dp, n1 + da, dp + n1 + da);
+	__m128i m = _mm_set1_epi32(masa);
+	d = _mm_srai_epi32(_mm_add_epi32(_mm_mullo_epi32(_mm_sub_epi32(color4, d), m), _mm_slli_epi32(d, 8)), 8);
+	affine_store_sse41(dp, d, n1 + da);
+	if (n1 == 4 && da)
+		dp[4] = FZ_BLEND(255, dp[4], masa);
+	if (hp)
+		hp[0] = FZ_BLEND(255, hp[0], masa);
+}
+
+static inline SIMD_TARGET __m128i
+affine_color_sse41(const byte * restrict color, int n1)
+{
+	int lanes[4];
+	int k;
+	for (k = 0; k < 4; k++)
+		lanes[k] = (k < n1 ? color[k] : 255);
+	return _mm_loadu_si128((const __m128i *)lanes);
+}
+
+static inline SIMD_TARGET void
+template_affine_color_N_lerp_sse41(byte * restrict dp, int da, const byte * restrict sp, int sw, int sh, int ss, int u, int v, int fa, int fb, int w, int n1, const byte * restrict color, byte * restrict hp)
+{
+	const __m128i color4 = affine_color_sse41(color, n1);
+	int sa = color[n1];
+
+	do
+	{
+		if (u + 32768 >= 0 && u + 65536 < sw && v + 32768 >= 0 && v + 65536 < sh)
+		{
+			int ui = u >> 16;
+			int vi = v >> 16;
+			int uf = u & 0xffff;
+			int vf = v & 0xffff;
+			const byte *a = sample_nearest(sp, sw, sh, ss, 1, ui, vi);
+			const byte *b = sample_nearest(sp, sw, sh, ss, 1, ui+1, vi);
+			const byte *c = sample_nearest(sp, sw, sh, ss, 1, ui, vi+1);
+			const byte *d = sample_nearest(sp, sw, sh, ss, 1, ui+1, vi+1);
+			int ma = bilerp(a[0], b[0], c[0], d[0], uf, vf);
+			int masa = FZ_COMBINE(FZ_EXPAND(ma), sa);
+			if (masa != 0)
+				affine_blend_sse41(dp, da, color4, n1, masa, hp);
+		}
+		dp += n1 + da;
+		if (hp)
+			hp++;
+		u += fa;
+		v += fb;
+	}
+	while (--w);
+}
+
+static inline SIMD_TARGET void
+template_affine_color_N_near_sse41(byte * restrict dp, int da, const byte * restrict sp, int sw, int sh, int ss, int u, int v, int fa, int fb, int w, int n1, const byte * restrict color, byte * restrict hp)
+{
+	const __m128i color4 = affine_color_sse41(color, n1);
+	int sa = color[n1];
+
+	do
+	{
+		int ui = u >> 16;
+		int vi = v >> 16;
+		if (ui >= 0 && ui < sw && vi >= 0 && vi < sh)
+		{
+			int ma = sp[vi * ss + ui];
+			int masa = FZ_COMBINE(FZ_EXPAND(ma), sa);
+			if (masa != 0)
+				affine_blend_sse41(dp, da, color4, n1, masa, hp);
+		}
+		dp += n1 + da;
+		if (hp)
+			hp++;
+		u += fa;
+		v += fb;
+	}
+	while (--w);
+}
+
+#if FZ_PLOTTERS_RGB
+static SIMD_TARGET void
+paint_affine_lerp_da_sa_3_sse41(byte * restrict dp, int da, const byte * restrict sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int dn, int sn, int alpha, const byte * restrict color, byte * restrict hp)
+{
+	TRACK_FN();
+	template_affine_N_lerp_sse41(dp, 1, sp, sw, sh, ss, 1, u, v, fa, fb, w, 3, alpha, hp);
+}
+
+static SIMD_TARGET void
+paint_affine_lerp_sa_3_sse41(byte * restrict dp, int da, const byte * restrict sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int dn, int sn, int alpha, const byte * restrict color, byte * restrict hp)
+{
+	TRACK_FN();
+	template_affine_N_lerp_sse41(dp, 0, sp, sw, sh, ss, 1, u, v, fa, fb, w, 3, alpha, hp);
+}
+
+static SIMD_TARGET void
+paint_affine_color_lerp_da_3_sse41(byte * restrict dp, int da, const byte * restrict sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int dn, int sn, int alpha, const byte * restrict color, byte * restrict hp)
+{
+	TRACK_FN();
+	template_affine_color_N_lerp_sse41(dp, 1, sp, sw, sh, ss, u, v, fa, fb, w, 3, color, hp);
+}
+
+static SIMD_TARGET void
+paint_affine_color_lerp_3_sse41(byte * restrict dp, int da, const byte * restrict sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int dn, int sn, int alpha, const byte * restrict color, byte * restrict hp)
+{
+	TRACK_FN();
+	template_affine_color_N_lerp_sse41(dp, 0, sp, sw, sh, ss, u, v, fa, fb, w, 3, color, hp);
+}
+
+static SIMD_TARGET void
+paint_affine_color_near_da_3_sse41(byte * restrict dp, int da, const byte * restrict sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int dn, int sn, int alpha, const byte * restrict color, byte * restrict hp)
+{
+	TRACK_FN();
+	template_affine_color_N_near_sse41(dp, 1, sp, sw, sh, ss, u, v, fa, fb, w, 3, color, hp);
+}
+
+static SIMD_TARGET void
+paint_affine_color_near_3_sse41(byte * restrict dp, int da, const byte * restrict sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int dn, int sn, int alpha, const byte * restrict color, byte * restrict hp)
+{
+	TRACK_FN();
+	template_affine_color_N_near_sse41(dp, 0, sp, sw, sh, ss, u, v, fa, fb, w, 3, color, hp);
+}
+
+#endif /* FZ_PLOTTERS_RGB */
+
+#if FZ_PLOTTERS_CMYK
+static SIMD_TARGET void
+paint_affine_lerp_da_sa_4_sse41(byte * restrict dp, int da, const byte * restrict sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int dn, int sn, int alpha, const byte * restrict color, byte * restrict hp)
+{
+	TRACK_FN();
+	template_affine_N_lerp_sse41(dp, 1, sp, sw, sh, ss, 1, u, v, fa, fb, w, 4, alpha, hp);
+}
+
+static SIMD_TARGET void
+paint_affine_lerp_da_4_sse41(byte * restrict dp, int da, const byte * restrict sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int dn, int sn, int alpha, const byte * restrict color, byte * restrict hp)
+{
+	TRACK_FN();
+	template_affine_N_lerp_sse41(dp, 1, sp, sw, sh, ss, 0, u, v, fa, fb, w, 4, alpha, hp);
+}
+
+static SIMD_TARGET void
+paint_affine_lerp_sa_4_sse41(byte * restrict dp, int da, const byte * restrict sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int dn, int sn, int alpha, const byte * restrict color, byte * restrict hp)
+{
+	TRACK_FN();
+	template_affine_N_lerp_sse41(dp, 0, sp, sw, sh, ss, 1, u, v, fa, fb, w, 4, alpha, hp);
+}
+
+static SIMD_TARGET void
+paint_affine_lerp_4_sse41(byte * restrict dp, int da, const byte * restrict sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int dn, int sn, int alpha, const byte * restrict color, byte * restrict hp)
+{
+	TRACK_FN();
+	template_affine_N_lerp_sse41(dp, 0, sp, sw, sh, ss, 0, u, v, fa, fb, w, 4, alpha, hp);
+}
+
+static SIMD_TARGET void
+paint_affine_color_lerp_da_4_sse41(byte * restrict dp, int da, const byte * restrict sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int dn, int sn, int alpha, const byte * restrict color, byte * restrict hp)
+{
+	TRACK_FN();
+	template_affine_color_N_lerp_sse41(dp, 1, sp, sw, sh, ss, u, v, fa, fb, w, 4, color, hp);
+}
+
+static SIMD_TARGET void
+paint_affine_color_lerp_4_sse41(byte * restrict dp, int da, const byte * restrict sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int dn, int sn, int alpha, const byte * restrict color, byte * restrict hp)
+{
+	TRACK_FN();
+	template_affine_color_N_lerp_sse41(dp, 0, sp, sw, sh, ss, u, v, fa, fb, w, 4, color, hp);
+}
+
+static SIMD_TARGET void
+paint_affine_color_near_da_4_sse41(byte * restrict dp, int da, const byte * restrict sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int dn, int sn, int alpha, const byte * restrict color, byte * restrict hp)
+{
+	TRACK_FN();
+	template_affine_color_N_near_sse41(dp, 1, sp, sw, sh, ss, u, v, fa, fb, w, 4, color, hp);
+}
+
+static SIMD_TARGET void
+paint_affine_color_near_4_sse41(byte * restrict dp, int da, const byte * restrict sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int dn, int sn, int alpha, const byte * restrict color, byte * restrict hp)
+{
+	TRACK_FN();
+	template_affine_color_N_near_sse41(dp, 0, sp, sw, sh, ss, u, v, fa, fb, w, 4, color, hp);
+}
+
+#endif /* FZ_PLOTTERS_CMYK */
+
+static paintfn_t *
+fz_paint_affine_lerp_sse41(int da, int sa, int n)
+{
+	switch (n)
+	{
+#if FZ_PLOTTERS_RGB
+	case 3:
+		if (!sa)
+			return NULL;
+		return da ? paint_affine_lerp_da_sa_3_sse41 : paint_affine_lerp_sa_3_sse41;
+#endif /* FZ_PLOTTERS_RGB */
+#if FZ_PLOTTERS_CMYK
+	case 4:
+		if (da)
+			return sa ? paint_affine_lerp_da_sa_4_sse41 : paint_affine_lerp_da_4_sse41;
+		else
+			return sa ? paint_affine_lerp_sa_4_sse41 : paint_affine_lerp_4_sse41;
+#endif /* FZ_PLOTTERS_CMYK */
+	}
+	return NULL;
+}
+
+static paintfn_t *
+fz_paint_affine_color_lerp_sse41(int da, int n)
+{
+	switch (n)
+	{
+#if FZ_PLOTTERS_RGB
+	case 3: return da ? paint_affine_color_lerp_da_3_sse41 : paint_affine_color_lerp_3_sse41;
+#endif /* FZ_PLOTTERS_RGB */
+#if FZ_PLOTTERS_CMYK
+	case 4: return da ? paint_affine_color_lerp_da_4_sse41 : paint_affine_color_lerp_4_sse41;
+#endif /* FZ_PLOTTERS_CMYK */
+	}
+	return NULL;
+}
+
+static paintfn_t *
+fz_paint_affine_color_near_sse41(int da, int n)
+{
+	switch (n)
+	{
+#if FZ_PLOTTERS_RGB
+	case 3: return da ? paint_affine_color_near_da_3_sse41 : paint_affine_color_near_3_sse41;
+#endif /* FZ_PLOTTERS_RGB */
+#if FZ_PLOTTERS_CMYK
+	case 4: return da ? paint_affine_color_near_da_4_sse41 : paint_affine_color_near_4_sse41;
+#endif /* FZ_PLOTTERS_CMYK */
+	}
+	return NULL;
+}
+
+#undef SIMD_TARGET
+
+#endif /* ARCH_X86_64 */
+
 static void
 paint_affine_lerp_da_sa_0(byte * restrict dp, int da, const byte * restrict sp, int sw, int sh, int ss, int sa, int u, int v, int fa, int fb, int w, int dn, int sn, int alpha, const byte * restrict color, byte * restrict hp)
 {
@@ -1072,6 +1474,17 @@ paint_affine_lerp_alpha_N(byte * restrict dp, int da, const byte * restrict sp,
 static paintfn_t *
 fz_paint_affine_lerp(int da, int sa, int fa, int fb, int n, int alpha)
 {
+#ifdef ARCH_X86_64
+	/* Unlike the nearest painters there are no fa == 0 or fb == 0
+	 * specialisations here, so the vector code is used wherever it wins. */
+	if (alpha > 0 && (fz_cpu_features & FZ_CPU_SSE41))
+	{
+		paintfn_t *fn = fz_paint_affine_lerp_sse41(da, sa, n);
+		if (fn)
+			return fn;
+	}
+#endif /* ARCH_X86_64 */
+
 	switch(n)
 	{
 	case 0:
@@ -3071,6 +3484,16 @@ fz_paint_affine_color_lerp(int da, int sa, int fa, int fb, int n, int alpha)
 static paintfn_t *
 fz_paint_affine_color_lerp_spots(int da, int sa, int fa, int fb, int dn, int sn, int alpha)
 {
+#ifdef ARCH_X86_64
+	/* Image masks painted in RGB or CMYK land here */
+	if (sn == 1 && sa == 0 && (fz_cpu_features & FZ_CPU_SSE41))
+	{
+		paintfn_t *fn = fz_paint_affine_color_lerp_sse41(da, dn);
+		if (fn)
+			return fn;
+	}
+#endif /* ARCH_X86_64 */
+
 #if FZ_PLOTTERS_N
 	return da ? paint_affine_color_lerp_da_N : paint_affine_color_lerp_N;
 #else
@@ -3175,6 +3598,16 @@ fz_paint_affine_color_near(int da, int sa, int fa, int fb, int n, int alpha)
 static paintfn_t *
 fz_paint_affine_color_near_spots(int da, int sa, int fa, int fb, int dn, int sn, int alpha)
 {
+#ifdef ARCH_X86_64
+	/* Image masks painted in RGB or CMYK land here */
+	if (sn == 1 && sa == 0 && (fz_cpu_features & FZ_CPU_SSE41))
+	{
+		paintfn_t *fn = fz_paint_affine_color_near_sse41(da, dn);
+		if (fn)
+			return fn;
+	}
+#endif /* ARCH_X86_64 */
+
 #if FZ_PLOTTERS_N
 	return da ? paint_affine_color_near_da_N : paint_affine_color_near_N;
 #else
@@ -794,10 +794,14 @@ fz_draw_fill_text(fz_context *ctx, fz_device *devp, const fz_text *text, const f
 			}
 			else
 			{
-				fz_path *path = fz_outline_glyph(ctx, span->font, gid, &tm);
+				/* Too big for the glyph cache; fill the cached
+				 * unit size outline, sized by the matrix. */
+				fz_path *path = fz_cached_glyph_outline(ctx, span->font, gid);
 				if (path)
 				{
-					fz_draw_fill_path(ctx, devp, path, 0, in_ctm, colorspace, color, alpha, color_params);
+					fz_matrix path_ctm;
+					fz_concat(&path_ctm, &tm, in_ctm);
+					fz_draw_fill_path(ctx, devp, path, 0, &path_ctm, colorspace, color, alpha, color_params);
 					fz_drop_path(ctx, path);
 				}
 				else
@@ -977,18 +981,20 @@ fz_draw_clip_text(fz_context *ctx, fz_device *devp, const fz_text *text, const f
 					}
 					else
 					{
-						fz_path *path = fz_outline_glyph(ctx, span->font, gid, &tm);
+						fz_path *path = fz_cached_glyph_outline(ctx, span->font, gid);
 						if (path)
 						{
 							fz_pixmap *old_dest;
+							fz_matrix path_ctm;
 							float white = 1;
 
+							fz_concat(&path_ctm, &tm, in_ctm);
 							old_dest = state[1].dest;
 							state[1].dest = state[1].mask;
 							state[1].mask = NULL;
 							fz_try(ctx)
 							{
-								fz_draw_fill_path(ctx, devp, path, 0, in_ctm, fz_device_gray(ctx), &white, 1, NULL);
+								fz_draw_fill_path(ctx, devp, path, 0, &path_ctm, fz_device_gray(ctx), &white, 1, NULL);
 							}
 							fz_always(ctx)
 							{
@@ -2092,7 +2098,8 @@ static const fz_store_type fz_tile_store_type =
 	fz_drop_tile_key,
 	fz_cmp_tile_key,
 	fz_format_tile_key,
-	NULL
+	NULL,
+	"pattern tile"
 };
 
 static void
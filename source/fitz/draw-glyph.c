@@ -10,6 +10,9 @@
 
 #define GLYPH_HASH_LEN 509
 
+/* Number of slots in the per-context front cache. Must be a power of 2. */
+#define GLYPH_FRONT_LEN 128
+
 typedef struct fz_glyph_cache_entry_s fz_glyph_cache_entry;
 typedef struct fz_glyph_key_s fz_glyph_key;
 
@@ -34,10 +37,23 @@ struct fz_glyph_cache_entry_s
 	fz_glyph *val;
 };
 
-struct fz_glyph_cache_s
+/*
+	The shared cache is split by hash into shards, each with its own
+	lock (FZ_LOCK_GLYPHCACHE + shard number), table, LRU list and
+	share of the size limit, so that threads rendering different
+	glyphs rarely wait for each other. No more than one shard lock
+	is ever held at a time. The reference count of the cache itself
+	is protected by the first shard's lock.
+*/
+
+#define GLYPH_CACHE_SHARDS (FZ_LOCK_GLYPHCACHE_LAST - FZ_LOCK_GLYPHCACHE + 1)
+
+typedef struct fz_glyph_cache_shard_s fz_glyph_cache_shard;
+
+struct fz_glyph_cache_shard_s
 {
-	int refs;
 	size_t total;
+	size_t max_size;
 #ifndef NDEBUG
 	int num_evictions;
 	ptrdiff_t evicted;
@@ -47,23 +63,92 @@ struct fz_glyph_cache_s
 	fz_glyph_cache_entry *lru_tail;
 };
 
+struct fz_glyph_cache_s
+{
+	int refs;
+	fz_glyph_cache_shard shard[GLYPH_CACHE_SHARDS];
+};
+
+/*
+	The front cache is a small direct mapped table of recently used
+	glyphs private to each context. Since a context is only ever used
+	by one thread at a time, lookups in it need no glyph cache lock.
+	Handing out a hit still keeps the glyph, which takes
+	FZ_LOCK_ALLOC unless built with FZ_ATOMIC_REFS. Each slot holds a
+	reference to both its glyph and its font, so a slot can never
+	match a stale font pointer.
+*/
+
+typedef struct fz_glyph_front_entry_s fz_glyph_front_entry;
+
+struct fz_glyph_front_entry_s
+{
+	fz_glyph_key key;
+	unsigned hash;
+	fz_glyph *val;
+};
+
+struct fz_glyph_front_s
+{
+#ifndef NDEBUG
+	int hits;
+	int misses;
+#endif
+	fz_glyph_front_entry entry[GLYPH_FRONT_LEN];
+};
+
 void
 fz_new_glyph_cache_context(fz_context *ctx)
 {
 	fz_glyph_cache *cache;
+	int i;
 
 	cache = fz_malloc_struct(ctx, fz_glyph_cache);
-	cache->total = 0;
+	for (i = 0; i < GLYPH_CACHE_SHARDS; i++)
+		cache->shard[i].max_size = MAX_CACHE_SIZE / GLYPH_CACHE_SHARDS;
 	cache->refs = 1;
 
 	ctx->glyph_cache = cache;
 }
 
+void
+fz_new_glyph_front_context(fz_context *ctx)
+{
+	ctx->glyph_front = fz_malloc_struct(ctx, fz_glyph_front);
+}
+
 static void
-drop_glyph_cache_entry(fz_context *ctx, fz_glyph_cache_entry *entry)
+do_purge_front(fz_context *ctx)
 {
-	fz_glyph_cache *cache = ctx->glyph_cache;
+	fz_glyph_front *front = ctx->glyph_front;
+	int i;
+
+	for (i = 0; i < GLYPH_FRONT_LEN; i++)
+	{
+		fz_glyph_front_entry *entry = &front->entry[i];
+		if (entry->val)
+		{
+			fz_drop_glyph(ctx, entry->val);
+			fz_drop_font(ctx, entry->key.font);
+			memset(entry, 0, sizeof *entry);
+		}
+	}
+}
+
+void
+fz_drop_glyph_front_context(fz_context *ctx)
+{
+	if (!ctx || !ctx->glyph_front)
+		return;
+
+	do_purge_front(ctx);
+	fz_free(ctx, ctx->glyph_front);
+	ctx->glyph_front = NULL;
+}
 
+static void
+drop_glyph_cache_entry(fz_context *ctx, fz_glyph_cache_shard *cache, fz_glyph_cache_entry *entry)
+{
 	if (entry->lru_next)
 		entry->lru_next->lru_prev = entry->lru_prev;
 	else
@@ -84,17 +169,16 @@ drop_glyph_cache_entry(fz_context *ctx, fz_glyph_cache_entry *entry)
 	fz_free(ctx, entry);
 }
 
-/* The glyph cache lock is always held when this function is called. */
+/* The shard's lock is always held when this function is called. */
 static void
-do_purge(fz_context *ctx)
+do_purge(fz_context *ctx, fz_glyph_cache_shard *cache)
 {
-	fz_glyph_cache *cache = ctx->glyph_cache;
 	int i;
 
 	for (i = 0; i < GLYPH_HASH_LEN; i++)
 	{
 		while (cache->entry[i])
-			drop_glyph_cache_entry(ctx, cache->entry[i]);
+			drop_glyph_cache_entry(ctx, cache, cache->entry[i]);
 	}
 
 	cache->total = 0;
@@ -103,9 +187,45 @@ do_purge(fz_context *ctx)
 void
 fz_purge_glyph_cache(fz_context *ctx)
 {
-	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	do_purge(ctx);
-	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+	int i;
+
+	if (ctx->glyph_front)
+		do_purge_front(ctx);
+	for (i = 0; i < GLYPH_CACHE_SHARDS; i++)
+	{
+		fz_lock(ctx, FZ_LOCK_GLYPHCACHE + i);
+		do_purge(ctx, &ctx->glyph_cache->shard[i]);
+		fz_unlock(ctx, FZ_LOCK_GLYPHCACHE + i);
+	}
+}
+
+/* The shard's lock is always held when this function is called. */
+static void
+do_evict(fz_context *ctx, fz_glyph_cache_shard *cache)
+{
+	while (cache->total > cache->max_size && cache->lru_tail)
+	{
+#ifndef NDEBUG
+		cache->num_evictions++;
+		cache->evicted += fz_glyph_size(ctx, cache->lru_tail->val);
+#endif
+		drop_glyph_cache_entry(ctx, cache, cache->lru_tail);
+	}
+}
+
+void
+fz_set_glyph_cache_size(fz_context *ctx, size_t size)
+{
+	int i;
+
+	for (i = 0; i < GLYPH_CACHE_SHARDS; i++)
+	{
+		fz_glyph_cache_shard *shard = &ctx->glyph_cache->shard[i];
+		fz_lock(ctx, FZ_LOCK_GLYPHCACHE + i);
+		shard->max_size = size / GLYPH_CACHE_SHARDS;
+		do_evict(ctx, shard);
+		fz_unlock(ctx, FZ_LOCK_GLYPHCACHE + i);
+	}
 }
 
 void
@@ -118,7 +238,11 @@ fz_drop_glyph_cache_context(fz_context *ctx)
 	ctx->glyph_cache->refs--;
 	if (ctx->glyph_cache->refs == 0)
 	{
-		do_purge(ctx);
+		int i;
+		/* Nobody else can see the cache now, so the other shards
+		 * need not (and by the lock ordering, may not) be locked. */
+		for (i = 0; i < GLYPH_CACHE_SHARDS; i++)
+			do_purge(ctx, &ctx->glyph_cache->shard[i]);
 		fz_free(ctx, ctx->glyph_cache);
 		ctx->glyph_cache = NULL;
 	}
@@ -224,8 +348,58 @@ static unsigned do_hash(unsigned char *s, int len)
 	return val;
 }
 
+static fz_glyph *
+lookup_front(fz_context *ctx, const fz_glyph_key *key, unsigned hash)
+{
+	fz_glyph_front *front = ctx->glyph_front;
+	fz_glyph_front_entry *entry;
+
+	if (!front)
+		return NULL;
+
+	entry = &front->entry[hash & (GLYPH_FRONT_LEN - 1)];
+	if (entry->val && entry->hash == hash && memcmp(&entry->key, key, sizeof(*key)) == 0)
+	{
+#ifndef NDEBUG
+		front->hits++;
+#endif
+		return fz_keep_glyph(ctx, entry->val);
+	}
+#ifndef NDEBUG
+	front->misses++;
+#endif
+	return NULL;
+}
+
+/* Must be called without the glyph cache lock held, as replacing a slot
+ * may drop the last reference to a font. */
+static void
+insert_front(fz_context *ctx, const fz_glyph_key *key, unsigned hash, fz_glyph *val)
+{
+	fz_glyph_front *front = ctx->glyph_front;
+	fz_glyph_front_entry *entry;
+	fz_glyph *old_val;
+	fz_font *old_font;
+
+	if (!front)
+		return;
+
+	entry = &front->entry[hash & (GLYPH_FRONT_LEN - 1)];
+	old_val = entry->val;
+	old_font = entry->key.font;
+	entry->key = *key;
+	entry->hash = hash;
+	entry->val = fz_keep_glyph(ctx, val);
+	fz_keep_font(ctx, key->font);
+	if (old_val)
+	{
+		fz_drop_glyph(ctx, old_val);
+		fz_drop_font(ctx, old_font);
+	}
+}
+
 static inline void
-move_to_front(fz_glyph_cache *cache, fz_glyph_cache_entry *entry)
+move_to_front(fz_glyph_cache_shard *cache, fz_glyph_cache_entry *entry)
 {
 	if (entry->lru_prev == NULL)
 		return; /* At front already */
@@ -247,19 +421,20 @@ move_to_front(fz_glyph_cache *cache, fz_glyph_cache_entry *entry)
 fz_glyph *
 fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colorspace *model, const fz_irect *scissor, int alpha, int aa)
 {
-	fz_glyph_cache *cache;
+	fz_glyph_cache_shard *cache;
 	fz_glyph_key key;
 	fz_matrix subpix_ctm;
 	fz_irect subpix_scissor;
 	float size;
 	fz_glyph *val;
-	int do_cache, locked, caching;
+	int do_cache, locked, caching, cached, lock;
 	fz_glyph_cache_entry *entry;
-	unsigned hash;
+	unsigned full_hash, hash;
 	int is_ft_font = !!fz_font_ft_face(ctx, font);
 
 	fz_var(locked);
 	fz_var(caching);
+	fz_var(cached);
 	fz_var(val);
 
 	memset(&key, 0, sizeof key);
@@ -281,8 +456,6 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 		do_cache = 0;
 	}
 
-	cache = ctx->glyph_cache;
-
 	key.font = font;
 	key.gid = gid;
 	key.a = subpix_ctm.a * 65536;
@@ -291,8 +464,21 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 	key.d = subpix_ctm.d * 65536;
 	key.aa = aa;
 
-	hash = do_hash((unsigned char *)&key, sizeof(key)) % GLYPH_HASH_LEN;
-	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	full_hash = do_hash((unsigned char *)&key, sizeof(key));
+	hash = full_hash % GLYPH_HASH_LEN;
+	lock = (full_hash / GLYPH_HASH_LEN) % GLYPH_CACHE_SHARDS;
+	cache = &ctx->glyph_cache->shard[lock];
+	lock += FZ_LOCK_GLYPHCACHE;
+
+	/* Try the front cache first; it needs no glyph cache lock. */
+	if (do_cache)
+	{
+		val = lookup_front(ctx, &key, full_hash);
+		if (val)
+			return val;
+	}
+
+	fz_lock(ctx, lock);
 	entry = cache->entry[hash];
 	while (entry)
 	{
@@ -300,7 +486,8 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 		{
 			move_to_front(cache, entry);
 			val = fz_keep_glyph(ctx, entry->val);
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+			fz_unlock(ctx, lock);
+			insert_front(ctx, &key, full_hash, val);
 			return val;
 		}
 		entry = entry->bucket_next;
@@ -308,29 +495,32 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 
 	locked = 1;
 	caching = 0;
+	cached = 0;
 	val = NULL;
 
 	fz_try(ctx)
 	{
-		if (is_ft_font)
-		{
-			val = fz_render_ft_glyph(ctx, font, gid, &subpix_ctm, aa);
-		}
-		else if (fz_font_t3_procs(ctx, font))
+		if (is_ft_font || fz_font_t3_procs(ctx, font))
 		{
-			/* We drop the glyphcache here, and execute the t3
-			 * glyph code. The danger here is that some other
-			 * thread will come along, and want the same glyph
-			 * too. If it does, we may both end up rendering
-			 * pixmaps. We cope with this later on, by ensuring
-			 * that only one gets inserted into the cache. If
-			 * we insert ours to find one already there, we
-			 * abandon ours, and use the one there already.
+			/* We drop the glyphcache here, and render the glyph
+			 * (either with freetype, or by executing the t3
+			 * glyph code), so that other threads can render
+			 * other glyphs at the same time. The danger here
+			 * is that some other thread will come along, and
+			 * want the same glyph too. If it does, we may both
+			 * end up rendering pixmaps. We cope with this later
+			 * on, by ensuring that only one gets inserted into
+			 * the cache. If we insert ours to find one already
+			 * there, we abandon ours, and use the one there
+			 * already.
 			 */
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+			fz_unlock(ctx, lock);
 			locked = 0;
-			val = fz_render_t3_glyph(ctx, font, gid, &subpix_ctm, model, scissor, aa);
-			fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+			if (is_ft_font)
+				val = fz_render_ft_glyph(ctx, font, gid, &subpix_ctm, aa);
+			else
+				val = fz_render_t3_glyph(ctx, font, gid, &subpix_ctm, model, scissor, aa);
+			fz_lock(ctx, lock);
 			locked = 1;
 		}
 		else
@@ -344,22 +534,20 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 				/* If we throw an exception whilst caching,
 				 * just ignore the exception and carry on. */
 				caching = 1;
-				if (!is_ft_font)
+				/* We had to unlock. Someone else might
+				 * have rendered in the meantime */
+				entry = cache->entry[hash];
+				while (entry)
 				{
-					/* We had to unlock. Someone else might
-					 * have rendered in the meantime */
-					entry = cache->entry[hash];
-					while (entry)
+					if (memcmp(&entry->key, &key, sizeof(key)) == 0)
 					{
-						if (memcmp(&entry->key, &key, sizeof(key)) == 0)
-						{
-							fz_drop_glyph(ctx, val);
-							move_to_front(cache, entry);
-							val = fz_keep_glyph(ctx, entry->val);
-							goto unlock_and_return_val;
-						}
-						entry = entry->bucket_next;
+						fz_drop_glyph(ctx, val);
+						move_to_front(cache, entry);
+						val = fz_keep_glyph(ctx, entry->val);
+						cached = 1;
+						goto unlock_and_return_val;
 					}
+					entry = entry->bucket_next;
 				}
 
 				entry = fz_malloc_struct(ctx, fz_glyph_cache_entry);
@@ -380,14 +568,8 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 				cache->lru_head = entry;
 
 				cache->total += fz_glyph_size(ctx, val);
-				while (cache->total > MAX_CACHE_SIZE)
-				{
-#ifndef NDEBUG
-					cache->num_evictions++;
-					cache->evicted += fz_glyph_size(ctx, cache->lru_tail->val);
-#endif
-					drop_glyph_cache_entry(ctx, cache->lru_tail);
-				}
+				do_evict(ctx, cache);
+				cached = 1;
 			}
 		}
 unlock_and_return_val:
@@ -397,7 +579,7 @@ unlock_and_return_val:
 	fz_always(ctx)
 	{
 		if (locked)
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+			fz_unlock(ctx, lock);
 	}
 	fz_catch(ctx)
 	{
@@ -407,6 +589,9 @@ unlock_and_return_val:
 			fz_rethrow(ctx);
 	}
 
+	if (cached)
+		insert_front(ctx, &key, full_hash, val);
+
 	return val;
 }
 
@@ -450,9 +635,26 @@ void
 fz_dump_glyph_cache_stats(fz_context *ctx)
 {
 	fz_glyph_cache *cache = ctx->glyph_cache;
+	size_t total = 0;
+#ifndef NDEBUG
+	int num_evictions = 0;
+	ptrdiff_t evicted = 0;
+#endif
+	int i;
+
+	for (i = 0; i < GLYPH_CACHE_SHARDS; i++)
+	{
+		total += cache->shard[i].total;
+#ifndef NDEBUG
+		num_evictions += cache->shard[i].num_evictions;
+		evicted += cache->shard[i].evicted;
+#endif
+	}
 
-	fz_write_printf(ctx, fz_stderr(ctx), "Glyph Cache Size: %zu\n", cache->total);
+	fz_write_printf(ctx, fz_stderr(ctx), "Glyph Cache Size: %zu\n", total);
 #ifndef NDEBUG
-	fz_write_printf(ctx, fz_stderr(ctx), "Glyph Cache Evictions: %d (%zu bytes)\n", cache->num_evictions, cache->evicted);
+	fz_write_printf(ctx, fz_stderr(ctx), "Glyph Cache Evictions: %d (%zu bytes)\n", num_evictions, evicted);
+	if (ctx->glyph_front)
+		fz_write_printf(ctx, fz_stderr(ctx), "Glyph Front Cache: %d hits, %d misses\n", ctx->glyph_front->hits, ctx->glyph_front->misses);
 #endif
 }
@@ -11,6 +11,7 @@ intermediate results rather than ints.
 */
 
 #include "mupdf/fitz.h"
+#include "fitz-imp.h"
 #include "draw-imp.h"
 
 #include <math.h>
@@ -18,6 +19,10 @@ intermediate results rather than ints.
 #include <assert.h>
 #include <limits.h>
 
+#ifdef ARCH_X86_64
+#include <smmintrin.h>
+#endif
+
 /* Do we special case handling of single pixel high/wide images? The
  * 'purest' handling is given by not special casing them, but certain
  * files that use such images 'stack' them to give full images. Not
@@ -1259,6 +1264,232 @@ scale_row_from_temp_alpha(unsigned char * restrict dst, const unsigned char * re
 }
 #endif
 
+#ifdef ARCH_X86_64
+
+/*
+	SSE4.1 versions of the row scalers. The weights fit in 16 bits,
+	so pairs of samples are multiplied and summed into 32-bit lanes
+	with pmaddwd, giving exactly the same sums as the C code.
+	Horizontally, two pixels are worked on at once with their
+	channels interleaved; vertically, 16 samples are done at once
+	with pairs of rows interleaved.
+*/
+
+#define SIMD_TARGET __attribute__((target("sse4.1")))
+
+/* Interleave the channels of two adjacent 3 or 4 byte pixels */
+static const signed char scale_pair_shuffle3[16] = { 0, 3, 1, 4, 2, 5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 };
+static const signed char scale_pair_shuffle4[16] = { 0, 4, 1, 5, 2, 6, 3, 7, -1, -1, -1, -1, -1, -1, -1, -1 };
+
+/* Gather byte 1 of each 32-bit lane, i.e. (unsigned char)(v>>8) */
+static const signed char scale_result_shuffle[16] = { 1, 5, 9, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 };
+
+static inline SIMD_TARGET __m128i
+scale_weight_pair_sse41(int w0, int w1)
+{
+	return _mm_set1_epi32((int)(((unsigned int)w1 << 16) | ((unsigned int)w0 & 0xffff)));
+}
+
+static SIMD_TARGET void
+scale_row_to_temp1_sse41(unsigned char * restrict dst, const unsigned char * restrict src, const fz_weights * restrict weights)
+{
+	const int *contrib = &weights->index[weights->index[0]];
+	int len, i, step;
+	const unsigned char *min;
+
+	assert(weights->n == 1);
+	step = 1;
+	if (weights->flip)
+	{
+		dst += weights->count - 1;
+		step = -1;
+	}
+	for (i=weights->count; i > 0; i--)
+	{
+		__m128i acc = _mm_setzero_si128();
+		int val;
+		min = &src[*contrib++];
+		len = *contrib++;
+		while (len >= 8)
+		{
+			__m128i s = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)min));
+			__m128i w = _mm_packs_epi32(_mm_loadu_si128((const __m128i *)contrib), _mm_loadu_si128((const __m128i *)(contrib + 4)));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(s, w));
+			min += 8;
+			contrib += 8;
+			len -= 8;
+		}
+		acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+		acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+		val = 128 + _mm_cvtsi128_si32(acc);
+		while (len-- > 0)
+		{
+			val += *min++ * *contrib++;
+		}
+		*dst = (unsigned char)(val>>8);
+		dst += step;
+	}
+}
+
+static SIMD_TARGET void
+scale_row_to_temp3_sse41(unsigned char * restrict dst, const unsigned char * restrict src, const fz_weights * restrict weights)
+{
+	const int *contrib = &weights->index[weights->index[0]];
+	const __m128i pair = _mm_loadu_si128((const __m128i *)scale_pair_shuffle3);
+	const __m128i result = _mm_loadu_si128((const __m128i *)scale_result_shuffle);
+	int len, i, step;
+	const unsigned char *min;
+
+	assert(weights->n == 3);
+	step = 3;
+	if (weights->flip)
+	{
+		dst += 3*(weights->count - 1);
+		step = -3;
+	}
+	for (i=weights->count; i > 0; i--)
+	{
+		__m128i acc = _mm_set1_epi32(128);
+		int v;
+		min = &src[3 * *contrib++];
+		len = *contrib++;
+		/* Reading 8 bytes for a pair of pixels is safe as long as
+		 * a third pixel follows them. */
+		while (len >= 3)
+		{
+			__m128i s = _mm_cvtepu8_epi16(_mm_shuffle_epi8(_mm_loadl_epi64((const __m128i *)min), pair));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(s, scale_weight_pair_sse41(contrib[0], contrib[1])));
+			min += 6;
+			contrib += 2;
+			len -= 2;
+		}
+		while (len-- > 0)
+		{
+			__m128i s = _mm_setr_epi32(min[0], min[1], min[2], 0);
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(s, _mm_set1_epi32(*contrib & 0xffff)));
+			min += 3;
+			contrib++;
+		}
+		v = _mm_cvtsi128_si32(_mm_shuffle_epi8(acc, result));
+		dst[0] = (unsigned char)v;
+		dst[1] = (unsigned char)(v>>8);
+		dst[2] = (unsigned char)(v>>16);
+		dst += step;
+	}
+}
+
+static SIMD_TARGET void
+scale_row_to_temp4_sse41(unsigned char * restrict dst, const unsigned char * restrict src, const fz_weights * restrict weights)
+{
+	const int *contrib = &weights->index[weights->index[0]];
+	const __m128i pair = _mm_loadu_si128((const __m128i *)scale_pair_shuffle4);
+	const __m128i result = _mm_loadu_si128((const __m128i *)scale_result_shuffle);
+	int len, i, step;
+	const unsigned char *min;
+
+	assert(weights->n == 4);
+	step = 4;
+	if (weights->flip)
+	{
+		dst += 4*(weights->count - 1);
+		step = -4;
+	}
+	for (i=weights->count; i > 0; i--)
+	{
+		__m128i acc = _mm_set1_epi32(128);
+		int v;
+		min = &src[4 * *contrib++];
+		len = *contrib++;
+		while (len >= 2)
+		{
+			__m128i s = _mm_cvtepu8_epi16(_mm_shuffle_epi8(_mm_loadl_epi64((const __m128i *)min), pair));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(s, scale_weight_pair_sse41(contrib[0], contrib[1])));
+			min += 8;
+			contrib += 2;
+			len -= 2;
+		}
+		if (len > 0)
+		{
+			memcpy(&v, min, 4);
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v)), _mm_set1_epi32(*contrib & 0xffff)));
+			contrib++;
+		}
+		v = _mm_cvtsi128_si32(_mm_shuffle_epi8(acc, result));
+		memcpy(dst, &v, 4);
+		dst += step;
+	}
+}
+
+static SIMD_TARGET void
+scale_row_from_temp_sse41(unsigned char * restrict dst, const unsigned char * restrict src, const fz_weights * restrict weights, int w, int n, int row)
+{
+	const int *contrib = &weights->index[weights->index[row]];
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i mask = _mm_set1_epi32(0xff);
+	int len, x, k;
+	int width = w * n;
+
+	contrib++; /* Skip min */
+	len = *contrib++;
+	for (x = width; x >= 16; x -= 16)
+	{
+		const unsigned char *min = src;
+		__m128i acc0 = _mm_set1_epi32(128);
+		__m128i acc1 = acc0;
+		__m128i acc2 = acc0;
+		__m128i acc3 = acc0;
+
+		for (k = 0; k < len; k += 2)
+		{
+			__m128i a = _mm_loadu_si128((const __m128i *)min);
+			__m128i b, wp, lo, hi;
+			if (k + 1 < len)
+			{
+				b = _mm_loadu_si128((const __m128i *)(min + width));
+				wp = scale_weight_pair_sse41(contrib[k], contrib[k+1]);
+			}
+			else
+			{
+				b = zero;
+				wp = scale_weight_pair_sse41(contrib[k], 0);
+			}
+			lo = _mm_unpacklo_epi8(a, zero);
+			hi = _mm_unpacklo_epi8(b, zero);
+			acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(lo, hi), wp));
+			acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(lo, hi), wp));
+			lo = _mm_unpackhi_epi8(a, zero);
+			hi = _mm_unpackhi_epi8(b, zero);
+			acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi16(lo, hi), wp));
+			acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi16(lo, hi), wp));
+			min += 2 * width;
+		}
+		acc0 = _mm_and_si128(_mm_srai_epi32(acc0, 8), mask);
+		acc1 = _mm_and_si128(_mm_srai_epi32(acc1, 8), mask);
+		acc2 = _mm_and_si128(_mm_srai_epi32(acc2, 8), mask);
+		acc3 = _mm_and_si128(_mm_srai_epi32(acc3, 8), mask);
+		_mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(_mm_packus_epi32(acc0, acc1), _mm_packus_epi32(acc2, acc3)));
+		dst += 16;
+		src += 16;
+	}
+	for (; x > 0; x--)
+	{
+		const unsigned char *min = src;
+		int val = 128;
+
+		for (k = 0; k < len; k++)
+		{
+			val += *min * contrib[k];
+			min += width;
+		}
+		*dst++ = (unsigned char)(val>>8);
+		src++;
+	}
+}
+
+#undef SIMD_TARGET
+
+#endif /* ARCH_X86_64 */
+
 #ifdef SINGLE_PIXEL_SPECIALS
 static void
 duplicate_single_pixel(unsigned char * restrict dst, const unsigned char * restrict src, int n, int forcealpha, int w, int h, int stride)
@@ -1525,6 +1756,70 @@ adjust_alpha_edges(fz_pixmap * restrict pix, const fz_weights * restrict rows, c
 	}
 }
 
+typedef void (row_scale_in_fn)(unsigned char * restrict dst, const unsigned char * restrict src, const fz_weights * restrict weights);
+typedef void (row_scale_out_fn)(unsigned char * restrict dst, const unsigned char * restrict src, const fz_weights * restrict weights, int w, int n, int row);
+
+/* Only split scales into bands when the source is at least this big
+ * (in bytes), and give each band at least this many output rows. */
+#define PARALLEL_SCALE_MIN_SIZE (1<<21)
+#define PARALLEL_SCALE_MIN_ROWS 16
+
+typedef struct
+{
+	const fz_pixmap *src;
+	fz_pixmap *output;
+	const fz_weights *contrib_rows;
+	const fz_weights *contrib_cols;
+	row_scale_in_fn *row_scale_in;
+	row_scale_out_fn *row_scale_out;
+	unsigned char *temp;
+	int temp_span;
+	int temp_rows;
+	int flip_y;
+	int bands;
+} scale_job;
+
+/* Scale one band of output rows, using a temporary buffer of its own.
+ * The weights are only read, so bands can be done in parallel. */
+static void
+scale_band(void *job_, int band)
+{
+	scale_job *job = (scale_job *)job_;
+	const fz_pixmap *src = job->src;
+	const fz_weights *contrib_rows = job->contrib_rows;
+	unsigned char *temp = job->temp + (size_t)job->temp_span * job->temp_rows * band;
+	int temp_span = job->temp_span;
+	int temp_rows = job->temp_rows;
+	int row = (int)((int64_t)contrib_rows->count * band / job->bands);
+	int row_end = (int)((int64_t)contrib_rows->count * (band + 1) / job->bands);
+	int max_row;
+
+	if (row >= row_end)
+		return;
+
+	max_row = contrib_rows->index[contrib_rows->index[row]];
+	for (; row < row_end; row++)
+	{
+		/*
+		Which source rows do we need to have scaled into the
+		temporary buffer in order to be able to do the final
+		scale?
+		*/
+		int row_index = contrib_rows->index[row];
+		int row_min = contrib_rows->index[row_index++];
+		int row_len = contrib_rows->index[row_index];
+		while (max_row < row_min+row_len)
+		{
+			/* Scale another row */
+			assert(max_row < src->h);
+			(*job->row_scale_in)(&temp[temp_span*(max_row % temp_rows)], &src->samples[(job->flip_y ? (src->h-1-max_row): max_row)*src->stride], job->contrib_cols);
+			max_row++;
+		}
+
+		(*job->row_scale_out)(&job->output->samples[row*job->output->stride], temp, contrib_rows, job->contrib_cols->count, src->n, row);
+	}
+}
+
 fz_pixmap *
 fz_scale_pixmap(fz_context *ctx, fz_pixmap *src, float x, float y, float w, float h, fz_irect *clip)
 {
@@ -1539,7 +1834,7 @@ fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y,
 	fz_weights *contrib_cols = NULL;
 	fz_pixmap *output = NULL;
 	unsigned char *temp = NULL;
-	int max_row, temp_span, temp_rows, row;
+	int temp_span, temp_rows, bands;
 	int dst_w_int, dst_h_int, dst_x_int, dst_y_int;
 	int flip_x, flip_y, forcealpha;
 	fz_rect patch;
@@ -1751,16 +2046,26 @@ fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y,
 	else
 #endif /* SINGLE_PIXEL_SPECIALS */
 	{
-		void (*row_scale_in)(unsigned char * restrict dst, const unsigned char * restrict src, const fz_weights * restrict weights);
-		void (*row_scale_out)(unsigned char * restrict dst, const unsigned char * restrict src, const fz_weights * restrict weights, int w, int n, int row);
+		scale_job job;
 
 		temp_span = contrib_cols->count * src->n;
 		temp_rows = contrib_rows->max_len;
 		if (temp_span <= 0 || temp_rows > INT_MAX / temp_span)
 			goto cleanup;
+
+		/* Split large scales into bands of rows for the worker
+		 * threads, if the caller has given us any. */
+		bands = 1;
+		if (ctx->tuning->parallel_threads > 1 && (int64_t)src->w * src->h * src->n >= PARALLEL_SCALE_MIN_SIZE)
+		{
+			bands = fz_mini(ctx->tuning->parallel_threads, contrib_rows->count / PARALLEL_SCALE_MIN_ROWS);
+			if (bands < 1 || temp_span*temp_rows > INT_MAX / bands)
+				bands = 1;
+		}
+
 		fz_try(ctx)
 		{
-			temp = fz_calloc(ctx, temp_span*temp_rows, sizeof(unsigned char));
+			temp = fz_calloc(ctx, temp_span*temp_rows, bands);
 		}
 		fz_catch(ctx)
 		{
@@ -1774,43 +2079,48 @@ fz_scale_pixmap_cached(fz_context *ctx, const fz_pixmap *src, float x, float y,
 		switch (src->n)
 		{
 		default:
-			row_scale_in = scale_row_to_temp;
+			job.row_scale_in = scale_row_to_temp;
 			break;
 		case 1: /* Image mask case or Greyscale case */
-			row_scale_in = scale_row_to_temp1;
+			job.row_scale_in = scale_row_to_temp1;
 			break;
 		case 2: /* Greyscale with alpha case */
-			row_scale_in = scale_row_to_temp2;
+			job.row_scale_in = scale_row_to_temp2;
 			break;
 		case 3: /* RGB case */
-			row_scale_in = scale_row_to_temp3;
+			job.row_scale_in = scale_row_to_temp3;
 			break;
 		case 4: /* RGBA or CMYK case */
-			row_scale_in = scale_row_to_temp4;
+			job.row_scale_in = scale_row_to_temp4;
 			break;
 		}
-		row_scale_out = forcealpha ? scale_row_from_temp_alpha : scale_row_from_temp;
-		max_row = contrib_rows->index[contrib_rows->index[0]];
-		for (row = 0; row < contrib_rows->count; row++)
+		job.row_scale_out = forcealpha ? scale_row_from_temp_alpha : scale_row_from_temp;
+#ifdef ARCH_X86_64
+		if (fz_cpu_features & FZ_CPU_SSE41)
 		{
-			/*
-			Which source rows do we need to have scaled into the
-			temporary buffer in order to be able to do the final
-			scale?
-			*/
-			int row_index = contrib_rows->index[row];
-			int row_min = contrib_rows->index[row_index++];
-			int row_len = contrib_rows->index[row_index];
-			while (max_row < row_min+row_len)
+			switch (src->n)
 			{
-				/* Scale another row */
-				assert(max_row < src->h);
-				(*row_scale_in)(&temp[temp_span*(max_row % temp_rows)], &src->samples[(flip_y ? (src->h-1-max_row): max_row)*src->stride], contrib_cols);
-				max_row++;
+			case 1: job.row_scale_in = scale_row_to_temp1_sse41; break;
+			case 3: job.row_scale_in = scale_row_to_temp3_sse41; break;
+			case 4: job.row_scale_in = scale_row_to_temp4_sse41; break;
 			}
-
-			(*row_scale_out)(&output->samples[row*output->stride], temp, contrib_rows, contrib_cols->count, src->n, row);
+			if (!forcealpha)
+				job.row_scale_out = scale_row_from_temp_sse41;
 		}
+#endif
+		job.src = src;
+		job.output = output;
+		job.contrib_rows = contrib_rows;
+		job.contrib_cols = contrib_cols;
+		job.temp = temp;
+		job.temp_span = temp_span;
+		job.temp_rows = temp_rows;
+		job.flip_y = flip_y;
+		job.bands = bands;
+		if (bands > 1)
+			ctx->tuning->parallel(ctx->tuning->parallel_arg, bands, scale_band, &job);
+		else
+			scale_band(&job, 0);
 		fz_free(ctx, temp);
 
 		if (forcealpha)
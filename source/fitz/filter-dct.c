@@ -147,107 +147,113 @@ static void skip_input_data_dct(j_decompress_ptr cinfo, long num_bytes)
 	}
 }
 
-static int
-next_dctd(fz_context *ctx, fz_stream *stm, size_t max)
+/* Must be called from within a setjmp(state->jb) scope */
+static void
+start_dctd(fz_context *ctx, fz_dctd *state)
 {
-	fz_dctd *state = stm->state;
 	j_decompress_ptr cinfo = &state->cinfo;
-	unsigned char *p = state->buffer;
-	unsigned char *ep;
+	int c;
 
-	if (max > sizeof(state->buffer))
-		max = sizeof(state->buffer);
-	ep = state->buffer + max;
+	cinfo->src = NULL;
+	cinfo->client_data = state;
+	cinfo->err = &state->errmgr;
+	jpeg_std_error(cinfo->err);
+	cinfo->err->error_exit = error_exit_dct;
 
-	if (setjmp(state->jb))
-	{
-		if (cinfo->src)
-			state->curr_stm->rp = state->curr_stm->wp - cinfo->src->bytes_in_buffer;
-		fz_throw(ctx, FZ_ERROR_GENERIC, "jpeg error: %s", state->msg);
-	}
+	fz_dct_mem_init(state);
 
-	if (!state->init)
-	{
-		int c;
+	jpeg_create_decompress(cinfo);
+	state->init = 1;
 
-		cinfo->src = NULL;
-		cinfo->client_data = state;
-		cinfo->err = &state->errmgr;
-		jpeg_std_error(cinfo->err);
-		cinfo->err->error_exit = error_exit_dct;
+	/* Skip over any stray returns at the start of the stream */
+	while ((c = fz_peek_byte(ctx, state->chain)) == '\n' || c == '\r')
+		(void)fz_read_byte(ctx, state->chain);
 
-		fz_dct_mem_init(state);
+	cinfo->src = &state->srcmgr;
+	cinfo->src->init_source = init_source_dct;
+	cinfo->src->fill_input_buffer = fill_input_buffer_dct;
+	cinfo->src->skip_input_data = skip_input_data_dct;
+	cinfo->src->resync_to_restart = jpeg_resync_to_restart;
+	cinfo->src->term_source = term_source_dct;
 
-		jpeg_create_decompress(cinfo);
-		state->init = 1;
+	/* optionally load additional JPEG tables first */
+	if (state->jpegtables)
+	{
+		state->curr_stm = state->jpegtables;
+		cinfo->src->next_input_byte = state->curr_stm->rp;
+		cinfo->src->bytes_in_buffer = state->curr_stm->wp - state->curr_stm->rp;
+		jpeg_read_header(cinfo, 0);
+		state->curr_stm->rp = state->curr_stm->wp - state->cinfo.src->bytes_in_buffer;
+		state->curr_stm = state->chain;
+	}
 
-		/* Skip over any stray returns at the start of the stream */
-		while ((c = fz_peek_byte(ctx, state->chain)) == '\n' || c == '\r')
-			(void)fz_read_byte(ctx, state->chain);
+	cinfo->src->next_input_byte = state->curr_stm->rp;
+	cinfo->src->bytes_in_buffer = state->curr_stm->wp - state->curr_stm->rp;
 
-		cinfo->src = &state->srcmgr;
-		cinfo->src->init_source = init_source_dct;
-		cinfo->src->fill_input_buffer = fill_input_buffer_dct;
-		cinfo->src->skip_input_data = skip_input_data_dct;
-		cinfo->src->resync_to_restart = jpeg_resync_to_restart;
-		cinfo->src->term_source = term_source_dct;
+	jpeg_read_header(cinfo, 1);
 
-		/* optionally load additional JPEG tables first */
-		if (state->jpegtables)
-		{
-			state->curr_stm = state->jpegtables;
-			cinfo->src->next_input_byte = state->curr_stm->rp;
-			cinfo->src->bytes_in_buffer = state->curr_stm->wp - state->curr_stm->rp;
-			jpeg_read_header(cinfo, 0);
-			state->curr_stm->rp = state->curr_stm->wp - state->cinfo.src->bytes_in_buffer;
-			state->curr_stm = state->chain;
-		}
+	/* default value if ColorTransform is not set */
+	if (state->color_transform == -1)
+	{
+		if (state->cinfo.num_components == 3)
+			state->color_transform = 1;
+		else
+			state->color_transform = 0;
+	}
 
-		cinfo->src->next_input_byte = state->curr_stm->rp;
-		cinfo->src->bytes_in_buffer = state->curr_stm->wp - state->curr_stm->rp;
+	if (cinfo->saw_Adobe_marker)
+		state->color_transform = cinfo->Adobe_transform;
 
-		jpeg_read_header(cinfo, 1);
+	/* Guess the input colorspace, and set output colorspace accordingly */
+	switch (cinfo->num_components)
+	{
+	case 3:
+		if (state->color_transform)
+			cinfo->jpeg_color_space = JCS_YCbCr;
+		else
+			cinfo->jpeg_color_space = JCS_RGB;
+		break;
+	case 4:
+		if (state->color_transform)
+			cinfo->jpeg_color_space = JCS_YCCK;
+		else
+			cinfo->jpeg_color_space = JCS_CMYK;
+		break;
+	}
 
-		/* default value if ColorTransform is not set */
-		if (state->color_transform == -1)
-		{
-			if (state->cinfo.num_components == 3)
-				state->color_transform = 1;
-			else
-				state->color_transform = 0;
-		}
+	cinfo->scale_num = 8/(1<<state->l2factor);
+	cinfo->scale_denom = 8;
 
-		if (cinfo->saw_Adobe_marker)
-			state->color_transform = cinfo->Adobe_transform;
+	jpeg_start_decompress(cinfo);
 
-		/* Guess the input colorspace, and set output colorspace accordingly */
-		switch (cinfo->num_components)
-		{
-		case 3:
-			if (state->color_transform)
-				cinfo->jpeg_color_space = JCS_YCbCr;
-			else
-				cinfo->jpeg_color_space = JCS_RGB;
-			break;
-		case 4:
-			if (state->color_transform)
-				cinfo->jpeg_color_space = JCS_YCCK;
-			else
-				cinfo->jpeg_color_space = JCS_CMYK;
-			break;
-		}
+	state->stride = cinfo->output_width * cinfo->output_components;
+	state->scanline = fz_malloc(ctx, state->stride);
+	state->rp = state->scanline;
+	state->wp = state->scanline;
+}
 
-		cinfo->scale_num = 8/(1<<state->l2factor);
-		cinfo->scale_denom = 8;
+static int
+next_dctd(fz_context *ctx, fz_stream *stm, size_t max)
+{
+	fz_dctd *state = stm->state;
+	j_decompress_ptr cinfo = &state->cinfo;
+	unsigned char *p = state->buffer;
+	unsigned char *ep;
 
-		jpeg_start_decompress(cinfo);
+	if (max > sizeof(state->buffer))
+		max = sizeof(state->buffer);
+	ep = state->buffer + max;
 
-		state->stride = cinfo->output_width * cinfo->output_components;
-		state->scanline = fz_malloc(ctx, state->stride);
-		state->rp = state->scanline;
-		state->wp = state->scanline;
+	if (setjmp(state->jb))
+	{
+		if (cinfo->src)
+			state->curr_stm->rp = state->curr_stm->wp - cinfo->src->bytes_in_buffer;
+		fz_throw(ctx, FZ_ERROR_GENERIC, "jpeg error: %s", state->msg);
 	}
 
+	if (!state->init)
+		start_dctd(ctx, state);
+
 	while (state->rp < state->wp && p < ep)
 		*p++ = *state->rp++;
 
@@ -280,6 +286,102 @@ next_dctd(fz_context *ctx, fz_stream *stm, size_t max)
 	return *stm->rp++;
 }
 
+/* Must be called from within a setjmp(state->jb) scope */
+static int
+skip_scanlines_dctd(fz_dctd *state, int n)
+{
+	j_decompress_ptr cinfo = &state->cinfo;
+	int left = cinfo->output_height - cinfo->output_scanline;
+
+	if (n > left)
+		n = left;
+	if (n <= 0)
+		return 0;
+
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER) && LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+	/* libjpeg-turbo can skip whole iMCU rows without running the IDCT.
+	 * Its upsampling context is not exact across a skip when scaling,
+	 * so only use it for full size output. */
+	if (state->l2factor == 0)
+		return jpeg_skip_scanlines(cinfo, n);
+#endif
+
+	{
+		int i;
+		for (i = 0; i < n; i++)
+			jpeg_read_scanlines(cinfo, &state->scanline, 1);
+	}
+	return n;
+}
+
+/*
+	Forward seeks only. Rows we seek over are never copied out of
+	the decoder, and with libjpeg-turbo they are not even decoded.
+	This lets image subarea decoding jump straight to the rows it
+	wants.
+*/
+static void
+seek_dctd(fz_context *ctx, fz_stream *stm, fz_off_t offset, int whence)
+{
+	fz_dctd *state = stm->state;
+	j_decompress_ptr cinfo = &state->cinfo;
+	fz_off_t skip;
+	size_t n;
+	int rows;
+
+	if (whence != 0)
+	{
+		fz_warn(ctx, "cannot seek");
+		return;
+	}
+	skip = offset - fz_tell(ctx, stm);
+	if (skip < 0)
+	{
+		fz_warn(ctx, "cannot seek backwards in jpeg stream");
+		return;
+	}
+
+	if (setjmp(state->jb))
+	{
+		if (cinfo->src)
+			state->curr_stm->rp = state->curr_stm->wp - cinfo->src->bytes_in_buffer;
+		fz_throw(ctx, FZ_ERROR_GENERIC, "jpeg error: %s", state->msg);
+	}
+
+	if (!state->init)
+		start_dctd(ctx, state);
+
+	/* Consume what has already been decoded. */
+	n = stm->wp - stm->rp;
+	if ((size_t)skip < n)
+		n = skip;
+	stm->rp += n;
+	skip -= n;
+
+	n = state->wp - state->rp;
+	if ((size_t)skip < n)
+		n = skip;
+	state->rp += n;
+	stm->pos += n;
+	skip -= n;
+
+	if (skip == 0)
+		return;
+
+	/* Both buffers are empty, so we are at the start of a scanline. */
+	rows = skip_scanlines_dctd(state, skip / state->stride);
+	stm->pos += (fz_off_t)rows * state->stride;
+	skip -= (fz_off_t)rows * state->stride;
+
+	if (skip > 0 && skip < state->stride && cinfo->output_scanline < cinfo->output_height)
+	{
+		jpeg_read_scanlines(cinfo, &state->scanline, 1);
+		state->rp = state->scanline + skip;
+		state->wp = state->scanline + state->stride;
+		stm->pos += skip;
+	}
+}
+
 static void
 close_dctd(fz_context *ctx, void *state_)
 {
@@ -317,6 +419,7 @@ fz_stream *
 fz_open_dctd(fz_context *ctx, fz_stream *chain, int color_transform, int l2factor, fz_stream *jpegtables)
 {
 	fz_dctd *state = NULL;
+	fz_stream *stm;
 
 	fz_var(state);
 
@@ -340,5 +443,7 @@ fz_open_dctd(fz_context *ctx, fz_stream *chain, int color_transform, int l2facto
 		fz_rethrow(ctx);
 	}
 
-	return fz_new_stream(ctx, state, next_dctd, close_dctd);
+	stm = fz_new_stream(ctx, state, next_dctd, close_dctd);
+	stm->seek = seek_dctd;
+	return stm;
 }
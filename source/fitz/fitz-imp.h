@@ -68,6 +68,9 @@ struct fz_tuning_context_s
 	void *image_decode_arg;
 	fz_tune_image_scale_fn *image_scale;
 	void *image_scale_arg;
+	fz_tune_parallel_fn *parallel;
+	void *parallel_arg;
+	int parallel_threads;
 };
 
 void fz_default_image_decode(void *arg, int w, int h, int l2factor, fz_irect *subarea);
@@ -83,6 +86,45 @@ void fz_new_glyph_cache_context(fz_context *ctx);
 fz_glyph_cache *fz_keep_glyph_cache(fz_context *ctx);
 void fz_drop_glyph_cache_context(fz_context *ctx);
 
+void fz_new_glyph_front_context(fz_context *ctx);
+void fz_drop_glyph_front_context(fz_context *ctx);
+
+void fz_new_disk_store_context(fz_context *ctx);
+fz_disk_store *fz_keep_disk_store_context(fz_context *ctx);
+void fz_drop_disk_store_context(fz_context *ctx);
+
+/*
+	fz_has_disk_store: Returns non zero if a disk store has been
+	enabled with fz_enable_disk_store.
+*/
+int fz_has_disk_store(fz_context *ctx);
+
+/*
+	fz_disk_store_load_fn: Make an object from the serialised form
+	given in data. Returns NULL (or throws) if it cannot.
+*/
+typedef void *(fz_disk_store_load_fn)(fz_context *ctx, const unsigned char *data, size_t len, void *arg);
+
+/*
+	fz_load_from_disk_store: Look for an entry in the disk store,
+	and if there is one, map it and call load to make an object from
+	its contents. The mapping only lasts for the duration of the call.
+
+	digest: The key for the entry. Callers should hash everything
+	that the stored object depends on.
+
+	Returns the result of load, or NULL if there was no entry or it
+	could not be loaded. Never throws.
+*/
+void *fz_load_from_disk_store(fz_context *ctx, const unsigned char digest[16], fz_disk_store_load_fn *load, void *arg);
+
+/*
+	fz_save_to_disk_store: Write the serialised form of an object to
+	the disk store, evicting old entries if required. Failures are
+	ignored. Never throws.
+*/
+void fz_save_to_disk_store(fz_context *ctx, const unsigned char digest[16], fz_buffer *buf);
+
 void fz_new_document_handler_context(fz_context *ctx);
 void fz_drop_document_handler_context(fz_context *ctx);
 fz_document_handler_context *fz_keep_document_handler_context(fz_context *ctx);
@@ -91,4 +133,21 @@ void fz_new_output_context(fz_context *ctx);
 void fz_drop_output_context(fz_context *ctx);
 fz_output_context *fz_keep_output_context(fz_context *ctx);
 
+/*
+	fz_cpu_features: Bitmask of the SIMD extensions available on
+	the current CPU, used to select optimised code paths. Filled in
+	by fz_init_cpu_features when the first context is created.
+
+	For internal use only.
+*/
+enum
+{
+	FZ_CPU_SSE41 = 1,
+	FZ_CPU_AVX2 = 2,
+};
+
+extern int fz_cpu_features;
+
+void fz_init_cpu_features(void);
+
 #endif
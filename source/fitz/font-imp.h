@@ -1,6 +1,9 @@
 #ifndef MUPDF_FITZ_FONT_IMP_H
 #define MUPDF_FITZ_FONT_IMP_H
 
+/* Faces kept for rendering glyphs from several threads at once. */
+#define FZ_MAX_SPARE_FT_FACES 16
+
 struct fz_font_s
 {
 	int refs;
@@ -10,6 +13,8 @@ struct fz_font_s
 	fz_font_flags_t flags;
 
 	void *ft_face; /* has an FT_Face if used */
+	int ft_spare_count;
+	void *ft_spare[FZ_MAX_SPARE_FT_FACES]; /* unused faces for rendering */
 	fz_shaper_data_t shaper_data;
 
 	fz_matrix t3matrix;
@@ -37,6 +42,10 @@ struct fz_font_s
 	/* cached glyph metrics */
 	float *advance_cache;
 
+	/* cached glyph outlines at unit size, for drawing large glyphs */
+	struct fz_path_s **outline_cache;
+	size_t outline_cache_size;
+
 	/* cached encoding lookup */
 	uint16_t *encoding_cache[256];
 };
@@ -20,6 +20,7 @@
 
 #define MAX_BBOX_TABLE_SIZE 4096
 #define MAX_ADVANCE_CACHE 4096
+#define MAX_OUTLINE_CACHE_SIZE (1 << 20) /* per font */
 
 #ifndef FT_SFNT_OS2
 #define FT_SFNT_OS2 ft_sfnt_os2
@@ -45,6 +46,7 @@ fz_new_font(fz_context *ctx, const char *name, int use_glyph_bbox, int glyph_cou
 		fz_strlcpy(font->name, "(null)", sizeof font->name);
 
 	font->ft_face = NULL;
+	font->ft_spare_count = 0;
 	font->flags.ft_substitute = 0;
 	font->flags.fake_bold = 0;
 	font->flags.fake_italic = 0;
@@ -81,6 +83,9 @@ fz_new_font(fz_context *ctx, const char *name, int use_glyph_bbox, int glyph_cou
 	font->width_count = 0;
 	font->width_table = NULL;
 
+	font->outline_cache = NULL;
+	font->outline_cache_size = 0;
+
 	return font;
 }
 
@@ -145,6 +150,8 @@ fz_drop_font(fz_context *ctx, fz_font *font)
 	if (font->ft_face)
 	{
 		fz_lock(ctx, FZ_LOCK_FREETYPE);
+		for (i = 0; i < font->ft_spare_count; i++)
+			FT_Done_Face((FT_Face)font->ft_spare[i]);
 		fterr = FT_Done_Face((FT_Face)font->ft_face);
 		fz_unlock(ctx, FZ_LOCK_FREETYPE);
 		if (fterr)
@@ -159,6 +166,12 @@ fz_drop_font(fz_context *ctx, fz_font *font)
 	fz_free(ctx, font->bbox_table);
 	fz_free(ctx, font->width_table);
 	fz_free(ctx, font->advance_cache);
+	if (font->outline_cache)
+	{
+		for (i = 0; i < font->glyph_count; i++)
+			fz_drop_path(ctx, font->outline_cache[i]);
+		fz_free(ctx, font->outline_cache);
+	}
 	if (font->shaper_data.destroy && font->shaper_data.shaper_handle)
 	{
 		font->shaper_data.destroy(ctx, font->shaper_data.shaper_handle);
@@ -224,6 +237,8 @@ struct fz_font_context_s
 	int ctx_refs;
 	FT_Library ftlib;
 	struct FT_MemoryRec_ ftmemory;
+	const fz_alloc_context *alloc;
+	const fz_locks_context *locks;
 	int ftlib_refs;
 	fz_load_system_font_fn *load_font;
 	fz_load_system_cjk_font_fn *load_cjk_font;
@@ -246,30 +261,49 @@ struct ft_error
 	char *str;
 };
 
+/*
+	Glyphs are rendered from many threads at once (see fz_take_ft_face),
+	so freetype cannot allocate through the fz_context that created the
+	library. Instead we call the allocator directly, under the alloc
+	lock, without scavenging the store.
+*/
 static void *ft_alloc(FT_Memory memory, long size)
 {
-	fz_context *ctx = (fz_context *) memory->user;
-	return fz_malloc_no_throw(ctx, size);
+	fz_font_context *fct = (fz_font_context *) memory->user;
+	void *p;
+	if (size <= 0)
+		return NULL;
+	fct->locks->lock(fct->locks->user, FZ_LOCK_ALLOC);
+	p = fct->alloc->malloc(fct->alloc->user, size);
+	fct->locks->unlock(fct->locks->user, FZ_LOCK_ALLOC);
+	return p;
 }
 
 static void ft_free(FT_Memory memory, void *block)
 {
-	fz_context *ctx = (fz_context *) memory->user;
-	fz_free(ctx, block);
+	fz_font_context *fct = (fz_font_context *) memory->user;
+	if (block == NULL)
+		return;
+	fct->locks->lock(fct->locks->user, FZ_LOCK_ALLOC);
+	fct->alloc->free(fct->alloc->user, block);
+	fct->locks->unlock(fct->locks->user, FZ_LOCK_ALLOC);
 }
 
 static void *ft_realloc(FT_Memory memory, long cur_size, long new_size, void *block)
 {
-	fz_context *ctx = (fz_context *) memory->user;
-	void *newblock = NULL;
+	fz_font_context *fct = (fz_font_context *) memory->user;
+	void *newblock;
 	if (new_size == 0)
 	{
-		fz_free(ctx, block);
-		return newblock;
+		ft_free(memory, block);
+		return NULL;
 	}
 	if (block == NULL)
 		return ft_alloc(memory, new_size);
-	return fz_resize_array_no_throw(ctx, block, 1, new_size);
+	fct->locks->lock(fct->locks->user, FZ_LOCK_ALLOC);
+	newblock = fct->alloc->realloc(fct->alloc->user, block, new_size);
+	fct->locks->unlock(fct->locks->user, FZ_LOCK_ALLOC);
+	return newblock;
 }
 
 
@@ -280,7 +314,9 @@ void fz_new_font_context(fz_context *ctx)
 	ctx->font->ftlib = NULL;
 	ctx->font->ftlib_refs = 0;
 	ctx->font->load_font = NULL;
-	ctx->font->ftmemory.user = ctx;
+	ctx->font->alloc = ctx->alloc;
+	ctx->font->locks = ctx->locks;
+	ctx->font->ftmemory.user = ctx->font;
 	ctx->font->ftmemory.alloc = ft_alloc;
 	ctx->font->ftmemory.free = ft_free;
 	ctx->font->ftmemory.realloc = ft_realloc;
@@ -614,8 +650,55 @@ fz_new_font_from_file(fz_context *ctx, const char *name, const char *path, int i
 	return font;
 }
 
+/*
+	An FT_Face can only be used by one thread at a time, but faces
+	from the same FT_Library may be used by different threads at once,
+	provided that faces are only created and destroyed under
+	FZ_LOCK_FREETYPE. The font's own face is shared by everyone, and
+	is only used with FZ_LOCK_FREETYPE held. To render, bound and
+	outline glyphs without holding the lock, we take a face of our own
+	from a small per-font pool instead. These are made from the same
+	font buffer as needed, so the pool only grows as large as the
+	number of threads using the font at once.
+*/
+static FT_Face
+fz_take_ft_face(fz_context *ctx, fz_font *font)
+{
+	FT_Face base = font->ft_face;
+	FT_Face face = NULL;
+	FT_Error fterr;
+
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	if (font->ft_spare_count > 0)
+		face = font->ft_spare[--font->ft_spare_count];
+	else
+	{
+		fterr = FT_New_Memory_Face(ctx->font->ftlib, font->buffer->data, (FT_Long)font->buffer->len, base->face_index, &face);
+		if (fterr)
+		{
+			fz_unlock(ctx, FZ_LOCK_FREETYPE);
+			fz_warn(ctx, "freetype: cannot load font: %s", ft_error_string(fterr));
+			return NULL;
+		}
+	}
+	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+
+	return face;
+}
+
+static void
+fz_put_ft_face(fz_context *ctx, fz_font *font, FT_Face face)
+{
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	if (font->ft_spare_count < FZ_MAX_SPARE_FT_FACES)
+		font->ft_spare[font->ft_spare_count++] = face;
+	else
+		FT_Done_Face(face);
+	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+}
+
 static fz_matrix *
-fz_adjust_ft_glyph_width(fz_context *ctx, fz_font *font, int gid, fz_matrix *trm)
+fz_adjust_ft_glyph_width(fz_context *ctx, fz_font *font, FT_Face face, int gid, fz_matrix *trm)
 {
 	/* Fudge the font matrix to stretch the glyph if we've substituted the font. */
 	if (font->flags.ft_stretch && font->width_table /* && font->wmode == 0 */)
@@ -624,11 +707,9 @@ fz_adjust_ft_glyph_width(fz_context *ctx, fz_font *font, int gid, fz_matrix *trm
 		float subw;
 		float realw;
 
-		fz_lock(ctx, FZ_LOCK_FREETYPE);
-		FT_Get_Advance(font->ft_face, gid, FT_LOAD_NO_SCALE | FT_LOAD_NO_HINTING | FT_LOAD_IGNORE_TRANSFORM, &adv);
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		FT_Get_Advance(face, gid, FT_LOAD_NO_SCALE | FT_LOAD_NO_HINTING | FT_LOAD_IGNORE_TRANSFORM, &adv);
 
-		realw = adv * 1000.0f / ((FT_Face)font->ft_face)->units_per_EM;
+		realw = adv * 1000.0f / face->units_per_EM;
 		if (gid < font->width_count)
 			subw = font->width_table[gid];
 		else
@@ -660,11 +741,9 @@ pixmap_from_ft_bitmap(fz_context *ctx, int left, int top, FT_Bitmap *bitmap)
 		return fz_new_pixmap_from_8bpp_data(ctx, left, top - bitmap->rows, bitmap->width, bitmap->rows, bitmap->buffer + (bitmap->rows-1)*bitmap->pitch, -bitmap->pitch);
 }
 
-/* Takes the freetype lock, and returns with it held */
 static FT_GlyphSlot
-do_ft_render_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm, int aa)
+do_ft_render_glyph(fz_context *ctx, fz_font *font, FT_Face face, int gid, const fz_matrix *trm, int aa)
 {
-	FT_Face face = font->ft_face;
 	FT_Matrix m;
 	FT_Vector v;
 	FT_Error fterr;
@@ -672,7 +751,7 @@ do_ft_render_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm
 
 	float strength = fz_matrix_expansion(trm) * 0.02f;
 
-	fz_adjust_ft_glyph_width(ctx, font, gid, &local_trm);
+	fz_adjust_ft_glyph_width(ctx, font, face, gid, &local_trm);
 
 	if (font->flags.fake_italic)
 		fz_pre_shear(&local_trm, SHEAR, 0);
@@ -692,7 +771,6 @@ do_ft_render_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm
 	v.x = local_trm.e * 64;
 	v.y = local_trm.f * 64;
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
 	fterr = FT_Set_Char_Size(face, 65536, 65536, 72, 72); /* should be 64, 64 */
 	if (fterr)
 		fz_warn(ctx, "freetype setting character size: %s", ft_error_string(fterr));
@@ -763,22 +841,22 @@ retry_unhinted:
 fz_pixmap *
 fz_render_ft_glyph_pixmap(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm, int aa)
 {
-	FT_GlyphSlot slot = do_ft_render_glyph(ctx, font, gid, trm, aa);
+	FT_Face face = fz_take_ft_face(ctx, font);
+	FT_GlyphSlot slot;
 	fz_pixmap *pixmap = NULL;
 
-	if (slot == NULL)
-	{
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	if (face == NULL)
 		return NULL;
-	}
 
 	fz_try(ctx)
 	{
-		pixmap = pixmap_from_ft_bitmap(ctx, slot->bitmap_left, slot->bitmap_top, &slot->bitmap);
+		slot = do_ft_render_glyph(ctx, font, face, gid, trm, aa);
+		if (slot)
+			pixmap = pixmap_from_ft_bitmap(ctx, slot->bitmap_left, slot->bitmap_top, &slot->bitmap);
 	}
 	fz_always(ctx)
 	{
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_put_ft_face(ctx, font, face);
 	}
 	fz_catch(ctx)
 	{
@@ -788,26 +866,25 @@ fz_render_ft_glyph_pixmap(fz_context *ctx, fz_font *font, int gid, const fz_matr
 	return pixmap;
 }
 
-/* The glyph cache lock is always taken when this is called. */
 fz_glyph *
 fz_render_ft_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm, int aa)
 {
-	FT_GlyphSlot slot = do_ft_render_glyph(ctx, font, gid, trm, aa);
+	FT_Face face = fz_take_ft_face(ctx, font);
+	FT_GlyphSlot slot;
 	fz_glyph *glyph = NULL;
 
-	if (slot == NULL)
-	{
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	if (face == NULL)
 		return NULL;
-	}
 
 	fz_try(ctx)
 	{
-		glyph = glyph_from_ft_bitmap(ctx, slot->bitmap_left, slot->bitmap_top, &slot->bitmap);
+		slot = do_ft_render_glyph(ctx, font, face, gid, trm, aa);
+		if (slot)
+			glyph = glyph_from_ft_bitmap(ctx, slot->bitmap_left, slot->bitmap_top, &slot->bitmap);
 	}
 	fz_always(ctx)
 	{
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_put_ft_face(ctx, font, face);
 	}
 	fz_catch(ctx)
 	{
@@ -817,11 +894,9 @@ fz_render_ft_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm
 	return glyph;
 }
 
-/* Takes the freetype lock, and returns with it held */
 static FT_Glyph
-do_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm, const fz_matrix *ctm, const fz_stroke_state *state, int aa)
+do_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, FT_Face face, int gid, const fz_matrix *trm, const fz_matrix *ctm, const fz_stroke_state *state, int aa)
 {
-	FT_Face face = font->ft_face;
 	float expansion = fz_matrix_expansion(ctm);
 	int linewidth = state->linewidth * expansion * 64 / 2;
 	FT_Matrix m;
@@ -833,7 +908,7 @@ do_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, const fz_mat
 	FT_Stroker_LineCap line_cap;
 	fz_matrix local_trm = *trm;
 
-	fz_adjust_ft_glyph_width(ctx, font, gid, &local_trm);
+	fz_adjust_ft_glyph_width(ctx, font, face, gid, &local_trm);
 
 	if (font->flags.fake_italic)
 		fz_pre_shear(&local_trm, SHEAR, 0);
@@ -845,7 +920,6 @@ do_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, const fz_mat
 	v.x = local_trm.e * 64;
 	v.y = local_trm.f * 64;
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
 	fterr = FT_Set_Char_Size(face, 65536, 65536, 72, 72); /* should be 64, 64 */
 	if (fterr)
 	{
@@ -915,24 +989,28 @@ do_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, const fz_mat
 fz_pixmap *
 fz_render_ft_stroked_glyph_pixmap(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm, const fz_matrix *ctm, const fz_stroke_state *state, int aa)
 {
-	FT_Glyph glyph = do_render_ft_stroked_glyph(ctx, font, gid, trm, ctm, state, aa);
-	FT_BitmapGlyph bitmap = (FT_BitmapGlyph)glyph;
+	FT_Face face = fz_take_ft_face(ctx, font);
+	FT_Glyph glyph = NULL;
+	FT_BitmapGlyph bitmap;
 	fz_pixmap *pixmap = NULL;
 
-	if (bitmap == NULL)
-	{
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	if (face == NULL)
 		return NULL;
-	}
+
+	fz_var(glyph);
 
 	fz_try(ctx)
 	{
-		pixmap = pixmap_from_ft_bitmap(ctx, bitmap->left, bitmap->top, &bitmap->bitmap);
+		glyph = do_render_ft_stroked_glyph(ctx, font, face, gid, trm, ctm, state, aa);
+		bitmap = (FT_BitmapGlyph)glyph;
+		if (bitmap)
+			pixmap = pixmap_from_ft_bitmap(ctx, bitmap->left, bitmap->top, &bitmap->bitmap);
 	}
 	fz_always(ctx)
 	{
-		FT_Done_Glyph(glyph);
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		if (glyph)
+			FT_Done_Glyph(glyph);
+		fz_put_ft_face(ctx, font, face);
 	}
 	fz_catch(ctx)
 	{
@@ -945,24 +1023,28 @@ fz_render_ft_stroked_glyph_pixmap(fz_context *ctx, fz_font *font, int gid, const
 fz_glyph *
 fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm, const fz_matrix *ctm, const fz_stroke_state *state, int aa)
 {
-	FT_Glyph glyph = do_render_ft_stroked_glyph(ctx, font, gid, trm, ctm, state, aa);
-	FT_BitmapGlyph bitmap = (FT_BitmapGlyph)glyph;
+	FT_Face face = fz_take_ft_face(ctx, font);
+	FT_Glyph glyph = NULL;
+	FT_BitmapGlyph bitmap;
 	fz_glyph *result = NULL;
 
-	if (bitmap == NULL)
-	{
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	if (face == NULL)
 		return NULL;
-	}
+
+	fz_var(glyph);
 
 	fz_try(ctx)
 	{
-		result = glyph_from_ft_bitmap(ctx, bitmap->left, bitmap->top, &bitmap->bitmap);
+		glyph = do_render_ft_stroked_glyph(ctx, font, face, gid, trm, ctm, state, aa);
+		bitmap = (FT_BitmapGlyph)glyph;
+		if (bitmap)
+			result = glyph_from_ft_bitmap(ctx, bitmap->left, bitmap->top, &bitmap->bitmap);
 	}
 	fz_always(ctx)
 	{
-		FT_Done_Glyph(glyph);
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		if (glyph)
+			FT_Done_Glyph(glyph);
+		fz_put_ft_face(ctx, font, face);
 	}
 	fz_catch(ctx)
 	{
@@ -975,7 +1057,7 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, const fz_mat
 static fz_rect *
 fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid)
 {
-	FT_Face face = font->ft_face;
+	FT_Face face;
 	FT_Error fterr;
 	FT_BBox cbox;
 	FT_Matrix m;
@@ -986,12 +1068,20 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid)
 	// TODO: refactor loading into fz_load_ft_glyph
 	// TODO: cache results
 
-	const int scale = face->units_per_EM;
+	const int scale = ((FT_Face)font->ft_face)->units_per_EM;
 	const float recip = 1.0f / scale;
 	const float strength = 0.02f;
 	fz_matrix local_trm = fz_identity;
 
-	fz_adjust_ft_glyph_width(ctx, font, gid, &local_trm);
+	face = fz_take_ft_face(ctx, font);
+	if (face == NULL)
+	{
+		bounds->x0 = bounds->x1 = 0;
+		bounds->y0 = bounds->y1 = 0;
+		return bounds;
+	}
+
+	fz_adjust_ft_glyph_width(ctx, font, face, gid, &local_trm);
 
 	if (font->flags.fake_italic)
 		fz_pre_shear(&local_trm, SHEAR, 0);
@@ -1012,7 +1102,6 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid)
 		ft_flags = FT_LOAD_NO_BITMAP | FT_LOAD_NO_HINTING;
 	}
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
 	/* Set the char size to scale=face->units_per_EM to effectively give
 	 * us unscaled results. This avoids quantisation. We then apply the
 	 * scale ourselves below. */
@@ -1025,7 +1114,7 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid)
 	if (fterr)
 	{
 		fz_warn(ctx, "freetype load glyph (gid %d): %s", gid, ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_put_ft_face(ctx, font, face);
 		bounds->x0 = bounds->x1 = local_trm.e;
 		bounds->y0 = bounds->y1 = local_trm.f;
 		return bounds;
@@ -1038,7 +1127,7 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid)
 	}
 
 	FT_Outline_Get_CBox(&face->glyph->outline, &cbox);
-	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	fz_put_ft_face(ctx, font, face);
 	bounds->x0 = cbox.xMin * recip;
 	bounds->y0 = cbox.yMin * recip;
 	bounds->x1 = cbox.xMax * recip;
@@ -1122,22 +1211,24 @@ fz_path *
 fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm)
 {
 	struct closure cc;
-	FT_Face face = font->ft_face;
+	FT_Face face;
 	int fterr;
 	fz_matrix local_trm = *trm;
 	int ft_flags;
 
-	const int scale = face->units_per_EM;
+	const int scale = ((FT_Face)font->ft_face)->units_per_EM;
 	const float recip = 1.0f / scale;
 	const float strength = 0.02f;
 
-	fz_adjust_ft_glyph_width(ctx, font, gid, &local_trm);
+	face = fz_take_ft_face(ctx, font);
+	if (face == NULL)
+		return NULL;
+
+	fz_adjust_ft_glyph_width(ctx, font, face, gid, &local_trm);
 
 	if (font->flags.fake_italic)
 		fz_pre_shear(&local_trm, SHEAR, 0);
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
-
 	if (font->flags.force_hinting)
 	{
 		ft_flags = FT_LOAD_NO_BITMAP | FT_LOAD_IGNORE_TRANSFORM;
@@ -1154,7 +1245,7 @@ fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *tr
 	if (fterr)
 	{
 		fz_warn(ctx, "freetype load glyph (gid %d): %s", gid, ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_put_ft_face(ctx, font, face);
 		return NULL;
 	}
 
@@ -1176,7 +1267,7 @@ fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *tr
 	}
 	fz_always(ctx)
 	{
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_put_ft_face(ctx, font, face);
 	}
 	fz_catch(ctx)
 	{
@@ -1474,12 +1565,100 @@ fz_bound_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm, fz
 	return fz_transform_rect(rect, trm);
 }
 
+/*
+	The outline of a glyph at any size is the outline at unit size,
+	transformed. We keep the outlines of the glyphs asked for (up to a
+	limit per font), so that large text, which is drawn from outlines
+	rather than from the glyph cache, does not load every glyph from
+	freetype again each time it is drawn.
+*/
 fz_path *
-fz_outline_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *ctm)
+fz_cached_glyph_outline(fz_context *ctx, fz_font *font, int gid)
 {
+	fz_path **cache = NULL;
+	fz_path *path;
+	size_t size;
+	int cached = 0;
+
 	if (!font->ft_face)
 		return NULL;
-	return fz_outline_ft_glyph(ctx, font, gid, ctm);
+	if (gid < 0 || gid >= font->glyph_count)
+		return fz_outline_ft_glyph(ctx, font, gid, &fz_identity);
+
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	path = font->outline_cache ? font->outline_cache[gid] : NULL;
+	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	if (path)
+		return fz_keep_path(ctx, path);
+
+	path = fz_outline_ft_glyph(ctx, font, gid, &fz_identity);
+	if (!path)
+		return NULL;
+
+	fz_try(ctx)
+		fz_trim_path(ctx, path);
+	fz_catch(ctx)
+	{
+		fz_drop_path(ctx, path);
+		fz_rethrow(ctx);
+	}
+
+	size = fz_packed_path_size(path);
+	if (font->outline_cache_size + size > MAX_OUTLINE_CACHE_SIZE)
+		return path;
+
+	if (!font->outline_cache)
+	{
+		cache = fz_calloc_no_throw(ctx, font->glyph_count, sizeof(*cache));
+		if (!cache)
+			return path;
+	}
+
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	if (!font->outline_cache)
+	{
+		font->outline_cache = cache;
+		cache = NULL;
+	}
+	if (!font->outline_cache[gid] && font->outline_cache_size + size <= MAX_OUTLINE_CACHE_SIZE)
+	{
+		font->outline_cache[gid] = path;
+		font->outline_cache_size += size;
+		cached = 1;
+	}
+	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	fz_free(ctx, cache);
+
+	/* The cache keeps the reference we made; give the caller another. */
+	if (cached)
+		fz_keep_path(ctx, path);
+
+	return path;
+}
+
+fz_path *
+fz_outline_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *ctm)
+{
+	fz_path *outline, *path = NULL;
+
+	outline = fz_cached_glyph_outline(ctx, font, gid);
+	if (!outline)
+		return NULL;
+
+	fz_try(ctx)
+	{
+		path = fz_clone_path(ctx, outline);
+		fz_transform_path(ctx, path, ctm);
+	}
+	fz_always(ctx)
+		fz_drop_path(ctx, outline);
+	fz_catch(ctx)
+	{
+		fz_drop_path(ctx, path);
+		fz_rethrow(ctx);
+	}
+
+	return path;
 }
 
 int fz_glyph_cacheable(fz_context *ctx, fz_font *font, int gid)
@@ -107,7 +107,8 @@ static const fz_store_type fz_image_store_type =
 	fz_drop_image_key,
 	fz_cmp_image_key,
 	fz_format_image_key,
-	fz_needs_reap_image_key
+	fz_needs_reap_image_key,
+	"decoded image"
 };
 
 void
@@ -189,6 +190,23 @@ fz_unblend_masked_tile(fz_context *ctx, fz_pixmap *tile, fz_image *image)
 	fz_drop_pixmap(ctx, mask);
 }
 
+/*
+	Skip over sample data we don't want. Streams that can seek (such
+	as the DCT decoder) can do this without producing the data.
+*/
+static size_t
+skip_image_data(fz_context *ctx, fz_stream *stm, size_t len)
+{
+	fz_off_t start;
+
+	if (!stm->seek)
+		return fz_skip(ctx, stm, len);
+
+	start = fz_tell(ctx, stm);
+	fz_seek(ctx, stm, (fz_off_t)len, 1);
+	return fz_tell(ctx, stm) - start;
+}
+
 fz_pixmap *
 fz_decomp_image_from_stream(fz_context *ctx, fz_stream *stm, fz_compressed_image *cimg, fz_irect *subarea, int indexed, int l2factor)
 {
@@ -283,12 +301,10 @@ fz_decomp_image_from_stream(fz_context *ctx, fz_stream *stm, fz_compressed_image
 			int l_margin = subarea->x0 >> l2factor;
 			int t_margin = subarea->y0 >> l2factor;
 			int r_margin = (image->w + f - 1 - subarea->x1) >> l2factor;
-			int b_margin = (image->h + f - 1 - subarea->y1) >> l2factor;
 			int l_skip = (l_margin * image->n * image->bpc)/8;
 			int r_skip = (r_margin * image->n * image->bpc + 7)/8;
 			size_t t_skip = t_margin * stream_stride + l_skip;
-			size_t b_skip = b_margin * stream_stride + r_skip;
-			size_t l = fz_skip(ctx, stm, t_skip);
+			size_t l = skip_image_data(ctx, stm, t_skip);
 			len = 0;
 			if (l == t_skip)
 			{
@@ -302,12 +318,12 @@ fz_decomp_image_from_stream(fz_context *ctx, fz_stream *stm, fz_compressed_image
 						break;
 					if (--hh == 0)
 						break;
-					l = fz_skip(ctx, stm, r_skip + l_skip);
+					l = skip_image_data(ctx, stm, r_skip + l_skip);
 					if (l < (size_t)(r_skip + l_skip))
 						break;
 				}
 				while (1);
-				(void)fz_skip(ctx, stm, r_skip + b_skip);
+				/* No need to decode the rows below the subarea. */
 			}
 		}
 		else
@@ -439,7 +455,11 @@ compressed_image_get_pixmap(fz_context *ctx, fz_image *image_, fz_irect *subarea
 		tile = fz_load_jxr(ctx, image->buffer->buffer->data, image->buffer->buffer->len);
 		break;
 	case FZ_IMAGE_JPX:
-		tile = fz_load_jpx(ctx, image->buffer->buffer->data, image->buffer->buffer->len, NULL);
+		/* OpenJPEG can decode just the subarea, at a reduced resolution */
+		tile = fz_load_jpx_subarea(ctx, image->buffer->buffer->data, image->buffer->buffer->len, image->super.colorspace, subarea, l2factor);
+		can_sub = 1;
+		if (image->super.use_decode && !fz_colorspace_is_indexed(ctx, image->super.colorspace))
+			fz_decode_tile(ctx, tile, image->super.decode);
 		break;
 	case FZ_IMAGE_JPEG:
 		/* Scan JPEG stream and patch missing height values in header */
@@ -549,6 +569,228 @@ void fz_default_image_decode(void *arg, int w, int h, int l2factor, fz_irect *su
 	}
 }
 
+/*
+	Decoded tiles of compressed images can be kept in the disk store.
+	Entries are keyed by a digest of the compressed data and of
+	everything else that affects decoding, so they are shared between
+	documents (and processes) that use the same image.
+*/
+
+static void
+digest_int(fz_md5 *md5, int v)
+{
+	unsigned char buf[4];
+
+	buf[0] = v;
+	buf[1] = v >> 8;
+	buf[2] = v >> 16;
+	buf[3] = v >> 24;
+	fz_md5_update(md5, buf, 4);
+}
+
+static int
+get_int_le(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+static int
+image_disk_digest(fz_context *ctx, fz_image *image, int l2factor, const fz_irect *rect, unsigned char digest[16])
+{
+	fz_compressed_image *cimg = (fz_compressed_image *)image;
+	fz_compression_params *params;
+	const char *csname;
+	fz_md5 md5;
+	int i;
+
+	/* Indexed and matted images depend on more than we hash here. */
+	if (image->get_pixmap != compressed_image_get_pixmap || !cimg->buffer || !cimg->buffer->buffer)
+		return 0;
+	if (fz_colorspace_is_indexed(ctx, image->colorspace) || (image->use_colorkey && image->mask))
+		return 0;
+
+	params = &cimg->buffer->params;
+	csname = image->colorspace ? fz_colorspace_name(ctx, image->colorspace) : "";
+
+	fz_md5_init(&md5);
+	fz_md5_update(&md5, (const unsigned char *)"image tile 1", 12);
+	fz_md5_update(&md5, (const unsigned char *)csname, strlen(csname) + 1);
+	digest_int(&md5, image->w);
+	digest_int(&md5, image->h);
+	digest_int(&md5, image->n);
+	digest_int(&md5, image->bpc);
+	digest_int(&md5, image->imagemask | (image->interpolate << 1) | (image->use_colorkey << 2) | (image->use_decode << 3) | (image->invert_cmyk_jpeg << 4));
+	if (image->use_colorkey)
+		for (i = 0; i < image->n * 2; i++)
+			digest_int(&md5, image->colorkey[i]);
+	if (image->use_decode)
+		fz_md5_update(&md5, (const unsigned char *)image->decode, sizeof(float) * image->n * 2);
+	digest_int(&md5, l2factor);
+	digest_int(&md5, rect->x0);
+	digest_int(&md5, rect->y0);
+	digest_int(&md5, rect->x1);
+	digest_int(&md5, rect->y1);
+
+	digest_int(&md5, params->type);
+	switch (params->type)
+	{
+	case FZ_IMAGE_JPEG:
+		digest_int(&md5, params->u.jpeg.color_transform);
+		break;
+	case FZ_IMAGE_JPX:
+		digest_int(&md5, params->u.jpx.smask_in_data);
+		break;
+	case FZ_IMAGE_FAX:
+		digest_int(&md5, params->u.fax.columns);
+		digest_int(&md5, params->u.fax.rows);
+		digest_int(&md5, params->u.fax.k);
+		digest_int(&md5, params->u.fax.end_of_line);
+		digest_int(&md5, params->u.fax.encoded_byte_align);
+		digest_int(&md5, params->u.fax.end_of_block);
+		digest_int(&md5, params->u.fax.black_is_1);
+		digest_int(&md5, params->u.fax.damaged_rows_before_error);
+		break;
+	case FZ_IMAGE_FLATE:
+		digest_int(&md5, params->u.flate.columns);
+		digest_int(&md5, params->u.flate.colors);
+		digest_int(&md5, params->u.flate.predictor);
+		digest_int(&md5, params->u.flate.bpc);
+		break;
+	case FZ_IMAGE_LZW:
+		digest_int(&md5, params->u.lzw.columns);
+		digest_int(&md5, params->u.lzw.colors);
+		digest_int(&md5, params->u.lzw.predictor);
+		digest_int(&md5, params->u.lzw.bpc);
+		digest_int(&md5, params->u.lzw.early_change);
+		break;
+	case FZ_IMAGE_RAW:
+	case FZ_IMAGE_RLD:
+	case FZ_IMAGE_BMP:
+	case FZ_IMAGE_GIF:
+	case FZ_IMAGE_JXR:
+	case FZ_IMAGE_PNG:
+	case FZ_IMAGE_PNM:
+	case FZ_IMAGE_TIFF:
+		break;
+	default:
+		return 0;
+	}
+	fz_md5_update(&md5, cimg->buffer->buffer->data, cimg->buffer->buffer->len);
+	fz_md5_final(&md5, digest);
+	return 1;
+}
+
+enum { TILE_HEADER_INTS = 12 };
+
+/* Colorspaces that a decoded tile can be in. */
+static int
+tile_colorspace_tag(fz_context *ctx, fz_image *image, fz_colorspace *cs)
+{
+	if (cs == NULL) return 0;
+	if (cs == image->colorspace) return 1;
+	if (cs == fz_device_gray(ctx)) return 2;
+	if (cs == fz_device_rgb(ctx)) return 3;
+	if (cs == fz_device_bgr(ctx)) return 4;
+	if (cs == fz_device_cmyk(ctx)) return 5;
+	return -1;
+}
+
+static fz_colorspace *
+tile_colorspace(fz_context *ctx, fz_image *image, int tag)
+{
+	switch (tag)
+	{
+	case 1: return image->colorspace;
+	case 2: return fz_device_gray(ctx);
+	case 3: return fz_device_rgb(ctx);
+	case 4: return fz_device_bgr(ctx);
+	case 5: return fz_device_cmyk(ctx);
+	default: return NULL;
+	}
+}
+
+static void
+save_disk_tile(fz_context *ctx, const unsigned char digest[16], fz_image *image, fz_pixmap *tile, const fz_irect *rect)
+{
+	fz_buffer *buf = NULL;
+	int tag = tile_colorspace_tag(ctx, image, tile->colorspace);
+	int y;
+
+	if (tag < 0 || tile->seps || tile->s)
+		return;
+
+	fz_var(buf);
+
+	fz_try(ctx)
+	{
+		buf = fz_new_buffer(ctx, TILE_HEADER_INTS * 4 + (size_t)tile->w * tile->n * tile->h);
+		fz_append_int32_le(ctx, buf, rect->x0);
+		fz_append_int32_le(ctx, buf, rect->y0);
+		fz_append_int32_le(ctx, buf, rect->x1);
+		fz_append_int32_le(ctx, buf, rect->y1);
+		fz_append_int32_le(ctx, buf, tile->x);
+		fz_append_int32_le(ctx, buf, tile->y);
+		fz_append_int32_le(ctx, buf, tile->w);
+		fz_append_int32_le(ctx, buf, tile->h);
+		fz_append_int32_le(ctx, buf, tile->alpha);
+		fz_append_int32_le(ctx, buf, tile->flags & FZ_PIXMAP_FLAG_INTERPOLATE);
+		fz_append_int32_le(ctx, buf, tile->xres);
+		fz_append_int32_le(ctx, buf, (tile->yres << 4) | tag);
+		for (y = 0; y < tile->h; y++)
+			fz_append_data(ctx, buf, tile->samples + y * tile->stride, (size_t)tile->w * tile->n);
+		fz_save_to_disk_store(ctx, digest, buf);
+	}
+	fz_always(ctx)
+		fz_drop_buffer(ctx, buf);
+	fz_catch(ctx)
+		fz_warn(ctx, "cannot save image to disk store: %s", fz_caught_message(ctx));
+}
+
+typedef struct
+{
+	fz_image *image;
+	fz_irect rect;
+} disk_tile_arg;
+
+static void *
+load_disk_tile(fz_context *ctx, const unsigned char *data, size_t len, void *arg_)
+{
+	disk_tile_arg *arg = arg_;
+	fz_colorspace *cs;
+	fz_pixmap *tile;
+	int hdr[TILE_HEADER_INTS];
+	int i, n;
+
+	if (len < TILE_HEADER_INTS * 4)
+		return NULL;
+	for (i = 0; i < TILE_HEADER_INTS; i++)
+		hdr[i] = get_int_le(data + i * 4);
+	data += TILE_HEADER_INTS * 4;
+	len -= TILE_HEADER_INTS * 4;
+
+	cs = tile_colorspace(ctx, arg->image, hdr[11] & 15);
+	n = fz_colorspace_n(ctx, cs) + (hdr[8] != 0);
+	if (hdr[6] <= 0 || hdr[7] <= 0 || n <= 0 || len % hdr[6] != 0 || len / hdr[6] % hdr[7] != 0 || len / hdr[6] / hdr[7] != (size_t)n)
+		return NULL;
+
+	tile = fz_new_pixmap(ctx, cs, hdr[6], hdr[7], NULL, hdr[8] != 0);
+	tile->x = hdr[4];
+	tile->y = hdr[5];
+	if (hdr[9])
+		tile->flags |= FZ_PIXMAP_FLAG_INTERPOLATE;
+	else
+		tile->flags &= ~FZ_PIXMAP_FLAG_INTERPOLATE;
+	tile->xres = hdr[10];
+	tile->yres = hdr[11] >> 4;
+	memcpy(tile->samples, data, len);
+
+	arg->rect.x0 = hdr[0];
+	arg->rect.y0 = hdr[1];
+	arg->rect.x1 = hdr[2];
+	arg->rect.y1 = hdr[3];
+	return tile;
+}
+
 fz_pixmap *
 fz_get_pixmap_from_image(fz_context *ctx, fz_image *image, const fz_irect *subarea, fz_matrix *ctm, int *dw, int *dh)
 {
@@ -556,6 +798,9 @@ fz_get_pixmap_from_image(fz_context *ctx, fz_image *image, const fz_irect *subar
 	int l2factor, l2factor_remaining;
 	fz_image_key key;
 	fz_image_key *keyp;
+	disk_tile_arg disk_arg;
+	unsigned char digest[16];
+	int use_disk;
 	int w;
 	int h;
 
@@ -673,21 +918,38 @@ fz_get_pixmap_from_image(fz_context *ctx, fz_image *image, const fz_irect *subar
 	}
 	while (key.l2factor >= 0);
 
-	/* We'll have to decode the image; request the correct amount of
-	 * downscaling. */
-	l2factor_remaining = l2factor;
-	tile = image->get_pixmap(ctx, image, &key.rect, w, h, &l2factor_remaining);
-
-	/* Update the ctm to allow for subareas. */
-	update_ctm_for_subarea(ctm, &key.rect, image->w, image->h);
+	/* Maybe an earlier run, or another process, has decoded it. */
+	use_disk = fz_has_disk_store(ctx) && image_disk_digest(ctx, image, l2factor, &key.rect, digest);
+	tile = NULL;
+	if (use_disk)
+	{
+		disk_arg.image = image;
+		tile = fz_load_from_disk_store(ctx, digest, load_disk_tile, &disk_arg);
+		if (tile)
+			key.rect = disk_arg.rect;
+	}
 
-	/* l2factor_remaining is updated to the amount of subscaling left to do */
-	assert(l2factor_remaining >= 0 && l2factor_remaining <= 6);
-	if (l2factor_remaining)
+	if (!tile)
 	{
-		fz_subsample_pixmap(ctx, tile, l2factor_remaining);
+		/* We'll have to decode the image; request the correct amount of
+		 * downscaling. */
+		l2factor_remaining = l2factor;
+		tile = image->get_pixmap(ctx, image, &key.rect, w, h, &l2factor_remaining);
+
+		/* l2factor_remaining is updated to the amount of subscaling left to do */
+		assert(l2factor_remaining >= 0 && l2factor_remaining <= 6);
+		if (l2factor_remaining)
+		{
+			fz_subsample_pixmap(ctx, tile, l2factor_remaining);
+		}
+
+		if (use_disk)
+			save_disk_tile(ctx, digest, image, tile, &key.rect);
 	}
 
+	/* Update the ctm to allow for subareas. */
+	update_ctm_for_subarea(ctm, &key.rect, image->w, image->h);
+
 	/* Now we try to cache the pixmap. Any failure here will just result
 	 * in us not caching. */
 	keyp = fz_malloc_struct(ctx, fz_image_key);
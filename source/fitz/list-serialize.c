@@ -0,0 +1,2499 @@
+#include "mupdf/fitz.h"
+#include "fitz-imp.h"
+#include "colorspace-imp.h"
+#include "font-imp.h"
+
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+/*
+	Serialised display lists.
+
+	A serialised list is the stream of device calls made when running
+	the list, preceded by a small header carrying the mediabox. Fonts,
+	images, shades and colorspaces are defined once, the first time a
+	call refers to them, and are referred to by index thereafter; the
+	device colorspaces are referred to by small negative numbers and
+	never defined. Type3 glyph procedures are stored as nested record
+	streams within the definition of their font.
+
+	All numbers are stored as 32-bit little-endian values (floats by
+	their bit pattern) so files can be moved between machines. The
+	format is private to this version of the library.
+*/
+
+#define LIST_MAGIC "MuPDFdl1"
+#define LIST_MAGIC_LEN 8
+
+enum
+{
+	DL_END,
+
+	DL_DEF_COLORSPACE,
+	DL_DEF_FONT,
+	DL_DEF_IMAGE,
+	DL_DEF_SHADE,
+
+	DL_FILL_PATH,
+	DL_STROKE_PATH,
+	DL_CLIP_PATH,
+	DL_CLIP_STROKE_PATH,
+	DL_FILL_TEXT,
+	DL_STROKE_TEXT,
+	DL_CLIP_TEXT,
+	DL_CLIP_STROKE_TEXT,
+	DL_IGNORE_TEXT,
+	DL_FILL_SHADE,
+	DL_FILL_IMAGE,
+	DL_FILL_IMAGE_MASK,
+	DL_CLIP_IMAGE_MASK,
+	DL_POP_CLIP,
+	DL_BEGIN_MASK,
+	DL_END_MASK,
+	DL_BEGIN_GROUP,
+	DL_END_GROUP,
+	DL_BEGIN_TILE,
+	DL_END_TILE,
+	DL_RENDER_FLAGS,
+	DL_DEFAULT_COLORSPACES
+};
+
+/* References to the device colorspaces; defined resources use ids >= 0 */
+enum
+{
+	DL_CS_NONE = -1,
+	DL_CS_GRAY = -2,
+	DL_CS_RGB = -3,
+	DL_CS_BGR = -4,
+	DL_CS_CMYK = -5,
+	DL_CS_LAB = -6
+};
+
+enum { DL_RES_COLORSPACE, DL_RES_FONT, DL_RES_IMAGE, DL_RES_SHADE };
+enum { DL_CS_ICC, DL_CS_INDEXED };
+enum { DL_FONT_BASE14, DL_FONT_EMBEDDED, DL_FONT_TYPE3 };
+enum { DL_IMAGE_COMPRESSED, DL_IMAGE_PIXMAP };
+enum { DL_PATH_END, DL_PATH_MOVE, DL_PATH_LINE, DL_PATH_CURVE, DL_PATH_CLOSE, DL_PATH_RECT };
+
+static const char *base14_names[] =
+{
+	"Courier", "Courier-Oblique", "Courier-Bold", "Courier-BoldOblique",
+	"Helvetica", "Helvetica-Oblique", "Helvetica-Bold", "Helvetica-BoldOblique",
+	"Times-Roman", "Times-Italic", "Times-Bold", "Times-BoldItalic",
+	"Symbol", "ZapfDingbats",
+};
+
+/* Writing */
+
+typedef struct list_writer_s
+{
+	fz_buffer *out;
+	fz_hash_table *ids;
+	int next_id;
+} list_writer;
+
+typedef struct fz_list_writer_device_s
+{
+	fz_device super;
+	list_writer *w;
+} fz_list_writer_device;
+
+static void write_records(fz_context *ctx, list_writer *w, fz_display_list *list);
+
+static void
+write_byte(fz_context *ctx, list_writer *w, int x)
+{
+	fz_append_byte(ctx, w->out, x);
+}
+
+static void
+write_int(fz_context *ctx, list_writer *w, int x)
+{
+	fz_append_int32_le(ctx, w->out, x);
+}
+
+static void
+write_float(fz_context *ctx, list_writer *w, float f)
+{
+	union { float f; int i; } u;
+	u.f = f;
+	fz_append_int32_le(ctx, w->out, u.i);
+}
+
+static void
+write_data(fz_context *ctx, list_writer *w, const unsigned char *data, size_t len)
+{
+	if (len > INT_MAX)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "resource too large to serialise");
+	write_int(ctx, w, (int)len);
+	fz_append_data(ctx, w->out, data, len);
+}
+
+static void
+write_string(fz_context *ctx, list_writer *w, const char *s)
+{
+	write_data(ctx, w, (const unsigned char *)s, strlen(s));
+}
+
+static void
+write_rect(fz_context *ctx, list_writer *w, const fz_rect *r)
+{
+	write_float(ctx, w, r->x0);
+	write_float(ctx, w, r->y0);
+	write_float(ctx, w, r->x1);
+	write_float(ctx, w, r->y1);
+}
+
+static void
+write_opt_rect(fz_context *ctx, list_writer *w, const fz_rect *r)
+{
+	write_byte(ctx, w, r != NULL);
+	if (r)
+		write_rect(ctx, w, r);
+}
+
+static void
+write_matrix(fz_context *ctx, list_writer *w, const fz_matrix *m)
+{
+	write_float(ctx, w, m->a);
+	write_float(ctx, w, m->b);
+	write_float(ctx, w, m->c);
+	write_float(ctx, w, m->d);
+	write_float(ctx, w, m->e);
+	write_float(ctx, w, m->f);
+}
+
+static void
+write_color_params(fz_context *ctx, list_writer *w, const fz_color_params *params)
+{
+	write_byte(ctx, w, params != NULL);
+	if (params)
+	{
+		write_byte(ctx, w, params->ri);
+		write_byte(ctx, w, params->bp);
+		write_byte(ctx, w, params->op);
+		write_byte(ctx, w, params->opm);
+	}
+}
+
+static int
+find_id(fz_context *ctx, list_writer *w, const void *obj)
+{
+	void *val = fz_hash_find(ctx, w->ids, &obj);
+	return val ? (int)((intptr_t)val - 1) : -1;
+}
+
+static int
+add_id(fz_context *ctx, list_writer *w, const void *obj)
+{
+	int id = w->next_id++;
+	fz_hash_insert(ctx, w->ids, &obj, (void *)(intptr_t)(id + 1));
+	return id;
+}
+
+static int
+is_serialisable_colorspace(fz_context *ctx, fz_colorspace *cs)
+{
+	if (cs == NULL ||
+		cs == fz_device_gray(ctx) ||
+		cs == fz_device_rgb(ctx) ||
+		cs == fz_device_bgr(ctx) ||
+		cs == fz_device_cmyk(ctx) ||
+		cs == fz_device_lab(ctx))
+		return 1;
+	if (fz_colorspace_is_icc(ctx, cs))
+		return !fz_colorspace_is_lab_icc(ctx, cs);
+	if (fz_colorspace_is_indexed(ctx, cs))
+		return is_serialisable_colorspace(ctx, fz_colorspace_base(ctx, cs));
+	return 0;
+}
+
+/* Colorspaces we cannot store (Separation, DeviceN, Cal) are replaced by RGB */
+static fz_colorspace *
+output_colorspace(fz_context *ctx, fz_colorspace *cs)
+{
+	return is_serialisable_colorspace(ctx, cs) ? cs : fz_device_rgb(ctx);
+}
+
+static int
+define_colorspace(fz_context *ctx, list_writer *w, fz_colorspace *cs)
+{
+	unsigned char *lookup;
+	fz_colorspace *base;
+	int id, high, base_ref;
+
+	cs = output_colorspace(ctx, cs);
+	if (cs == NULL) return DL_CS_NONE;
+	if (cs == fz_device_gray(ctx)) return DL_CS_GRAY;
+	if (cs == fz_device_rgb(ctx)) return DL_CS_RGB;
+	if (cs == fz_device_bgr(ctx)) return DL_CS_BGR;
+	if (cs == fz_device_cmyk(ctx)) return DL_CS_CMYK;
+	if (cs == fz_device_lab(ctx)) return DL_CS_LAB;
+
+	id = find_id(ctx, w, cs);
+	if (id >= 0)
+		return id;
+
+	if (fz_colorspace_is_indexed(ctx, cs))
+	{
+		base = fz_colorspace_base(ctx, cs);
+		base_ref = define_colorspace(ctx, w, base);
+		lookup = fz_indexed_colorspace_palette(ctx, cs, &high);
+		id = add_id(ctx, w, cs);
+		write_byte(ctx, w, DL_DEF_COLORSPACE);
+		write_int(ctx, w, id);
+		write_byte(ctx, w, DL_CS_INDEXED);
+		write_int(ctx, w, base_ref);
+		write_int(ctx, w, high);
+		write_data(ctx, w, lookup, (size_t)fz_colorspace_n(ctx, base) * (high + 1));
+	}
+	else
+	{
+		fz_iccprofile *profile = cs->data;
+		id = add_id(ctx, w, cs);
+		write_byte(ctx, w, DL_DEF_COLORSPACE);
+		write_int(ctx, w, id);
+		write_byte(ctx, w, DL_CS_ICC);
+		write_string(ctx, w, fz_colorspace_name(ctx, cs));
+		write_int(ctx, w, fz_colorspace_n(ctx, cs));
+		write_data(ctx, w, profile->buffer->data, profile->buffer->len);
+	}
+	return id;
+}
+
+static void
+write_color(fz_context *ctx, list_writer *w, fz_colorspace *cs, const float *color, const fz_color_params *params)
+{
+	fz_colorspace *out = output_colorspace(ctx, cs);
+	float conv[FZ_MAX_COLORS];
+	int i, n;
+
+	n = (color && out) ? fz_colorspace_n(ctx, out) : 0;
+	if (n && out != cs)
+	{
+		fz_convert_color(ctx, params ? params : fz_default_color_params(ctx), NULL, out, conv, cs, color);
+		color = conv;
+	}
+
+	write_int(ctx, w, define_colorspace(ctx, w, cs));
+	write_byte(ctx, w, n);
+	for (i = 0; i < n; i++)
+		write_float(ctx, w, color[i]);
+}
+
+static void
+write_compressed_buffer(fz_context *ctx, list_writer *w, fz_compressed_buffer *cbuf)
+{
+	fz_compression_params *p = &cbuf->params;
+
+	write_int(ctx, w, p->type);
+	switch (p->type)
+	{
+	case FZ_IMAGE_JPEG:
+		write_int(ctx, w, p->u.jpeg.color_transform);
+		break;
+	case FZ_IMAGE_JPX:
+		write_int(ctx, w, p->u.jpx.smask_in_data);
+		break;
+	case FZ_IMAGE_FAX:
+		write_int(ctx, w, p->u.fax.columns);
+		write_int(ctx, w, p->u.fax.rows);
+		write_int(ctx, w, p->u.fax.k);
+		write_int(ctx, w, p->u.fax.end_of_line);
+		write_int(ctx, w, p->u.fax.encoded_byte_align);
+		write_int(ctx, w, p->u.fax.end_of_block);
+		write_int(ctx, w, p->u.fax.black_is_1);
+		write_int(ctx, w, p->u.fax.damaged_rows_before_error);
+		break;
+	case FZ_IMAGE_FLATE:
+		write_int(ctx, w, p->u.flate.columns);
+		write_int(ctx, w, p->u.flate.colors);
+		write_int(ctx, w, p->u.flate.predictor);
+		write_int(ctx, w, p->u.flate.bpc);
+		break;
+	case FZ_IMAGE_LZW:
+		write_int(ctx, w, p->u.lzw.columns);
+		write_int(ctx, w, p->u.lzw.colors);
+		write_int(ctx, w, p->u.lzw.predictor);
+		write_int(ctx, w, p->u.lzw.bpc);
+		write_int(ctx, w, p->u.lzw.early_change);
+		break;
+	}
+	write_data(ctx, w, cbuf->buffer->data, cbuf->buffer->len);
+}
+
+static int
+define_image(fz_context *ctx, list_writer *w, fz_image *image)
+{
+	fz_compressed_buffer *cbuf;
+	fz_pixmap *pix = NULL;
+	int id, mask_ref, cs_ref, i, y;
+
+	id = find_id(ctx, w, image);
+	if (id >= 0)
+		return id;
+
+	mask_ref = image->mask ? define_image(ctx, w, image->mask) : -1;
+
+	cbuf = fz_compressed_image_buffer(ctx, image);
+	if (cbuf && is_serialisable_colorspace(ctx, image->colorspace))
+	{
+		cs_ref = define_colorspace(ctx, w, image->colorspace);
+		id = add_id(ctx, w, image);
+		write_byte(ctx, w, DL_DEF_IMAGE);
+		write_int(ctx, w, id);
+		write_byte(ctx, w, DL_IMAGE_COMPRESSED);
+		write_int(ctx, w, image->w);
+		write_int(ctx, w, image->h);
+		write_int(ctx, w, image->bpc);
+		write_int(ctx, w, cs_ref);
+		write_int(ctx, w, image->xres);
+		write_int(ctx, w, image->yres);
+		write_byte(ctx, w, image->interpolate);
+		write_byte(ctx, w, image->imagemask);
+		write_byte(ctx, w, image->invert_cmyk_jpeg);
+		write_byte(ctx, w, image->use_decode);
+		if (image->use_decode)
+			for (i = 0; i < image->n * 2; i++)
+				write_float(ctx, w, image->decode[i]);
+		write_byte(ctx, w, image->use_colorkey);
+		if (image->use_colorkey)
+			for (i = 0; i < image->n * 2; i++)
+				write_int(ctx, w, image->colorkey[i]);
+		write_int(ctx, w, mask_ref);
+		write_compressed_buffer(ctx, w, cbuf);
+		return id;
+	}
+
+	/* Anything else is stored decoded, at its full resolution. */
+	fz_var(pix);
+	fz_try(ctx)
+	{
+		pix = fz_get_pixmap_from_image(ctx, image, NULL, NULL, NULL, NULL);
+		if (!is_serialisable_colorspace(ctx, pix->colorspace))
+		{
+			fz_pixmap *conv = fz_convert_pixmap(ctx, pix, fz_device_rgb(ctx), NULL, NULL, NULL, 1);
+			fz_drop_pixmap(ctx, pix);
+			pix = conv;
+		}
+		cs_ref = define_colorspace(ctx, w, pix->colorspace);
+		id = add_id(ctx, w, image);
+		write_byte(ctx, w, DL_DEF_IMAGE);
+		write_int(ctx, w, id);
+		write_byte(ctx, w, DL_IMAGE_PIXMAP);
+		write_int(ctx, w, pix->w);
+		write_int(ctx, w, pix->h);
+		write_int(ctx, w, cs_ref);
+		write_byte(ctx, w, pix->alpha);
+		write_int(ctx, w, pix->xres);
+		write_int(ctx, w, pix->yres);
+		write_byte(ctx, w, image->interpolate);
+		write_byte(ctx, w, image->imagemask);
+		write_int(ctx, w, mask_ref);
+		for (y = 0; y < pix->h; y++)
+			fz_append_data(ctx, w->out, pix->samples + (size_t)y * pix->stride, (size_t)pix->w * pix->n);
+	}
+	fz_always(ctx)
+		fz_drop_pixmap(ctx, pix);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return id;
+}
+
+static int
+define_font(fz_context *ctx, list_writer *w, fz_font *font)
+{
+	const unsigned char *data;
+	int id, i, len;
+
+	id = find_id(ctx, w, font);
+	if (id >= 0)
+		return id;
+
+	if (font->t3lists)
+	{
+		/* Define everything the glyphs use before the font itself. */
+		id = add_id(ctx, w, font);
+		write_byte(ctx, w, DL_DEF_FONT);
+		write_int(ctx, w, id);
+		write_byte(ctx, w, DL_FONT_TYPE3);
+		write_string(ctx, w, fz_font_name(ctx, font));
+		write_matrix(ctx, w, &font->t3matrix);
+		write_rect(ctx, w, &font->bbox);
+		write_int(ctx, w, font->flags.invalid_bbox);
+		for (i = 0; i < 256; i++)
+		{
+			write_float(ctx, w, font->t3widths[i]);
+			write_int(ctx, w, font->t3flags[i]);
+			write_rect(ctx, w, &font->bbox_table[i]);
+		}
+		for (i = 0; i < 256; i++)
+		{
+			if (!font->t3lists[i])
+				continue;
+			write_int(ctx, w, i);
+			write_records(ctx, w, font->t3lists[i]);
+		}
+		write_int(ctx, w, -1);
+		return id;
+	}
+
+	if (!font->ft_face || !font->buffer)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot serialise font '%s'", fz_font_name(ctx, font));
+
+	id = add_id(ctx, w, font);
+	write_byte(ctx, w, DL_DEF_FONT);
+	write_int(ctx, w, id);
+
+	for (i = 0; i < (int)nelem(base14_names); i++)
+	{
+		data = fz_lookup_base14_font(ctx, base14_names[i], &len);
+		if (data == font->buffer->data)
+			break;
+	}
+	if (i < (int)nelem(base14_names))
+	{
+		write_byte(ctx, w, DL_FONT_BASE14);
+		write_string(ctx, w, base14_names[i]);
+	}
+	else
+	{
+		write_byte(ctx, w, DL_FONT_EMBEDDED);
+		write_data(ctx, w, font->buffer->data, font->buffer->len);
+	}
+	write_string(ctx, w, fz_font_name(ctx, font));
+	write_int(ctx, w, ((FT_Face)font->ft_face)->face_index);
+	write_byte(ctx, w, font->bbox_table != NULL);
+	write_rect(ctx, w, &font->bbox);
+	write_byte(ctx, w, font->flags.is_mono);
+	write_byte(ctx, w, font->flags.is_serif);
+	write_byte(ctx, w, font->flags.is_bold);
+	write_byte(ctx, w, font->flags.is_italic);
+	write_byte(ctx, w, font->flags.ft_substitute);
+	write_byte(ctx, w, font->flags.ft_stretch);
+	write_byte(ctx, w, font->flags.fake_bold);
+	write_byte(ctx, w, font->flags.fake_italic);
+	write_byte(ctx, w, font->flags.force_hinting);
+	write_int(ctx, w, font->width_table ? font->width_count : 0);
+	write_int(ctx, w, font->width_default);
+	if (font->width_table)
+		for (i = 0; i < font->width_count; i++)
+			write_int(ctx, w, font->width_table[i]);
+	return id;
+}
+
+static int
+define_shade(fz_context *ctx, list_writer *w, fz_shade *shade)
+{
+	fz_colorspace *cs = shade->colorspace;
+	fz_colorspace *out = output_colorspace(ctx, cs);
+	const fz_color_params *params = fz_default_color_params(ctx);
+	float conv[FZ_MAX_COLORS];
+	int id, cs_ref, n, out_n, ncomp, count, i, k;
+	float *p;
+
+	id = find_id(ctx, w, shade);
+	if (id >= 0)
+		return id;
+
+	n = fz_colorspace_n(ctx, cs);
+	out_n = fz_colorspace_n(ctx, out);
+	ncomp = shade->use_function ? 1 : n;
+	if (out != cs && shade->type >= FZ_MESH_TYPE4 && !shade->use_function)
+	{
+		fz_warn(ctx, "cannot serialise %s mesh shading; dropping it", fz_colorspace_name(ctx, cs));
+		return -1;
+	}
+
+	cs_ref = define_colorspace(ctx, w, cs);
+	id = add_id(ctx, w, shade);
+	write_byte(ctx, w, DL_DEF_SHADE);
+	write_int(ctx, w, id);
+	write_int(ctx, w, shade->type);
+	write_rect(ctx, w, &shade->bbox);
+	write_int(ctx, w, cs_ref);
+	write_matrix(ctx, w, &shade->matrix);
+
+	write_byte(ctx, w, shade->use_background);
+	if (shade->use_background)
+	{
+		p = shade->background;
+		if (out != cs)
+			fz_convert_color(ctx, params, NULL, out, p = conv, cs, shade->background);
+		for (k = 0; k < out_n; k++)
+			write_float(ctx, w, p[k]);
+	}
+
+	write_byte(ctx, w, shade->use_function);
+	if (shade->use_function)
+	{
+		for (i = 0; i < 256; i++)
+		{
+			p = shade->function[i];
+			if (out != cs)
+				fz_convert_color(ctx, params, NULL, out, p = conv, cs, shade->function[i]);
+			for (k = 0; k < out_n; k++)
+				write_float(ctx, w, p[k]);
+			write_float(ctx, w, shade->function[i][n]);
+		}
+	}
+
+	switch (shade->type)
+	{
+	case FZ_FUNCTION_BASED:
+		write_matrix(ctx, w, &shade->u.f.matrix);
+		write_int(ctx, w, shade->u.f.xdivs);
+		write_int(ctx, w, shade->u.f.ydivs);
+		write_float(ctx, w, shade->u.f.domain[0][0]);
+		write_float(ctx, w, shade->u.f.domain[0][1]);
+		write_float(ctx, w, shade->u.f.domain[1][0]);
+		write_float(ctx, w, shade->u.f.domain[1][1]);
+		count = (shade->u.f.xdivs + 1) * (shade->u.f.ydivs + 1);
+		for (i = 0; i < count; i++)
+		{
+			p = shade->u.f.fn_vals + i * n;
+			if (out != cs)
+				fz_convert_color(ctx, params, NULL, out, p = conv, cs, shade->u.f.fn_vals + i * n);
+			for (k = 0; k < out_n; k++)
+				write_float(ctx, w, p[k]);
+		}
+		break;
+	case FZ_LINEAR:
+	case FZ_RADIAL:
+		write_int(ctx, w, shade->u.l_or_r.extend[0]);
+		write_int(ctx, w, shade->u.l_or_r.extend[1]);
+		for (i = 0; i < 2; i++)
+			for (k = 0; k < 3; k++)
+				write_float(ctx, w, shade->u.l_or_r.coords[i][k]);
+		break;
+	default:
+		write_int(ctx, w, shade->u.m.vprow);
+		write_int(ctx, w, shade->u.m.bpflag);
+		write_int(ctx, w, shade->u.m.bpcoord);
+		write_int(ctx, w, shade->u.m.bpcomp);
+		write_float(ctx, w, shade->u.m.x0);
+		write_float(ctx, w, shade->u.m.x1);
+		write_float(ctx, w, shade->u.m.y0);
+		write_float(ctx, w, shade->u.m.y1);
+		for (k = 0; k < ncomp; k++)
+			write_float(ctx, w, shade->u.m.c0[k]);
+		for (k = 0; k < ncomp; k++)
+			write_float(ctx, w, shade->u.m.c1[k]);
+		break;
+	}
+
+	write_byte(ctx, w, shade->buffer != NULL);
+	if (shade->buffer)
+		write_compressed_buffer(ctx, w, shade->buffer);
+
+	return id;
+}
+
+static void
+define_text(fz_context *ctx, list_writer *w, const fz_text *text)
+{
+	fz_text_span *span;
+	for (span = text->head; span; span = span->next)
+		define_font(ctx, w, span->font);
+}
+
+static void
+write_text(fz_context *ctx, list_writer *w, const fz_text *text)
+{
+	fz_text_span *span;
+	int i, count = 0;
+
+	for (span = text->head; span; span = span->next)
+		count++;
+	write_int(ctx, w, count);
+	for (span = text->head; span; span = span->next)
+	{
+		write_int(ctx, w, define_font(ctx, w, span->font));
+		write_matrix(ctx, w, &span->trm);
+		write_byte(ctx, w, span->wmode);
+		write_byte(ctx, w, span->bidi_level);
+		write_byte(ctx, w, span->markup_dir);
+		write_int(ctx, w, span->language);
+		write_int(ctx, w, span->len);
+		for (i = 0; i < span->len; i++)
+		{
+			write_float(ctx, w, span->items[i].x);
+			write_float(ctx, w, span->items[i].y);
+			write_int(ctx, w, span->items[i].gid);
+			write_int(ctx, w, span->items[i].ucs);
+		}
+	}
+}
+
+static void
+path_moveto(fz_context *ctx, void *arg, float x, float y)
+{
+	list_writer *w = arg;
+	write_byte(ctx, w, DL_PATH_MOVE);
+	write_float(ctx, w, x);
+	write_float(ctx, w, y);
+}
+
+static void
+path_lineto(fz_context *ctx, void *arg, float x, float y)
+{
+	list_writer *w = arg;
+	write_byte(ctx, w, DL_PATH_LINE);
+	write_float(ctx, w, x);
+	write_float(ctx, w, y);
+}
+
+static void
+path_curveto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2, float x3, float y3)
+{
+	list_writer *w = arg;
+	write_byte(ctx, w, DL_PATH_CURVE);
+	write_float(ctx, w, x1);
+	write_float(ctx, w, y1);
+	write_float(ctx, w, x2);
+	write_float(ctx, w, y2);
+	write_float(ctx, w, x3);
+	write_float(ctx, w, y3);
+}
+
+static void
+path_closepath(fz_context *ctx, void *arg)
+{
+	list_writer *w = arg;
+	write_byte(ctx, w, DL_PATH_CLOSE);
+}
+
+static void
+path_rectto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2)
+{
+	list_writer *w = arg;
+	write_byte(ctx, w, DL_PATH_RECT);
+	write_float(ctx, w, x1);
+	write_float(ctx, w, y1);
+	write_float(ctx, w, x2);
+	write_float(ctx, w, y2);
+}
+
+static const fz_path_walker path_writer =
+{
+	path_moveto,
+	path_lineto,
+	path_curveto,
+	path_closepath,
+	NULL,
+	NULL,
+	NULL,
+	path_rectto
+};
+
+static void
+write_path(fz_context *ctx, list_writer *w, const fz_path *path)
+{
+	fz_walk_path(ctx, path, &path_writer, w);
+	write_byte(ctx, w, DL_PATH_END);
+}
+
+static void
+write_stroke(fz_context *ctx, list_writer *w, const fz_stroke_state *stroke)
+{
+	int i;
+
+	write_byte(ctx, w, stroke->start_cap);
+	write_byte(ctx, w, stroke->dash_cap);
+	write_byte(ctx, w, stroke->end_cap);
+	write_byte(ctx, w, stroke->linejoin);
+	write_float(ctx, w, stroke->linewidth);
+	write_float(ctx, w, stroke->miterlimit);
+	write_float(ctx, w, stroke->dash_phase);
+	write_int(ctx, w, stroke->dash_len);
+	for (i = 0; i < stroke->dash_len; i++)
+		write_float(ctx, w, stroke->dash_list[i]);
+}
+
+static void
+fz_writer_fill_path(fz_context *ctx, fz_device *dev, const fz_path *path, int even_odd, const fz_matrix *ctm,
+	fz_colorspace *colorspace, const float *color, float alpha, const fz_color_params *color_params)
+{
+	list_writer *w = ((fz_list_writer_device *)dev)->w;
+	define_colorspace(ctx, w, colorspace);
+	write_byte(ctx, w, DL_FILL_PATH);
+	write_path(ctx, w, path);
+	write_byte(ctx, w, even_odd);
+	write_matrix(ctx, w, ctm);
+	write_color(ctx, w, colorspace, color, color_params);
+	write_float(ctx, w, alpha);
+	write_color_params(ctx, w, color_params);
+}
+
+static void
+fz_writer_stroke_path(fz_context *ctx, fz_device *dev, const fz_path *path, const fz_stroke_state *stroke,
+	const fz_matrix *ctm, fz_colorspace *colorspace, const float *color, float alpha, const fz_color_params *color_params)
+{
+	list_writer *w = ((fz_list_writer_device *)dev)->w;
+	define_colorspace(ctx, w, colorspace);
+	write_byte(ctx, w, DL_STROKE_PATH);
+	write_path(ctx, w, path);
+	write_stroke(ctx, w, stroke);
+	write_matrix(ctx, w, ctm);
+	write_color(ctx, w, colorspace, color, color_params);
+	write_float(ctx, w, alpha);
+	write_color_params(ctx, w, color_params);
+}
+
+static void
+fz_writer_clip_path(fz_context *ctx, fz_device *dev, const fz_path *path, int even_odd, const fz_matrix *ctm, const fz_rect *scissor)
+{
+	list_writer *w = ((fz_list_writer_device *)dev)->w;
+	write_byte(ctx, w, DL_CLIP_PATH);
+	write_path(ctx, w, path);
+	write_byte(ctx, w, even_odd);
+	write_matrix(ctx, w, ctm);
+	write_opt_rect(ctx, w, scissor);
+}
+
+static void
+fz_writer_clip_stroke_path(fz_context *ctx, fz_device *dev, const fz_path *path, const fz_stroke_state *stroke,
+	const fz_matrix *ctm, const fz_rect *scissor)
+{
+	list_writer *w = ((fz_list_writer_device *)dev)->w;
+	write_byte(ctx, w, DL_CLIP_STROKE_PATH);
+	write_path(ctx, w, path);
+	write_stroke(ctx, w, stroke);
+	write_matrix(ctx, w, ctm);
+	write_opt_rect(ctx, w, scissor);
+}
+
+static void
+fz_writer_fill_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_matrix *ctm,
+	fz_colorspace *colorspace, const float *color, float alpha, const fz_color_params *color_params)
+{
+	list_writer *w = ((fz_list_writer_device *)dev)->w;
+	define_text(ctx, w, text);
+	define_colorspace(ctx, w, colorspace);
+	write_byte(ctx, w, DL_FILL_TEXT);
+	write_text(ctx, w, text);
+	write_matrix(ctx, w, ctm);
+	write_color(ctx, w, colorspace, color, color_params);
+	write_float(ctx, w, alpha);
+	write_color_params(ctx, w, color_params);
+}
+
+static void
+fz_writer_stroke_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_stroke_state *stroke,
+	const fz_matrix *ctm, fz_colorspace *colorspace, const float *color, float alpha, const fz_color_params *color_params)
+{
+	list_writer *w = ((fz_list_writer_device *)dev)->w;
+	define_text(ctx, w, text);
+	define_colorspace(ctx, w, colorspace);
+	write_byte(ctx, w, DL_STROKE_TEXT);
+	write_text(ctx, w, text);
+	write_stroke(ctx, w, stroke);
+	write_matrix(ctx, w, ctm);
+	write_color(ctx, w, colorspace, color, color_params);
+	write_float(ctx, w, alpha);
+	write_color_params(ctx, w, color_params);
+}
+
+static void
+fz_writer_clip_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_matrix *ctm, const fz_rect *scissor)
+{
+	list_writer *w = ((fz_list_writer_device *)dev)->w;
+	define_text(ctx, w, text);
+	write_byte(ctx, w, DL_CLIP_TEXT);
+	write_text(ctx, w, text);
+	write_matrix(ctx, w, ctm);
+	write_opt_rect(ctx, w, scissor);
+}
+
+static void
+fz_writer_clip_stroke_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_stroke_state *stroke,
+	const fz_matrix *ctm, const fz_rect *scissor)
+{
+	list_writer *w = ((fz_list_writer_device *)dev)->w;
+	define_text(ctx, w, text);
+	write_byte(ctx, w, DL_CLIP_STROKE_TEXT);
+	write_text(ctx, w, text);
+	write_stroke(ctx, w, stroke);
+	write_matrix(ctx, w, ctm);
+	write_opt_rect(ctx, w, scissor);
+}
+
+static void
+fz_writer_ignore_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_matrix *ctm)
+{
+	list_writer *w = ((fz_list_writer_device *)dev)->w;
+	define_text(ctx, w, text);
+	write_byte(ctx, w, DL_IGNORE_TEXT);
+	write_text(ctx, w, text);
+	write_matrix(ctx, w, ctm);
+}
+
+static void
+fz_writer_fill_shade(fz_context *ctx, fz_device *dev, fz_shade *shade, const fz_matrix *ctm, float alpha, const fz_color_params *color_params)
+{
+	list_writer *w = ((fz_list_writer_device *)dev)->w;
+	int id = define_shade(ctx, w, shade);
+	if (id < 0)
+		return;
+	write_byte(ctx, w, DL_FILL_SHADE);
+	write_int(ctx, w, id);
+	write_matrix(ctx, w, ctm);
+	write_float(ctx, w, alpha);
+	write_color_params(ctx, w, color_params);
+}
+
+static void
+fz_writer_fill_image(fz_context *ctx, fz_device *dev, fz_image *image, const fz_matrix *ctm, float alpha, const fz_color_params *color_params)
+{
+	list_writer *w = ((fz_list_writer_device *)dev)->w;
+	int id = define_image(ctx, w, image);
+	write_byte(ctx, w, DL_FILL_IMAGE);
+	write_int(ctx, w, id);
+	write_matrix(ctx, w, ctm);
+	write_float(ctx, w, alpha);
+	write_color_params(ctx, w, color_params);
+}
+
+static void
+fz_writer_fill_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, const fz_matrix *ctm,
+	fz_colorspace *colorspace, const float *color, float alpha, const fz_color_params *color_params)
+{
+	list_writer *w = ((fz_list_writer_device *)dev)->w;
+	int id = define_image(ctx, w, image);
+	define_colorspace(ctx, w, colorspace);
+	write_byte(ctx, w, DL_FILL_IMAGE_MASK);
+	write_int(ctx, w, id);
+	write_matrix(ctx, w, ctm);
+	write_color(ctx, w, colorspace, color, color_params);
+	write_float(ctx, w, alpha);
+	write_color_params(ctx, w, color_params);
+}
+
+static void
+fz_writer_clip_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, const fz_matrix *ctm, const fz_rect *scissor)
+{
+	list_writer *w = ((fz_list_writer_device *)dev)->w;
+	int id = define_image(ctx, w, image);
+	write_byte(ctx, w, DL_CLIP_IMAGE_MASK);
+	write_int(ctx, w, id);
+	write_matrix(ctx, w, ctm);
+	write_opt_rect(ctx, w, scissor);
+}
+
+static void
+fz_writer_pop_clip(fz_context *ctx, fz_device *dev)
+{
+	write_byte(ctx, ((fz_list_writer_device *)dev)->w, DL_POP_CLIP);
+}
+
+static void
+fz_writer_begin_mask(fz_context *ctx, fz_device *dev, const fz_rect *rect, int luminosity,
+	fz_colorspace *colorspace, const float *color, const fz_color_params *color_params)
+{
+	list_writer *w = ((fz_list_writer_device *)dev)->w;
+	define_colorspace(ctx, w, colorspace);
+	write_byte(ctx, w, DL_BEGIN_MASK);
+	write_rect(ctx, w, rect);
+	write_byte(ctx, w, luminosity);
+	write_color(ctx, w, colorspace, color, color_params);
+	write_color_params(ctx, w, color_params);
+}
+
+static void
+fz_writer_end_mask(fz_context *ctx, fz_device *dev)
+{
+	write_byte(ctx, ((fz_list_writer_device *)dev)->w, DL_END_MASK);
+}
+
+static void
+fz_writer_begin_group(fz_context *ctx, fz_device *dev, const fz_rect *rect, fz_colorspace *colorspace,
+	int isolated, int knockout, int blendmode, float alpha)
+{
+	list_writer *w = ((fz_list_writer_device *)dev)->w;
+	int cs_ref = define_colorspace(ctx, w, colorspace);
+	write_byte(ctx, w, DL_BEGIN_GROUP);
+	write_rect(ctx, w, rect);
+	write_int(ctx, w, cs_ref);
+	write_byte(ctx, w, isolated);
+	write_byte(ctx, w, knockout);
+	write_int(ctx, w, blendmode);
+	write_float(ctx, w, alpha);
+}
+
+static void
+fz_writer_end_group(fz_context *ctx, fz_device *dev)
+{
+	write_byte(ctx, ((fz_list_writer_device *)dev)->w, DL_END_GROUP);
+}
+
+static int
+fz_writer_begin_tile(fz_context *ctx, fz_device *dev, const fz_rect *area, const fz_rect *view,
+	float xstep, float ystep, const fz_matrix *ctm, int id)
+{
+	list_writer *w = ((fz_list_writer_device *)dev)->w;
+	write_byte(ctx, w, DL_BEGIN_TILE);
+	write_rect(ctx, w, area);
+	write_rect(ctx, w, view);
+	write_float(ctx, w, xstep);
+	write_float(ctx, w, ystep);
+	write_matrix(ctx, w, ctm);
+	write_int(ctx, w, id);
+	/* Always ask for the tile contents. */
+	return 0;
+}
+
+static void
+fz_writer_end_tile(fz_context *ctx, fz_device *dev)
+{
+	write_byte(ctx, ((fz_list_writer_device *)dev)->w, DL_END_TILE);
+}
+
+static void
+fz_writer_render_flags(fz_context *ctx, fz_device *dev, int set, int clear)
+{
+	list_writer *w = ((fz_list_writer_device *)dev)->w;
+	write_byte(ctx, w, DL_RENDER_FLAGS);
+	write_int(ctx, w, set);
+	write_int(ctx, w, clear);
+}
+
+static void
+fz_writer_set_default_colorspaces(fz_context *ctx, fz_device *dev, fz_default_colorspaces *dcs)
+{
+	list_writer *w = ((fz_list_writer_device *)dev)->w;
+	int gray = define_colorspace(ctx, w, fz_default_gray(ctx, dcs));
+	int rgb = define_colorspace(ctx, w, fz_default_rgb(ctx, dcs));
+	int cmyk = define_colorspace(ctx, w, fz_default_cmyk(ctx, dcs));
+	int oi = define_colorspace(ctx, w, fz_default_output_intent(ctx, dcs));
+	write_byte(ctx, w, DL_DEFAULT_COLORSPACES);
+	write_int(ctx, w, gray);
+	write_int(ctx, w, rgb);
+	write_int(ctx, w, cmyk);
+	write_int(ctx, w, oi);
+}
+
+static fz_device *
+new_writer_device(fz_context *ctx, list_writer *w)
+{
+	fz_list_writer_device *dev = fz_new_derived_device(ctx, fz_list_writer_device);
+
+	dev->super.fill_path = fz_writer_fill_path;
+	dev->super.stroke_path = fz_writer_stroke_path;
+	dev->super.clip_path = fz_writer_clip_path;
+	dev->super.clip_stroke_path = fz_writer_clip_stroke_path;
+
+	dev->super.fill_text = fz_writer_fill_text;
+	dev->super.stroke_text = fz_writer_stroke_text;
+	dev->super.clip_text = fz_writer_clip_text;
+	dev->super.clip_stroke_text = fz_writer_clip_stroke_text;
+	dev->super.ignore_text = fz_writer_ignore_text;
+
+	dev->super.fill_shade = fz_writer_fill_shade;
+	dev->super.fill_image = fz_writer_fill_image;
+	dev->super.fill_image_mask = fz_writer_fill_image_mask;
+	dev->super.clip_image_mask = fz_writer_clip_image_mask;
+
+	dev->super.pop_clip = fz_writer_pop_clip;
+
+	dev->super.begin_mask = fz_writer_begin_mask;
+	dev->super.end_mask = fz_writer_end_mask;
+	dev->super.begin_group = fz_writer_begin_group;
+	dev->super.end_group = fz_writer_end_group;
+
+	dev->super.begin_tile = fz_writer_begin_tile;
+	dev->super.end_tile = fz_writer_end_tile;
+
+	dev->super.render_flags = fz_writer_render_flags;
+	dev->super.set_default_colorspaces = fz_writer_set_default_colorspaces;
+
+	dev->w = w;
+
+	return &dev->super;
+}
+
+static void
+write_records(fz_context *ctx, list_writer *w, fz_display_list *list)
+{
+	fz_device *dev = new_writer_device(ctx, w);
+	fz_try(ctx)
+	{
+		fz_run_display_list(ctx, list, dev, &fz_identity, &fz_infinite_rect, NULL);
+		fz_close_device(ctx, dev);
+		write_byte(ctx, w, DL_END);
+	}
+	fz_always(ctx)
+		fz_drop_device(ctx, dev);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+fz_buffer *
+fz_serialize_display_list(fz_context *ctx, fz_display_list *list)
+{
+	list_writer w = { NULL, NULL, 0 };
+	fz_rect mediabox;
+
+	fz_var(w.ids);
+
+	w.out = fz_new_buffer(ctx, 4096);
+	fz_try(ctx)
+	{
+		w.ids = fz_new_hash_table(ctx, 256, sizeof(void *), -1, NULL);
+		fz_append_data(ctx, w.out, LIST_MAGIC, LIST_MAGIC_LEN);
+		write_rect(ctx, &w, fz_bound_display_list(ctx, list, &mediabox));
+		write_records(ctx, &w, list);
+	}
+	fz_always(ctx)
+		fz_drop_hash_table(ctx, w.ids);
+	fz_catch(ctx)
+	{
+		fz_drop_buffer(ctx, w.out);
+		fz_rethrow(ctx);
+	}
+
+	return w.out;
+}
+
+void
+fz_save_display_list(fz_context *ctx, fz_display_list *list, const char *filename)
+{
+	fz_buffer *buf = fz_serialize_display_list(ctx, list);
+	fz_try(ctx)
+		fz_save_buffer(ctx, buf, filename);
+	fz_always(ctx)
+		fz_drop_buffer(ctx, buf);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+/* Reading */
+
+typedef struct list_resource_s
+{
+	int type;
+	void *obj;
+} list_resource;
+
+/* Type 3 glyphs may use Type 3 fonts; limit the nesting like pdf_run_glyph */
+#define MAX_TYPE3_DEPTH 10
+
+typedef struct list_reader_s
+{
+	const unsigned char *p, *end;
+	int len, cap;
+	list_resource *res;
+	int type3_depth;
+} list_reader;
+
+static void replay_records(fz_context *ctx, list_reader *r, fz_device *dev);
+
+static void
+need_bytes(fz_context *ctx, list_reader *r, size_t n)
+{
+	if ((size_t)(r->end - r->p) < n)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "truncated display list");
+}
+
+static int
+read_byte(fz_context *ctx, list_reader *r)
+{
+	need_bytes(ctx, r, 1);
+	return *r->p++;
+}
+
+static int
+read_int(fz_context *ctx, list_reader *r)
+{
+	const unsigned char *p;
+	need_bytes(ctx, r, 4);
+	p = r->p;
+	r->p += 4;
+	return (int)(p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24));
+}
+
+static float
+read_float(fz_context *ctx, list_reader *r)
+{
+	union { float f; int i; } u;
+	u.i = read_int(ctx, r);
+	return u.f;
+}
+
+static const unsigned char *
+read_data(fz_context *ctx, list_reader *r, size_t *len)
+{
+	const unsigned char *data;
+	int n = read_int(ctx, r);
+	if (n < 0)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list");
+	need_bytes(ctx, r, n);
+	data = r->p;
+	r->p += n;
+	*len = n;
+	return data;
+}
+
+static void
+read_string(fz_context *ctx, list_reader *r, char *buf, size_t size)
+{
+	size_t len;
+	const unsigned char *data = read_data(ctx, r, &len);
+	if (len >= size)
+		len = size - 1;
+	memcpy(buf, data, len);
+	buf[len] = 0;
+}
+
+static fz_rect *
+read_rect(fz_context *ctx, list_reader *r, fz_rect *rect)
+{
+	rect->x0 = read_float(ctx, r);
+	rect->y0 = read_float(ctx, r);
+	rect->x1 = read_float(ctx, r);
+	rect->y1 = read_float(ctx, r);
+	return rect;
+}
+
+static fz_rect *
+read_opt_rect(fz_context *ctx, list_reader *r, fz_rect *rect)
+{
+	return read_byte(ctx, r) ? read_rect(ctx, r, rect) : NULL;
+}
+
+static fz_matrix *
+read_matrix(fz_context *ctx, list_reader *r, fz_matrix *m)
+{
+	m->a = read_float(ctx, r);
+	m->b = read_float(ctx, r);
+	m->c = read_float(ctx, r);
+	m->d = read_float(ctx, r);
+	m->e = read_float(ctx, r);
+	m->f = read_float(ctx, r);
+	return m;
+}
+
+static const fz_color_params *
+read_color_params(fz_context *ctx, list_reader *r, fz_color_params *params)
+{
+	if (!read_byte(ctx, r))
+		return NULL;
+	params->ri = read_byte(ctx, r);
+	params->bp = read_byte(ctx, r);
+	params->op = read_byte(ctx, r);
+	params->opm = read_byte(ctx, r);
+	return params;
+}
+
+static void
+drop_resource(fz_context *ctx, int type, void *obj)
+{
+	switch (type)
+	{
+	case DL_RES_COLORSPACE: fz_drop_colorspace(ctx, obj); break;
+	case DL_RES_FONT: fz_drop_font(ctx, obj); break;
+	case DL_RES_IMAGE: fz_drop_image(ctx, obj); break;
+	case DL_RES_SHADE: fz_drop_shade(ctx, obj); break;
+	}
+}
+
+/* Takes ownership of obj */
+static void
+add_resource(fz_context *ctx, list_reader *r, int id, int type, void *obj)
+{
+	fz_try(ctx)
+	{
+		if (id != r->len)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list resource table");
+		if (r->len == r->cap)
+		{
+			int cap = r->cap ? r->cap * 2 : 64;
+			r->res = fz_resize_array(ctx, r->res, cap, sizeof *r->res);
+			r->cap = cap;
+		}
+	}
+	fz_catch(ctx)
+	{
+		drop_resource(ctx, type, obj);
+		fz_rethrow(ctx);
+	}
+	r->res[r->len].type = type;
+	r->res[r->len].obj = obj;
+	r->len++;
+}
+
+static void *
+get_resource(fz_context *ctx, list_reader *r, int id, int type)
+{
+	if (id < 0 || id >= r->len || r->res[id].type != type)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list resource reference");
+	return r->res[id].obj;
+}
+
+static fz_colorspace *
+get_colorspace(fz_context *ctx, list_reader *r, int ref)
+{
+	switch (ref)
+	{
+	case DL_CS_NONE: return NULL;
+	case DL_CS_GRAY: return fz_device_gray(ctx);
+	case DL_CS_RGB: return fz_device_rgb(ctx);
+	case DL_CS_BGR: return fz_device_bgr(ctx);
+	case DL_CS_CMYK: return fz_device_cmyk(ctx);
+	case DL_CS_LAB: return fz_device_lab(ctx);
+	}
+	return get_resource(ctx, r, ref, DL_RES_COLORSPACE);
+}
+
+static const float *
+read_color(fz_context *ctx, list_reader *r, fz_colorspace **cs, float *color)
+{
+	int i, n;
+
+	*cs = get_colorspace(ctx, r, read_int(ctx, r));
+	n = read_byte(ctx, r);
+	if (n > FZ_MAX_COLORS || (n != 0 && (*cs == NULL || n != fz_colorspace_n(ctx, *cs))))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list color");
+	for (i = 0; i < n; i++)
+		color[i] = read_float(ctx, r);
+	return n ? color : NULL;
+}
+
+static void
+read_colorspace_def(fz_context *ctx, list_reader *r)
+{
+	fz_colorspace *cs = NULL;
+	fz_buffer *buf = NULL;
+	unsigned char *lookup = NULL;
+	const unsigned char *data;
+	fz_colorspace *base;
+	char name[24];
+	size_t len;
+	int id, high, n;
+
+	fz_var(buf);
+	fz_var(lookup);
+
+	id = read_int(ctx, r);
+	switch (read_byte(ctx, r))
+	{
+	case DL_CS_INDEXED:
+		base = get_colorspace(ctx, r, read_int(ctx, r));
+		high = read_int(ctx, r);
+		data = read_data(ctx, r, &len);
+		if (!base || high < 0 || high > 255 || len != (size_t)fz_colorspace_n(ctx, base) * (high + 1))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list colorspace");
+		lookup = fz_malloc(ctx, len);
+		memcpy(lookup, data, len);
+		fz_try(ctx)
+			cs = fz_new_indexed_colorspace(ctx, base, high, lookup);
+		fz_catch(ctx)
+		{
+			fz_free(ctx, lookup);
+			fz_rethrow(ctx);
+		}
+		break;
+	case DL_CS_ICC:
+		read_string(ctx, r, name, sizeof name);
+		n = read_int(ctx, r);
+		data = read_data(ctx, r, &len);
+		buf = fz_new_buffer_from_copied_data(ctx, data, len);
+		fz_try(ctx)
+			cs = fz_new_icc_colorspace(ctx, name, n, buf);
+		fz_always(ctx)
+			fz_drop_buffer(ctx, buf);
+		fz_catch(ctx)
+			fz_rethrow(ctx);
+		if (!cs)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot load ICC profile '%s' from display list", name);
+		break;
+	default:
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list colorspace");
+	}
+	add_resource(ctx, r, id, DL_RES_COLORSPACE, cs);
+}
+
+static fz_compressed_buffer *
+read_compressed_buffer(fz_context *ctx, list_reader *r)
+{
+	fz_compressed_buffer *cbuf;
+	fz_compression_params p = { 0 };
+	const unsigned char *data;
+	size_t len;
+
+	p.type = read_int(ctx, r);
+	switch (p.type)
+	{
+	case FZ_IMAGE_JPEG:
+		p.u.jpeg.color_transform = read_int(ctx, r);
+		break;
+	case FZ_IMAGE_JPX:
+		p.u.jpx.smask_in_data = read_int(ctx, r);
+		break;
+	case FZ_IMAGE_FAX:
+		p.u.fax.columns = read_int(ctx, r);
+		p.u.fax.rows = read_int(ctx, r);
+		p.u.fax.k = read_int(ctx, r);
+		p.u.fax.end_of_line = read_int(ctx, r);
+		p.u.fax.encoded_byte_align = read_int(ctx, r);
+		p.u.fax.end_of_block = read_int(ctx, r);
+		p.u.fax.black_is_1 = read_int(ctx, r);
+		p.u.fax.damaged_rows_before_error = read_int(ctx, r);
+		break;
+	case FZ_IMAGE_FLATE:
+		p.u.flate.columns = read_int(ctx, r);
+		p.u.flate.colors = read_int(ctx, r);
+		p.u.flate.predictor = read_int(ctx, r);
+		p.u.flate.bpc = read_int(ctx, r);
+		break;
+	case FZ_IMAGE_LZW:
+		p.u.lzw.columns = read_int(ctx, r);
+		p.u.lzw.colors = read_int(ctx, r);
+		p.u.lzw.predictor = read_int(ctx, r);
+		p.u.lzw.bpc = read_int(ctx, r);
+		p.u.lzw.early_change = read_int(ctx, r);
+		break;
+	}
+	data = read_data(ctx, r, &len);
+
+	cbuf = fz_malloc_struct(ctx, fz_compressed_buffer);
+	cbuf->params = p;
+	fz_try(ctx)
+		cbuf->buffer = fz_new_buffer_from_copied_data(ctx, data, len);
+	fz_catch(ctx)
+	{
+		fz_free(ctx, cbuf);
+		fz_rethrow(ctx);
+	}
+	return cbuf;
+}
+
+static void
+read_image_def(fz_context *ctx, list_reader *r)
+{
+	fz_image *image = NULL;
+	fz_image *mask;
+	fz_compressed_buffer *cbuf;
+	fz_pixmap *pix = NULL;
+	fz_colorspace *cs;
+	float decode[FZ_MAX_COLORS * 2];
+	int colorkey[FZ_MAX_COLORS * 2];
+	int id, w, h, bpc, n, xres, yres, alpha, interpolate, imagemask, invert_cmyk_jpeg;
+	int use_decode, use_colorkey, i, y;
+	size_t stride;
+
+	fz_var(pix);
+
+	id = read_int(ctx, r);
+	switch (read_byte(ctx, r))
+	{
+	case DL_IMAGE_COMPRESSED:
+		w = read_int(ctx, r);
+		h = read_int(ctx, r);
+		bpc = read_int(ctx, r);
+		cs = get_colorspace(ctx, r, read_int(ctx, r));
+		n = cs ? fz_colorspace_n(ctx, cs) : 1;
+		xres = read_int(ctx, r);
+		yres = read_int(ctx, r);
+		interpolate = read_byte(ctx, r);
+		imagemask = read_byte(ctx, r);
+		invert_cmyk_jpeg = read_byte(ctx, r);
+		use_decode = read_byte(ctx, r);
+		if (use_decode)
+			for (i = 0; i < n * 2; i++)
+				decode[i] = read_float(ctx, r);
+		use_colorkey = read_byte(ctx, r);
+		if (use_colorkey)
+			for (i = 0; i < n * 2; i++)
+				colorkey[i] = read_int(ctx, r);
+		i = read_int(ctx, r);
+		mask = i < 0 ? NULL : get_resource(ctx, r, i, DL_RES_IMAGE);
+		if (w <= 0 || h <= 0 || (mask && mask->mask) ||
+				(bpc != 1 && bpc != 2 && bpc != 4 && bpc != 8 && bpc != 16))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list image");
+		cbuf = read_compressed_buffer(ctx, r);
+		/* Takes ownership of cbuf, and drops it if it throws */
+		image = fz_new_image_from_compressed_buffer(ctx, w, h, bpc, cs, xres, yres, interpolate, imagemask,
+				use_decode ? decode : NULL, use_colorkey ? colorkey : NULL, cbuf, mask);
+		image->invert_cmyk_jpeg = invert_cmyk_jpeg;
+		break;
+
+	case DL_IMAGE_PIXMAP:
+		w = read_int(ctx, r);
+		h = read_int(ctx, r);
+		cs = get_colorspace(ctx, r, read_int(ctx, r));
+		alpha = read_byte(ctx, r);
+		xres = read_int(ctx, r);
+		yres = read_int(ctx, r);
+		interpolate = read_byte(ctx, r);
+		imagemask = read_byte(ctx, r);
+		i = read_int(ctx, r);
+		mask = i < 0 ? NULL : get_resource(ctx, r, i, DL_RES_IMAGE);
+		if (w <= 0 || h <= 0 || (mask && mask->mask))
+			fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list image");
+		pix = fz_new_pixmap(ctx, cs, w, h, NULL, alpha);
+		fz_try(ctx)
+		{
+			pix->xres = xres;
+			pix->yres = yres;
+			stride = (size_t)pix->w * pix->n;
+			need_bytes(ctx, r, stride * h);
+			for (y = 0; y < h; y++)
+			{
+				memcpy(pix->samples + (size_t)y * pix->stride, r->p, stride);
+				r->p += stride;
+			}
+			image = fz_new_image_from_pixmap(ctx, pix, mask);
+			image->interpolate = interpolate;
+			image->imagemask = imagemask;
+		}
+		fz_always(ctx)
+			fz_drop_pixmap(ctx, pix);
+		fz_catch(ctx)
+			fz_rethrow(ctx);
+		break;
+
+	default:
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list image");
+	}
+	add_resource(ctx, r, id, DL_RES_IMAGE, image);
+}
+
+static fz_font *
+read_type3_font(fz_context *ctx, list_reader *r)
+{
+	fz_font *font;
+	fz_device *dev = NULL;
+	fz_matrix matrix;
+	char name[32];
+	int i, gid;
+
+	fz_var(dev);
+
+	if (r->type3_depth >= MAX_TYPE3_DEPTH)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "type3 fonts nested too deeply in display list");
+
+	read_string(ctx, r, name, sizeof name);
+	read_matrix(ctx, r, &matrix);
+	font = fz_new_type3_font(ctx, name, &matrix);
+	r->type3_depth++;
+	fz_try(ctx)
+	{
+		read_rect(ctx, r, &font->bbox);
+		font->flags.invalid_bbox = read_int(ctx, r);
+		for (i = 0; i < 256; i++)
+		{
+			font->t3widths[i] = read_float(ctx, r);
+			font->t3flags[i] = read_int(ctx, r);
+			read_rect(ctx, r, &font->bbox_table[i]);
+		}
+		while ((gid = read_int(ctx, r)) >= 0)
+		{
+			if (gid > 255 || font->t3lists[gid])
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list type3 font");
+			font->t3lists[gid] = fz_new_display_list(ctx, &font->bbox);
+			dev = fz_new_list_device(ctx, font->t3lists[gid]);
+			replay_records(ctx, r, dev);
+			fz_close_device(ctx, dev);
+			fz_drop_device(ctx, dev);
+			dev = NULL;
+		}
+	}
+	fz_always(ctx)
+		r->type3_depth--;
+	fz_catch(ctx)
+	{
+		fz_drop_device(ctx, dev);
+		fz_drop_font(ctx, font);
+		fz_rethrow(ctx);
+	}
+	return font;
+}
+
+/*
+	Fonts are kept in the store by a digest of their record, so that
+	lists loaded one after another (the pages of a document kept in
+	the disk store, say) share one fz_font for each font, and with it
+	the FreeType face and the glyph cache entries.
+*/
+typedef struct
+{
+	fz_storable storable;
+	fz_font *font;
+} list_font;
+
+typedef struct
+{
+	int refs;
+	unsigned char digest[16];
+} list_font_key;
+
+static void
+drop_list_font(fz_context *ctx, fz_storable *storable)
+{
+	list_font *lf = (list_font *)storable;
+	fz_drop_font(ctx, lf->font);
+	fz_free(ctx, lf);
+}
+
+static int
+make_hash_list_font_key(fz_context *ctx, fz_store_hash *hash, void *key_)
+{
+	list_font_key *key = key_;
+	memcpy(hash->u.link.src_md5, key->digest, 16);
+	return 1;
+}
+
+static void *
+keep_list_font_key(fz_context *ctx, void *key_)
+{
+	list_font_key *key = key_;
+	return fz_keep_imp(ctx, key, &key->refs);
+}
+
+static void
+drop_list_font_key(fz_context *ctx, void *key_)
+{
+	list_font_key *key = key_;
+	if (fz_drop_imp(ctx, key, &key->refs))
+		fz_free(ctx, key);
+}
+
+static int
+cmp_list_font_key(fz_context *ctx, void *k0_, void *k1_)
+{
+	list_font_key *k0 = k0_;
+	list_font_key *k1 = k1_;
+	return !memcmp(k0->digest, k1->digest, 16);
+}
+
+static void
+format_list_font_key(fz_context *ctx, char *s, int n, void *key_)
+{
+	list_font_key *key = key_;
+	fz_snprintf(s, n, "(display list font %02x%02x%02x%02x...)",
+			key->digest[0], key->digest[1], key->digest[2], key->digest[3]);
+}
+
+static const fz_store_type list_font_store_type =
+{
+	make_hash_list_font_key,
+	keep_list_font_key,
+	drop_list_font_key,
+	cmp_list_font_key,
+	format_list_font_key,
+	NULL,
+	"display list font"
+};
+
+static fz_font *
+find_list_font(fz_context *ctx, const unsigned char digest[16])
+{
+	list_font_key key;
+	list_font *lf;
+	fz_font *font;
+
+	key.refs = 1;
+	memcpy(key.digest, digest, 16);
+	lf = fz_find_item(ctx, drop_list_font, &key, &list_font_store_type);
+	if (!lf)
+		return NULL;
+	font = fz_keep_font(ctx, lf->font);
+	fz_drop_storable(ctx, &lf->storable);
+	return font;
+}
+
+static void
+store_list_font(fz_context *ctx, const unsigned char digest[16], fz_font *font, size_t size)
+{
+	list_font_key *key = NULL;
+	list_font *lf = NULL;
+	list_font *existing;
+
+	fz_var(key);
+	fz_var(lf);
+
+	/* Failing to store the font just means that it is not shared */
+	fz_try(ctx)
+	{
+		key = fz_malloc_struct(ctx, list_font_key);
+		key->refs = 1;
+		memcpy(key->digest, digest, 16);
+		lf = fz_malloc_struct(ctx, list_font);
+		FZ_INIT_STORABLE(lf, 1, drop_list_font);
+		lf->font = fz_keep_font(ctx, font);
+		existing = fz_store_item(ctx, key, lf, sizeof *lf + size, &list_font_store_type);
+		if (existing)
+			fz_drop_storable(ctx, &existing->storable);
+	}
+	fz_always(ctx)
+	{
+		if (lf)
+			fz_drop_storable(ctx, &lf->storable);
+		if (key)
+			drop_list_font_key(ctx, key);
+	}
+	fz_catch(ctx)
+	{
+		/* Ignore the error */
+	}
+}
+
+static fz_font *
+read_ft_font(fz_context *ctx, list_reader *r, int kind)
+{
+	fz_font *font;
+	fz_buffer *buf;
+	const unsigned char *start = r->p;
+	const unsigned char *data, *widths;
+	unsigned char digest[16];
+	unsigned char kind_byte = kind;
+	list_reader wr;
+	fz_md5 md5;
+	fz_rect bbox;
+	char base14[32], name[32];
+	size_t len;
+	int index, use_glyph_bbox, count, width_default, i, n;
+	int flags[9];
+
+	if (kind == DL_FONT_BASE14)
+	{
+		read_string(ctx, r, base14, sizeof base14);
+		data = fz_lookup_base14_font(ctx, base14, &n);
+		if (!data)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "cannot find builtin font '%s'", base14);
+		len = n;
+	}
+	else
+		data = read_data(ctx, r, &len);
+	read_string(ctx, r, name, sizeof name);
+	index = read_int(ctx, r);
+	use_glyph_bbox = read_byte(ctx, r);
+	read_rect(ctx, r, &bbox);
+	for (i = 0; i < (int)nelem(flags); i++)
+		flags[i] = read_byte(ctx, r);
+	count = read_int(ctx, r);
+	width_default = read_int(ctx, r);
+	widths = r->p;
+	if (count > 0)
+	{
+		need_bytes(ctx, r, (size_t)count * 4);
+		r->p += (size_t)count * 4;
+	}
+
+	fz_md5_init(&md5);
+	fz_md5_update(&md5, &kind_byte, 1);
+	fz_md5_update(&md5, start, r->p - start);
+	fz_md5_final(&md5, digest);
+
+	font = find_list_font(ctx, digest);
+	if (font)
+		return font;
+
+	if (kind == DL_FONT_BASE14)
+		buf = fz_new_buffer_from_shared_data(ctx, data, len);
+	else
+		buf = fz_new_buffer_from_copied_data(ctx, data, len);
+	fz_try(ctx)
+		font = fz_new_font_from_buffer(ctx, name, buf, index, use_glyph_bbox);
+	fz_always(ctx)
+		fz_drop_buffer(ctx, buf);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	fz_try(ctx)
+	{
+		font->bbox = bbox;
+		font->flags.is_mono = flags[0];
+		font->flags.is_serif = flags[1];
+		font->flags.is_bold = flags[2];
+		font->flags.is_italic = flags[3];
+		font->flags.ft_substitute = flags[4];
+		font->flags.ft_stretch = flags[5];
+		font->flags.fake_bold = flags[6];
+		font->flags.fake_italic = flags[7];
+		font->flags.force_hinting = flags[8];
+		font->width_default = width_default;
+		if (count > 0)
+		{
+			wr.p = widths;
+			wr.end = r->p;
+			font->width_table = fz_malloc_array(ctx, count, sizeof(short));
+			font->width_count = count;
+			for (i = 0; i < count; i++)
+				font->width_table[i] = read_int(ctx, &wr);
+		}
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_font(ctx, font);
+		fz_rethrow(ctx);
+	}
+
+	store_list_font(ctx, digest, font, kind == DL_FONT_BASE14 ? 0 : len);
+	return font;
+}
+
+static void
+read_font_def(fz_context *ctx, list_reader *r)
+{
+	fz_font *font;
+	int id, kind;
+
+	id = read_int(ctx, r);
+	kind = read_byte(ctx, r);
+	switch (kind)
+	{
+	case DL_FONT_TYPE3:
+		font = read_type3_font(ctx, r);
+		break;
+	case DL_FONT_BASE14:
+	case DL_FONT_EMBEDDED:
+		font = read_ft_font(ctx, r, kind);
+		break;
+	default:
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list font");
+	}
+	add_resource(ctx, r, id, DL_RES_FONT, font);
+}
+
+static void
+read_shade_def(fz_context *ctx, list_reader *r)
+{
+	fz_shade *shade;
+	int id, n, ncomp, count, i, k;
+
+	id = read_int(ctx, r);
+	shade = fz_malloc_struct(ctx, fz_shade);
+	FZ_INIT_STORABLE(shade, 1, fz_drop_shade_imp);
+	fz_try(ctx)
+	{
+		shade->type = read_int(ctx, r);
+		if (shade->type < FZ_FUNCTION_BASED || shade->type > FZ_MESH_TYPE7)
+		{
+			shade->type = FZ_LINEAR;
+			fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list shade");
+		}
+		read_rect(ctx, r, &shade->bbox);
+		shade->colorspace = fz_keep_colorspace(ctx, get_colorspace(ctx, r, read_int(ctx, r)));
+		if (!shade->colorspace)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list shade");
+		n = fz_colorspace_n(ctx, shade->colorspace);
+		read_matrix(ctx, r, &shade->matrix);
+
+		shade->use_background = read_byte(ctx, r);
+		if (shade->use_background)
+			for (k = 0; k < n; k++)
+				shade->background[k] = read_float(ctx, r);
+
+		shade->use_function = read_byte(ctx, r);
+		if (shade->use_function)
+			for (i = 0; i < 256; i++)
+				for (k = 0; k <= n; k++)
+					shade->function[i][k] = read_float(ctx, r);
+		ncomp = shade->use_function ? 1 : n;
+
+		switch (shade->type)
+		{
+		case FZ_FUNCTION_BASED:
+			read_matrix(ctx, r, &shade->u.f.matrix);
+			shade->u.f.xdivs = read_int(ctx, r);
+			shade->u.f.ydivs = read_int(ctx, r);
+			shade->u.f.domain[0][0] = read_float(ctx, r);
+			shade->u.f.domain[0][1] = read_float(ctx, r);
+			shade->u.f.domain[1][0] = read_float(ctx, r);
+			shade->u.f.domain[1][1] = read_float(ctx, r);
+			if (shade->u.f.xdivs < 1 || shade->u.f.xdivs > 1024 || shade->u.f.ydivs < 1 || shade->u.f.ydivs > 1024)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list shade");
+			count = (shade->u.f.xdivs + 1) * (shade->u.f.ydivs + 1) * n;
+			need_bytes(ctx, r, (size_t)count * 4);
+			shade->u.f.fn_vals = fz_malloc_array(ctx, count, sizeof(float));
+			for (i = 0; i < count; i++)
+				shade->u.f.fn_vals[i] = read_float(ctx, r);
+			break;
+		case FZ_LINEAR:
+		case FZ_RADIAL:
+			shade->u.l_or_r.extend[0] = read_int(ctx, r);
+			shade->u.l_or_r.extend[1] = read_int(ctx, r);
+			for (i = 0; i < 2; i++)
+				for (k = 0; k < 3; k++)
+					shade->u.l_or_r.coords[i][k] = read_float(ctx, r);
+			break;
+		default:
+			shade->u.m.vprow = read_int(ctx, r);
+			shade->u.m.bpflag = read_int(ctx, r);
+			shade->u.m.bpcoord = read_int(ctx, r);
+			shade->u.m.bpcomp = read_int(ctx, r);
+			shade->u.m.x0 = read_float(ctx, r);
+			shade->u.m.x1 = read_float(ctx, r);
+			shade->u.m.y0 = read_float(ctx, r);
+			shade->u.m.y1 = read_float(ctx, r);
+			for (k = 0; k < ncomp; k++)
+				shade->u.m.c0[k] = read_float(ctx, r);
+			for (k = 0; k < ncomp; k++)
+				shade->u.m.c1[k] = read_float(ctx, r);
+			break;
+		}
+
+		if (read_byte(ctx, r))
+			shade->buffer = read_compressed_buffer(ctx, r);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_shade(ctx, shade);
+		fz_rethrow(ctx);
+	}
+	add_resource(ctx, r, id, DL_RES_SHADE, shade);
+}
+
+static fz_path *
+read_path(fz_context *ctx, list_reader *r)
+{
+	fz_path *path = fz_new_path(ctx);
+	float x1, y1, x2, y2, x3, y3;
+	int op;
+
+	fz_try(ctx)
+	{
+		while ((op = read_byte(ctx, r)) != DL_PATH_END)
+		{
+			switch (op)
+			{
+			case DL_PATH_MOVE:
+				x1 = read_float(ctx, r);
+				y1 = read_float(ctx, r);
+				fz_moveto(ctx, path, x1, y1);
+				break;
+			case DL_PATH_LINE:
+				x1 = read_float(ctx, r);
+				y1 = read_float(ctx, r);
+				fz_lineto(ctx, path, x1, y1);
+				break;
+			case DL_PATH_CURVE:
+				x1 = read_float(ctx, r);
+				y1 = read_float(ctx, r);
+				x2 = read_float(ctx, r);
+				y2 = read_float(ctx, r);
+				x3 = read_float(ctx, r);
+				y3 = read_float(ctx, r);
+				fz_curveto(ctx, path, x1, y1, x2, y2, x3, y3);
+				break;
+			case DL_PATH_CLOSE:
+				fz_closepath(ctx, path);
+				break;
+			case DL_PATH_RECT:
+				x1 = read_float(ctx, r);
+				y1 = read_float(ctx, r);
+				x2 = read_float(ctx, r);
+				y2 = read_float(ctx, r);
+				fz_rectto(ctx, path, x1, y1, x2, y2);
+				break;
+			default:
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list path");
+			}
+		}
+		fz_trim_path(ctx, path);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_path(ctx, path);
+		fz_rethrow(ctx);
+	}
+	return path;
+}
+
+static fz_stroke_state *
+read_stroke(fz_context *ctx, list_reader *r)
+{
+	fz_stroke_state *stroke;
+	int start_cap, dash_cap, end_cap, linejoin, len, i;
+	float linewidth, miterlimit, dash_phase;
+
+	start_cap = read_byte(ctx, r);
+	dash_cap = read_byte(ctx, r);
+	end_cap = read_byte(ctx, r);
+	linejoin = read_byte(ctx, r);
+	linewidth = read_float(ctx, r);
+	miterlimit = read_float(ctx, r);
+	dash_phase = read_float(ctx, r);
+	len = read_int(ctx, r);
+	if (len < 0 || len > 4096)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list stroke state");
+	need_bytes(ctx, r, (size_t)len * 4);
+
+	stroke = fz_new_stroke_state_with_dash_len(ctx, len);
+	stroke->start_cap = start_cap;
+	stroke->dash_cap = dash_cap;
+	stroke->end_cap = end_cap;
+	stroke->linejoin = linejoin;
+	stroke->linewidth = linewidth;
+	stroke->miterlimit = miterlimit;
+	stroke->dash_phase = dash_phase;
+	stroke->dash_len = len;
+	for (i = 0; i < len; i++)
+		stroke->dash_list[i] = read_float(ctx, r);
+	return stroke;
+}
+
+static fz_text *
+read_text(fz_context *ctx, list_reader *r)
+{
+	fz_text *text = fz_new_text(ctx);
+	fz_font *font;
+	fz_matrix trm;
+	int spans, wmode, bidi_level, markup_dir, language, len, gid, ucs, i;
+
+	fz_try(ctx)
+	{
+		spans = read_int(ctx, r);
+		while (spans-- > 0)
+		{
+			font = get_resource(ctx, r, read_int(ctx, r), DL_RES_FONT);
+			read_matrix(ctx, r, &trm);
+			wmode = read_byte(ctx, r);
+			bidi_level = read_byte(ctx, r);
+			markup_dir = read_byte(ctx, r);
+			language = read_int(ctx, r);
+			len = read_int(ctx, r);
+			if (len < 0)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list text");
+			need_bytes(ctx, r, (size_t)len * 16);
+			for (i = 0; i < len; i++)
+			{
+				trm.e = read_float(ctx, r);
+				trm.f = read_float(ctx, r);
+				gid = read_int(ctx, r);
+				ucs = read_int(ctx, r);
+				fz_show_glyph(ctx, text, font, &trm, gid, ucs, wmode, bidi_level, markup_dir, language);
+			}
+		}
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_text(ctx, text);
+		fz_rethrow(ctx);
+	}
+	return text;
+}
+
+static void
+replay_records(fz_context *ctx, list_reader *r, fz_device *dev)
+{
+	fz_path *path = NULL;
+	fz_stroke_state *stroke = NULL;
+	fz_text *text = NULL;
+	fz_default_colorspaces *dcs = NULL;
+	fz_colorspace *cs;
+	fz_image *image;
+	fz_shade *shade;
+	fz_matrix ctm;
+	fz_rect rect, view;
+	const fz_rect *scissor;
+	fz_color_params params;
+	const fz_color_params *pp;
+	const float *color;
+	float colorbuf[FZ_MAX_COLORS];
+	float alpha, xstep, ystep;
+	int op, even_odd, luminosity, isolated, knockout, blendmode, set, clear, id;
+
+	fz_var(path);
+	fz_var(stroke);
+	fz_var(text);
+	fz_var(dcs);
+
+	fz_try(ctx)
+	{
+		while ((op = read_byte(ctx, r)) != DL_END)
+		{
+			switch (op)
+			{
+			case DL_DEF_COLORSPACE:
+				read_colorspace_def(ctx, r);
+				break;
+			case DL_DEF_FONT:
+				read_font_def(ctx, r);
+				break;
+			case DL_DEF_IMAGE:
+				read_image_def(ctx, r);
+				break;
+			case DL_DEF_SHADE:
+				read_shade_def(ctx, r);
+				break;
+
+			case DL_FILL_PATH:
+				path = read_path(ctx, r);
+				even_odd = read_byte(ctx, r);
+				read_matrix(ctx, r, &ctm);
+				color = read_color(ctx, r, &cs, colorbuf);
+				alpha = read_float(ctx, r);
+				pp = read_color_params(ctx, r, &params);
+				fz_fill_path(ctx, dev, path, even_odd, &ctm, cs, color, alpha, pp);
+				break;
+			case DL_STROKE_PATH:
+				path = read_path(ctx, r);
+				stroke = read_stroke(ctx, r);
+				read_matrix(ctx, r, &ctm);
+				color = read_color(ctx, r, &cs, colorbuf);
+				alpha = read_float(ctx, r);
+				pp = read_color_params(ctx, r, &params);
+				fz_stroke_path(ctx, dev, path, stroke, &ctm, cs, color, alpha, pp);
+				break;
+			case DL_CLIP_PATH:
+				path = read_path(ctx, r);
+				even_odd = read_byte(ctx, r);
+				read_matrix(ctx, r, &ctm);
+				scissor = read_opt_rect(ctx, r, &rect);
+				fz_clip_path(ctx, dev, path, even_odd, &ctm, scissor);
+				break;
+			case DL_CLIP_STROKE_PATH:
+				path = read_path(ctx, r);
+				stroke = read_stroke(ctx, r);
+				read_matrix(ctx, r, &ctm);
+				scissor = read_opt_rect(ctx, r, &rect);
+				fz_clip_stroke_path(ctx, dev, path, stroke, &ctm, scissor);
+				break;
+
+			case DL_FILL_TEXT:
+				text = read_text(ctx, r);
+				read_matrix(ctx, r, &ctm);
+				color = read_color(ctx, r, &cs, colorbuf);
+				alpha = read_float(ctx, r);
+				pp = read_color_params(ctx, r, &params);
+				fz_fill_text(ctx, dev, text, &ctm, cs, color, alpha, pp);
+				break;
+			case DL_STROKE_TEXT:
+				text = read_text(ctx, r);
+				stroke = read_stroke(ctx, r);
+				read_matrix(ctx, r, &ctm);
+				color = read_color(ctx, r, &cs, colorbuf);
+				alpha = read_float(ctx, r);
+				pp = read_color_params(ctx, r, &params);
+				fz_stroke_text(ctx, dev, text, stroke, &ctm, cs, color, alpha, pp);
+				break;
+			case DL_CLIP_TEXT:
+				text = read_text(ctx, r);
+				read_matrix(ctx, r, &ctm);
+				scissor = read_opt_rect(ctx, r, &rect);
+				fz_clip_text(ctx, dev, text, &ctm, scissor);
+				break;
+			case DL_CLIP_STROKE_TEXT:
+				text = read_text(ctx, r);
+				stroke = read_stroke(ctx, r);
+				read_matrix(ctx, r, &ctm);
+				scissor = read_opt_rect(ctx, r, &rect);
+				fz_clip_stroke_text(ctx, dev, text, stroke, &ctm, scissor);
+				break;
+			case DL_IGNORE_TEXT:
+				text = read_text(ctx, r);
+				read_matrix(ctx, r, &ctm);
+				fz_ignore_text(ctx, dev, text, &ctm);
+				break;
+
+			case DL_FILL_SHADE:
+				shade = get_resource(ctx, r, read_int(ctx, r), DL_RES_SHADE);
+				read_matrix(ctx, r, &ctm);
+				alpha = read_float(ctx, r);
+				pp = read_color_params(ctx, r, &params);
+				fz_fill_shade(ctx, dev, shade, &ctm, alpha, pp);
+				break;
+			case DL_FILL_IMAGE:
+				image = get_resource(ctx, r, read_int(ctx, r), DL_RES_IMAGE);
+				read_matrix(ctx, r, &ctm);
+				alpha = read_float(ctx, r);
+				pp = read_color_params(ctx, r, &params);
+				fz_fill_image(ctx, dev, image, &ctm, alpha, pp);
+				break;
+			case DL_FILL_IMAGE_MASK:
+				image = get_resource(ctx, r, read_int(ctx, r), DL_RES_IMAGE);
+				read_matrix(ctx, r, &ctm);
+				color = read_color(ctx, r, &cs, colorbuf);
+				alpha = read_float(ctx, r);
+				pp = read_color_params(ctx, r, &params);
+				fz_fill_image_mask(ctx, dev, image, &ctm, cs, color, alpha, pp);
+				break;
+			case DL_CLIP_IMAGE_MASK:
+				image = get_resource(ctx, r, read_int(ctx, r), DL_RES_IMAGE);
+				read_matrix(ctx, r, &ctm);
+				scissor = read_opt_rect(ctx, r, &rect);
+				fz_clip_image_mask(ctx, dev, image, &ctm, scissor);
+				break;
+
+			case DL_POP_CLIP:
+				fz_pop_clip(ctx, dev);
+				break;
+			case DL_BEGIN_MASK:
+				read_rect(ctx, r, &rect);
+				luminosity = read_byte(ctx, r);
+				color = read_color(ctx, r, &cs, colorbuf);
+				pp = read_color_params(ctx, r, &params);
+				fz_begin_mask(ctx, dev, &rect, luminosity, cs, color, pp);
+				break;
+			case DL_END_MASK:
+				fz_end_mask(ctx, dev);
+				break;
+			case DL_BEGIN_GROUP:
+				read_rect(ctx, r, &rect);
+				cs = get_colorspace(ctx, r, read_int(ctx, r));
+				isolated = read_byte(ctx, r);
+				knockout = read_byte(ctx, r);
+				blendmode = read_int(ctx, r);
+				alpha = read_float(ctx, r);
+				fz_begin_group(ctx, dev, &rect, cs, isolated, knockout, blendmode, alpha);
+				break;
+			case DL_END_GROUP:
+				fz_end_group(ctx, dev);
+				break;
+			case DL_BEGIN_TILE:
+				read_rect(ctx, r, &rect);
+				read_rect(ctx, r, &view);
+				xstep = read_float(ctx, r);
+				ystep = read_float(ctx, r);
+				read_matrix(ctx, r, &ctm);
+				id = read_int(ctx, r);
+				(void)fz_begin_tile_id(ctx, dev, &rect, &view, xstep, ystep, &ctm, id);
+				break;
+			case DL_END_TILE:
+				fz_end_tile(ctx, dev);
+				break;
+			case DL_RENDER_FLAGS:
+				set = read_int(ctx, r);
+				clear = read_int(ctx, r);
+				fz_render_flags(ctx, dev, set, clear);
+				break;
+			case DL_DEFAULT_COLORSPACES:
+				dcs = fz_new_default_colorspaces(ctx);
+				fz_set_default_gray(ctx, dcs, get_colorspace(ctx, r, read_int(ctx, r)));
+				fz_set_default_rgb(ctx, dcs, get_colorspace(ctx, r, read_int(ctx, r)));
+				fz_set_default_cmyk(ctx, dcs, get_colorspace(ctx, r, read_int(ctx, r)));
+				fz_set_default_output_intent(ctx, dcs, get_colorspace(ctx, r, read_int(ctx, r)));
+				fz_set_default_colorspaces(ctx, dev, dcs);
+				break;
+
+			default:
+				fz_throw(ctx, FZ_ERROR_GENERIC, "corrupt display list record");
+			}
+
+			fz_drop_path(ctx, path);
+			path = NULL;
+			fz_drop_stroke_state(ctx, stroke);
+			stroke = NULL;
+			fz_drop_text(ctx, text);
+			text = NULL;
+			fz_drop_default_colorspaces(ctx, dcs);
+			dcs = NULL;
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_path(ctx, path);
+		fz_drop_stroke_state(ctx, stroke);
+		fz_drop_text(ctx, text);
+		fz_drop_default_colorspaces(ctx, dcs);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+static fz_display_list *
+load_display_list(fz_context *ctx, const unsigned char *data, size_t len)
+{
+	list_reader r = { NULL, NULL, 0, 0, NULL, 0 };
+	fz_display_list *list = NULL;
+	fz_device *dev = NULL;
+	fz_rect mediabox;
+	int i;
+
+	fz_var(list);
+	fz_var(dev);
+
+	if (len < LIST_MAGIC_LEN || memcmp(data, LIST_MAGIC, LIST_MAGIC_LEN))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "not a serialised display list");
+	r.p = data + LIST_MAGIC_LEN;
+	r.end = data + len;
+
+	fz_try(ctx)
+	{
+		read_rect(ctx, &r, &mediabox);
+		list = fz_new_display_list(ctx, &mediabox);
+		dev = fz_new_list_device(ctx, list);
+		replay_records(ctx, &r, dev);
+		fz_close_device(ctx, dev);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_device(ctx, dev);
+		for (i = 0; i < r.len; i++)
+			drop_resource(ctx, r.res[i].type, r.res[i].obj);
+		fz_free(ctx, r.res);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_display_list(ctx, list);
+		fz_rethrow(ctx);
+	}
+
+	return list;
+}
+
+fz_display_list *
+fz_new_display_list_from_buffer(fz_context *ctx, fz_buffer *buf)
+{
+	return load_display_list(ctx, buf->data, buf->len);
+}
+
+fz_display_list *
+fz_load_display_list(fz_context *ctx, const char *filename)
+{
+	fz_display_list *list = NULL;
+#ifdef _WIN32
+	fz_buffer *buf = fz_read_file(ctx, filename);
+	fz_try(ctx)
+		list = load_display_list(ctx, buf->data, buf->len);
+	fz_always(ctx)
+		fz_drop_buffer(ctx, buf);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+#else
+	struct stat info;
+	void *map;
+	size_t len;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot open %s: %s", filename, strerror(errno));
+	if (fstat(fd, &info) < 0 || info.st_size <= 0)
+	{
+		close(fd);
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot stat %s", filename);
+	}
+	len = info.st_size;
+	map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot map %s: %s", filename, strerror(errno));
+
+	fz_try(ctx)
+		list = load_display_list(ctx, map, len);
+	fz_always(ctx)
+		munmap(map, len);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+#endif
+	return list;
+}
+
+/* Disk store */
+
+static int
+page_disk_digest(fz_context *ctx, fz_document *doc, int number, unsigned char digest[16])
+{
+	unsigned char fingerprint[16];
+	unsigned char buf[4];
+	fz_md5 md5;
+
+	if (!fz_has_disk_store(ctx) || !fz_document_fingerprint(ctx, doc, fingerprint))
+		return 0;
+
+	buf[0] = number;
+	buf[1] = number >> 8;
+	buf[2] = number >> 16;
+	buf[3] = number >> 24;
+
+	fz_md5_init(&md5);
+	fz_md5_update(&md5, (const unsigned char *)LIST_MAGIC, LIST_MAGIC_LEN);
+	fz_md5_update(&md5, fingerprint, 16);
+	fz_md5_update(&md5, buf, 4);
+	fz_md5_final(&md5, digest);
+	return 1;
+}
+
+static void *
+load_disk_list(fz_context *ctx, const unsigned char *data, size_t len, void *arg)
+{
+	return load_display_list(ctx, data, len);
+}
+
+fz_display_list *
+fz_load_display_list_from_disk_store(fz_context *ctx, fz_document *doc, int number)
+{
+	unsigned char digest[16];
+
+	if (!page_disk_digest(ctx, doc, number, digest))
+		return NULL;
+	return fz_load_from_disk_store(ctx, digest, load_disk_list, NULL);
+}
+
+void
+fz_save_display_list_to_disk_store(fz_context *ctx, fz_document *doc, int number, fz_display_list *list)
+{
+	unsigned char digest[16];
+	fz_buffer *buf = NULL;
+
+	if (!page_disk_digest(ctx, doc, number, digest))
+		return;
+
+	fz_var(buf);
+
+	fz_try(ctx)
+	{
+		buf = fz_serialize_display_list(ctx, list);
+		fz_save_to_disk_store(ctx, digest, buf);
+	}
+	fz_always(ctx)
+		fz_drop_buffer(ctx, buf);
+	fz_catch(ctx)
+		fz_warn(ctx, "cannot save display list to disk store: %s", fz_caught_message(ctx));
+}
+
+/* Document handler, so that saved lists can be opened like any document */
+
+typedef struct
+{
+	fz_document super;
+	fz_display_list *list;
+} list_document;
+
+typedef struct
+{
+	fz_page super;
+	fz_display_list *list;
+} list_page;
+
+static void
+list_drop_document(fz_context *ctx, fz_document *doc_)
+{
+	list_document *doc = (list_document *)doc_;
+	fz_drop_display_list(ctx, doc->list);
+}
+
+static int
+list_count_pages(fz_context *ctx, fz_document *doc_)
+{
+	return 1;
+}
+
+static fz_rect *
+list_bound_page(fz_context *ctx, fz_page *page_, fz_rect *bbox)
+{
+	list_page *page = (list_page *)page_;
+	return fz_bound_display_list(ctx, page->list, bbox);
+}
+
+static void
+list_run_page(fz_context *ctx, fz_page *page_, fz_device *dev, const fz_matrix *ctm, fz_cookie *cookie)
+{
+	list_page *page = (list_page *)page_;
+	fz_run_display_list(ctx, page->list, dev, ctm, &fz_infinite_rect, cookie);
+}
+
+static void
+list_drop_page(fz_context *ctx, fz_page *page_)
+{
+	list_page *page = (list_page *)page_;
+	fz_drop_display_list(ctx, page->list);
+}
+
+static fz_page *
+list_load_page(fz_context *ctx, fz_document *doc_, int number)
+{
+	list_document *doc = (list_document *)doc_;
+	list_page *page;
+
+	if (number != 0)
+		return NULL;
+
+	page = fz_new_derived_page(ctx, list_page);
+	page->super.bound_page = list_bound_page;
+	page->super.run_page_contents = list_run_page;
+	page->super.drop_page = list_drop_page;
+	page->list = fz_keep_display_list(ctx, doc->list);
+
+	return (fz_page *)page;
+}
+
+static int
+list_lookup_metadata(fz_context *ctx, fz_document *doc_, const char *key, char *buf, int size)
+{
+	if (!strcmp(key, "format"))
+		return (int)fz_strlcpy(buf, "Display list", size);
+	return -1;
+}
+
+static fz_document *
+list_new_document(fz_context *ctx, fz_display_list *list)
+{
+	list_document *doc;
+
+	fz_try(ctx)
+		doc = fz_new_derived_document(ctx, list_document);
+	fz_catch(ctx)
+	{
+		fz_drop_display_list(ctx, list);
+		fz_rethrow(ctx);
+	}
+
+	doc->super.drop_document = list_drop_document;
+	doc->super.count_pages = list_count_pages;
+	doc->super.load_page = list_load_page;
+	doc->super.lookup_metadata = list_lookup_metadata;
+	doc->list = list;
+
+	return (fz_document *)doc;
+}
+
+static fz_document *
+list_open_document(fz_context *ctx, const char *filename)
+{
+	return list_new_document(ctx, fz_load_display_list(ctx, filename));
+}
+
+static fz_document *
+list_open_document_with_stream(fz_context *ctx, fz_stream *stm)
+{
+	fz_display_list *list = NULL;
+	fz_buffer *buf;
+
+	buf = fz_read_all(ctx, stm, 0);
+	fz_try(ctx)
+		list = fz_new_display_list_from_buffer(ctx, buf);
+	fz_always(ctx)
+		fz_drop_buffer(ctx, buf);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return list_new_document(ctx, list);
+}
+
+static const char *list_extensions[] =
+{
+	"list",
+	NULL
+};
+
+static const char *list_mimetypes[] =
+{
+	"application/x-mupdf-display-list",
+	NULL
+};
+
+fz_document_handler list_document_handler =
+{
+	NULL,
+	list_open_document,
+	list_open_document_with_stream,
+	list_extensions,
+	list_mimetypes
+};
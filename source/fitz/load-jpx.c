@@ -1,5 +1,7 @@
 #include "mupdf/fitz.h"
 
+#include "fitz-imp.h"
+
 #include <assert.h>
 #include <string.h>
 
@@ -428,6 +430,22 @@ fz_load_jpx(fz_context *ctx, const unsigned char *data, size_t size, fz_colorspa
 	return jpx_read_image(ctx, &state, data, size, defcs, 0);
 }
 
+fz_pixmap *
+fz_load_jpx_subarea(fz_context *ctx, const unsigned char *data, size_t size, fz_colorspace *defcs, fz_irect *subarea, int *l2factor)
+{
+	fz_pixmap *pix = fz_load_jpx(ctx, data, size, defcs);
+
+	/* Always decodes the whole image at full resolution */
+	if (subarea)
+	{
+		subarea->x0 = 0;
+		subarea->y0 = 0;
+		subarea->x1 = pix->w;
+		subarea->y1 = pix->h;
+	}
+	return pix;
+}
+
 void
 fz_load_jpx_info(fz_context *ctx, const unsigned char *data, size_t size, int *wp, int *hp, int *xresp, int *yresp, fz_colorspace **cspacep)
 {
@@ -460,6 +478,11 @@ struct fz_jpxd_s
 	fz_colorspace *cs;
 	int xres;
 	int yres;
+
+	/* Requested on entry, and what was actually decoded on exit */
+	int reduce;
+	int use_area;
+	fz_irect area;
 };
 
 struct stream_block_s
@@ -475,81 +498,86 @@ struct stream_block_s
  *
  * In order to ensure that allocations throughout mupdf
  * are done consistently, we implement opj_malloc etc as
- * functions that call down to fz_malloc etc. These
- * require context variables, so we lock and unlock around
- * calls to openjpeg. Any attempt to call through
+ * functions that call down to the allocator of the context
+ * that holds FZ_LOCK_JPX. Any attempt to call through
  * without setting these will be detected.
  *
+ * The allocator is called directly under the alloc lock
+ * rather than through that context, as large images are
+ * decoded in bands from several threads at once, each with
+ * its own clone of the context.
+ *
  * It is therefore vital that any fz_lock/fz_unlock
  * handlers are shared between all the fz_contexts in
  * use at a time.
  */
 
-/* Potentially we can write different versions
- * of get_context and set_context for different
- * threading systems.
- */
-
-static fz_context *opj_secret = NULL;
-
-static void set_opj_context(fz_context *ctx)
-{
-	opj_secret = ctx;
-}
-
-static fz_context *get_opj_context(void)
-{
-	return opj_secret;
-}
+static const fz_alloc_context *opj_alloc = NULL;
+static const fz_locks_context *opj_locks = NULL;
 
 void opj_lock(fz_context *ctx)
 {
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	fz_lock(ctx, FZ_LOCK_JPX);
 
-	set_opj_context(ctx);
+	opj_alloc = ctx->alloc;
+	opj_locks = ctx->locks;
 }
 
 void opj_unlock(fz_context *ctx)
 {
-	set_opj_context(NULL);
+	opj_alloc = NULL;
+	opj_locks = NULL;
 
-	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	fz_unlock(ctx, FZ_LOCK_JPX);
 }
 
 void *opj_malloc(size_t size)
 {
-	fz_context *ctx = get_opj_context();
+	void *p;
 
-	assert(ctx != NULL);
+	assert(opj_alloc != NULL);
 
-	return fz_malloc_no_throw(ctx, size);
+	opj_locks->lock(opj_locks->user, FZ_LOCK_ALLOC);
+	p = opj_alloc->malloc(opj_alloc->user, size);
+	opj_locks->unlock(opj_locks->user, FZ_LOCK_ALLOC);
+	return p;
 }
 
 void *opj_calloc(size_t n, size_t size)
 {
-	fz_context *ctx = get_opj_context();
+	void *p;
 
-	assert(ctx != NULL);
+	assert(opj_alloc != NULL);
 
-	return fz_calloc_no_throw(ctx, n, size);
+	if (n == 0 || size == 0)
+		return NULL;
+	if (n > SIZE_MAX / size)
+		return NULL;
+	p = opj_malloc(n * size);
+	if (p)
+		memset(p, 0, n * size);
+	return p;
 }
 
 void *opj_realloc(void *ptr, size_t size)
 {
-	fz_context *ctx = get_opj_context();
+	void *p;
 
-	assert(ctx != NULL);
+	assert(opj_alloc != NULL);
 
-	return fz_resize_array_no_throw(ctx, ptr, 1, size);
+	opj_locks->lock(opj_locks->user, FZ_LOCK_ALLOC);
+	p = opj_alloc->realloc(opj_alloc->user, ptr, size);
+	opj_locks->unlock(opj_locks->user, FZ_LOCK_ALLOC);
+	return p;
 }
 
 void opj_free(void *ptr)
 {
-	fz_context *ctx = get_opj_context();
-
-	assert(ctx != NULL);
+	assert(opj_alloc != NULL);
 
-	fz_free(ctx, ptr);
+	opj_locks->lock(opj_locks->user, FZ_LOCK_ALLOC);
+	opj_alloc->free(opj_alloc->user, ptr);
+	opj_locks->unlock(opj_locks->user, FZ_LOCK_ALLOC);
 }
 
 void * opj_aligned_malloc(size_t size)
@@ -652,29 +680,30 @@ l2subfactor(fz_context *ctx, unsigned int max_w, unsigned int w)
 	return i;
 }
 
-static fz_pixmap *
-jpx_read_image(fz_context *ctx, fz_jpxd *state, const unsigned char *data, size_t size, fz_colorspace *defcs, int onlymeta)
+/*
+	Components must be at full resolution for us to ask for a
+	decode area or a reduced resolution; otherwise the component
+	sizes OpenJPEG gives back need not match our upsampling.
+*/
+static int
+jpx_can_subsample(opj_image_t *jpx)
+{
+	OPJ_UINT32 i;
+
+	for (i = 0; i < jpx->numcomps; i++)
+		if (jpx->comps[i].dx != 1 || jpx->comps[i].dy != 1)
+			return 0;
+	return 1;
+}
+
+/* Open a codestream and read its header. */
+static opj_codec_t *
+jpx_open(fz_context *ctx, stream_block *sb, const unsigned char *data, size_t size, int ignore_pclr, opj_stream_t **streamp, opj_image_t **jpxp)
 {
-	fz_pixmap *img = NULL;
 	opj_dparameters_t params;
 	opj_codec_t *codec;
-	opj_image_t *jpx;
 	opj_stream_t *stream;
-	unsigned char *p;
 	OPJ_CODEC_FORMAT format;
-	int a, n, w, h, depth, sgnd;
-	int x, y, k, v, stride;
-	stream_block sb;
-	unsigned int max_w, max_h;
-	int sub_w[FZ_MAX_COLORS];
-	int sub_h[FZ_MAX_COLORS];
-	int upsample_required = 0;
-	OPJ_UINT32 i;
-
-	fz_var(img);
-
-	if (size < 2)
-		fz_throw(ctx, FZ_ERROR_GENERIC, "not enough data to determine image format");
 
 	/* Check for SOC marker -- if found we have a bare J2K stream */
 	if (data[0] == 0xFF && data[1] == 0x4F)
@@ -683,7 +712,7 @@ jpx_read_image(fz_context *ctx, fz_jpxd *state, const unsigned char *data, size_
 		format = OPJ_CODEC_JP2;
 
 	opj_set_default_decoder_parameters(&params);
-	if (fz_colorspace_is_indexed(ctx, defcs))
+	if (ignore_pclr)
 		params.flags |= OPJ_DPARAMETERS_IGNORE_PCLR_CMAP_CDEF_FLAG;
 
 	codec = opj_create_decompress(format);
@@ -697,35 +726,390 @@ jpx_read_image(fz_context *ctx, fz_jpxd *state, const unsigned char *data, size_
 	}
 
 	stream = opj_stream_default_create(OPJ_TRUE);
-	sb.data = data;
-	sb.pos = 0;
-	sb.size = size;
+	sb->data = data;
+	sb->pos = 0;
+	sb->size = size;
 
 	opj_stream_set_read_function(stream, fz_opj_stream_read);
 	opj_stream_set_skip_function(stream, fz_opj_stream_skip);
 	opj_stream_set_seek_function(stream, fz_opj_stream_seek);
-	opj_stream_set_user_data(stream, &sb, NULL);
+	opj_stream_set_user_data(stream, sb, NULL);
 	/* Set the length to avoid an assert */
 	opj_stream_set_user_data_length(stream, size);
 
-	if (!opj_read_header(stream, codec, &jpx))
+	if (!opj_read_header(stream, codec, jpxp))
 	{
 		opj_stream_destroy(stream);
 		opj_destroy_codec(codec);
 		fz_throw(ctx, FZ_ERROR_GENERIC, "Failed to read JPX header");
 	}
 
-	if (!opj_decode(codec, stream, jpx))
+	*streamp = stream;
+	return codec;
+}
+
+static void
+jpx_full_size(opj_image_t *jpx, int *w, int *h)
+{
+	OPJ_UINT32 i;
+
+	*w = 0;
+	*h = 0;
+	for (i = 0; i < jpx->numcomps; i++)
+	{
+		if (*w < (int)jpx->comps[i].w)
+			*w = jpx->comps[i].w;
+		if (*h < (int)jpx->comps[i].h)
+			*h = jpx->comps[i].h;
+	}
+}
+
+/*
+	Decode the codestream, restricted to state->area (if use_area)
+	and reduced by 2^state->reduce. Both are updated to what was
+	actually used. Returns NULL if a restricted decode fails, so that
+	the caller can retry without restrictions.
+
+	If bands > 1, only the given horizontal band (of that many equal
+	bands) of the area is decoded.
+*/
+static opj_image_t *
+jpx_decode(fz_context *ctx, fz_jpxd *state, const unsigned char *data, size_t size, int ignore_pclr, int band, int bands)
+{
+	opj_codec_t *codec;
+	opj_image_t *jpx;
+	opj_stream_t *stream;
+	stream_block sb;
+	OPJ_UINT32 i;
+	int ok = 1;
+
+	codec = jpx_open(ctx, &sb, data, size, ignore_pclr, &stream, &jpx);
+
+	/* The full size of the image, whatever we decode. */
+	jpx_full_size(jpx, &state->width, &state->height);
+
+	if (!jpx_can_subsample(jpx))
+	{
+		state->reduce = 0;
+		state->use_area = 0;
+		if (bands > 1)
+			ok = 0;
+	}
+
+	/* The codestream limits how many resolution levels we can drop. */
+	if (state->reduce > 0)
+	{
+		opj_codestream_info_v2_t *info = opj_get_cstr_info(codec);
+		if (info)
+		{
+			for (i = 0; i < info->nbcomps; i++)
+				if (state->reduce > (int)info->m_default_tile_info.tccp_info[i].numresolutions - 1)
+					state->reduce = (int)info->m_default_tile_info.tccp_info[i].numresolutions - 1;
+			opj_destroy_cstr_info(&info);
+		}
+		else
+			state->reduce = 0;
+		if (state->reduce > 0 && !opj_set_decoded_resolution_factor(codec, state->reduce))
+			state->reduce = 0;
+	}
+
+	if (state->use_area)
+	{
+		fz_irect *r = &state->area;
+		int f = 1 << state->reduce;
+
+		r->x0 &= ~(f - 1);
+		r->y0 &= ~(f - 1);
+		r->x1 = (r->x1 + f - 1) & ~(f - 1);
+		r->y1 = (r->y1 + f - 1) & ~(f - 1);
+		if (r->x0 < 0)
+			r->x0 = 0;
+		if (r->y0 < 0)
+			r->y0 = 0;
+		if (r->x1 > state->width)
+			r->x1 = state->width;
+		if (r->y1 > state->height)
+			r->y1 = state->height;
+
+		if (r->x0 == 0 && r->y0 == 0 && r->x1 == state->width && r->y1 == state->height)
+			state->use_area = 0;
+		else if (r->x0 >= r->x1 || r->y0 >= r->y1)
+			state->use_area = 0;
+	}
+
+	if (ok && bands > 1)
+	{
+		/* Split the output rows evenly. Moving the top of the area
+		 * down by a multiple of f moves the output down by exactly
+		 * that many rows, whatever the image origin. */
+		fz_irect r;
+		int f = 1 << state->reduce;
+		int rows, y0, y1;
+
+		if (state->use_area)
+			r = state->area;
+		else
+		{
+			r.x0 = r.y0 = 0;
+			r.x1 = state->width;
+			r.y1 = state->height;
+		}
+		rows = (r.y1 - r.y0 + f - 1) / f;
+		y0 = r.y0 + (int)((int64_t)rows * band / bands) * f;
+		y1 = r.y0 + (int)((int64_t)rows * (band + 1) / bands) * f;
+		if (band == bands - 1 || y1 > r.y1)
+			y1 = r.y1;
+		if (y0 >= y1 || !opj_set_decode_area(codec, jpx,
+				jpx->x0 + r.x0, jpx->y0 + y0,
+				jpx->x0 + r.x1, jpx->y0 + y1))
+			ok = 0;
+	}
+	else if (state->use_area)
+	{
+		fz_irect *r = &state->area;
+		if (!opj_set_decode_area(codec, jpx,
+				jpx->x0 + r->x0, jpx->y0 + r->y0,
+				jpx->x0 + r->x1, jpx->y0 + r->y1))
+			state->use_area = 0;
+	}
+
+	if (!ok || !opj_decode(codec, stream, jpx))
 	{
 		opj_stream_destroy(stream);
 		opj_destroy_codec(codec);
 		opj_image_destroy(jpx);
+		if (bands > 1 || state->reduce || state->use_area)
+			return NULL;
 		fz_throw(ctx, FZ_ERROR_GENERIC, "Failed to decode JPX image");
 	}
 
 	opj_stream_destroy(stream);
 	opj_destroy_codec(codec);
 
+	return jpx;
+}
+
+/* Only split decoding into bands when the output is at least this many
+ * pixels, and give each band at least this many rows. */
+#define PARALLEL_JPX_MIN_SIZE (1<<20)
+#define PARALLEL_JPX_MIN_ROWS 64
+
+typedef struct
+{
+	const unsigned char *data;
+	size_t size;
+	int ignore_pclr;
+	int bands;
+	fz_context **ctx; /* one clone per band */
+	fz_jpxd *state;
+	opj_image_t **jpx;
+} jpx_decode_job;
+
+/*
+	Decode one band with the band's own context. OpenJPEG allocates
+	through the shared allocator under the alloc lock, so the bands
+	never use the calling thread's context.
+*/
+static void
+jpx_decode_band(void *job_, int band)
+{
+	jpx_decode_job *job = (jpx_decode_job *)job_;
+	fz_context *ctx = job->ctx[band];
+
+	fz_try(ctx)
+		job->jpx[band] = jpx_decode(ctx, &job->state[band], job->data, job->size, job->ignore_pclr, band, job->bands);
+	fz_catch(ctx)
+		job->jpx[band] = NULL;
+}
+
+/* Stack the bands into the first one. */
+static opj_image_t *
+jpx_join_bands(fz_context *ctx, opj_image_t **jpx, int bands)
+{
+	opj_image_t *img = jpx[0];
+	OPJ_UINT32 i;
+	size_t h;
+	int b;
+
+	for (b = 1; b < bands; b++)
+	{
+		if (jpx[b]->numcomps != img->numcomps)
+			return NULL;
+		for (i = 0; i < img->numcomps; i++)
+			if (jpx[b]->comps[i].w != img->comps[i].w ||
+				jpx[b]->comps[i].prec != img->comps[i].prec ||
+				jpx[b]->comps[i].alpha != img->comps[i].alpha ||
+				!jpx[b]->comps[i].data)
+				return NULL;
+	}
+
+	for (i = 0; i < img->numcomps; i++)
+	{
+		OPJ_INT32 *data, *p;
+
+		if (!img->comps[i].data)
+			return NULL;
+		h = 0;
+		for (b = 0; b < bands; b++)
+			h += jpx[b]->comps[i].h;
+		data = opj_image_data_alloc(sizeof(OPJ_INT32) * img->comps[i].w * h);
+		if (!data)
+			return NULL;
+		p = data;
+		for (b = 0; b < bands; b++)
+		{
+			size_t len = (size_t)jpx[b]->comps[i].w * jpx[b]->comps[i].h;
+			memcpy(p, jpx[b]->comps[i].data, sizeof(OPJ_INT32) * len);
+			p += len;
+		}
+		opj_image_data_free(img->comps[i].data);
+		img->comps[i].data = data;
+		img->comps[i].h = (OPJ_UINT32)h;
+	}
+
+	return img;
+}
+
+/*
+	Decode horizontal bands of a large image from several threads,
+	each with its own codec. Returns NULL if the image is too small
+	to be worth it, or if anything goes wrong, in which case the
+	caller decodes it in one go as usual.
+*/
+static opj_image_t *
+jpx_decode_parallel(fz_context *ctx, fz_jpxd *state, const unsigned char *data, size_t size, int ignore_pclr)
+{
+	jpx_decode_job job;
+	opj_codec_t *codec;
+	opj_stream_t *stream;
+	opj_image_t *jpx;
+	opj_image_t *result = NULL;
+	stream_block sb;
+	int w, h, can_subsample, bands, i;
+
+	codec = jpx_open(ctx, &sb, data, size, ignore_pclr, &stream, &jpx);
+	jpx_full_size(jpx, &w, &h);
+	can_subsample = jpx_can_subsample(jpx);
+	opj_stream_destroy(stream);
+	opj_destroy_codec(codec);
+	opj_image_destroy(jpx);
+
+	if (!can_subsample)
+		return NULL;
+	if (state->use_area)
+	{
+		w = state->area.x1 - state->area.x0;
+		h = state->area.y1 - state->area.y0;
+	}
+	w >>= state->reduce;
+	h >>= state->reduce;
+	if ((int64_t)w * h < PARALLEL_JPX_MIN_SIZE)
+		return NULL;
+	bands = fz_mini(ctx->tuning->parallel_threads, h / PARALLEL_JPX_MIN_ROWS);
+	if (bands <= 1)
+		return NULL;
+
+	job.data = data;
+	job.size = size;
+	job.ignore_pclr = ignore_pclr;
+	job.bands = bands;
+	job.ctx = fz_calloc(ctx, bands, sizeof *job.ctx);
+	job.state = NULL;
+	job.jpx = NULL;
+
+	fz_try(ctx)
+	{
+		job.state = fz_calloc(ctx, bands, sizeof *job.state);
+		job.jpx = fz_calloc(ctx, bands, sizeof *job.jpx);
+		for (i = 0; i < bands; i++)
+		{
+			job.state[i] = *state;
+			/* Cloning needs locking functions; without them stay single threaded. */
+			job.ctx[i] = fz_clone_context(ctx);
+			if (!job.ctx[i])
+				break;
+		}
+		if (i == bands)
+		{
+			ctx->tuning->parallel(ctx->tuning->parallel_arg, bands, jpx_decode_band, &job);
+			for (i = 0; i < bands; i++)
+				if (!job.jpx[i])
+					break;
+			if (i == bands)
+				result = jpx_join_bands(ctx, job.jpx, bands);
+			if (result)
+			{
+				*state = job.state[0];
+				job.jpx[0] = NULL;
+			}
+		}
+	}
+	fz_always(ctx)
+	{
+		for (i = 0; i < bands; i++)
+		{
+			if (job.jpx && job.jpx[i])
+				opj_image_destroy(job.jpx[i]);
+			fz_drop_context(job.ctx[i]);
+		}
+		fz_free(ctx, job.ctx);
+		fz_free(ctx, job.state);
+		fz_free(ctx, job.jpx);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return result;
+}
+
+static fz_pixmap *
+jpx_read_image(fz_context *ctx, fz_jpxd *state, const unsigned char *data, size_t size, fz_colorspace *defcs, int onlymeta)
+{
+	fz_pixmap *img = NULL;
+	opj_image_t *jpx;
+	unsigned char *p;
+	int a, n, w, h, depth, sgnd;
+	int x, y, k, v, stride;
+	unsigned int max_w, max_h;
+	int sub_w[FZ_MAX_COLORS];
+	int sub_h[FZ_MAX_COLORS];
+	int upsample_required = 0;
+	int ignore_pclr;
+	OPJ_UINT32 i;
+
+	fz_var(img);
+
+	if (size < 2)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "not enough data to determine image format");
+
+	ignore_pclr = fz_colorspace_is_indexed(ctx, defcs);
+
+	/* For the metadata we need the channel definitions, but only
+	 * the smallest sliver of the image data. */
+	if (onlymeta)
+	{
+		/* Clamped to the levels in the codestream, which can be up
+		 * to 32; 16 is plenty, and keeps 1 << reduce in range. */
+		state->reduce = 16;
+		state->use_area = 1;
+		state->area.x0 = 0;
+		state->area.y0 = 0;
+		state->area.x1 = 1;
+		state->area.y1 = 1;
+	}
+
+	jpx = NULL;
+	if (!onlymeta && ctx->tuning->parallel_threads > 1)
+		jpx = jpx_decode_parallel(ctx, state, data, size, ignore_pclr);
+	if (!jpx)
+		jpx = jpx_decode(ctx, state, data, size, ignore_pclr, 0, 1);
+	if (!jpx)
+	{
+		state->reduce = 0;
+		state->use_area = 0;
+		jpx = jpx_decode(ctx, state, data, size, ignore_pclr, 0, 1);
+	}
+
 	/* jpx should never be NULL here, but check anyway */
 	if (!jpx)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "opj_decode failed");
@@ -804,8 +1188,8 @@ jpx_read_image(fz_context *ctx, fz_jpxd *state, const unsigned char *data, size_
 			upsample_required = 1;
 	}
 
-	state->width = w = (int)max_w;
-	state->height = h = (int)max_h;
+	w = (int)max_w;
+	h = (int)max_h;
 	state->xres = 72; /* openjpeg does not read the JPEG 2000 resc box */
 	state->yres = 72; /* openjpeg does not read the JPEG 2000 resc box */
 
@@ -890,10 +1274,24 @@ jpx_read_image(fz_context *ctx, fz_jpxd *state, const unsigned char *data, size_
 
 fz_pixmap *
 fz_load_jpx(fz_context *ctx, const unsigned char *data, size_t size, fz_colorspace *defcs)
+{
+	return fz_load_jpx_subarea(ctx, data, size, defcs, NULL, NULL);
+}
+
+fz_pixmap *
+fz_load_jpx_subarea(fz_context *ctx, const unsigned char *data, size_t size, fz_colorspace *defcs, fz_irect *subarea, int *l2factor)
 {
 	fz_jpxd state = { 0 };
 	fz_pixmap *pix = NULL;
 
+	if (subarea)
+	{
+		state.use_area = 1;
+		state.area = *subarea;
+	}
+	if (l2factor)
+		state.reduce = *l2factor;
+
 	fz_try(ctx)
 	{
 		opj_lock(ctx);
@@ -904,6 +1302,18 @@ fz_load_jpx(fz_context *ctx, const unsigned char *data, size_t size, fz_colorspa
 	fz_catch(ctx)
 		fz_rethrow(ctx);
 
+	if (subarea && !state.use_area)
+	{
+		subarea->x0 = 0;
+		subarea->y0 = 0;
+		subarea->x1 = state.width;
+		subarea->y1 = state.height;
+	}
+	else if (subarea)
+		*subarea = state.area;
+	if (l2factor)
+		*l2factor -= state.reduce;
+
 	return pix;
 }
 
@@ -945,4 +1355,10 @@ fz_load_jpx_info(fz_context *ctx, unsigned char *data, size_t size, int *wp, int
 	fz_throw(ctx, FZ_ERROR_GENERIC, "JPX support disabled");
 }
 
+fz_pixmap *
+fz_load_jpx_subarea(fz_context *ctx, const unsigned char *data, size_t size, fz_colorspace *defcs, fz_irect *subarea, int *l2factor)
+{
+	fz_throw(ctx, FZ_ERROR_GENERIC, "JPX support disabled");
+}
+
 #endif
@@ -1,7 +1,14 @@
 #include "mupdf/fitz.h"
+#include "fitz-imp.h"
 
+#include <string.h>
+#include <stdlib.h>
 #include <zlib.h>
 
+#ifdef ARCH_X86_64
+#include <smmintrin.h>
+#endif
+
 static inline void big32(unsigned char *buf, unsigned int v)
 {
 	buf[0] = (v >> 24) & 0xff;
@@ -72,16 +79,85 @@ fz_write_pixmap_as_png(fz_context *ctx, fz_output *out, const fz_pixmap *pixmap)
 	}
 }
 
+/* Only deflate images in parallel when they are at least this big (in
+ * bytes of filtered data), and give each block at least this much. */
+#define PARALLEL_PNG_MIN_SIZE (1<<21)
+#define PARALLEL_PNG_MIN_BLOCK (1<<18)
+
+/* Deflate window size, and so the most history a block can use. */
+#define PNG_DICT_SIZE 32768
+
+typedef struct
+{
+	z_stream stream;
+	int inited;
+	size_t ofs, cap, len;
+	uLong adler;
+	int failed;
+} png_block;
+
 typedef struct png_band_writer_s
 {
 	fz_band_writer super;
+	int level;
+	int filter;
 	unsigned char *udata;
 	unsigned char *cdata;
 	uLong usize, csize;
 	z_stream stream;
 	int stream_ended;
+
+	/* Unpremultiplied rows of the current band, and the last row of
+	 * the previous one for the up, average and paeth filters. */
+	unsigned char *rdata;
+	unsigned char *prev;
+	int inva[256];
+
+	/* Parallel deflate */
+	int parallel;
+	int max_blocks;
+	png_block *blocks;
+	unsigned char *dict;
+	size_t dict_len;
+	uLong adler;
+	int started;
 } png_band_writer;
 
+fz_png_options *
+fz_parse_png_options(fz_context *ctx, fz_png_options *opts, const char *args)
+{
+	const char *val;
+
+	memset(opts, 0, sizeof *opts);
+	opts->compression = FZ_DEFLATE_DEFAULT;
+	opts->filter = FZ_PNG_FILTER_SUB;
+
+	if (fz_has_option(ctx, args, "compression", &val))
+	{
+		int i = atoi(val);
+		if (i < FZ_DEFLATE_NONE || i > FZ_DEFLATE_BEST)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "Unsupported PNG compression level %d (0 to 9)", i);
+		opts->compression = i;
+	}
+	if (fz_has_option(ctx, args, "filter", &val))
+	{
+		if (fz_option_eq(val, "none"))
+			opts->filter = FZ_PNG_FILTER_NONE;
+		else if (fz_option_eq(val, "sub"))
+			opts->filter = FZ_PNG_FILTER_SUB;
+		else if (fz_option_eq(val, "up"))
+			opts->filter = FZ_PNG_FILTER_UP;
+		else if (fz_option_eq(val, "average"))
+			opts->filter = FZ_PNG_FILTER_AVERAGE;
+		else if (fz_option_eq(val, "paeth"))
+			opts->filter = FZ_PNG_FILTER_PAETH;
+		else
+			fz_throw(ctx, FZ_ERROR_GENERIC, "Unsupported PNG filter %s (none, sub, up, average or paeth)", val);
+	}
+
+	return opts;
+}
+
 static void
 png_write_icc(fz_context *ctx, png_band_writer *writer, const fz_colorspace *cs)
 {
@@ -160,13 +236,359 @@ png_write_header(fz_context *ctx, fz_band_writer *writer_, const fz_colorspace *
 	png_write_icc(ctx, writer, cs);
 }
 
+static inline int paeth(int a, int b, int c)
+{
+	int pa = fz_absi(b - c);
+	int pb = fz_absi(a - c);
+	int pc = fz_absi(a + b - 2 * c);
+	if (pa <= pb && pa <= pc)
+		return a;
+	if (pb <= pc)
+		return b;
+	return c;
+}
+
+/* Filter bytes i0 to len-1 of row r (with p the row above) into dp. */
+static void
+png_filter_bytes(unsigned char *dp, const unsigned char *r, const unsigned char *p, int i0, int len, int n, int filter)
+{
+	int i;
+
+	switch (filter)
+	{
+	case FZ_PNG_FILTER_NONE:
+		memcpy(dp + i0, r + i0, len - i0);
+		break;
+	case FZ_PNG_FILTER_SUB:
+		for (i = i0; i < len; i++)
+			dp[i] = r[i] - (i < n ? 0 : r[i-n]);
+		break;
+	case FZ_PNG_FILTER_UP:
+		for (i = i0; i < len; i++)
+			dp[i] = r[i] - p[i];
+		break;
+	case FZ_PNG_FILTER_AVERAGE:
+		for (i = i0; i < len; i++)
+			dp[i] = r[i] - (((i < n ? 0 : r[i-n]) + p[i]) >> 1);
+		break;
+	case FZ_PNG_FILTER_PAETH:
+		for (i = i0; i < len; i++)
+			dp[i] = r[i] - (i < n ? p[i] : paeth(r[i-n], p[i], p[i-n]));
+		break;
+	}
+}
+
+#ifdef ARCH_X86_64
+
+/*
+	SSE4.1 row filters, selected at run time. They do the bytes that
+	have a pixel to their left 16 at a time, and leave the first pixel
+	and the tail of the row to the C code.
+*/
+
+#define SIMD_TARGET __attribute__((target("sse4.1")))
+
+static SIMD_TARGET __m128i
+paeth_sse41(__m128i a, __m128i b, __m128i c)
+{
+	__m128i bc = _mm_sub_epi16(b, c);
+	__m128i ac = _mm_sub_epi16(a, c);
+	__m128i pa = _mm_abs_epi16(bc);
+	__m128i pb = _mm_abs_epi16(ac);
+	__m128i pc = _mm_abs_epi16(_mm_add_epi16(bc, ac));
+	__m128i notb = _mm_cmpgt_epi16(pb, pc);
+	__m128i nota = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+	return _mm_blendv_epi8(a, _mm_blendv_epi8(b, c, notb), nota);
+}
+
+static SIMD_TARGET int
+png_filter_sse41(unsigned char *dp, const unsigned char *r, const unsigned char *p, int len, int n, int filter)
+{
+	const __m128i one = _mm_set1_epi8(1);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a, b, c, avg, lo, hi;
+	int i = n;
+
+	switch (filter)
+	{
+	case FZ_PNG_FILTER_SUB:
+		for (; i + 16 <= len; i += 16)
+		{
+			a = _mm_loadu_si128((const __m128i *)(r + i - n));
+			_mm_storeu_si128((__m128i *)(dp + i), _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(r + i)), a));
+		}
+		break;
+	case FZ_PNG_FILTER_UP:
+		for (; i + 16 <= len; i += 16)
+		{
+			b = _mm_loadu_si128((const __m128i *)(p + i));
+			_mm_storeu_si128((__m128i *)(dp + i), _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(r + i)), b));
+		}
+		break;
+	case FZ_PNG_FILTER_AVERAGE:
+		for (; i + 16 <= len; i += 16)
+		{
+			a = _mm_loadu_si128((const __m128i *)(r + i - n));
+			b = _mm_loadu_si128((const __m128i *)(p + i));
+			/* pavgb rounds up; take off the carry to round down */
+			avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+			_mm_storeu_si128((__m128i *)(dp + i), _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(r + i)), avg));
+		}
+		break;
+	case FZ_PNG_FILTER_PAETH:
+		for (; i + 16 <= len; i += 16)
+		{
+			a = _mm_loadu_si128((const __m128i *)(r + i - n));
+			b = _mm_loadu_si128((const __m128i *)(p + i));
+			c = _mm_loadu_si128((const __m128i *)(p + i - n));
+			lo = paeth_sse41(_mm_cvtepu8_epi16(a), _mm_cvtepu8_epi16(b), _mm_cvtepu8_epi16(c));
+			hi = paeth_sse41(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+			_mm_storeu_si128((__m128i *)(dp + i), _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(r + i)), _mm_packus_epi16(lo, hi)));
+		}
+		break;
+	}
+	return i;
+}
+
+#endif /* ARCH_X86_64 */
+
+/* Write filter byte and filtered row of len bytes. */
+static void
+png_filter_row(unsigned char *dp, const unsigned char *r, const unsigned char *p, int len, int n, int filter)
+{
+	*dp++ = filter;
+#ifdef ARCH_X86_64
+	if ((fz_cpu_features & FZ_CPU_SSE41) && filter != FZ_PNG_FILTER_NONE && len > n)
+	{
+		int i = png_filter_sse41(dp, r, p, len, n, filter);
+		png_filter_bytes(dp, r, p, 0, n, n, filter);
+		png_filter_bytes(dp, r, p, i, len, n, filter);
+		return;
+	}
+#endif
+	png_filter_bytes(dp, r, p, 0, len, n, filter);
+}
+
+static void
+png_unpremultiply_rows(png_band_writer *writer, const unsigned char *sp, int stride, int y0, int y1)
+{
+	int w = writer->super.w;
+	int n = writer->super.n;
+	unsigned char *dp = writer->rdata + (size_t)w * n * y0;
+	int x, y, k;
+
+	sp += (size_t)stride * y0;
+	stride -= w * n;
+	for (y = y0; y < y1; y++)
+	{
+		for (x = 0; x < w; x++)
+		{
+			int a = sp[n-1];
+			int inva = writer->inva[a];
+			for (k = 0; k < n-1; k++)
+				dp[k] = (sp[k] * inva + 128)>>8;
+			dp[k] = a;
+			sp += n;
+			dp += n;
+		}
+		sp += stride;
+	}
+}
+
+static void
+png_filter_rows(png_band_writer *writer, const unsigned char *rp, int rstride, int y0, int y1)
+{
+	int len = writer->super.w * writer->super.n;
+	int y;
+
+	for (y = y0; y < y1; y++)
+	{
+		const unsigned char *r = rp + (size_t)rstride * y;
+		const unsigned char *p = y ? r - rstride : writer->prev;
+		png_filter_row(writer->udata + (size_t)(len + 1) * y, r, p, len, writer->super.n, writer->filter);
+	}
+}
+
+/* Deflate rows y0 to y1 of the filtered band as a block of its own,
+ * primed with whatever data came before it. */
+static int
+png_deflate_block(png_band_writer *writer, png_block *block, int y0, int y1, int last)
+{
+	size_t rowlen = (size_t)writer->super.w * writer->super.n + 1;
+	unsigned char *data = writer->udata + rowlen * y0;
+	size_t len = rowlen * (y1 - y0);
+	z_stream *s = &block->stream;
+	int err;
+
+	if (deflateReset(s) != Z_OK)
+		return 1;
+	if (y0 > 0)
+	{
+		size_t n = fz_minz(rowlen * y0, PNG_DICT_SIZE);
+		err = deflateSetDictionary(s, data - n, (uInt)n);
+	}
+	else if (writer->dict_len > 0)
+		err = deflateSetDictionary(s, writer->dict, (uInt)writer->dict_len);
+	else
+		err = Z_OK;
+	if (err != Z_OK)
+		return 1;
+
+	s->next_in = data;
+	s->avail_in = (uInt)len;
+	s->next_out = writer->cdata + block->ofs;
+	s->avail_out = (uInt)block->cap;
+	err = deflate(s, last ? Z_FINISH : Z_SYNC_FLUSH);
+	if (err != (last ? Z_STREAM_END : Z_OK) || s->avail_in != 0 || s->avail_out == 0)
+		return 1;
+
+	block->len = s->next_out - (writer->cdata + block->ofs);
+	block->adler = adler32(adler32(0, NULL, 0), data, (uInt)len);
+	return 0;
+}
+
+typedef struct
+{
+	png_band_writer *writer;
+	const unsigned char *sp;
+	int stride;
+	int band_height;
+	int blocks;
+	int stage;
+	int finalband;
+} png_job;
+
+/* Stage 0 unpremultiplies a block of rows, stage 1 filters them and
+ * stage 2 deflates them. Filtering needs the unpremultiplied row above
+ * the block, and deflating uses the filtered data before the block as
+ * its dictionary, so each stage is run over all the blocks in turn. */
+static void
+png_band_block(void *job_, int b)
+{
+	png_job *job = (png_job *)job_;
+	png_band_writer *writer = job->writer;
+	int y0 = (int)((int64_t)job->band_height * b / job->blocks);
+	int y1 = (int)((int64_t)job->band_height * (b + 1) / job->blocks);
+
+	if (job->stage == 0)
+		png_unpremultiply_rows(writer, job->sp, job->stride, y0, y1);
+	else if (job->stage == 1)
+	{
+		if (writer->super.alpha)
+			png_filter_rows(writer, writer->rdata, writer->super.w * writer->super.n, y0, y1);
+		else
+			png_filter_rows(writer, job->sp, job->stride, y0, y1);
+	}
+	else
+		writer->blocks[b].failed = png_deflate_block(writer, &writer->blocks[b], y0, y1, job->finalband && b == job->blocks - 1);
+}
+
+/* Keep the last PNG_DICT_SIZE bytes of filtered data to prime the
+ * first block of the next band. */
+static void
+png_update_dict(png_band_writer *writer, size_t len)
+{
+	if (len >= PNG_DICT_SIZE)
+	{
+		memcpy(writer->dict, writer->udata + len - PNG_DICT_SIZE, PNG_DICT_SIZE);
+		writer->dict_len = PNG_DICT_SIZE;
+	}
+	else
+	{
+		size_t keep = fz_minz(writer->dict_len, PNG_DICT_SIZE - len);
+		memmove(writer->dict, writer->dict + writer->dict_len - keep, keep);
+		memcpy(writer->dict + keep, writer->udata, len);
+		writer->dict_len = keep + len;
+	}
+}
+
+static void
+png_write_band_parallel(fz_context *ctx, png_band_writer *writer, int stride, int band_height, const unsigned char *sp, int finalband)
+{
+	fz_output *out = writer->super.out;
+	size_t rowlen = (size_t)writer->super.w * writer->super.n + 1;
+	size_t len = rowlen * band_height;
+	size_t pos, need;
+	png_job job;
+	int b, blocks, y0, y1;
+
+	blocks = (int)fz_minz(writer->max_blocks, len / PARALLEL_PNG_MIN_BLOCK);
+	blocks = fz_clampi(blocks, 1, band_height);
+
+	/* Room for the zlib header, each block and the adler32 trailer */
+	need = 2;
+	for (b = 0; b < blocks; b++)
+	{
+		png_block *block = &writer->blocks[b];
+		y0 = (int)((int64_t)band_height * b / blocks);
+		y1 = (int)((int64_t)band_height * (b + 1) / blocks);
+		block->ofs = need;
+		block->cap = deflateBound(&block->stream, (uLong)(rowlen * (y1 - y0))) + 16;
+		block->failed = 0;
+		need += block->cap;
+	}
+	need += 4;
+	if (need > writer->csize)
+	{
+		writer->cdata = fz_resize_array(ctx, writer->cdata, need, 1);
+		writer->csize = (uLong)need;
+	}
+
+	job.writer = writer;
+	job.sp = sp;
+	job.stride = stride;
+	job.band_height = band_height;
+	job.blocks = blocks;
+	job.finalband = finalband;
+	for (job.stage = writer->super.alpha ? 0 : 1; job.stage < 3; job.stage++)
+	{
+		if (blocks == 1)
+			png_band_block(&job, 0);
+		else
+			ctx->tuning->parallel(ctx->tuning->parallel_arg, blocks, png_band_block, &job);
+	}
+
+	for (b = 0; b < blocks; b++)
+		if (writer->blocks[b].failed)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "compression error");
+
+	/* Gather the blocks up into one chunk */
+	pos = 0;
+	if (!writer->started)
+	{
+		int level = writer->level < 0 ? 6 : writer->level;
+		int flg = (level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6;
+		flg += 31 - (0x7800 + flg) % 31;
+		writer->cdata[0] = 0x78; /* deflate, 32K window */
+		writer->cdata[1] = flg;
+		writer->started = 1;
+		pos = 2;
+	}
+	for (b = 0; b < blocks; b++)
+	{
+		png_block *block = &writer->blocks[b];
+		y0 = (int)((int64_t)band_height * b / blocks);
+		y1 = (int)((int64_t)band_height * (b + 1) / blocks);
+		memmove(writer->cdata + pos, writer->cdata + block->ofs, block->len);
+		pos += block->len;
+		writer->adler = adler32_combine(writer->adler, block->adler, (z_off_t)(rowlen * (y1 - y0)));
+	}
+	if (finalband)
+	{
+		big32(writer->cdata + pos, (unsigned int)writer->adler);
+		pos += 4;
+	}
+	putchunk(ctx, out, "IDAT", writer->cdata, (int)pos);
+
+	png_update_dict(writer, len);
+}
+
 static void
 png_write_band(fz_context *ctx, fz_band_writer *writer_, int stride, int band_start, int band_height, const unsigned char *sp)
 {
 	png_band_writer *writer = (png_band_writer *)(void *)writer_;
 	fz_output *out = writer->super.out;
-	unsigned char *dp;
-	int y, x, k, err, finalband;
+	int err, finalband, i;
 	int w, h, n;
 
 	if (!out)
@@ -183,74 +605,70 @@ png_write_band(fz_context *ctx, fz_band_writer *writer_, int stride, int band_st
 	if (writer->udata == NULL)
 	{
 		writer->usize = (w * n + 1) * band_height;
-		/* Sadly the bound returned by compressBound is just for a
-		 * single usize chunk; if you compress a sequence of them
-		 * the buffering can result in you suddenly getting a block
-		 * larger than compressBound outputted in one go, even if you
-		 * take all the data out each time. */
-		writer->csize = compressBound(writer->usize);
 		writer->udata = fz_malloc(ctx, writer->usize);
-		writer->cdata = fz_malloc(ctx, writer->csize);
-		err = deflateInit(&writer->stream, Z_DEFAULT_COMPRESSION);
-		if (err != Z_OK)
-			fz_throw(ctx, FZ_ERROR_GENERIC, "compression error %d", err);
-	}
+		writer->prev = fz_calloc(ctx, w, n);
+		if (writer->super.alpha)
+		{
+			writer->rdata = fz_malloc(ctx, (size_t)w * n * band_height);
+			writer->inva[0] = 0;
+			for (i = 1; i < 256; i++)
+				writer->inva[i] = 256*255/i;
+		}
 
-	dp = writer->udata;
-	stride -= w*n;
-	if (writer->super.alpha)
-	{
-		/* Unpremultiply data */
-		for (y = 0; y < band_height; y++)
+		writer->parallel = ctx->tuning->parallel_threads > 1 && (int64_t)(w * n + 1) * h >= PARALLEL_PNG_MIN_SIZE;
+		if (writer->parallel)
 		{
-			*dp++ = 1; /* sub prediction filter */
-			for (x = 0; x < w; x++)
+			writer->max_blocks = ctx->tuning->parallel_threads;
+			writer->blocks = fz_calloc(ctx, writer->max_blocks, sizeof *writer->blocks);
+			writer->dict = fz_malloc(ctx, PNG_DICT_SIZE);
+			writer->adler = adler32(0, NULL, 0);
+			for (i = 0; i < writer->max_blocks; i++)
 			{
-				int prev[FZ_MAX_COLORS];
-				int a = sp[n-1];
-				int inva = a ? 256*255/a : 0;
-				int p;
-				for (k = 0; k < n-1; k++)
-				{
-					int v = (sp[k] * inva + 128)>>8;
-					p = x ? prev[k] : 0;
-					prev[k] = v;
-					v -= p;
-					dp[k] = v;
-				}
-				p = x ? prev[k] : 0;
-				prev[k] = a;
-				a -= p;
-				dp[k] = a;
-				sp += n;
-				dp += n;
+				/* Raw deflate; we write the zlib header and trailer ourselves */
+				err = deflateInit2(&writer->blocks[i].stream, writer->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+				if (err != Z_OK)
+					fz_throw(ctx, FZ_ERROR_GENERIC, "compression error %d", err);
+				writer->blocks[i].inited = 1;
 			}
-			sp += stride;
 		}
-	}
-	else
-	{
-		for (y = 0; y < band_height; y++)
+		else
 		{
-			*dp++ = 1; /* sub prediction filter */
-			for (x = 0; x < w; x++)
-			{
-				for (k = 0; k < n; k++)
-				{
-					if (x == 0)
-						dp[k] = sp[k];
-					else
-						dp[k] = sp[k] - sp[k-n];
-				}
-				sp += n;
-				dp += n;
-			}
-			sp += stride;
+			/* Sadly the bound returned by compressBound is just for a
+			 * single usize chunk; if you compress a sequence of them
+			 * the buffering can result in you suddenly getting a block
+			 * larger than compressBound outputted in one go, even if you
+			 * take all the data out each time. */
+			writer->csize = compressBound(writer->usize);
+			writer->cdata = fz_malloc(ctx, writer->csize);
+			err = deflateInit(&writer->stream, writer->level);
+			if (err != Z_OK)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "compression error %d", err);
 		}
 	}
 
+	if (writer->parallel)
+	{
+		png_write_band_parallel(ctx, writer, stride, band_height, sp, finalband);
+	}
+	else if (writer->super.alpha)
+	{
+		png_unpremultiply_rows(writer, sp, stride, 0, band_height);
+		png_filter_rows(writer, writer->rdata, w * n, 0, band_height);
+	}
+	else
+		png_filter_rows(writer, sp, stride, 0, band_height);
+
+	/* Remember the last row for the filters of the next band */
+	if (writer->super.alpha)
+		memcpy(writer->prev, writer->rdata + (size_t)w * n * (band_height - 1), w * n);
+	else
+		memcpy(writer->prev, sp + (size_t)stride * (band_height - 1), w * n);
+
+	if (writer->parallel)
+		return;
+
 	writer->stream.next_in = (Bytef*)writer->udata;
-	writer->stream.avail_in = (uInt)(dp - writer->udata);
+	writer->stream.avail_in = (uInt)((w * n + 1) * band_height);
 	do
 	{
 		writer->stream.next_out = writer->cdata;
@@ -264,8 +682,9 @@ png_write_band(fz_context *ctx, fz_band_writer *writer_, int stride, int band_st
 		}
 		else
 		{
+			/* Finishing may take more than one buffer full */
 			err = deflate(&writer->stream, Z_FINISH);
-			if (err != Z_STREAM_END)
+			if (err != Z_STREAM_END && !(err == Z_OK && writer->stream.avail_out == 0))
 				fz_throw(ctx, FZ_ERROR_GENERIC, "compression error %d", err);
 		}
 
@@ -283,10 +702,13 @@ png_write_trailer(fz_context *ctx, fz_band_writer *writer_)
 	unsigned char block[1];
 	int err;
 
-	writer->stream_ended = 1;
-	err = deflateEnd(&writer->stream);
-	if (err != Z_OK)
-		fz_throw(ctx, FZ_ERROR_GENERIC, "compression error %d", err);
+	if (!writer->parallel)
+	{
+		writer->stream_ended = 1;
+		err = deflateEnd(&writer->stream);
+		if (err != Z_OK)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "compression error %d", err);
+	}
 
 	putchunk(ctx, out, "IEND", block, 0);
 }
@@ -295,30 +717,55 @@ static void
 png_drop_band_writer(fz_context *ctx, fz_band_writer *writer_)
 {
 	png_band_writer *writer = (png_band_writer *)(void *)writer_;
+	int i;
 
-	if (!writer->stream_ended)
+	if (!writer->parallel && !writer->stream_ended)
 	{
 		int err = deflateEnd(&writer->stream);
 		if (err != Z_OK)
 			fz_warn(ctx, "ignoring compression error %d", err);
 	}
 
+	if (writer->blocks)
+	{
+		for (i = 0; i < writer->max_blocks; i++)
+			if (writer->blocks[i].inited)
+				deflateEnd(&writer->blocks[i].stream);
+		fz_free(ctx, writer->blocks);
+	}
+
+	fz_free(ctx, writer->dict);
+	fz_free(ctx, writer->prev);
+	fz_free(ctx, writer->rdata);
 	fz_free(ctx, writer->cdata);
 	fz_free(ctx, writer->udata);
 }
 
-fz_band_writer *fz_new_png_band_writer(fz_context *ctx, fz_output *out)
+fz_band_writer *fz_new_png_band_writer_with_options(fz_context *ctx, fz_output *out, const fz_png_options *options)
 {
-	png_band_writer *writer = fz_new_band_writer(ctx, png_band_writer, out);
+	png_band_writer *writer;
+
+	if (options && (options->filter < FZ_PNG_FILTER_NONE || options->filter > FZ_PNG_FILTER_PAETH))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "Unsupported PNG filter %d", options->filter);
+
+	writer = fz_new_band_writer(ctx, png_band_writer, out);
 
 	writer->super.header = png_write_header;
 	writer->super.band = png_write_band;
 	writer->super.trailer = png_write_trailer;
 	writer->super.drop = png_drop_band_writer;
 
+	writer->level = options ? options->compression : FZ_DEFLATE_DEFAULT;
+	writer->filter = options ? options->filter : FZ_PNG_FILTER_SUB;
+
 	return &writer->super;
 }
 
+fz_band_writer *fz_new_png_band_writer(fz_context *ctx, fz_output *out)
+{
+	return fz_new_png_band_writer_with_options(ctx, out, NULL);
+}
+
 /* We use an auxiliary function to do pixmap_as_png, as it can enable us to
  * drop pix early in the case where we have to convert, potentially saving
  * us having to have 2 copies of the pixmap and a buffer open at once. */
@@ -1186,12 +1186,12 @@ fz_transform_path(fz_context *ctx, fz_path *path, const fz_matrix *ctm)
 				break;
 			}
 		}
-		if (path->cmd_len + extra_cmd < path->cmd_cap)
+		if (path->cmd_len + extra_cmd > path->cmd_cap)
 		{
 			path->cmds = fz_resize_array(ctx, path->cmds, path->cmd_len + extra_cmd, sizeof(unsigned char));
 			path->cmd_cap = path->cmd_len + extra_cmd;
 		}
-		if (path->coord_len + extra_coord < path->coord_cap)
+		if (path->coord_len + extra_coord > path->coord_cap)
 		{
 			path->coords = fz_resize_array(ctx, path->coords, path->coord_len + extra_coord, sizeof(float));
 			path->coord_cap = path->coord_len + extra_coord;
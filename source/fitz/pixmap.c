@@ -894,7 +894,7 @@ fz_convert_pixmap(fz_context *ctx, fz_pixmap *pix, fz_colorspace *ds, fz_colorsp
 	fz_try(ctx)
 	{
 		fz_pixmap_converter *pc = fz_lookup_pixmap_converter(ctx, ds, pix->colorspace);
-		pc(ctx, cvt, pix, prf, default_cs, color_params, 1);
+		fz_run_pixmap_converter(ctx, pc, cvt, pix, prf, default_cs, color_params, 1);
 	}
 	fz_catch(ctx)
 	{
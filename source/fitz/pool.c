@@ -6,6 +6,7 @@ typedef struct fz_pool_node_s fz_pool_node;
 
 struct fz_pool_s
 {
+	size_t size;
 	fz_pool_node *head, *tail;
 	char *pos, *end;
 };
@@ -20,6 +21,7 @@ fz_pool *fz_new_pool(fz_context *ctx)
 {
 	fz_pool *pool = fz_malloc_struct(ctx, fz_pool);
 	fz_pool_node *node = fz_malloc_struct(ctx, fz_pool_node);
+	pool->size = sizeof *pool + sizeof *node;
 	pool->head = pool->tail = node;
 	pool->pos = node->mem;
 	pool->end = node->mem + sizeof node->mem;
@@ -36,6 +38,7 @@ void *fz_pool_alloc(fz_context *ctx, fz_pool *pool, size_t size)
 	if (pool->pos + size > pool->end)
 	{
 		fz_pool_node *node = fz_malloc_struct(ctx, fz_pool_node);
+		pool->size += sizeof *node;
 		pool->tail = pool->tail->next = node;
 		pool->pos = node->mem;
 		pool->end = node->mem + sizeof node->mem;
@@ -47,6 +50,11 @@ void *fz_pool_alloc(fz_context *ctx, fz_pool *pool, size_t size)
 	return ptr;
 }
 
+size_t fz_pool_size(fz_context *ctx, fz_pool *pool)
+{
+	return pool ? pool->size : 0;
+}
+
 char *fz_pool_strdup(fz_context *ctx, fz_pool *pool, const char *s)
 {
 	size_t n = strlen(s) + 1;
@@ -0,0 +1,441 @@
+#include "mupdf/fitz.h"
+#include "fitz-imp.h"
+
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#include <process.h>
+#include <sys/utime.h>
+#define getpid _getpid
+#define utime _utime
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef _MSC_VER
+#define stat _stat
+#endif
+
+/*
+	The disk store is a directory of files, one per entry, named by
+	the hex digest of the entry key. Each file starts with a magic
+	string and the digest again (so truncated or foreign files are
+	rejected) followed by the serialised object.
+
+	Files are written under a temporary name and renamed into place,
+	so several processes can share the directory without locking.
+	Reading an entry touches its modification time; when the
+	directory grows beyond its limit the least recently used files
+	are deleted until it is back to 3/4 of the limit.
+*/
+
+#define DISK_STORE_MAGIC "MuPDFds1"
+#define DISK_STORE_MAGIC_LEN 8
+#define DISK_STORE_HEADER_LEN (DISK_STORE_MAGIC_LEN + 16)
+#define DISK_STORE_SUFFIX ".fzs"
+
+/* The sizes are protected by the alloc lock. The path is only changed
+ * by fz_enable_disk_store and fz_disable_disk_store, which must not
+ * be called while other threads are using the store. */
+struct fz_disk_store_s
+{
+	int refs;
+	char *path;
+	size_t max;
+	size_t size;
+	int evicting;
+};
+
+void
+fz_new_disk_store_context(fz_context *ctx)
+{
+	ctx->disk_store = fz_malloc_struct(ctx, fz_disk_store);
+	ctx->disk_store->refs = 1;
+}
+
+fz_disk_store *
+fz_keep_disk_store_context(fz_context *ctx)
+{
+	if (!ctx || !ctx->disk_store)
+		return NULL;
+	return fz_keep_imp(ctx, ctx->disk_store, &ctx->disk_store->refs);
+}
+
+void
+fz_drop_disk_store_context(fz_context *ctx)
+{
+	if (!ctx || !ctx->disk_store)
+		return;
+	if (fz_drop_imp(ctx, ctx->disk_store, &ctx->disk_store->refs))
+	{
+		fz_free(ctx, ctx->disk_store->path);
+		fz_free(ctx, ctx->disk_store);
+	}
+	ctx->disk_store = NULL;
+}
+
+static void
+entry_name(char *buf, size_t size, const char *path, const unsigned char digest[16], const char *suffix)
+{
+	static const char hex[] = "0123456789abcdef";
+	char name[33];
+	int i;
+
+	for (i = 0; i < 16; i++)
+	{
+		name[i*2] = hex[digest[i] >> 4];
+		name[i*2+1] = hex[digest[i] & 15];
+	}
+	name[32] = 0;
+
+	fz_strlcpy(buf, path, size);
+	fz_strlcat(buf, "/", size);
+	fz_strlcat(buf, name, size);
+	fz_strlcat(buf, suffix, size);
+}
+
+typedef struct
+{
+	char name[64];
+	size_t size;
+	time_t mtime;
+} disk_entry;
+
+static int
+cmp_disk_entry(const void *a_, const void *b_)
+{
+	const disk_entry *a = a_;
+	const disk_entry *b = b_;
+
+	if (a->mtime < b->mtime)
+		return -1;
+	return a->mtime > b->mtime;
+}
+
+static int
+is_entry_name(const char *name)
+{
+	size_t len = strlen(name);
+
+	return len == 32 + strlen(DISK_STORE_SUFFIX) && !strcmp(name + 32, DISK_STORE_SUFFIX);
+}
+
+static void
+add_disk_entry(fz_context *ctx, disk_entry **entries, int *len, int *cap, const char *dir, const char *name, size_t *total)
+{
+	char path[2048];
+	struct stat info;
+
+	if (!is_entry_name(name))
+		return;
+	fz_strlcpy(path, dir, sizeof path);
+	fz_strlcat(path, "/", sizeof path);
+	fz_strlcat(path, name, sizeof path);
+	if (stat(path, &info) < 0)
+		return;
+
+	if (*len == *cap)
+	{
+		int newcap = *cap ? *cap * 2 : 256;
+		*entries = fz_resize_array(ctx, *entries, newcap, sizeof(disk_entry));
+		*cap = newcap;
+	}
+	fz_strlcpy((*entries)[*len].name, name, sizeof (*entries)[*len].name);
+	(*entries)[*len].size = info.st_size;
+	(*entries)[*len].mtime = info.st_mtime;
+	(*len)++;
+	*total += info.st_size;
+}
+
+/* List the entries in the directory, returning their total size. */
+static size_t
+list_disk_entries(fz_context *ctx, const char *dir, disk_entry **entries, int *len)
+{
+	size_t total = 0;
+	int cap = 0;
+
+	*entries = NULL;
+	*len = 0;
+
+	fz_try(ctx)
+	{
+#ifdef _WIN32
+		WIN32_FIND_DATAA data;
+		HANDLE h;
+		char pattern[2048];
+
+		fz_strlcpy(pattern, dir, sizeof pattern);
+		fz_strlcat(pattern, "/*" DISK_STORE_SUFFIX, sizeof pattern);
+		h = FindFirstFileA(pattern, &data);
+		if (h != INVALID_HANDLE_VALUE)
+		{
+			do
+				add_disk_entry(ctx, entries, len, &cap, dir, data.cFileName, &total);
+			while (FindNextFileA(h, &data));
+			FindClose(h);
+		}
+#else
+		DIR *d = opendir(dir);
+		struct dirent *de;
+
+		if (d)
+		{
+			fz_try(ctx)
+				while ((de = readdir(d)) != NULL)
+					add_disk_entry(ctx, entries, len, &cap, dir, de->d_name, &total);
+			fz_always(ctx)
+				closedir(d);
+			fz_catch(ctx)
+				fz_rethrow(ctx);
+		}
+#endif
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, *entries);
+		*entries = NULL;
+		*len = 0;
+		fz_rethrow(ctx);
+	}
+
+	return total;
+}
+
+/* Delete the least recently used entries until the directory is
+ * back to 3/4 of its limit. Only one thread evicts at a time. */
+static void
+evict_disk_store(fz_context *ctx, fz_disk_store *disk)
+{
+	disk_entry *entries = NULL;
+	int i, len = 0;
+	size_t total;
+	char path[2048];
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (disk->evicting || disk->size <= disk->max)
+	{
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		return;
+	}
+	disk->evicting = 1;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	fz_try(ctx)
+	{
+		total = list_disk_entries(ctx, disk->path, &entries, &len);
+		qsort(entries, len, sizeof *entries, cmp_disk_entry);
+		for (i = 0; i < len && total > disk->max / 4 * 3; i++)
+		{
+			fz_strlcpy(path, disk->path, sizeof path);
+			fz_strlcat(path, "/", sizeof path);
+			fz_strlcat(path, entries[i].name, sizeof path);
+			if (fz_remove(path) == 0)
+				total -= entries[i].size;
+		}
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		disk->size = total;
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, entries);
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		disk->evicting = 0;
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+	}
+	fz_catch(ctx)
+	{
+		fz_warn(ctx, "cannot evict from disk store: %s", fz_caught_message(ctx));
+	}
+}
+
+void
+fz_enable_disk_store(fz_context *ctx, const char *path, size_t max_size)
+{
+	fz_disk_store *disk = ctx->disk_store;
+	disk_entry *entries = NULL;
+	struct stat info;
+	int len;
+	size_t total;
+	char *copy, *old;
+
+#ifdef _WIN32
+	(void)_mkdir(path);
+#else
+	(void)mkdir(path, 0777);
+#endif
+	if (stat(path, &info) < 0)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot create disk store '%s': %s", path, strerror(errno));
+	if (!S_ISDIR(info.st_mode))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "'%s' is not a directory", path);
+
+	copy = fz_strdup(ctx, path);
+	fz_try(ctx)
+		total = list_disk_entries(ctx, path, &entries, &len);
+	fz_catch(ctx)
+	{
+		fz_free(ctx, copy);
+		fz_rethrow(ctx);
+	}
+	fz_free(ctx, entries);
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	old = disk->path;
+	disk->path = copy;
+	disk->max = max_size;
+	disk->size = total;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_free(ctx, old);
+
+	evict_disk_store(ctx, disk);
+}
+
+void
+fz_disable_disk_store(fz_context *ctx)
+{
+	fz_disk_store *disk = ctx->disk_store;
+	char *old;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	old = disk->path;
+	disk->path = NULL;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_free(ctx, old);
+}
+
+int
+fz_has_disk_store(fz_context *ctx)
+{
+	return ctx->disk_store && ctx->disk_store->path;
+}
+
+static void *
+load_mapped_entry(fz_context *ctx, const unsigned char *data, size_t len, const unsigned char digest[16], fz_disk_store_load_fn *load, void *arg)
+{
+	if (len < DISK_STORE_HEADER_LEN ||
+		memcmp(data, DISK_STORE_MAGIC, DISK_STORE_MAGIC_LEN) ||
+		memcmp(data + DISK_STORE_MAGIC_LEN, digest, 16))
+		return NULL;
+	return load(ctx, data + DISK_STORE_HEADER_LEN, len - DISK_STORE_HEADER_LEN, arg);
+}
+
+void *
+fz_load_from_disk_store(fz_context *ctx, const unsigned char digest[16], fz_disk_store_load_fn *load, void *arg)
+{
+	fz_disk_store *disk = ctx->disk_store;
+	char path[2048];
+	void *result = NULL;
+
+	if (!disk || !disk->path)
+		return NULL;
+	entry_name(path, sizeof path, disk->path, digest, DISK_STORE_SUFFIX);
+
+	fz_try(ctx)
+	{
+#ifdef _WIN32
+		fz_buffer *buf = NULL;
+		if (fz_file_exists(ctx, path))
+		{
+			buf = fz_read_file(ctx, path);
+			fz_try(ctx)
+				result = load_mapped_entry(ctx, buf->data, buf->len, digest, load, arg);
+			fz_always(ctx)
+				fz_drop_buffer(ctx, buf);
+			fz_catch(ctx)
+				fz_rethrow(ctx);
+		}
+#else
+		int fd = open(path, O_RDONLY);
+		if (fd >= 0)
+		{
+			struct stat info;
+			void *map = MAP_FAILED;
+			size_t len = 0;
+
+			if (fstat(fd, &info) == 0 && info.st_size > 0)
+			{
+				len = info.st_size;
+				map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+			}
+			close(fd);
+			if (map != MAP_FAILED)
+			{
+				fz_try(ctx)
+					result = load_mapped_entry(ctx, map, len, digest, load, arg);
+				fz_always(ctx)
+					munmap(map, len);
+				fz_catch(ctx)
+					fz_rethrow(ctx);
+			}
+		}
+#endif
+	}
+	fz_catch(ctx)
+	{
+		fz_warn(ctx, "cannot load from disk store: %s", fz_caught_message(ctx));
+		result = NULL;
+	}
+
+	/* Mark the entry as recently used */
+	if (result)
+		(void)utime(path, NULL);
+
+	return result;
+}
+
+void
+fz_save_to_disk_store(fz_context *ctx, const unsigned char digest[16], fz_buffer *buf)
+{
+	fz_disk_store *disk = ctx->disk_store;
+	char path[2048];
+	char tmp[2048];
+	char suffix[40];
+	FILE *file;
+	int ok;
+
+	if (!disk || !disk->path)
+		return;
+
+	entry_name(path, sizeof path, disk->path, digest, DISK_STORE_SUFFIX);
+	fz_snprintf(suffix, sizeof suffix, ".%d.%p.tmp", (int)getpid(), (void *)buf);
+	entry_name(tmp, sizeof tmp, disk->path, digest, suffix);
+
+	file = fz_fopen(tmp, "wb");
+	if (!file)
+		return;
+	ok = fwrite(DISK_STORE_MAGIC, 1, DISK_STORE_MAGIC_LEN, file) == DISK_STORE_MAGIC_LEN;
+	ok = ok && fwrite(digest, 1, 16, file) == 16;
+	ok = ok && fwrite(buf->data, 1, buf->len, file) == buf->len;
+	ok = (fclose(file) == 0) && ok;
+	if (ok)
+	{
+		/* Another process may have made the same entry first. */
+#ifdef _WIN32
+		if (fz_file_exists(ctx, path))
+			ok = 0;
+		else
+#endif
+		ok = rename(tmp, path) == 0;
+	}
+	if (!ok)
+	{
+		fz_remove(tmp);
+		return;
+	}
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	disk->size += DISK_STORE_HEADER_LEN + buf->len;
+	ok = disk->size > disk->max;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	if (ok)
+		evict_disk_store(ctx, disk);
+}
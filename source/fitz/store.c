@@ -2,6 +2,7 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 typedef struct fz_item_s fz_item;
 
@@ -14,8 +15,12 @@ struct fz_item_s
 	fz_item *prev;
 	fz_store *store;
 	const fz_store_type *type;
+	fz_store_type_stats *stats;
 };
 
+/* Items to look at when making space below the soft limit on storing. */
+#define FZ_STORE_TRIM_STEPS 4
+
 /* Every entry in fz_store is protected by the alloc lock */
 struct fz_store_s
 {
@@ -33,6 +38,16 @@ struct fz_store_s
 	/* We keep track of the size of the store, and keep it below max. */
 	size_t max;
 	size_t size;
+	int count;
+
+	/* Above soft_max (if set) we trim the store a little at a time. */
+	size_t soft_max;
+
+	/* Sizes and usage counts for each type of item. */
+	int ntypes;
+	const fz_store_type *type[FZ_STORE_MAX_TYPES];
+	fz_store_type_stats stats[FZ_STORE_MAX_TYPES];
+	fz_store_type_stats other_stats;
 
 	int defer_reap_count;
 	int needs_reaping;
@@ -56,7 +71,10 @@ fz_new_store_context(fz_context *ctx, size_t max)
 	store->head = NULL;
 	store->tail = NULL;
 	store->size = 0;
+	store->count = 0;
 	store->max = max;
+	store->soft_max = FZ_STORE_UNLIMITED;
+	store->ntypes = 0;
 	store->defer_reap_count = 0;
 	store->needs_reaping = 0;
 	ctx->store = store;
@@ -95,6 +113,49 @@ void *fz_keep_key_storable(fz_context *ctx, const fz_key_storable *sc)
 	return fz_keep_storable(ctx, &sc->storable);
 }
 
+/* Called with FZ_LOCK_ALLOC held. */
+static fz_store_type_stats *
+type_stats(fz_store *store, const fz_store_type *type)
+{
+	int i;
+
+	for (i = 0; i < store->ntypes; i++)
+		if (store->type[i] == type)
+			return &store->stats[i];
+	if (store->ntypes == FZ_STORE_MAX_TYPES)
+		return &store->other_stats;
+	store->type[i] = type;
+	store->ntypes++;
+	return &store->stats[i];
+}
+
+/*
+	Unlink an item from the LRU list, and stop counting it towards
+	the size of the store. Items can momentarily be in the hash table
+	without being in the list; we leave those (item->next == item)
+	alone.
+*/
+static void
+unlink_item(fz_store *store, fz_item *item)
+{
+	if (item->next == item)
+		return;
+
+	store->size -= item->size;
+	store->count--;
+	item->stats->size -= item->size;
+	item->stats->items--;
+
+	if (item->next)
+		item->next->prev = item->prev;
+	else
+		store->tail = item->prev;
+	if (item->prev)
+		item->prev->next = item->next;
+	else
+		store->head = item->next;
+}
+
 /*
 	Entered with FZ_LOCK_ALLOC held.
 	Drops FZ_LOCK_ALLOC.
@@ -125,17 +186,7 @@ do_reap(fz_context *ctx)
 			continue;
 
 		/* We have to drop it */
-		store->size -= item->size;
-
-		/* Unlink from the linked list */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
+		unlink_item(store, item);
 
 		/* Remove from the hash table */
 		if (item->type->make_hash_key)
@@ -269,16 +320,7 @@ evict(fz_context *ctx, fz_item *item)
 	fz_store *store = ctx->store;
 	int drop;
 
-	store->size -= item->size;
-	/* Unlink from the linked list */
-	if (item->next)
-		item->next->prev = item->prev;
-	else
-		store->tail = item->prev;
-	if (item->prev)
-		item->prev->next = item->next;
-	else
-		store->head = item->next;
+	unlink_item(store, item);
 
 	/* Drop a reference to the value (freeing if required) */
 	if (item->val->refs > 0)
@@ -303,74 +345,6 @@ evict(fz_context *ctx, fz_item *item)
 	fz_lock(ctx, FZ_LOCK_ALLOC);
 }
 
-static size_t
-ensure_space(fz_context *ctx, size_t tofree)
-{
-	fz_item *item, *prev;
-	size_t count;
-	fz_store *store = ctx->store;
-
-	fz_assert_lock_held(ctx, FZ_LOCK_ALLOC);
-
-	/* First check that we *can* free tofree; if not, we'd rather not
-	 * cache this. */
-	count = 0;
-	for (item = store->tail; item; item = item->prev)
-	{
-		if (item->val->refs == 1)
-		{
-			count += item->size;
-			if (count >= tofree)
-				break;
-		}
-	}
-
-	/* If we ran out of items to search, then we can never free enough */
-	if (item == NULL)
-	{
-		return 0;
-	}
-
-	/* Actually free the items */
-	count = 0;
-	for (item = store->tail; item; item = prev)
-	{
-		prev = item->prev;
-		if (item->val->refs == 1)
-		{
-			/* Free this item. Evict has to drop the lock to
-			 * manage that, which could cause prev to be removed
-			 * in the meantime. To avoid that we bump its reference
-			 * count here. This may cause another simultaneous
-			 * evict process to fail to make enough space as prev is
-			 * pinned - but that will only happen if we're near to
-			 * the limit anyway, and it will only cause something to
-			 * not be cached. */
-			count += item->size;
-			if (prev)
-			{
-				(void)Memento_takeRef(prev->val);
-				prev->val->refs++;
-			}
-			evict(ctx, item); /* Drops then retakes lock */
-			/* So the store has 1 reference to prev, as do we, so
-			 * no other evict process can have thrown prev away in
-			 * the meantime. So we are safe to just decrement its
-			 * reference count here. */
-			if (prev)
-			{
-				(void)Memento_dropRef(prev->val);
-				--prev->val->refs;
-			}
-
-			if (count >= tofree)
-				return count;
-		}
-	}
-
-	return count;
-}
-
 static void
 touch(fz_store *store, fz_item *item)
 {
@@ -396,6 +370,44 @@ touch(fz_store *store, fz_item *item)
 	item->prev = NULL;
 }
 
+/*
+	Evict unused items from the LRU end of the store until at least
+	tofree bytes have gone, looking at no more than steps items.
+
+	Items that are in use (held by someone other than the store) are
+	moved to the front of the list as we pass them; being in use they
+	are recently used anyway, and this way we don't look at them again
+	until everything else has been looked at. Each call therefore
+	costs in proportion to what it evicts, rather than to the number
+	of items in use at the LRU end.
+
+	Called with FZ_LOCK_ALLOC held; evict drops and retakes it, so we
+	always restart from the current tail.
+*/
+static size_t
+evict_lru(fz_context *ctx, size_t tofree, int steps)
+{
+	fz_store *store = ctx->store;
+	fz_item *item;
+	size_t count = 0;
+
+	fz_assert_lock_held(ctx, FZ_LOCK_ALLOC);
+
+	while (count < tofree && steps-- > 0 && (item = store->tail) != NULL)
+	{
+		if (item->val->refs == 1)
+		{
+			count += item->size;
+			item->stats->evictions++;
+			evict(ctx, item); /* Drops then retakes lock */
+		}
+		else
+			touch(store, item);
+	}
+
+	return count;
+}
+
 void *
 fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_store_type *type)
 {
@@ -442,6 +454,7 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_
 	item->next = item;
 	item->prev = item;
 	item->type = type;
+	item->stats = type_stats(store, type);
 
 	/* If we can index it fast, put it into the hash table. This serves
 	 * to check whether we have one there already. */
@@ -505,8 +518,8 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_
 			if (size <= store->max)
 				break;
 
-			/* ensure_space may drop, then retake the lock */
-			saved = ensure_space(ctx, size - store->max);
+			/* evict_lru may drop, then retake the lock */
+			saved = evict_lru(ctx, size - store->max, store->count);
 			size -= saved;
 			if (saved == 0)
 			{
@@ -524,7 +537,15 @@ fz_store_item(fz_context *ctx, void *key, void *val_, size_t itemsize, const fz_
 			}
 		}
 	}
+	/* Above the soft limit we only do a bounded amount of work here,
+	 * leaving the rest to later calls (or to fz_trim_store). */
+	if (store->soft_max != FZ_STORE_UNLIMITED && store->size + itemsize > store->soft_max)
+		(void)evict_lru(ctx, store->size + itemsize - store->soft_max, FZ_STORE_TRIM_STEPS);
+
 	store->size += itemsize;
+	store->count++;
+	item->stats->size += itemsize;
+	item->stats->items++;
 
 	/* Regardless of whether it's indexed, it goes into the linked list */
 	touch(store, item);
@@ -570,6 +591,7 @@ fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_store_
 	}
 	if (item)
 	{
+		item->stats->hits++;
 		/* LRU the block. This also serves to ensure that any item
 		 * picked up from the hash before it has made it into the
 		 * linked list does not get whipped out again due to the
@@ -584,6 +606,7 @@ fz_find_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_store_
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
 		return (void *)item->val;
 	}
+	type_stats(store, type)->misses++;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
 	return NULL;
@@ -621,20 +644,7 @@ fz_remove_item(fz_context *ctx, fz_store_drop_fn *drop, void *key, const fz_stor
 	}
 	if (item)
 	{
-		/* Momentarily things can be in the hash table without being
-		 * in the list. Don't attempt to unlink these. We indicate
-		 * such items by setting item->next == item. */
-		if (item->next != item)
-		{
-			if (item->next)
-				item->next->prev = item->prev;
-			else
-				store->tail = item->prev;
-			if (item->prev)
-				item->prev->next = item->next;
-			else
-				store->head = item->next;
-		}
+		unlink_item(store, item);
 		if (item->val->refs > 0)
 			(void)Memento_dropRef(item->val);
 		dodrop = (item->val->refs > 0 && --item->val->refs == 0);
@@ -709,6 +719,7 @@ fz_debug_store_locked(fz_context *ctx)
 	fz_item *item, *next;
 	char buf[256];
 	fz_store *store = ctx->store;
+	int i;
 
 	printf("-- resource store contents --\n");
 
@@ -734,6 +745,15 @@ fz_debug_store_locked(fz_context *ctx)
 
 	printf("-- resource store hash contents --\n");
 	fz_hash_for_each(ctx, store->hash, NULL, fz_debug_store_item);
+
+	printf("-- resource store statistics --\n");
+	for (i = 0; i < store->ntypes; i++)
+	{
+		fz_store_type_stats *st = &store->stats[i];
+		const char *name = store->type[i]->name;
+		printf("type[%s] items=" FZ_FMT_zu " size=" FZ_FMT_zu " hits=" FZ_FMT_zu " misses=" FZ_FMT_zu " evictions=" FZ_FMT_zu "\n",
+			name ? name : "?", st->items, st->size, st->hits, st->misses, st->evictions);
+	}
 	printf("-- end --\n");
 }
 
@@ -745,35 +765,11 @@ fz_debug_store(fz_context *ctx)
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 }
 
-/* This is now an n^2 algorithm - not ideal, but it'll only be bad if we are
- * actually managing to scavenge lots of blocks back. */
 static int
 scavenge(fz_context *ctx, size_t tofree)
 {
-	fz_store *store = ctx->store;
-	size_t count = 0;
-	fz_item *item, *prev;
-
-	/* Free the items */
-	for (item = store->tail; item; item = prev)
-	{
-		prev = item->prev;
-		if (item->val->refs == 1)
-		{
-			/* Free this item */
-			count += item->size;
-			evict(ctx, item); /* Drops then retakes lock */
-
-			if (count >= tofree)
-				break;
-
-			/* Have to restart search again, as prev may no longer
-			 * be valid due to release of lock in evict. */
-			prev = store->tail;
-		}
-	}
 	/* Success is managing to evict any blocks */
-	return count != 0;
+	return evict_lru(ctx, tofree, ctx->store->count) != 0;
 }
 
 int fz_store_scavenge(fz_context *ctx, size_t size, int *phase)
@@ -863,6 +859,139 @@ fz_shrink_store(fz_context *ctx, unsigned int percent)
 	return success;
 }
 
+void
+fz_set_store_soft_limit(fz_context *ctx, size_t soft_max)
+{
+	if (ctx->store == NULL)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	ctx->store->soft_max = soft_max;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+}
+
+int
+fz_trim_store(fz_context *ctx)
+{
+	fz_store *store = ctx->store;
+	int success;
+
+	if (store == NULL)
+		return 1;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (store->soft_max != FZ_STORE_UNLIMITED && store->size > store->soft_max)
+		(void)evict_lru(ctx, store->size - store->soft_max, store->count);
+	success = (store->soft_max == FZ_STORE_UNLIMITED || store->size <= store->soft_max);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return success;
+}
+
+int
+fz_lookup_store_type_stats(fz_context *ctx, const fz_store_type *type, fz_store_type_stats *stats)
+{
+	fz_store *store = ctx->store;
+	int i;
+
+	memset(stats, 0, sizeof *stats);
+	if (store == NULL)
+		return 0;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	for (i = 0; i < store->ntypes; i++)
+		if (store->type[i] == type)
+			break;
+	if (i < store->ntypes)
+		*stats = store->stats[i];
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return i < store->ntypes;
+}
+
+static void
+add_stats(fz_store_type_stats *total, const fz_store_type_stats *st)
+{
+	total->items += st->items;
+	total->size += st->size;
+	total->hits += st->hits;
+	total->misses += st->misses;
+	total->evictions += st->evictions;
+}
+
+void
+fz_get_store_stats(fz_context *ctx, fz_store_stats *stats)
+{
+	fz_store *store = ctx->store;
+	int i;
+
+	memset(stats, 0, sizeof *stats);
+	if (store == NULL)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	stats->max = store->max;
+	stats->size = store->size;
+	for (i = 0; i < store->ntypes; i++)
+	{
+		stats->type[i].name = store->type[i]->name ? store->type[i]->name : "unnamed";
+		stats->type[i].stats = store->stats[i];
+		add_stats(&stats->total, &store->stats[i]);
+	}
+	if (store->ntypes == FZ_STORE_MAX_TYPES)
+	{
+		stats->type[i].name = "other";
+		stats->type[i].stats = store->other_stats;
+		add_stats(&stats->total, &store->other_stats);
+		i++;
+	}
+	stats->count = i;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+}
+
+static void
+print_type_stats(fz_context *ctx, fz_output *out, const char *name, const fz_store_type_stats *st)
+{
+	size_t lookups = st->hits + st->misses;
+	size_t n = strlen(name);
+
+	/* Our printf does not pad strings, so do it by hand. */
+	fz_write_string(ctx, out, name);
+	while (n++ < 16)
+		fz_write_byte(ctx, out, ' ');
+	fz_write_printf(ctx, out, " %8zu %12zu %10zu %10zu", st->items, st->size, st->hits, st->misses);
+	if (lookups > 0)
+		fz_write_printf(ctx, out, " %5.1f%%", 100.0 * st->hits / lookups);
+	else
+		fz_write_string(ctx, out, "      -");
+	fz_write_printf(ctx, out, " %10zu\n", st->evictions);
+}
+
+void
+fz_print_store_stats(fz_context *ctx, fz_output *out)
+{
+	fz_store_stats *stats;
+	int i;
+
+	stats = fz_malloc_struct(ctx, fz_store_stats);
+	fz_try(ctx)
+	{
+		fz_get_store_stats(ctx, stats);
+		if (stats->max == FZ_STORE_UNLIMITED)
+			fz_write_printf(ctx, out, "store: %zu bytes used, unlimited\n", stats->size);
+		else
+			fz_write_printf(ctx, out, "store: %zu of %zu bytes used\n", stats->size, stats->max);
+		fz_write_string(ctx, out, "type                items        bytes       hits     misses  ratio  evictions\n");
+		for (i = 0; i < stats->count; i++)
+			print_type_stats(ctx, out, stats->type[i].name, &stats->type[i].stats);
+		print_type_stats(ctx, out, "total", &stats->total);
+	}
+	fz_always(ctx)
+		fz_free(ctx, stats);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
 void fz_filter_store(fz_context *ctx, fz_store_filter_fn *fn, void *arg, const fz_store_type *type)
 {
 	fz_store *store;
@@ -886,17 +1015,7 @@ void fz_filter_store(fz_context *ctx, fz_store_filter_fn *fn, void *arg, const f
 			continue;
 
 		/* We have to drop it */
-		store->size -= item->size;
-
-		/* Unlink from the linked list */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
+		unlink_item(store, item);
 
 		/* Remove from the hash table */
 		if (item->type->make_hash_key)
@@ -4,6 +4,13 @@
 #include <errno.h>
 #include <stdio.h>
 
+#if FZ_ENABLE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
 int
 fz_file_exists(fz_context *ctx, const char *path)
 {
@@ -122,10 +129,101 @@ fz_open_file_ptr(fz_context *ctx, FILE *file)
 	return stm;
 }
 
+#if FZ_ENABLE_MMAP
+
+/* Mapped file stream; the whole file is one buffer, as for fz_open_memory */
+
+typedef struct fz_mapped_stream_s
+{
+	void *map;
+	size_t len;
+} fz_mapped_stream;
+
+static int next_mapped(fz_context *ctx, fz_stream *stm, size_t n)
+{
+	return EOF;
+}
+
+static void seek_mapped(fz_context *ctx, fz_stream *stm, fz_off_t offset, int whence)
+{
+	fz_mapped_stream *state = stm->state;
+	if (whence == 1)
+		offset += stm->rp - (unsigned char *)state->map;
+	else if (whence == 2)
+		offset += (fz_off_t)state->len;
+	if (offset < 0)
+		offset = 0;
+	if (offset > (fz_off_t)state->len)
+		offset = (fz_off_t)state->len;
+	stm->rp = (unsigned char *)state->map + offset;
+}
+
+static void close_mapped(fz_context *ctx, void *state_)
+{
+	fz_mapped_stream *state = state_;
+	if (munmap(state->map, state->len) < 0)
+		fz_warn(ctx, "cannot unmap file: %s", strerror(errno));
+	fz_free(ctx, state);
+}
+
+/* Returns NULL if the file cannot be mapped, so the caller can fall back to stdio. */
+static fz_stream *
+fz_open_mapped_file(fz_context *ctx, const char *name)
+{
+	fz_mapped_stream *state;
+	fz_stream *stm;
+	struct stat info;
+	void *map;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode) || info.st_size <= 0 ||
+		(unsigned long long)info.st_size > (unsigned long long)(SIZE_MAX / 2))
+	{
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	fz_try(ctx)
+	{
+		state = fz_malloc_struct(ctx, fz_mapped_stream);
+	}
+	fz_catch(ctx)
+	{
+		munmap(map, (size_t)info.st_size);
+		fz_rethrow(ctx);
+	}
+	state->map = map;
+	state->len = (size_t)info.st_size;
+
+	stm = fz_new_stream(ctx, state, next_mapped, close_mapped);
+	stm->seek = seek_mapped;
+
+	stm->rp = map;
+	stm->wp = (unsigned char *)map + state->len;
+
+	stm->pos = (fz_off_t)state->len;
+
+	return stm;
+}
+
+#endif
+
 fz_stream *
 fz_open_file(fz_context *ctx, const char *name)
 {
 	FILE *f;
+#if FZ_ENABLE_MMAP
+	fz_stream *stm = fz_open_mapped_file(ctx, name);
+	if (stm)
+		return stm;
+#endif
 #if defined(_WIN32) || defined(_WIN64)
 	char *s = (char*)name;
 	wchar_t *wname, *d;
@@ -36,6 +36,10 @@ fz_new_display_list_from_page_number(fz_context *ctx, fz_document *doc, int numb
 	fz_page *page;
 	fz_display_list *list = NULL;
 
+	list = fz_load_display_list_from_disk_store(ctx, doc, number);
+	if (list)
+		return list;
+
 	page = fz_load_page(ctx, doc, number);
 	fz_try(ctx)
 		list = fz_new_display_list_from_page(ctx, page);
@@ -43,6 +47,7 @@ fz_new_display_list_from_page_number(fz_context *ctx, fz_document *doc, int numb
 		fz_drop_page(ctx, page);
 	fz_catch(ctx)
 		fz_rethrow(ctx);
+	fz_save_display_list_to_disk_store(ctx, doc, number, list);
 	return list;
 }
 
@@ -19,13 +19,30 @@ struct epub_document_s
 	epub_chapter *spine;
 	fz_outline *outline;
 	char *dc_title, *dc_creator;
+	float layout_w, layout_h, layout_em;
+	int laid_out_chapters, laid_out_pages; /* for estimating the rest */
+	int *chapter_start; /* first page of each chapter, and the page count */
+	int starts_dirty, outline_dirty;
+	int mark_bits; /* bookmark bits holding the flow index */
 };
 
+/*
+	Chapters are parsed and laid out when first needed, and the trees
+	are kept in the store so they can be evicted under memory pressure
+	and parsed again later. Until a chapter has been laid out its page
+	count is estimated from the chapters that have been, so page counts
+	and numbers settle as the document is read.
+
+	Laying out a chapter only marks the chapter start pages and the
+	outline as dirty; they are recomputed when next asked for, so
+	reading through a book does not cost a pass over the spine and the
+	outline for every chapter.
+*/
 struct epub_chapter_s
 {
 	char *path;
-	int start;
-	fz_html *html;
+	int number;
+	int pages; /* -1 until laid out at the current size */
 	epub_chapter *next;
 };
 
@@ -33,14 +50,140 @@ struct epub_page_s
 {
 	fz_page super;
 	epub_document *doc;
-	int number;
+	epub_chapter *ch;
+	int number; /* within the chapter */
 };
 
+/*
+	Bookmarks are the chapter number plus one above the index of a flow
+	node within the chapter. The chapter takes as few bits as the spine
+	needs and the index has the rest, short of the sign bit.
+*/
+#define EPUB_MARK_MASK(doc) (((fz_bookmark)1 << (doc)->mark_bits) - 1)
+
+static fz_html *
+epub_parse_chapter(fz_context *ctx, epub_document *doc, epub_chapter *ch)
+{
+	fz_archive *zip = doc->zip;
+	fz_buffer *buf;
+	fz_html *html = NULL;
+	char base_uri[2048];
+
+	fz_dirname(base_uri, ch->path, sizeof base_uri);
+
+	buf = fz_read_archive_entry(ctx, zip, ch->path);
+	fz_try(ctx)
+		html = fz_parse_html(ctx, doc->set, zip, base_uri, buf, fz_user_css(ctx));
+	fz_always(ctx)
+		fz_drop_buffer(ctx, buf);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return html;
+}
+
+static fz_html *
+epub_get_laid_out_html(fz_context *ctx, epub_document *doc, epub_chapter *ch)
+{
+	fz_html *html = fz_find_html(ctx, doc, ch->number);
+
+	if (!html)
+	{
+		html = epub_parse_chapter(ctx, doc, ch);
+		html = fz_store_html(ctx, html, doc, ch->number);
+	}
+
+	if (html->layout_w != doc->layout_w || html->layout_h != doc->layout_h || html->layout_em != doc->layout_em)
+	{
+		fz_try(ctx)
+			fz_layout_html(ctx, html, doc->layout_w, doc->layout_h, doc->layout_em);
+		fz_catch(ctx)
+		{
+			fz_drop_html(ctx, html);
+			fz_rethrow(ctx);
+		}
+	}
+
+	if (ch->pages < 0)
+	{
+		ch->pages = ceilf(html->root->h / html->page_h);
+		doc->laid_out_chapters++;
+		doc->laid_out_pages += ch->pages;
+		/* The estimates have changed */
+		doc->starts_dirty = 1;
+		doc->outline_dirty = 1;
+	}
+
+	return html;
+}
+
 static int
-epub_resolve_link(fz_context *ctx, fz_document *doc_, const char *dest, float *xp, float *yp)
+epub_chapter_pages(epub_document *doc, epub_chapter *ch)
+{
+	if (ch->pages >= 0)
+		return ch->pages;
+	if (doc->laid_out_chapters == 0)
+		return 1;
+	return (doc->laid_out_pages + doc->laid_out_chapters - 1) / doc->laid_out_chapters;
+}
+
+static int
+epub_chapter_start(epub_document *doc, epub_chapter *target)
+{
+	if (doc->starts_dirty)
+	{
+		epub_chapter *ch;
+		int count = 0;
+		for (ch = doc->spine; ch; ch = ch->next)
+		{
+			doc->chapter_start[ch->number] = count;
+			count += epub_chapter_pages(doc, ch);
+		}
+		doc->chapter_start[doc->count] = count;
+		doc->starts_dirty = 0;
+	}
+	return doc->chapter_start[target ? target->number : doc->count];
+}
+
+static epub_chapter *
+epub_find_page(fz_context *ctx, epub_document *doc, int n, int *page)
+{
+	epub_chapter *ch;
+	int count = 0;
+	int cn;
+
+	for (ch = doc->spine; ch; ch = ch->next)
+	{
+		cn = epub_chapter_pages(doc, ch);
+		if (n < count + cn && ch->pages < 0)
+		{
+			/* Replace the estimate with the real page count */
+			fz_drop_html(ctx, epub_get_laid_out_html(ctx, doc, ch));
+			cn = ch->pages;
+		}
+		if (n < count + cn)
+		{
+			*page = n - count;
+			return ch;
+		}
+		count += cn;
+	}
+
+	return NULL;
+}
+
+/*
+	Resolve a link to a page. A lazy resolve never lays out a chapter:
+	targets within chapters that are not yet laid out at the current
+	size resolve to the (estimated) start of the chapter.
+*/
+static int
+epub_resolve_link_imp(fz_context *ctx, epub_document *doc, const char *dest, float *xp, float *yp, int lazy)
 {
-	epub_document *doc = (epub_document*)doc_;
 	epub_chapter *ch;
+	fz_html *html;
+	float y;
+	int page;
 
 	const char *s = strchr(dest, '#');
 	size_t n = s ? s - dest : strlen(dest);
@@ -54,28 +197,54 @@ epub_resolve_link(fz_context *ctx, fz_document *doc_, const char *dest, float *x
 			if (s)
 			{
 				/* Search for a matching fragment */
-				float y = fz_find_html_target(ctx, ch->html, s+1);
-				if (y >= 0)
+				if (lazy)
 				{
-					int page = y / ch->html->page_h;
-					if (yp) *yp = y - page * ch->html->page_h;
-					return ch->start + page;
+					html = ch->pages < 0 ? NULL : fz_find_html(ctx, doc, ch->number);
+					if (html && (html->layout_w != doc->layout_w || html->layout_h != doc->layout_h || html->layout_em != doc->layout_em))
+					{
+						fz_drop_html(ctx, html);
+						html = NULL;
+					}
+					if (!html)
+						return epub_chapter_start(doc, ch);
 				}
+				else
+					html = epub_get_laid_out_html(ctx, doc, ch);
+				y = fz_find_html_target(ctx, html, s+1);
+				page = y / html->page_h;
+				if (y >= 0 && yp)
+					*yp = y - page * html->page_h;
+				fz_drop_html(ctx, html);
+				if (y >= 0)
+					return epub_chapter_start(doc, ch) + page;
 				return -1;
 			}
-			return ch->start;
+			return epub_chapter_start(doc, ch);
 		}
 	}
 
 	return -1;
 }
 
+static int
+epub_resolve_link(fz_context *ctx, fz_document *doc_, const char *dest, float *xp, float *yp)
+{
+	return epub_resolve_link_imp(ctx, (epub_document*)doc_, dest, xp, yp, 0);
+}
+
+/*
+	Outline pages are resolved lazily, and refreshed when the outline is
+	loaded if the page estimates have changed since: after a layout, or
+	once another chapter has been laid out. Loading the outline does not
+	lay out the whole book.
+*/
 static void
-epub_update_outline(fz_context *ctx, fz_document *doc, fz_outline *node)
+epub_update_outline(fz_context *ctx, epub_document *doc, fz_outline *node)
 {
 	while (node)
 	{
-		node->page = epub_resolve_link(ctx, doc, node->uri, &node->x, &node->y);
+		node->x = node->y = 0;
+		node->page = epub_resolve_link_imp(ctx, doc, node->uri, &node->x, &node->y, 1);
 		epub_update_outline(ctx, doc, node->down);
 		node = node->next;
 	}
@@ -86,27 +255,24 @@ epub_layout(fz_context *ctx, fz_document *doc_, float w, float h, float em)
 {
 	epub_document *doc = (epub_document*)doc_;
 	epub_chapter *ch;
-	int count = 0;
 
-	for (ch = doc->spine; ch; ch = ch->next)
-	{
-		ch->start = count;
-		fz_layout_html(ctx, ch->html, w, h, em);
-		count += ceilf(ch->html->root->h / ch->html->page_h);
-	}
+	doc->layout_w = w;
+	doc->layout_h = h;
+	doc->layout_em = em;
 
-	epub_update_outline(ctx, doc_, doc->outline);
+	for (ch = doc->spine; ch; ch = ch->next)
+		ch->pages = -1;
+	doc->laid_out_chapters = 0;
+	doc->laid_out_pages = 0;
+	doc->starts_dirty = 1;
+	doc->outline_dirty = 1;
 }
 
 static int
 epub_count_pages(fz_context *ctx, fz_document *doc_)
 {
 	epub_document *doc = (epub_document*)doc_;
-	epub_chapter *ch;
-	int count = 0;
-	for (ch = doc->spine; ch; ch = ch->next)
-		count += ceilf(ch->html->root->h / ch->html->page_h);
-	return count;
+	return epub_chapter_start(doc, NULL);
 }
 
 static void
@@ -118,26 +284,20 @@ static fz_rect *
 epub_bound_page(fz_context *ctx, fz_page *page_, fz_rect *bbox)
 {
 	epub_page *page = (epub_page*)page_;
-	epub_document *doc = page->doc;
-	epub_chapter *ch;
-	int n = page->number;
-	int count = 0;
+	fz_html *html;
 
-	for (ch = doc->spine; ch; ch = ch->next)
+	if (!page->ch)
 	{
-		int cn = ceilf(ch->html->root->h / ch->html->page_h);
-		if (n < count + cn)
-		{
-			bbox->x0 = 0;
-			bbox->y0 = 0;
-			bbox->x1 = ch->html->page_w + ch->html->page_margin[L] + ch->html->page_margin[R];
-			bbox->y1 = ch->html->page_h + ch->html->page_margin[T] + ch->html->page_margin[B];
-			return bbox;
-		}
-		count += cn;
+		*bbox = fz_unit_rect;
+		return bbox;
 	}
 
-	*bbox = fz_unit_rect;
+	html = epub_get_laid_out_html(ctx, page->doc, page->ch);
+	bbox->x0 = 0;
+	bbox->y0 = 0;
+	bbox->x1 = html->page_w + html->page_margin[L] + html->page_margin[R];
+	bbox->y1 = html->page_h + html->page_margin[T] + html->page_margin[B];
+	fz_drop_html(ctx, html);
 	return bbox;
 }
 
@@ -145,41 +305,39 @@ static void
 epub_run_page(fz_context *ctx, fz_page *page_, fz_device *dev, const fz_matrix *ctm, fz_cookie *cookie)
 {
 	epub_page *page = (epub_page*)page_;
-	epub_document *doc = page->doc;
-	epub_chapter *ch;
-	int n = page->number;
-	int count = 0;
+	fz_html *html;
 
-	for (ch = doc->spine; ch; ch = ch->next)
-	{
-		int cn = ceilf(ch->html->root->h / ch->html->page_h);
-		if (n < count + cn)
-		{
-			fz_draw_html(ctx, dev, ctm, ch->html, n-count);
-			break;
-		}
-		count += cn;
-	}
+	if (!page->ch)
+		return;
+
+	html = epub_get_laid_out_html(ctx, page->doc, page->ch);
+	fz_try(ctx)
+		fz_draw_html(ctx, dev, ctm, html, page->number);
+	fz_always(ctx)
+		fz_drop_html(ctx, html);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
 }
 
 static fz_link *
 epub_load_links(fz_context *ctx, fz_page *page_)
 {
 	epub_page *page = (epub_page*)page_;
-	epub_document *doc = page->doc;
-	epub_chapter *ch;
-	int n = page->number;
-	int count = 0;
+	fz_link *links = NULL;
+	fz_html *html;
 
-	for (ch = doc->spine; ch; ch = ch->next)
-	{
-		int cn = ceilf(ch->html->root->h / ch->html->page_h);
-		if (n < count + cn)
-			return fz_load_html_links(ctx, ch->html, n - count, ch->path, doc);
-		count += cn;
-	}
+	if (!page->ch)
+		return NULL;
 
-	return NULL;
+	html = epub_get_laid_out_html(ctx, page->doc, page->ch);
+	fz_try(ctx)
+		links = fz_load_html_links(ctx, html, page->number, page->ch->path, page->doc);
+	fz_always(ctx)
+		fz_drop_html(ctx, html);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return links;
 }
 
 static fz_bookmark
@@ -187,17 +345,20 @@ epub_make_bookmark(fz_context *ctx, fz_document *doc_, int n)
 {
 	epub_document *doc = (epub_document*)doc_;
 	epub_chapter *ch;
-	int count = 0;
+	fz_html *html;
+	int page, index;
 
-	for (ch = doc->spine; ch; ch = ch->next)
-	{
-		int cn = ceilf(ch->html->root->h / ch->html->page_h);
-		if (n < count + cn)
-			return fz_make_html_bookmark(ctx, ch->html, n - count);
-		count += cn;
-	}
+	ch = epub_find_page(ctx, doc, n, &page);
+	if (!ch)
+		return 0;
 
-	return 0;
+	html = epub_get_laid_out_html(ctx, doc, ch);
+	index = fz_html_bookmark_index(ctx, html, fz_make_html_bookmark(ctx, html, page));
+	fz_drop_html(ctx, html);
+	if (index < 0 || ((fz_bookmark)index >> doc->mark_bits) != 0)
+		return 0;
+
+	return ((fz_bookmark)(ch->number + 1) << doc->mark_bits) | index;
 }
 
 static int
@@ -205,12 +366,21 @@ epub_lookup_bookmark(fz_context *ctx, fz_document *doc_, fz_bookmark mark)
 {
 	epub_document *doc = (epub_document*)doc_;
 	epub_chapter *ch;
+	fz_html *html;
+	int number = (int)(mark >> doc->mark_bits) - 1;
+	int p;
 
 	for (ch = doc->spine; ch; ch = ch->next)
 	{
-		int p = fz_lookup_html_bookmark(ctx, ch->html, mark);
-		if (p != -1)
-			return ch->start + p;
+		if (ch->number == number)
+		{
+			html = epub_get_laid_out_html(ctx, doc, ch);
+			p = fz_lookup_html_bookmark(ctx, html, fz_html_bookmark_from_index(ctx, html, (int)(mark & EPUB_MARK_MASK(doc))));
+			fz_drop_html(ctx, html);
+			if (p != -1)
+				return epub_chapter_start(doc, ch) + p;
+			break;
+		}
 	}
 	return -1;
 }
@@ -219,13 +389,20 @@ static fz_page *
 epub_load_page(fz_context *ctx, fz_document *doc_, int number)
 {
 	epub_document *doc = (epub_document*)doc_;
-	epub_page *page = fz_new_derived_page(ctx, epub_page);
+	epub_page *page;
+	epub_chapter *ch;
+	int n = 0;
+
+	ch = epub_find_page(ctx, doc, number, &n);
+
+	page = fz_new_derived_page(ctx, epub_page);
 	page->super.bound_page = epub_bound_page;
 	page->super.run_page_contents = epub_run_page;
 	page->super.load_links = epub_load_links;
 	page->super.drop_page = epub_drop_page;
 	page->doc = doc;
-	page->number = number;
+	page->ch = ch;
+	page->number = n;
 	return (fz_page*)page;
 }
 
@@ -234,11 +411,11 @@ epub_drop_document(fz_context *ctx, fz_document *doc_)
 {
 	epub_document *doc = (epub_document*)doc_;
 	epub_chapter *ch, *next;
+	fz_purge_stored_html(ctx, doc);
 	ch = doc->spine;
 	while (ch)
 	{
 		next = ch->next;
-		fz_drop_html(ctx, ch->html);
 		fz_free(ctx, ch->path);
 		fz_free(ctx, ch);
 		ch = next;
@@ -246,6 +423,7 @@ epub_drop_document(fz_context *ctx, fz_document *doc_)
 	fz_drop_archive(ctx, doc->zip);
 	fz_drop_html_font_set(ctx, doc->set);
 	fz_drop_outline(ctx, doc->outline);
+	fz_free(ctx, doc->chapter_start);
 	fz_free(ctx, doc->dc_title);
 	fz_free(ctx, doc->dc_creator);
 }
@@ -283,38 +461,19 @@ path_from_idref(char *path, fz_xml *manifest, const char *base_uri, const char *
 }
 
 static epub_chapter *
-epub_parse_chapter(fz_context *ctx, epub_document *doc, const char *path)
+epub_new_chapter(fz_context *ctx, const char *path, int number)
 {
-	fz_archive *zip = doc->zip;
-	fz_buffer *buf = NULL;
-	epub_chapter *ch;
-	char base_uri[2048];
-
-	fz_dirname(base_uri, path, sizeof base_uri);
-
-	ch = fz_malloc_struct(ctx, epub_chapter);
-	ch->path = NULL;
-	ch->html = NULL;
-	ch->next = NULL;
-
-	fz_var(buf);
-
+	epub_chapter *ch = fz_malloc_struct(ctx, epub_chapter);
 	fz_try(ctx)
-	{
-		buf = fz_read_archive_entry(ctx, zip, path);
 		ch->path = fz_strdup(ctx, path);
-		ch->html = fz_parse_html(ctx, doc->set, zip, base_uri, buf, fz_user_css(ctx));
-	}
-	fz_always(ctx)
-		fz_drop_buffer(ctx, buf);
 	fz_catch(ctx)
 	{
-		fz_drop_html(ctx, ch->html);
-		fz_free(ctx, ch->path);
 		fz_free(ctx, ch);
 		fz_rethrow(ctx);
 	}
-
+	ch->number = number;
+	ch->pages = -1;
+	ch->next = NULL;
 	return ch;
 }
 
@@ -395,6 +554,7 @@ epub_parse_header(fz_context *ctx, epub_document *doc)
 	const char *version;
 	char ncx[2048], s[2048];
 	epub_chapter **tailp;
+	int n;
 
 	if (fz_has_archive_entry(ctx, zip, "META-INF/rights.xml"))
 		fz_throw(ctx, FZ_ERROR_GENERIC, "EPUB is locked by DRM");
@@ -457,11 +617,21 @@ epub_parse_header(fz_context *ctx, epub_document *doc)
 		{
 			if (path_from_idref(s, manifest, base_uri, fz_xml_att(itemref, "idref"), sizeof s))
 			{
-				*tailp = epub_parse_chapter(ctx, doc, s);
+				*tailp = epub_new_chapter(ctx, s, doc->count++);
 				tailp = &(*tailp)->next;
 			}
 			itemref = fz_xml_find_next(itemref, "itemref");
 		}
+
+		doc->chapter_start = fz_malloc_array(ctx, doc->count + 1, sizeof *doc->chapter_start);
+		doc->starts_dirty = 1;
+		doc->outline_dirty = 1;
+
+		/* Leave room for chapter numbers 1 to count and the sign bit */
+		n = 1;
+		while (n < (int)sizeof(fz_bookmark) * 8 - 2 && ((fz_bookmark)1 << n) <= doc->count)
+			n++;
+		doc->mark_bits = (int)sizeof(fz_bookmark) * 8 - 1 - n;
 	}
 	fz_always(ctx)
 	{
@@ -478,6 +648,11 @@ static fz_outline *
 epub_load_outline(fz_context *ctx, fz_document *doc_)
 {
 	epub_document *doc = (epub_document*)doc_;
+	if (doc->outline_dirty)
+	{
+		epub_update_outline(ctx, doc, doc->outline);
+		doc->outline_dirty = 0;
+	}
 	return fz_keep_outline(ctx, doc->outline);
 }
 
@@ -6,6 +6,7 @@ typedef struct fz_html_font_set_s fz_html_font_set;
 typedef struct fz_html_s fz_html;
 typedef struct fz_html_box_s fz_html_box;
 typedef struct fz_html_flow_s fz_html_flow;
+typedef struct fz_html_page_item_s fz_html_page_item;
 
 typedef struct fz_css_s fz_css;
 typedef struct fz_css_rule_s fz_css_rule;
@@ -188,10 +189,23 @@ enum
 
 struct fz_html_s
 {
+	fz_storable storable;
 	fz_pool *pool; /* pool allocator for this html tree */
+	float layout_w, layout_h, layout_em; /* arguments of the last fz_layout_html */
 	float page_w, page_h;
 	float page_margin[4];
 	fz_html_box *root;
+	int page_count; /* pages in the page index */
+	int *page_items; /* page_count + 1 offsets into items */
+	fz_html_page_item *items;
+};
+
+/* The block and flow boxes touching a page, in drawing order */
+struct fz_html_page_item_s
+{
+	fz_html_box *box;
+	fz_html_flow *first, *last; /* range of flow nodes on the page */
+	int drawn; /* box and all its ancestors are visible on the page */
 };
 
 struct fz_html_box_s
@@ -281,8 +295,15 @@ void fz_draw_html(fz_context *ctx, fz_device *dev, const fz_matrix *ctm, fz_html
 
 float fz_find_html_target(fz_context *ctx, fz_html *html, const char *id);
 fz_link *fz_load_html_links(fz_context *ctx, fz_html *html, int page, const char *base_uri, void *doc);
+fz_html *fz_keep_html(fz_context *ctx, fz_html *html);
 void fz_drop_html(fz_context *ctx, fz_html *html);
 fz_bookmark fz_make_html_bookmark(fz_context *ctx, fz_html *html, int page);
 int fz_lookup_html_bookmark(fz_context *ctx, fz_html *html, fz_bookmark mark);
+int fz_html_bookmark_index(fz_context *ctx, fz_html *html, fz_bookmark mark);
+fz_bookmark fz_html_bookmark_from_index(fz_context *ctx, fz_html *html, int index);
+
+fz_html *fz_store_html(fz_context *ctx, fz_html *html, void *doc, int chapter);
+fz_html *fz_find_html(fz_context *ctx, void *doc, int chapter);
+void fz_purge_stored_html(fz_context *ctx, void *doc);
 
 #endif
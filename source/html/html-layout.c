@@ -493,13 +493,23 @@ static void fz_drop_html_box(fz_context *ctx, fz_html_box *box)
 	}
 }
 
+static void fz_drop_html_imp(fz_context *ctx, fz_storable *stor)
+{
+	fz_html *html = (fz_html *)stor;
+	fz_drop_html_box(ctx, html->root);
+	fz_free(ctx, html->page_items);
+	fz_free(ctx, html->items);
+	fz_drop_pool(ctx, html->pool);
+}
+
+fz_html *fz_keep_html(fz_context *ctx, fz_html *html)
+{
+	return fz_keep_storable(ctx, &html->storable);
+}
+
 void fz_drop_html(fz_context *ctx, fz_html *html)
 {
-	if (html)
-	{
-		fz_drop_html_box(ctx, html->root);
-		fz_drop_pool(ctx, html->pool);
-	}
+	fz_drop_storable(ctx, &html->storable);
 }
 
 static fz_html_box *new_box(fz_context *ctx, fz_pool *pool, fz_bidi_direction markup_dir)
@@ -1484,9 +1494,9 @@ static float layout_block(fz_context *ctx, fz_html_box *box, fz_html_box *top, f
 	return vertical;
 }
 
-static void draw_flow_box(fz_context *ctx, fz_html_box *box, float page_top, float page_bot, fz_device *dev, const fz_matrix *ctm, hb_buffer_t *hb_buf)
+static void draw_flow_box(fz_context *ctx, fz_html_box *box, fz_html_flow *first, fz_html_flow *last, float page_top, float page_bot, fz_device *dev, const fz_matrix *ctm, hb_buffer_t *hb_buf)
 {
-	fz_html_flow *node;
+	fz_html_flow *node, *end = last->next;
 	fz_text *text;
 	fz_matrix trm;
 	float color[3];
@@ -1499,7 +1509,7 @@ static void draw_flow_box(fz_context *ctx, fz_html_box *box, float page_top, flo
 	prev_color[1] = 0;
 	prev_color[2] = 0;
 
-	for (node = box->flow_head; node; node = node->next)
+	for (node = first; node != end; node = node->next)
 	{
 		fz_css_style *style = &node->box->style;
 
@@ -1830,7 +1840,7 @@ static void draw_list_mark(fz_context *ctx, fz_html_box *box, float page_top, fl
 		fz_rethrow(ctx);
 }
 
-static void draw_block_box(fz_context *ctx, fz_html_box *box, float page_top, float page_bot, fz_device *dev, const fz_matrix *ctm, hb_buffer_t *hb_buf)
+static void draw_block_box(fz_context *ctx, fz_html_box *box, float page_top, float page_bot, fz_device *dev, const fz_matrix *ctm)
 {
 	float x0, y0, x1, y1;
 
@@ -1861,15 +1871,6 @@ static void draw_block_box(fz_context *ctx, fz_html_box *box, float page_top, fl
 		if (box->list_item)
 			draw_list_mark(ctx, box, page_top, page_bot, dev, ctm, box->list_item);
 	}
-
-	for (box = box->down; box; box = box->next)
-	{
-		switch (box->type)
-		{
-		case BOX_BLOCK: draw_block_box(ctx, box, page_top, page_bot, dev, ctm, hb_buf); break;
-		case BOX_FLOW: draw_flow_box(ctx, box, page_top, page_bot, dev, ctm, hb_buf); break;
-		}
-	}
 }
 
 void
@@ -1877,7 +1878,7 @@ fz_draw_html(fz_context *ctx, fz_device *dev, const fz_matrix *ctm, fz_html *htm
 {
 	fz_matrix local_ctm = *ctm;
 	hb_buffer_t *hb_buf = NULL;
-	fz_html_box *box;
+	fz_html_page_item *item, *end;
 	int unlocked = 0;
 	float page_top = page * html->page_h;
 	float page_bot = (page + 1) * html->page_h;
@@ -1899,8 +1900,20 @@ fz_draw_html(fz_context *ctx, fz_device *dev, const fz_matrix *ctm, fz_html *htm
 		fz_hb_unlock(ctx);
 		unlocked = 1;
 
-		for (box = html->root->down; box; box = box->next)
-			draw_block_box(ctx, box, page_top, page_bot, dev, &local_ctm, hb_buf);
+		if (page >= 0 && page < html->page_count)
+		{
+			item = html->items + html->page_items[page];
+			end = html->items + html->page_items[page + 1];
+			for (; item < end; item++)
+			{
+				if (!item->drawn)
+					continue;
+				if (item->box->type == BOX_BLOCK)
+					draw_block_box(ctx, item->box, page_top, page_bot, dev, &local_ctm);
+				else
+					draw_flow_box(ctx, item->box, item->first, item->last, page_top, page_bot, dev, &local_ctm, hb_buf);
+			}
+		}
 	}
 	fz_always(ctx)
 	{
@@ -1948,17 +1961,17 @@ static int has_same_href(fz_html_box *box, const char *old_href)
 	return 0;
 }
 
-static fz_link *load_link_flow(fz_context *ctx, fz_html_flow *flow, fz_link *head, int page, float page_h, const char *dir, const char *file)
+static fz_link *load_link_flow(fz_context *ctx, fz_html_flow *flow, fz_html_flow *last, fz_link *head, int page, float page_h, const char *dir, const char *file)
 {
 	fz_link *link;
-	fz_html_flow *next;
+	fz_html_flow *next, *stop = last->next;
 	char path[2048];
 	fz_rect bbox;
 	const char *dest;
 	const char *href;
 	float end;
 
-	while (flow)
+	while (flow != stop)
 	{
 		href = box_href(flow->box);
 		next = flow->next;
@@ -1966,7 +1979,7 @@ static fz_link *load_link_flow(fz_context *ctx, fz_html_flow *flow, fz_link *hea
 		{
 			/* Coalesce contiguous flow boxes into one link node */
 			end = flow->x + flow->w;
-			while (next &&
+			while (next != stop &&
 					next->y == flow->y &&
 					next->h == flow->h &&
 					has_same_href(next->box, href))
@@ -2018,27 +2031,22 @@ static fz_link *load_link_flow(fz_context *ctx, fz_html_flow *flow, fz_link *hea
 	return head;
 }
 
-static fz_link *load_link_box(fz_context *ctx, fz_html_box *box, fz_link *head, int page, float page_h, const char *dir, const char *file)
-{
-	while (box)
-	{
-		if (box->flow_head)
-			head = load_link_flow(ctx, box->flow_head, head, page, page_h, dir, file);
-		if (box->down)
-			head = load_link_box(ctx, box->down, head, page, page_h, dir, file);
-		box = box->next;
-	}
-	return head;
-}
-
 fz_link *
 fz_load_html_links(fz_context *ctx, fz_html *html, int page, const char *file, void *doc)
 {
-	fz_link *link, *head;
+	fz_link *link, *head = NULL;
+	fz_html_page_item *item, *end;
 	char dir[2048];
 	fz_dirname(dir, file, sizeof dir);
 
-	head = load_link_box(ctx, html->root, NULL, page, html->page_h, dir, file);
+	if (page >= 0 && page < html->page_count)
+	{
+		item = html->items + html->page_items[page];
+		end = html->items + html->page_items[page + 1];
+		for (; item < end; item++)
+			if (item->box->type == BOX_FLOW)
+				head = load_link_flow(ctx, item->first, item->last, head, page, html->page_h, dir, file);
+	}
 
 	for (link = head; link; link = link->next)
 	{
@@ -2200,6 +2208,72 @@ fz_lookup_html_bookmark(fz_context *ctx, fz_html *html, fz_bookmark mark)
 	return -1;
 }
 
+/*
+	Bookmarks made by fz_make_html_bookmark point into the box tree, so
+	they do not survive the tree being dropped and parsed again. These
+	convert them to and from the index of the flow node in document
+	order, which stays the same for every parse of the same source.
+*/
+
+static int
+flow_index(fz_html_box *box, fz_html_flow *mark, int *index)
+{
+	fz_html_flow *flow;
+	while (box)
+	{
+		if (box->type == BOX_FLOW)
+		{
+			for (flow = box->flow_head; flow; flow = flow->next, ++*index)
+				if (flow == mark)
+					return 1;
+		}
+		else if (flow_index(box->down, mark, index))
+			return 1;
+		box = box->next;
+	}
+	return 0;
+}
+
+static fz_html_flow *
+flow_at_index(fz_html_box *box, int *index)
+{
+	fz_html_flow *flow;
+	while (box)
+	{
+		if (box->type == BOX_FLOW)
+		{
+			for (flow = box->flow_head; flow; flow = flow->next)
+				if ((*index)-- == 0)
+					return flow;
+		}
+		else
+		{
+			flow = flow_at_index(box->down, index);
+			if (flow)
+				return flow;
+		}
+		box = box->next;
+	}
+	return NULL;
+}
+
+int
+fz_html_bookmark_index(fz_context *ctx, fz_html *html, fz_bookmark mark)
+{
+	int index = 0;
+	if (mark && flow_index(html->root, (fz_html_flow*)mark, &index))
+		return index;
+	return -1;
+}
+
+fz_bookmark
+fz_html_bookmark_from_index(fz_context *ctx, fz_html *html, int index)
+{
+	if (index < 0)
+		return 0;
+	return (fz_bookmark)flow_at_index(html->root, &index);
+}
+
 static char *concat_text(fz_context *ctx, fz_xml *root)
 {
 	fz_xml *node;
@@ -2454,6 +2528,199 @@ fz_debug_html(fz_context *ctx, fz_html_box *box)
 	fz_debug_html_box(ctx, box, 0);
 }
 
+/*
+	Index the block and flow boxes touching each page, so that drawing
+	and loading links for one page only visits the boxes on that page
+	rather than the whole tree. The visibility tests must match the
+	ones in draw_block_box, draw_flow_box and load_link_flow.
+*/
+
+struct page_index
+{
+	float page_h;
+	int fill;
+	int cap;
+	int *count;
+	fz_html_page_item *items;
+	fz_html_flow **scratch; /* first and last nodes of a flow box per page */
+	int scratch_cap;
+};
+
+static int block_on_page(fz_html_box *box, int p, float page_h)
+{
+	float y0 = box->y - box->padding[T];
+	float y1 = box->y + box->h + box->padding[B];
+	return !(y0 > (p + 1) * page_h || y1 < p * page_h);
+}
+
+static int flow_on_page(fz_html_flow *node, int p, float page_h)
+{
+	float page_top = p * page_h;
+	float page_bot = (p + 1) * page_h;
+	if ((int)(node->y / page_h) == p)
+		return 1;
+	if (node->type == FLOW_IMAGE)
+		return !(node->y >= page_bot || node->y + node->h <= page_top);
+	return !(node->y > page_bot || node->y < page_top);
+}
+
+static void index_item(fz_context *ctx, struct page_index *ix, int p, fz_html_box *box, fz_html_flow *first, fz_html_flow *last, int drawn)
+{
+	fz_html_page_item *item;
+
+	if (ix->fill)
+	{
+		item = &ix->items[ix->count[p]++];
+		item->box = box;
+		item->first = first;
+		item->last = last;
+		item->drawn = drawn;
+		return;
+	}
+
+	if (p >= ix->cap)
+	{
+		int cap = fz_maxi(p + 1, ix->cap * 2);
+		ix->count = fz_resize_array(ctx, ix->count, cap, sizeof *ix->count);
+		memset(ix->count + ix->cap, 0, (cap - ix->cap) * sizeof *ix->count);
+		ix->cap = cap;
+	}
+	ix->count[p]++;
+}
+
+static void index_flow_box(fz_context *ctx, struct page_index *ix, fz_html_box *box, int v0, int v1)
+{
+	float page_h = ix->page_h;
+	fz_html_flow *node;
+	int p, p0 = INT_MAX, p1 = -1, n;
+
+	for (node = box->flow_head; node; node = node->next)
+	{
+		for (p = fz_maxi(0, (int)floorf(node->y / page_h) - 1); p <= (int)floorf((node->y + node->h) / page_h) + 1; p++)
+		{
+			if (flow_on_page(node, p, page_h))
+			{
+				p0 = fz_mini(p0, p);
+				p1 = fz_maxi(p1, p);
+			}
+		}
+	}
+	if (p1 < 0)
+		return;
+
+	n = (p1 - p0 + 1) * 2;
+	if (n > ix->scratch_cap)
+	{
+		ix->scratch = fz_resize_array(ctx, ix->scratch, n, sizeof *ix->scratch);
+		ix->scratch_cap = n;
+	}
+	memset(ix->scratch, 0, n * sizeof *ix->scratch);
+
+	for (node = box->flow_head; node; node = node->next)
+	{
+		for (p = fz_maxi(p0, (int)floorf(node->y / page_h) - 1); p <= fz_mini(p1, (int)floorf((node->y + node->h) / page_h) + 1); p++)
+		{
+			if (flow_on_page(node, p, page_h))
+			{
+				if (!ix->scratch[(p - p0) * 2])
+					ix->scratch[(p - p0) * 2] = node;
+				ix->scratch[(p - p0) * 2 + 1] = node;
+			}
+		}
+	}
+
+	for (p = p0; p <= p1; p++)
+		if (ix->scratch[(p - p0) * 2])
+			index_item(ctx, ix, p, box, ix->scratch[(p - p0) * 2], ix->scratch[(p - p0) * 2 + 1], p >= v0 && p <= v1);
+}
+
+static void index_block_box(fz_context *ctx, struct page_index *ix, fz_html_box *box, int v0, int v1)
+{
+	float page_h = ix->page_h;
+	float y0 = box->y - box->padding[T];
+	float y1 = box->y + box->h + box->padding[B];
+	int p, b0 = INT_MAX, b1 = -1;
+
+	for (p = fz_maxi(0, (int)floorf(y0 / page_h) - 1); p <= (int)floorf(y1 / page_h) + 1; p++)
+	{
+		if (block_on_page(box, p, page_h))
+		{
+			b0 = fz_mini(b0, p);
+			b1 = fz_maxi(b1, p);
+		}
+	}
+
+	/* Children are only drawn on pages where all their ancestors are */
+	v0 = fz_maxi(v0, b0);
+	v1 = fz_mini(v1, b1);
+	for (p = v0; p <= v1; p++)
+		index_item(ctx, ix, p, box, NULL, NULL, 1);
+
+	for (box = box->down; box; box = box->next)
+	{
+		switch (box->type)
+		{
+		case BOX_BLOCK: index_block_box(ctx, ix, box, v0, v1); break;
+		case BOX_FLOW: index_flow_box(ctx, ix, box, v0, v1); break;
+		}
+	}
+}
+
+static void
+index_html_pages(fz_context *ctx, fz_html *html)
+{
+	struct page_index ix = { 0 };
+	fz_html_box *box;
+	int p, n, total;
+
+	fz_free(ctx, html->page_items);
+	fz_free(ctx, html->items);
+	html->page_items = NULL;
+	html->items = NULL;
+	html->page_count = 0;
+
+	if (html->page_h <= 0)
+		return;
+
+	ix.page_h = html->page_h;
+
+	fz_try(ctx)
+	{
+		for (box = html->root->down; box; box = box->next)
+			index_block_box(ctx, &ix, box, 0, INT_MAX);
+
+		html->page_items = fz_malloc_array(ctx, ix.cap + 1, sizeof *html->page_items);
+		for (total = 0, p = 0; p < ix.cap; p++)
+		{
+			n = ix.count[p];
+			html->page_items[p] = ix.count[p] = total;
+			total += n;
+		}
+		html->page_items[ix.cap] = total;
+		html->items = fz_malloc_array(ctx, total, sizeof *html->items);
+		html->page_count = ix.cap;
+
+		ix.items = html->items;
+		ix.fill = 1;
+		for (box = html->root->down; box; box = box->next)
+			index_block_box(ctx, &ix, box, 0, INT_MAX);
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, ix.count);
+		fz_free(ctx, ix.scratch);
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, html->page_items);
+		fz_free(ctx, html->items);
+		html->page_items = NULL;
+		html->items = NULL;
+		html->page_count = 0;
+		fz_rethrow(ctx);
+	}
+}
+
 void
 fz_layout_html(fz_context *ctx, fz_html *html, float w, float h, float em)
 {
@@ -2464,6 +2731,10 @@ fz_layout_html(fz_context *ctx, fz_html *html, float w, float h, float em)
 	fz_var(hb_buf);
 	fz_var(unlocked);
 
+	html->layout_w = w;
+	html->layout_h = h;
+	html->layout_em = em;
+
 	html->page_margin[T] = fz_from_css_number(html->root->style.margin[T], em, em, 0);
 	html->page_margin[B] = fz_from_css_number(html->root->style.margin[B], em, em, 0);
 	html->page_margin[L] = fz_from_css_number(html->root->style.margin[L], em, em, 0);
@@ -2489,6 +2760,8 @@ fz_layout_html(fz_context *ctx, fz_html *html, float w, float h, float em)
 			layout_block(ctx, box->down, box, html->page_h, 0, hb_buf);
 			box->h = box->down->h;
 		}
+
+		index_html_pages(ctx, html);
 	}
 	fz_always(ctx)
 	{
@@ -2734,7 +3007,12 @@ fz_parse_html(fz_context *ctx, fz_html_font_set *set, fz_archive *zip, const cha
 	{
 		g.pool = fz_new_pool(ctx);
 		html = fz_pool_alloc(ctx, g.pool, sizeof *html);
+		FZ_INIT_STORABLE(html, 1, fz_drop_html_imp);
 		html->pool = g.pool;
+		html->layout_w = html->layout_h = html->layout_em = 0;
+		html->page_count = 0;
+		html->page_items = NULL;
+		html->items = NULL;
 		html->root = new_box(ctx, g.pool, DEFAULT_DIR);
 
 		match.up = NULL;
@@ -2761,3 +3039,128 @@ fz_parse_html(fz_context *ctx, fz_html_font_set *set, fz_archive *zip, const cha
 
 	return html;
 }
+
+/*
+	Parsed and laid out html trees can be kept in the store, keyed on
+	the document they belong to and their position within it, so that
+	documents made up of many html files (EPUB) need only keep the ones
+	in use in memory. The document pointer is not referenced; documents
+	must call fz_purge_stored_html before they are dropped.
+*/
+
+typedef struct fz_html_key_s fz_html_key;
+
+struct fz_html_key_s
+{
+	int refs;
+	void *doc;
+	int chapter;
+};
+
+static int
+fz_make_hash_html_key(fz_context *ctx, fz_store_hash *hash, void *key_)
+{
+	fz_html_key *key = (fz_html_key *)key_;
+	hash->u.pi.ptr = key->doc;
+	hash->u.pi.i = key->chapter;
+	return 1;
+}
+
+static void *
+fz_keep_html_key(fz_context *ctx, void *key_)
+{
+	fz_html_key *key = (fz_html_key *)key_;
+	return fz_keep_imp(ctx, key, &key->refs);
+}
+
+static void
+fz_drop_html_key(fz_context *ctx, void *key_)
+{
+	fz_html_key *key = (fz_html_key *)key_;
+	if (fz_drop_imp(ctx, key, &key->refs))
+		fz_free(ctx, key);
+}
+
+static int
+fz_cmp_html_key(fz_context *ctx, void *k0_, void *k1_)
+{
+	fz_html_key *k0 = (fz_html_key *)k0_;
+	fz_html_key *k1 = (fz_html_key *)k1_;
+	return k0->doc == k1->doc && k0->chapter == k1->chapter;
+}
+
+static void
+fz_format_html_key(fz_context *ctx, char *s, int n, void *key_)
+{
+	fz_html_key *key = (fz_html_key *)key_;
+	fz_snprintf(s, n, "(html doc=%p chapter=%d)", key->doc, key->chapter);
+}
+
+static const fz_store_type fz_html_store_type =
+{
+	fz_make_hash_html_key,
+	fz_keep_html_key,
+	fz_drop_html_key,
+	fz_cmp_html_key,
+	fz_format_html_key,
+	NULL,
+	"html"
+};
+
+fz_html *
+fz_store_html(fz_context *ctx, fz_html *html, void *doc, int chapter)
+{
+	fz_html_key *key = NULL;
+	fz_html *other;
+
+	fz_var(key);
+
+	/* Takes ownership of html, so drop it if we cannot store it. */
+	fz_try(ctx)
+	{
+		key = fz_malloc_struct(ctx, fz_html_key);
+		key->refs = 1;
+		key->doc = doc;
+		key->chapter = chapter;
+		other = fz_store_item(ctx, key, html, fz_pool_size(ctx, html->pool), &fz_html_store_type);
+	}
+	fz_always(ctx)
+		fz_drop_html_key(ctx, key);
+	fz_catch(ctx)
+	{
+		fz_drop_html(ctx, html);
+		fz_rethrow(ctx);
+	}
+
+	/* Someone else got there first; use theirs. */
+	if (other)
+	{
+		fz_drop_html(ctx, html);
+		return other;
+	}
+	return html;
+}
+
+fz_html *
+fz_find_html(fz_context *ctx, void *doc, int chapter)
+{
+	fz_html_key key;
+
+	key.refs = 1;
+	key.doc = doc;
+	key.chapter = chapter;
+	return fz_find_item(ctx, &fz_drop_html_imp, &key, &fz_html_store_type);
+}
+
+static int
+html_key_matches_doc(fz_context *ctx, void *doc, void *key_)
+{
+	fz_html_key *key = (fz_html_key *)key_;
+	return key->doc == doc;
+}
+
+void
+fz_purge_stored_html(fz_context *ctx, void *doc)
+{
+	fz_filter_store(ctx, html_key_matches_doc, doc, &fz_html_store_type);
+}
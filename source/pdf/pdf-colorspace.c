@@ -1,5 +1,6 @@
 #include "mupdf/fitz.h"
 #include "mupdf/pdf.h"
+#include "pdf-imp.h"
 
 #include "../fitz/colorspace-imp.h"
 
@@ -533,16 +534,25 @@ pdf_load_colorspace_imp(fz_context *ctx, pdf_obj *obj)
 fz_colorspace *
 pdf_load_colorspace(fz_context *ctx, pdf_obj *obj)
 {
-	fz_colorspace *cs;
+	pdf_document *doc = pdf_get_bound_document(ctx, obj);
+	fz_colorspace *cs = NULL;
 
 	if ((cs = pdf_find_item(ctx, fz_drop_colorspace_imp, obj)) != NULL)
 	{
 		return cs;
 	}
 
-	cs = pdf_load_colorspace_imp(ctx, obj);
-
-	pdf_store_item(ctx, obj, cs, cs->size);
+	/* Loading marks objects to catch recursion, which only works for one thread at a time. */
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+	{
+		cs = pdf_load_colorspace_imp(ctx, obj);
+		pdf_store_item(ctx, obj, cs, cs->size);
+	}
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
 
 	return cs;
 }
@@ -586,8 +596,16 @@ fz_colorspace *
 pdf_document_output_intent(fz_context *ctx, pdf_document *doc)
 {
 #ifndef NOICC
-	if (!doc->oi)
-		doc->oi = pdf_load_output_intent(ctx, doc);
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+	{
+		if (!doc->oi)
+			doc->oi = pdf_load_output_intent(ctx, doc);
+	}
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
 #endif
 	return doc->oi;
 }
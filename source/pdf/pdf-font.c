@@ -1,10 +1,9 @@
 #include "mupdf/fitz.h"
 #include "mupdf/pdf.h"
 
+#include "pdf-imp.h"
 #include "../fitz/font-imp.h"
 
-#include <assert.h>
-
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include FT_ADVANCES_H
@@ -497,7 +496,7 @@ pdf_drop_font(fz_context *ctx, pdf_font_desc *fontdesc)
 	fz_drop_storable(ctx, &fontdesc->storable);
 }
 
-static void
+void
 pdf_drop_font_imp(fz_context *ctx, fz_storable *fontdesc_)
 {
 	pdf_font_desc *fontdesc = (pdf_font_desc *)fontdesc_;
@@ -975,7 +974,8 @@ static const fz_store_type hail_mary_store_type =
 	hail_mary_drop_key,
 	hail_mary_cmp_key,
 	hail_mary_format_key,
-	NULL
+	NULL,
+	"fallback font"
 };
 
 pdf_font_desc *
@@ -992,9 +992,13 @@ pdf_load_hail_mary_font(fz_context *ctx, pdf_document *doc)
 	/* FIXME: Get someone with a clue about fonts to fix this */
 	fontdesc = pdf_load_simple_font_by_name(ctx, doc, NULL, "Helvetica");
 
+	/* Another thread may have got there first. */
 	existing = fz_store_item(ctx, &hail_mary_store_key, fontdesc, fontdesc->size, &hail_mary_store_type);
-	assert(existing == NULL);
-	(void)existing; /* Silence warning in release builds */
+	if (existing)
+	{
+		pdf_drop_font(ctx, fontdesc);
+		fontdesc = existing;
+	}
 
 	return fontdesc;
 }
@@ -1379,8 +1383,8 @@ pdf_make_width_table(fz_context *ctx, pdf_font_desc *fontdesc)
 			font->width_table[i] = font->width_default;
 }
 
-pdf_font_desc *
-pdf_load_font(fz_context *ctx, pdf_document *doc, pdf_obj *rdb, pdf_obj *dict, int nested_depth)
+static pdf_font_desc *
+pdf_load_font_imp(fz_context *ctx, pdf_document *doc, pdf_obj *rdb, pdf_obj *dict, int nested_depth)
 {
 	pdf_obj *subtype;
 	pdf_obj *dfonts;
@@ -1449,6 +1453,22 @@ pdf_load_font(fz_context *ctx, pdf_document *doc, pdf_obj *rdb, pdf_obj *dict, i
 	return fontdesc;
 }
 
+pdf_font_desc *
+pdf_load_font(fz_context *ctx, pdf_document *doc, pdf_obj *rdb, pdf_obj *dict, int nested_depth)
+{
+	pdf_font_desc *fontdesc = NULL;
+
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+		fontdesc = pdf_load_font_imp(ctx, doc, rdb, dict, nested_depth);
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return fontdesc;
+}
+
 void
 pdf_print_font(fz_context *ctx, fz_output *out, pdf_font_desc *fontdesc)
 {
@@ -1,5 +1,6 @@
 #include "mupdf/fitz.h"
 #include "mupdf/pdf.h"
+#include "pdf-imp.h"
 
 #include <string.h>
 #include <math.h>
@@ -1372,7 +1373,7 @@ eval_stitching_func(fz_context *ctx, pdf_function *func, float in, float *out)
  * Common
  */
 
-static void
+void
 pdf_drop_function_imp(fz_context *ctx, fz_storable *func_)
 {
 	pdf_function *func = (pdf_function *)func_;
@@ -1441,8 +1442,8 @@ pdf_eval_function(fz_context *ctx, pdf_function *func, const float *in, int inle
 	}
 }
 
-pdf_function *
-pdf_load_function(fz_context *ctx, pdf_obj *dict, int in, int out)
+static pdf_function *
+pdf_load_function_imp(fz_context *ctx, pdf_obj *dict, int in, int out)
 {
 	pdf_function *func;
 	pdf_obj *obj;
@@ -1527,3 +1528,21 @@ pdf_load_function(fz_context *ctx, pdf_obj *dict, int in, int out)
 
 	return func;
 }
+
+pdf_function *
+pdf_load_function(fz_context *ctx, pdf_obj *dict, int in, int out)
+{
+	pdf_document *doc = pdf_get_bound_document(ctx, dict);
+	pdf_function *func = NULL;
+
+	/* Loading marks objects to catch recursion, which only works for one thread at a time. */
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+		func = pdf_load_function_imp(ctx, dict, in, out);
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return func;
+}
@@ -214,6 +214,7 @@ pdf_load_jpx(fz_context *ctx, pdf_document *doc, pdf_obj *dict, int forcemask)
 	fz_buffer *buf = NULL;
 	fz_colorspace *colorspace = NULL;
 	fz_pixmap *pix = NULL;
+	fz_compressed_buffer *bc = NULL;
 	pdf_obj *obj;
 	fz_image *mask = NULL;
 	fz_image *img = NULL;
@@ -236,7 +237,6 @@ pdf_load_jpx(fz_context *ctx, pdf_document *doc, pdf_obj *dict, int forcemask)
 			colorspace = pdf_load_colorspace(ctx, obj);
 
 		len = fz_buffer_storage(ctx, buf, &data);
-		pix = fz_load_jpx(ctx, data, len, colorspace);
 
 		obj = pdf_dict_geta(ctx, dict, PDF_NAME_SMask, PDF_NAME_Mask);
 		if (pdf_is_dict(ctx, obj))
@@ -247,19 +247,60 @@ pdf_load_jpx(fz_context *ctx, pdf_document *doc, pdf_obj *dict, int forcemask)
 				mask = pdf_load_image_imp(ctx, doc, NULL, obj, NULL, 1);
 		}
 
-		obj = pdf_dict_geta(ctx, dict, PDF_NAME_Decode, PDF_NAME_D);
-		if (obj && !fz_colorspace_is_indexed(ctx, colorspace))
+		if (forcemask)
 		{
-			float decode[FZ_MAX_COLORS * 2];
-			int i;
+			/* Soft masks are converted to alpha by the caller, so
+			 * decode the whole thing now. */
+			pix = fz_load_jpx(ctx, data, len, colorspace);
 
-			for (i = 0; i < pix->n * 2; i++)
-				decode[i] = pdf_to_real(ctx, pdf_array_get(ctx, obj, i));
+			obj = pdf_dict_geta(ctx, dict, PDF_NAME_Decode, PDF_NAME_D);
+			if (obj && !fz_colorspace_is_indexed(ctx, colorspace))
+			{
+				float decode[FZ_MAX_COLORS * 2];
+				int i;
+
+				for (i = 0; i < pix->n * 2; i++)
+					decode[i] = pdf_to_real(ctx, pdf_array_get(ctx, obj, i));
 
-			fz_decode_tile(ctx, pix, decode);
+				fz_decode_tile(ctx, pix, decode);
+			}
+
+			img = fz_new_image_from_pixmap(ctx, pix, mask);
 		}
+		else
+		{
+			/* Keep the codestream, so that we only ever decode the
+			 * parts and resolutions that are drawn. */
+			float decode[FZ_MAX_COLORS * 2];
+			fz_colorspace *cs;
+			int w, h, xres, yres;
+			int use_decode = 0;
 
-		img = fz_new_image_from_pixmap(ctx, pix, mask);
+			fz_load_jpx_info(ctx, data, len, &w, &h, &xres, &yres, &cs);
+			if (colorspace && !fz_colorspace_is_indexed(ctx, colorspace) && fz_colorspace_n(ctx, colorspace) != fz_colorspace_n(ctx, cs))
+			{
+				fz_warn(ctx, "jpx file and dict colorspace do not match");
+				fz_drop_colorspace(ctx, colorspace);
+				colorspace = NULL;
+			}
+			if (!colorspace)
+				colorspace = fz_keep_colorspace(ctx, cs);
+
+			obj = pdf_dict_geta(ctx, dict, PDF_NAME_Decode, PDF_NAME_D);
+			if (obj && !fz_colorspace_is_indexed(ctx, colorspace))
+			{
+				int i;
+
+				for (i = 0; i < fz_colorspace_n(ctx, colorspace) * 2; i++)
+					decode[i] = pdf_to_real(ctx, pdf_array_get(ctx, obj, i));
+				use_decode = 1;
+			}
+
+			bc = fz_malloc_struct(ctx, fz_compressed_buffer);
+			bc->buffer = fz_keep_buffer(ctx, buf);
+			bc->params.type = FZ_IMAGE_JPX;
+			img = fz_new_image_from_compressed_buffer(ctx, w, h, 8, colorspace, xres, yres, 0, 0, use_decode ? decode : NULL, NULL, bc, mask);
+		}
 	}
 	fz_always(ctx)
 	{
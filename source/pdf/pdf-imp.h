@@ -18,4 +18,9 @@ int pdf_is_hidden_ocg(fz_context *ctx, pdf_ocg_descriptor *desc, pdf_obj *rdb, c
 
 void pdf_drop_portfolio(fz_context *ctx, pdf_document *doc);
 
+/* Private threading functions. */
+
+void pdf_lock_document(fz_context *ctx, pdf_document *doc);
+void pdf_unlock_document(fz_context *ctx, pdf_document *doc);
+
 #endif
@@ -102,7 +102,7 @@ parse_inline_image(fz_context *ctx, pdf_csi *csi, fz_stream *stm)
 
 	fz_try(ctx)
 	{
-		obj = pdf_parse_dict(ctx, doc, stm, &doc->lexbuf.base);
+		obj = pdf_parse_dict(ctx, doc, stm, csi->buf);
 
 		/* read whitespace after ID keyword */
 		ch = fz_read_byte(ctx, stm);
@@ -574,14 +574,175 @@ pdf_process_end(fz_context *ctx, pdf_processor *proc, pdf_csi *csi)
 		proc->op_END(ctx, proc);
 }
 
+/*
+	A content stream tokenised into a list of operators. Each operator
+	refers to its operands by index into the shared operand, string and
+	object arrays, so that it can be replayed without lexing the stream
+	again. These are kept in the store, keyed on the stream object.
+*/
+
+typedef struct pdf_content_op_s pdf_content_op;
+
+struct pdf_content_op_s
+{
+	int key;
+	int top;
+	int stack;
+	int name;
+	int string;
+	int string_len;
+	int obj;
+	int image;
+};
+
+struct pdf_content_ops_s
+{
+	fz_storable storable;
+	pdf_obj *rdb;
+	int len, cap;
+	pdf_content_op *op;
+	int stack_len, stack_cap;
+	float *stack;
+	int data_len, data_cap;
+	char *data;
+	int obj_len, obj_cap;
+	pdf_obj **obj;
+	int image_len, image_cap;
+	fz_image **image;
+};
+
+void
+pdf_drop_content_ops_imp(fz_context *ctx, fz_storable *ops_)
+{
+	pdf_content_ops *ops = (pdf_content_ops *)ops_;
+	int i;
+
+	for (i = 0; i < ops->obj_len; i++)
+		pdf_drop_obj(ctx, ops->obj[i]);
+	for (i = 0; i < ops->image_len; i++)
+		fz_drop_image(ctx, ops->image[i]);
+	pdf_drop_obj(ctx, ops->rdb);
+	fz_free(ctx, ops->op);
+	fz_free(ctx, ops->stack);
+	fz_free(ctx, ops->data);
+	fz_free(ctx, ops->obj);
+	fz_free(ctx, ops->image);
+	fz_free(ctx, ops);
+}
+
+static pdf_content_ops *
+pdf_new_content_ops(fz_context *ctx, pdf_obj *rdb)
+{
+	pdf_content_ops *ops = fz_malloc_struct(ctx, pdf_content_ops);
+	FZ_INIT_STORABLE(ops, 1, pdf_drop_content_ops_imp);
+	ops->rdb = pdf_keep_obj(ctx, rdb);
+	return ops;
+}
+
+static size_t
+pdf_content_ops_size(fz_context *ctx, pdf_content_ops *ops)
+{
+	size_t size = sizeof(*ops);
+	int i;
+
+	size += (size_t)ops->cap * sizeof(*ops->op);
+	size += (size_t)ops->stack_cap * sizeof(*ops->stack);
+	size += (size_t)ops->data_cap;
+	size += (size_t)ops->obj_cap * sizeof(*ops->obj);
+	size += (size_t)ops->image_cap * sizeof(*ops->image);
+	for (i = 0; i < ops->image_len; i++)
+		size += fz_image_size(ctx, ops->image[i]);
+	return size;
+}
+
+static void
+pdf_record_op(fz_context *ctx, pdf_content_ops *ops, pdf_csi *csi, int key, fz_image *img)
+{
+	pdf_content_op *op;
+	int name_len = csi->name[0] ? (int)strlen(csi->name) + 1 : 0;
+
+	/* Make room for everything first, so that a failure leaves ops intact. */
+	if (ops->len == ops->cap)
+	{
+		int cap = ops->cap ? ops->cap * 2 : 64;
+		ops->op = fz_resize_array(ctx, ops->op, cap, sizeof(*ops->op));
+		ops->cap = cap;
+	}
+	if (ops->stack_len + csi->top > ops->stack_cap)
+	{
+		int cap = ops->stack_cap ? ops->stack_cap * 2 : 256;
+		while (cap < ops->stack_len + csi->top)
+			cap *= 2;
+		ops->stack = fz_resize_array(ctx, ops->stack, cap, sizeof(*ops->stack));
+		ops->stack_cap = cap;
+	}
+	if (ops->data_len + name_len + csi->string_len > ops->data_cap)
+	{
+		int cap = ops->data_cap ? ops->data_cap * 2 : 256;
+		while (cap < ops->data_len + name_len + csi->string_len)
+			cap *= 2;
+		ops->data = fz_resize_array(ctx, ops->data, cap, 1);
+		ops->data_cap = cap;
+	}
+	if (csi->obj && ops->obj_len == ops->obj_cap)
+	{
+		int cap = ops->obj_cap ? ops->obj_cap * 2 : 16;
+		ops->obj = fz_resize_array(ctx, ops->obj, cap, sizeof(*ops->obj));
+		ops->obj_cap = cap;
+	}
+	if (img && ops->image_len == ops->image_cap)
+	{
+		int cap = ops->image_cap ? ops->image_cap * 2 : 4;
+		ops->image = fz_resize_array(ctx, ops->image, cap, sizeof(*ops->image));
+		ops->image_cap = cap;
+	}
+
+	op = &ops->op[ops->len++];
+	op->key = key;
+	op->top = csi->top;
+	op->stack = ops->stack_len;
+	memcpy(ops->stack + ops->stack_len, csi->stack, csi->top * sizeof(*csi->stack));
+	ops->stack_len += csi->top;
+
+	op->name = -1;
+	if (name_len)
+	{
+		op->name = ops->data_len;
+		memcpy(ops->data + ops->data_len, csi->name, name_len);
+		ops->data_len += name_len;
+	}
+
+	op->string = -1;
+	op->string_len = csi->string_len;
+	if (csi->string_len > 0)
+	{
+		op->string = ops->data_len;
+		memcpy(ops->data + ops->data_len, csi->string, csi->string_len);
+		ops->data_len += csi->string_len;
+	}
+
+	op->obj = -1;
+	if (csi->obj)
+	{
+		op->obj = ops->obj_len;
+		ops->obj[ops->obj_len++] = pdf_keep_obj(ctx, csi->obj);
+	}
+
+	op->image = -1;
+	if (img)
+	{
+		op->image = ops->image_len;
+		ops->image[ops->image_len++] = fz_keep_image(ctx, img);
+	}
+}
+
 #define A(a) (a)
 #define B(a,b) (a | b << 8)
 #define C(a,b,c) (a | b << 8 | c << 16)
 
-static void
-pdf_process_keyword(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream *stm, char *word)
+static int
+pdf_keyword_key(const char *word)
 {
-	float *s = csi->stack;
 	int key;
 
 	key = word[0];
@@ -596,6 +757,17 @@ pdf_process_keyword(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_strea
 		}
 	}
 
+	return key;
+}
+
+static void
+pdf_process_keyword(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream *stm, pdf_content_ops *ops, int key, const char *word)
+{
+	float *s = csi->stack;
+
+	if (ops && key != B('B','I'))
+		pdf_record_op(ctx, ops, csi, key, NULL);
+
 	switch (key)
 	{
 	default:
@@ -753,6 +925,8 @@ pdf_process_keyword(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_strea
 			fz_image *img = parse_inline_image(ctx, csi, stm);
 			fz_try(ctx)
 			{
+				if (ops)
+					pdf_record_op(ctx, ops, csi, key, img);
 				if (proc->op_BI)
 					proc->op_BI(ctx, proc, img);
 			}
@@ -799,8 +973,77 @@ pdf_process_keyword(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_strea
 	}
 }
 
-static void
-pdf_process_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream *stm)
+/*
+	Deal with an error caught while processing a content stream.
+	Returns non-zero if the rest of the stream should be ignored.
+*/
+static int
+pdf_process_error(fz_context *ctx, pdf_csi *csi, int *syntax_errors)
+{
+	fz_cookie *cookie = csi->cookie;
+	int caught = fz_caught(ctx);
+
+	if (cookie)
+	{
+		if (caught == FZ_ERROR_TRYLATER)
+		{
+			if (cookie->incomplete_ok)
+				cookie->incomplete++;
+			else
+				fz_rethrow(ctx);
+		}
+		else if (caught == FZ_ERROR_ABORT)
+		{
+			fz_rethrow(ctx);
+		}
+		else if (caught == FZ_ERROR_SYNTAX)
+		{
+			cookie->errors++;
+			if (++*syntax_errors >= MAX_SYNTAX_ERRORS)
+			{
+				fz_warn(ctx, "too many syntax errors; ignoring rest of page");
+				return 1;
+			}
+		}
+		else
+		{
+			cookie->errors++;
+			fz_warn(ctx, "unrecoverable error; ignoring rest of page");
+			return 1;
+		}
+	}
+	else
+	{
+		if (caught == FZ_ERROR_TRYLATER)
+			fz_rethrow(ctx);
+		else if (caught == FZ_ERROR_ABORT)
+			fz_rethrow(ctx);
+		else if (caught == FZ_ERROR_SYNTAX)
+		{
+			if (++*syntax_errors >= MAX_SYNTAX_ERRORS)
+			{
+				fz_warn(ctx, "too many syntax errors; ignoring rest of page");
+				return 1;
+			}
+		}
+		else
+		{
+			fz_warn(ctx, "unrecoverable error; ignoring rest of page");
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+	Lex and process a content stream. If ops is given, every operator
+	is also recorded into it for later replay. Returns non-zero if the
+	whole stream was processed without any errors, in which case the
+	recording is complete.
+*/
+static int
+pdf_process_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream *stm, pdf_content_ops *ops)
 {
 	pdf_document *doc = csi->doc;
 	pdf_lexbuf *buf = csi->buf;
@@ -809,12 +1052,14 @@ pdf_process_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream
 	pdf_token tok = PDF_TOK_ERROR;
 	int in_text_array = 0;
 	int syntax_errors = 0;
+	int complete = 1;
 
 	/* make sure we have a clean slate if we come here from flush_text */
 	pdf_clear_stack(ctx, csi);
 
 	fz_var(in_text_array);
 	fz_var(tok);
+	fz_var(complete);
 
 	if (cookie)
 	{
@@ -833,6 +1078,7 @@ pdf_process_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream
 				{
 					if (cookie->abort)
 					{
+						complete = 0;
 						tok = PDF_TOK_EOF;
 						break;
 					}
@@ -870,7 +1116,7 @@ pdf_process_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream
 								{
 									csi->stack[0] = pdf_to_real(ctx, o);
 									pdf_array_delete(ctx, csi->obj, n-1);
-									pdf_process_keyword(ctx, proc, csi, stm, buf->scratch);
+									pdf_process_keyword(ctx, proc, csi, stm, NULL, pdf_keyword_key(buf->scratch), buf->scratch);
 								}
 							}
 						}
@@ -959,7 +1205,7 @@ pdf_process_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream
 					break;
 
 				case PDF_TOK_KEYWORD:
-					pdf_process_keyword(ctx, proc, csi, stm, buf->scratch);
+					pdf_process_keyword(ctx, proc, csi, stm, ops, pdf_keyword_key(buf->scratch), buf->scratch);
 					pdf_clear_stack(ctx, csi);
 					break;
 
@@ -975,63 +1221,96 @@ pdf_process_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, fz_stream
 		}
 		fz_catch(ctx)
 		{
-			int caught = fz_caught(ctx);
+			complete = 0;
+			if (pdf_process_error(ctx, csi, &syntax_errors))
+				tok = PDF_TOK_EOF;
+
+			/* If we do catch an error, then reset ourselves to a base lexing state */
+			in_text_array = 0;
+		}
+	}
+	while (tok != PDF_TOK_EOF);
 
-			if (cookie)
+	return complete;
+}
+
+/*
+	Replay a content stream tokenised by pdf_process_stream, with the
+	same error recovery as when lexing it.
+*/
+static void
+pdf_replay_stream(fz_context *ctx, pdf_processor *proc, pdf_csi *csi, pdf_content_ops *ops)
+{
+	fz_cookie *cookie = csi->cookie;
+	int syntax_errors = 0;
+	int i = 0;
+
+	pdf_clear_stack(ctx, csi);
+
+	fz_var(i);
+
+	if (cookie)
+	{
+		cookie->progress_max = -1;
+		cookie->progress = 0;
+	}
+
+	while (i < ops->len)
+	{
+		fz_try(ctx)
+		{
+			for (; i < ops->len; i++)
 			{
-				if (caught == FZ_ERROR_TRYLATER)
-				{
-					if (cookie->incomplete_ok)
-						cookie->incomplete++;
-					else
-						fz_rethrow(ctx);
-				}
-				else if (caught == FZ_ERROR_ABORT)
-				{
-					fz_rethrow(ctx);
-				}
-				else if (caught == FZ_ERROR_SYNTAX)
+				pdf_content_op *op = &ops->op[i];
+
+				if (cookie)
 				{
-					cookie->errors++;
-					if (++syntax_errors >= MAX_SYNTAX_ERRORS)
+					if (cookie->abort)
 					{
-						fz_warn(ctx, "too many syntax errors; ignoring rest of page");
-						tok = PDF_TOK_EOF;
+						i = ops->len;
+						break;
 					}
+					cookie->progress++;
 				}
-				else
-				{
-					cookie->errors++;
-					fz_warn(ctx, "unrecoverable error; ignoring rest of page");
-					tok = PDF_TOK_EOF;
-				}
-			}
-			else
-			{
-				if (caught == FZ_ERROR_TRYLATER)
-					fz_rethrow(ctx);
-				else if (caught == FZ_ERROR_ABORT)
-					fz_rethrow(ctx);
-				else if (caught == FZ_ERROR_SYNTAX)
+
+				csi->top = op->top;
+				memcpy(csi->stack, ops->stack + op->stack, op->top * sizeof(*csi->stack));
+				if (op->name >= 0)
+					fz_strlcpy(csi->name, ops->data + op->name, sizeof(csi->name));
+				if (op->string >= 0)
+					memcpy(csi->string, ops->data + op->string, op->string_len);
+				csi->string_len = op->string_len;
+				if (op->obj >= 0)
+					csi->obj = pdf_keep_obj(ctx, ops->obj[op->obj]);
+
+				if (op->image >= 0)
 				{
-					if (++syntax_errors >= MAX_SYNTAX_ERRORS)
-					{
-						fz_warn(ctx, "too many syntax errors; ignoring rest of page");
-						tok = PDF_TOK_EOF;
-					}
+					if (proc->op_BI)
+						proc->op_BI(ctx, proc, ops->image[op->image]);
 				}
 				else
 				{
-					fz_warn(ctx, "unrecoverable error; ignoring rest of page");
-					tok = PDF_TOK_EOF;
+					char word[4];
+					word[0] = op->key & 0xff;
+					word[1] = (op->key >> 8) & 0xff;
+					word[2] = (op->key >> 16) & 0xff;
+					word[3] = 0;
+					pdf_process_keyword(ctx, proc, csi, NULL, NULL, op->key, op->key ? word : "?");
 				}
+				pdf_clear_stack(ctx, csi);
 			}
-
-			/* If we do catch an error, then reset ourselves to a base lexing state */
-			in_text_array = 0;
+		}
+		fz_always(ctx)
+		{
+			pdf_clear_stack(ctx, csi);
+		}
+		fz_catch(ctx)
+		{
+			if (pdf_process_error(ctx, csi, &syntax_errors))
+				break;
+			i++;
 		}
 	}
-	while (tok != PDF_TOK_EOF);
 }
 
 void
@@ -1040,11 +1319,13 @@ pdf_process_contents(fz_context *ctx, pdf_processor *proc, pdf_document *doc, pd
 	pdf_csi csi;
 	pdf_lexbuf buf;
 	fz_stream *stm = NULL;
+	pdf_content_ops *ops = NULL;
 
 	if (!stmobj)
 		return;
 
 	fz_var(stm);
+	fz_var(ops);
 
 	pdf_lexbuf_init(ctx, &buf, PDF_LEXBUF_SMALL);
 	pdf_init_csi(ctx, &csi, doc, rdb, &buf, cookie);
@@ -1052,13 +1333,47 @@ pdf_process_contents(fz_context *ctx, pdf_processor *proc, pdf_document *doc, pd
 	fz_try(ctx)
 	{
 		fz_defer_reap_start(ctx);
-		stm = pdf_open_contents_stream(ctx, doc, stmobj);
-		pdf_process_stream(ctx, proc, &csi, stm);
+
+		/*
+			Only single content streams are cached; the store cannot
+			tell when the streams of a contents array are edited.
+		*/
+		if (pdf_is_indirect(ctx, stmobj) && pdf_is_stream(ctx, stmobj))
+		{
+			ops = pdf_find_item(ctx, pdf_drop_content_ops_imp, stmobj);
+
+			/* Inline images were loaded using the resources at the time. */
+			if (ops && ops->image_len > 0 && pdf_objcmp(ctx, ops->rdb, rdb))
+			{
+				fz_drop_storable(ctx, &ops->storable);
+				ops = NULL;
+			}
+			else if (ops)
+			{
+				pdf_replay_stream(ctx, proc, &csi, ops);
+			}
+			else
+			{
+				ops = pdf_new_content_ops(ctx, rdb);
+				stm = pdf_open_contents_stream(ctx, doc, stmobj);
+				if (pdf_process_stream(ctx, proc, &csi, stm, ops))
+					pdf_store_item(ctx, stmobj, ops, pdf_content_ops_size(ctx, ops));
+			}
+		}
+
+		if (!ops)
+		{
+			stm = pdf_open_contents_stream(ctx, doc, stmobj);
+			pdf_process_stream(ctx, proc, &csi, stm, NULL);
+		}
+
 		pdf_process_end(ctx, proc, &csi);
 	}
 	fz_always(ctx)
 	{
 		fz_defer_reap_end(ctx);
+		if (ops)
+			fz_drop_storable(ctx, &ops->storable);
 		fz_drop_stream(ctx, stm);
 		pdf_clear_stack(ctx, &csi);
 		pdf_lexbuf_fin(ctx, &buf);
@@ -1126,7 +1441,7 @@ pdf_process_glyph(fz_context *ctx, pdf_processor *proc, pdf_document *doc, pdf_o
 	fz_try(ctx)
 	{
 		stm = fz_open_buffer(ctx, contents);
-		pdf_process_stream(ctx, proc, &csi, stm);
+		pdf_process_stream(ctx, proc, &csi, stm, NULL);
 		pdf_process_end(ctx, proc, &csi);
 	}
 	fz_always(ctx)
@@ -506,8 +506,8 @@ ocg_intents_include(fz_context *ctx, pdf_ocg_descriptor *desc, const char *name)
 	return 0;
 }
 
-int
-pdf_is_hidden_ocg(fz_context *ctx, pdf_ocg_descriptor *desc, pdf_obj *rdb, const char *usage, pdf_obj *ocg)
+static int
+pdf_is_hidden_ocg_imp(fz_context *ctx, pdf_ocg_descriptor *desc, pdf_obj *rdb, const char *usage, pdf_obj *ocg)
 {
 	char event_state[16];
 	pdf_obj *obj, *obj2, *type;
@@ -655,7 +655,7 @@ pdf_is_hidden_ocg(fz_context *ctx, pdf_ocg_descriptor *desc, pdf_obj *rdb, const
 				len = pdf_array_len(ctx, obj);
 				for (i = 0; i < len; i++)
 				{
-					int hidden = pdf_is_hidden_ocg(ctx, desc, rdb, usage, pdf_array_get(ctx, obj, i));
+					int hidden = pdf_is_hidden_ocg_imp(ctx, desc, rdb, usage, pdf_array_get(ctx, obj, i));
 					if ((combine & 1) == 0)
 						hidden = !hidden;
 					if (combine & 2)
@@ -666,7 +666,7 @@ pdf_is_hidden_ocg(fz_context *ctx, pdf_ocg_descriptor *desc, pdf_obj *rdb, const
 			}
 			else
 			{
-				on = pdf_is_hidden_ocg(ctx, desc, rdb, usage, obj);
+				on = pdf_is_hidden_ocg_imp(ctx, desc, rdb, usage, obj);
 				if ((combine & 1) == 0)
 					on = !on;
 			}
@@ -685,6 +685,31 @@ pdf_is_hidden_ocg(fz_context *ctx, pdf_ocg_descriptor *desc, pdf_obj *rdb, const
 	return 0;
 }
 
+int
+pdf_is_hidden_ocg(fz_context *ctx, pdf_ocg_descriptor *desc, pdf_obj *rdb, const char *usage, pdf_obj *ocg)
+{
+	pdf_document *doc;
+	int hidden = 0;
+
+	if (!usage || !desc || !ocg)
+		return 0;
+
+	/* Membership dictionaries are marked while they are evaluated. */
+	doc = pdf_get_bound_document(ctx, ocg);
+	if (!doc)
+		doc = pdf_get_bound_document(ctx, rdb);
+
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+		hidden = pdf_is_hidden_ocg_imp(ctx, desc, rdb, usage, ocg);
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return hidden;
+}
+
 void
 pdf_read_ocg(fz_context *ctx, pdf_document *doc)
 {
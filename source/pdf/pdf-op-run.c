@@ -12,6 +12,7 @@
 
 typedef struct pdf_material_s pdf_material;
 typedef struct pdf_run_processor_s pdf_run_processor;
+typedef struct pdf_run_form_s pdf_run_form;
 
 static void pdf_run_xobject(fz_context *ctx, pdf_run_processor *proc, pdf_xobject *xobj, pdf_obj *page_resources, const fz_matrix *transform, int is_smask);
 
@@ -97,6 +98,19 @@ struct pdf_run_processor_s
 	int gtop;
 	int gbot;
 	int gparent;
+
+	/* forms being run, innermost first */
+	pdf_run_form *forms;
+};
+
+/*
+	Forms are tracked per processor rather than by marking the form
+	object, as other threads may be running the same form.
+*/
+struct pdf_run_form_s
+{
+	pdf_obj *obj;
+	pdf_run_form *up;
 };
 
 typedef struct softmask_save_s softmask_save;
@@ -1221,11 +1235,19 @@ pdf_run_xobject(fz_context *ctx, pdf_run_processor *proc, pdf_xobject *xobj, pdf
 	int transparency = 0;
 	pdf_document *doc;
 	fz_colorspace *cs = NULL;
+	pdf_run_form form, *up;
 
-	/* Avoid infinite recursion */
-	if (xobj == NULL || pdf_mark_obj(ctx, xobj->obj))
+	if (xobj == NULL)
 		return;
 
+	/* Avoid infinite recursion */
+	form.obj = pdf_resolve_indirect(ctx, xobj->obj);
+	for (up = pr->forms; up; up = up->up)
+		if (up->obj == form.obj)
+			return;
+	form.up = pr->forms;
+	pr->forms = &form;
+
 	fz_var(cleanup_state);
 	fz_var(gstate);
 	fz_var(oldtop);
@@ -1363,7 +1385,7 @@ pdf_run_xobject(fz_context *ctx, pdf_run_processor *proc, pdf_xobject *xobj, pdf
 		while (oldtop < pr->gtop)
 			pdf_grestore(ctx, pr);
 
-		pdf_unmark_obj(ctx, xobj->obj);
+		pr->forms = form.up;
 	}
 	fz_catch(ctx)
 	{
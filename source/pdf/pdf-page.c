@@ -1,5 +1,6 @@
 #include "mupdf/fitz.h"
 #include "mupdf/pdf.h"
+#include "pdf-imp.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -337,13 +338,17 @@ pdf_lookup_anchor(fz_context *ctx, pdf_document *doc, const char *name, float *x
 	return fz_atoi(name) - 1;
 }
 
+/* The marks on the page tree nodes are shared between all the threads
+ * using a document, so walking the parents is done under its lock. */
 static pdf_obj *
 pdf_lookup_inherited_page_item(fz_context *ctx, pdf_obj *node, pdf_obj *key)
 {
+	pdf_document *doc = pdf_get_bound_document(ctx, node);
 	pdf_obj *node2 = node;
 	pdf_obj *val = NULL;
 
 	fz_var(node);
+	pdf_lock_document(ctx, doc);
 	fz_try(ctx)
 	{
 		do
@@ -367,6 +372,7 @@ pdf_lookup_inherited_page_item(fz_context *ctx, pdf_obj *node, pdf_obj *key)
 			node2 = pdf_dict_get(ctx, node2, PDF_NAME_Parent);
 		}
 		while (node2);
+		pdf_unlock_document(ctx, doc);
 	}
 	fz_catch(ctx)
 	{
@@ -808,16 +814,30 @@ pdf_page_separations(fz_context *ctx, pdf_page *page)
 	pdf_obj *res = pdf_page_resources(ctx, page);
 	fz_separations *seps = NULL;
 
-	/* Run through and look for separations first. This is
-	 * because separations are simplest to deal with, and
-	 * because DeviceN may be implemented on top of separations.
-	 */
-	scan_page_seps(ctx, res, &seps, find_seps);
+	fz_var(seps);
 
-	/* Now run through again, and look for DeviceNs. These may
-	 * have spot colors in that aren't defined in terms of
-	 * separations. */
-	scan_page_seps(ctx, res, &seps, find_devn);
+	/* scan_page_seps marks the shared resource objects */
+	pdf_lock_document(ctx, page->doc);
+	fz_try(ctx)
+	{
+		/* Run through and look for separations first. This is
+		 * because separations are simplest to deal with, and
+		 * because DeviceN may be implemented on top of separations.
+		 */
+		scan_page_seps(ctx, res, &seps, find_seps);
+
+		/* Now run through again, and look for DeviceNs. These may
+		 * have spot colors in that aren't defined in terms of
+		 * separations. */
+		scan_page_seps(ctx, res, &seps, find_devn);
+	}
+	fz_always(ctx)
+		pdf_unlock_document(ctx, page->doc);
+	fz_catch(ctx)
+	{
+		fz_drop_separations(ctx, seps);
+		fz_rethrow(ctx);
+	}
 
 	return seps;
 }
@@ -834,7 +854,9 @@ pdf_drop_page_imp(fz_context *ctx, pdf_page *page)
 	 * the annotations and must be NULLed when the
 	 * annotations are destroyed. doc->focus_obj
 	 * keeps track of the actual annotation object. */
+	pdf_lock_document(ctx, doc);
 	doc->focus = NULL;
+	pdf_unlock_document(ctx, doc);
 
 	pdf_drop_obj(ctx, page->obj);
 
@@ -934,8 +956,8 @@ pdf_load_default_colorspaces(fz_context *ctx, pdf_document *doc, pdf_page *page)
 	return default_cs;
 }
 
-pdf_page *
-pdf_load_page(fz_context *ctx, pdf_document *doc, int number)
+static pdf_page *
+pdf_load_page_imp(fz_context *ctx, pdf_document *doc, int number)
 {
 	pdf_page *page;
 	pdf_annot *annot;
@@ -1003,6 +1025,23 @@ pdf_load_page(fz_context *ctx, pdf_document *doc, int number)
 	return page;
 }
 
+pdf_page *
+pdf_load_page(fz_context *ctx, pdf_document *doc, int number)
+{
+	pdf_page *page = NULL;
+
+	/* Walking the page tree and scanning resources mark objects as they go. */
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+		page = pdf_load_page_imp(ctx, doc, number);
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return page;
+}
+
 void
 pdf_delete_page(fz_context *ctx, pdf_document *doc, int at)
 {
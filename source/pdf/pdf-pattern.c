@@ -1,5 +1,6 @@
 #include "mupdf/fitz.h"
 #include "mupdf/pdf.h"
+#include "pdf-imp.h"
 
 pdf_pattern *
 pdf_keep_pattern(fz_context *ctx, pdf_pattern *pat)
@@ -13,7 +14,7 @@ pdf_drop_pattern(fz_context *ctx, pdf_pattern *pat)
 	fz_drop_storable(ctx, &pat->storable);
 }
 
-static void
+void
 pdf_drop_pattern_imp(fz_context *ctx, fz_storable *pat_)
 {
 	pdf_pattern *pat = (pdf_pattern *)pat_;
@@ -30,8 +31,8 @@ pdf_pattern_size(pdf_pattern *pat)
 	return sizeof(*pat);
 }
 
-pdf_pattern *
-pdf_load_pattern(fz_context *ctx, pdf_document *doc, pdf_obj *dict)
+static pdf_pattern *
+pdf_load_pattern_imp(fz_context *ctx, pdf_document *doc, pdf_obj *dict)
 {
 	pdf_pattern *pat;
 	pdf_obj *obj;
@@ -80,3 +81,20 @@ pdf_load_pattern(fz_context *ctx, pdf_document *doc, pdf_obj *dict)
 	}
 	return pat;
 }
+
+pdf_pattern *
+pdf_load_pattern(fz_context *ctx, pdf_document *doc, pdf_obj *dict)
+{
+	pdf_pattern *pat = NULL;
+
+	/* Other threads must not find the pattern before it is filled in. */
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+		pat = pdf_load_pattern_imp(ctx, doc, dict);
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return pat;
+}
@@ -43,37 +43,68 @@ pdf_format_key(fz_context *ctx, char *s, int n, void *key_)
 		pdf_sprint_obj(ctx, s, n, key, 1);
 }
 
-static const fz_store_type pdf_obj_store_type =
+#define PDF_STORE_TYPE(name) \
+	{ pdf_make_hash_key, pdf_keep_key, pdf_drop_key, pdf_cmp_key, pdf_format_key, NULL, name }
+
+static const fz_store_type pdf_obj_store_type = PDF_STORE_TYPE("pdf object");
+
+/*
+	All values loaded from pdf objects share the same kind of key, but
+	we give each kind of value its own store type so that the store can
+	tell them apart in its statistics.
+*/
+static const struct
 {
-	pdf_make_hash_key,
-	pdf_keep_key,
-	pdf_drop_key,
-	pdf_cmp_key,
-	pdf_format_key,
-	NULL
+	fz_store_drop_fn *drop;
+	fz_store_type type;
+} pdf_store_types[] =
+{
+	{ pdf_drop_font_imp, PDF_STORE_TYPE("font") },
+	{ fz_drop_image_imp, PDF_STORE_TYPE("image") },
+	{ fz_drop_colorspace_imp, PDF_STORE_TYPE("colorspace") },
+	{ pdf_drop_function_imp, PDF_STORE_TYPE("function") },
+	{ fz_drop_shade_imp, PDF_STORE_TYPE("shading") },
+	{ pdf_drop_pattern_imp, PDF_STORE_TYPE("pattern") },
+	{ pdf_drop_xobject_imp, PDF_STORE_TYPE("xobject") },
+	{ pdf_drop_cmap_imp, PDF_STORE_TYPE("cmap") },
+	{ fz_drop_jbig2_globals_imp, PDF_STORE_TYPE("jbig2 globals") },
+	{ pdf_drop_content_ops_imp, PDF_STORE_TYPE("content stream") },
 };
 
+static const fz_store_type *
+pdf_store_type(fz_store_drop_fn *drop)
+{
+	int i;
+
+	for (i = 0; i < nelem(pdf_store_types); i++)
+		if (pdf_store_types[i].drop == drop)
+			return &pdf_store_types[i].type;
+	return &pdf_obj_store_type;
+}
+
 void
 pdf_store_item(fz_context *ctx, pdf_obj *key, void *val, size_t itemsize)
 {
 	void *existing;
 
 	assert(pdf_is_name(ctx, key) || pdf_is_array(ctx, key) || pdf_is_dict(ctx, key) || pdf_is_indirect(ctx, key));
-	existing = fz_store_item(ctx, key, val, itemsize, &pdf_obj_store_type);
-	assert(existing == NULL);
-	(void)existing; /* Silence warning in release builds */
+	existing = fz_store_item(ctx, key, val, itemsize, pdf_store_type(((fz_storable *)val)->drop));
+	/* Another thread sharing the document may have stored the same item
+	 * first. Our caller just goes on using its own copy. */
+	if (existing)
+		fz_drop_storable(ctx, existing);
 }
 
 void *
 pdf_find_item(fz_context *ctx, fz_store_drop_fn *drop, pdf_obj *key)
 {
-	return fz_find_item(ctx, drop, key, &pdf_obj_store_type);
+	return fz_find_item(ctx, drop, key, pdf_store_type(drop));
 }
 
 void
 pdf_remove_item(fz_context *ctx, fz_store_drop_fn *drop, pdf_obj *key)
 {
-	fz_remove_item(ctx, drop, key, &pdf_obj_store_type);
+	fz_remove_item(ctx, drop, key, pdf_store_type(drop));
 }
 
 static int
@@ -89,5 +120,9 @@ pdf_filter_store(fz_context *ctx, void *doc_, void *key)
 void
 pdf_empty_store(fz_context *ctx, pdf_document *doc)
 {
+	int i;
+
 	fz_filter_store(ctx, pdf_filter_store, doc, &pdf_obj_store_type);
+	for (i = 0; i < nelem(pdf_store_types); i++)
+		fz_filter_store(ctx, pdf_filter_store, doc, &pdf_store_types[i].type);
 }
@@ -1,5 +1,6 @@
 #include "mupdf/fitz.h"
 #include "mupdf/pdf.h"
+#include "pdf-imp.h"
 
 #include <string.h>
 
@@ -280,10 +281,11 @@ build_filter_chain(fz_context *ctx, fz_stream *chain, pdf_document *doc, pdf_obj
  * orig_num and orig_gen are used purely to seed the encryption.
  */
 static fz_stream *
-pdf_open_raw_filter(fz_context *ctx, fz_stream *chain, pdf_document *doc, pdf_obj *stmobj, int num, int *orig_num, int *orig_gen, fz_off_t offset)
+pdf_open_raw_filter_imp(fz_context *ctx, fz_stream *chain, pdf_document *doc, pdf_obj *stmobj, int num, int *orig_num, int *orig_gen, fz_off_t offset)
 {
 	pdf_xref_entry *x = NULL;
 	fz_stream *chain2;
+	fz_buffer *buf = NULL;
 	int hascrypt;
 	int len;
 
@@ -304,6 +306,7 @@ pdf_open_raw_filter(fz_context *ctx, fz_stream *chain, pdf_document *doc, pdf_ob
 	}
 
 	fz_var(chain);
+	fz_var(buf);
 
 	fz_try(ctx)
 	{
@@ -314,6 +317,15 @@ pdf_open_raw_filter(fz_context *ctx, fz_stream *chain, pdf_document *doc, pdf_ob
 		chain = NULL;
 		chain = fz_open_null(ctx, chain2, len, offset);
 
+		/* Other threads move the file position, so read it all while we hold the lock. */
+		if (doc->threaded)
+		{
+			buf = fz_read_all(ctx, chain, len);
+			fz_drop_stream(ctx, chain);
+			chain = NULL;
+			chain = fz_open_buffer(ctx, buf);
+		}
+
 		hascrypt = pdf_stream_has_crypt(ctx, stmobj);
 		if (doc->crypt && !hascrypt)
 		{
@@ -322,6 +334,10 @@ pdf_open_raw_filter(fz_context *ctx, fz_stream *chain, pdf_document *doc, pdf_ob
 			chain = pdf_open_crypt(ctx, chain2, doc->crypt, *orig_num, *orig_gen);
 		}
 	}
+	fz_always(ctx)
+	{
+		fz_drop_buffer(ctx, buf);
+	}
 	fz_catch(ctx)
 	{
 		fz_drop_stream(ctx, chain);
@@ -331,6 +347,22 @@ pdf_open_raw_filter(fz_context *ctx, fz_stream *chain, pdf_document *doc, pdf_ob
 	return chain;
 }
 
+static fz_stream *
+pdf_open_raw_filter(fz_context *ctx, fz_stream *chain, pdf_document *doc, pdf_obj *stmobj, int num, int *orig_num, int *orig_gen, fz_off_t offset)
+{
+	fz_stream *stm = NULL;
+
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+		stm = pdf_open_raw_filter_imp(ctx, chain, doc, stmobj, num, orig_num, orig_gen, offset);
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return stm;
+}
+
 /*
  * Construct a filter to decode a stream, constraining
  * to stream length and decrypting.
@@ -498,11 +530,23 @@ pdf_load_raw_stream_number(fz_context *ctx, pdf_document *doc, int num)
 	fz_buffer *buf = NULL;
 	pdf_xref_entry *x;
 
+	fz_var(buf);
+
 	if (num > 0 && num < pdf_xref_len(ctx, doc))
 	{
-		x = pdf_get_xref_entry(ctx, doc, num);
-		if (x->stm_buf)
-			return fz_keep_buffer(ctx, x->stm_buf);
+		pdf_lock_document(ctx, doc);
+		fz_try(ctx)
+		{
+			x = pdf_get_xref_entry(ctx, doc, num);
+			if (x->stm_buf)
+				buf = fz_keep_buffer(ctx, x->stm_buf);
+		}
+		fz_always(ctx)
+			pdf_unlock_document(ctx, doc);
+		fz_catch(ctx)
+			fz_rethrow(ctx);
+		if (buf)
+			return buf;
 	}
 
 	dict = pdf_load_object(ctx, doc, num);
@@ -603,11 +647,22 @@ pdf_load_image_stream(fz_context *ctx, pdf_document *doc, int num, fz_compressio
 
 	if (num > 0 && num < pdf_xref_len(ctx, doc))
 	{
-		pdf_xref_entry *entry = pdf_get_xref_entry(ctx, doc, num);
-		/* Return ref to existing buffer, but only if uncompressed,
-		 * or shortstoppable */
-		if (can_reuse_buffer(ctx, entry, params))
-			return fz_keep_buffer(ctx, entry->stm_buf);
+		buf = NULL;
+		pdf_lock_document(ctx, doc);
+		fz_try(ctx)
+		{
+			pdf_xref_entry *entry = pdf_get_xref_entry(ctx, doc, num);
+			/* Return ref to existing buffer, but only if uncompressed,
+			 * or shortstoppable */
+			if (can_reuse_buffer(ctx, entry, params))
+				buf = fz_keep_buffer(ctx, entry->stm_buf);
+		}
+		fz_always(ctx)
+			pdf_unlock_document(ctx, doc);
+		fz_catch(ctx)
+			fz_rethrow(ctx);
+		if (buf)
+			return buf;
 	}
 
 	dict = pdf_load_object(ctx, doc, num);
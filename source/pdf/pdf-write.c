@@ -65,6 +65,7 @@ struct pdf_write_state_s
 	int do_garbage;
 	int do_linear;
 	int do_clean;
+	int do_objstms;
 
 	int *use_list;
 	fz_off_t *ofs_list;
@@ -92,6 +93,11 @@ struct pdf_write_state_s
 	pdf_obj *hints_length;
 	int page_count;
 	page_objects_list *page_object_lists;
+	/* The following extras are required for object streams */
+	int *objstm_list;
+	int *objstm_index;
+	int objstm_first;
+	int objstm_count;
 };
 
 /*
@@ -628,29 +634,203 @@ static int markobj(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, pd
 }
 
 /*
- * Scan for and remove duplicate objects (slow)
+ * Scan for and remove duplicate objects
+ *
+ * Rather than comparing every object with every preceding object, we
+ * compute a structural hash of each object (consistent with pdf_objcmp)
+ * and only compare objects that fall in the same hash bucket. Stream
+ * contents are only digested when two streams have identical dictionaries,
+ * and the digest of each stream is computed at most once.
  */
 
+typedef struct
+{
+	unsigned int hash;
+	int num;
+} dedup_entry;
+
+typedef struct
+{
+	int digested;
+	size_t len;
+	unsigned char digest[16];
+} dedup_digest;
+
+static unsigned int dedup_hash_bytes(unsigned int h, const void *data, size_t len)
+{
+	const unsigned char *s = data;
+	while (len--)
+		h = (h ^ *s++) * 16777619;
+	return h;
+}
+
+static unsigned int dedup_hash_obj(fz_context *ctx, pdf_obj *obj, unsigned int h)
+{
+	int i, n, v;
+	float f;
+
+	if (obj == NULL)
+		return dedup_hash_bytes(h, "0", 1);
+
+	/* Check indirect first; the pdf_is_* functions resolve references. */
+	if (pdf_is_indirect(ctx, obj))
+	{
+		h = dedup_hash_bytes(h, "R", 1);
+		v = pdf_to_num(ctx, obj);
+		h = dedup_hash_bytes(h, &v, sizeof v);
+		v = pdf_to_gen(ctx, obj);
+		return dedup_hash_bytes(h, &v, sizeof v);
+	}
+	if (pdf_is_name(ctx, obj))
+	{
+		/* Predefined and dynamically allocated names compare equal by string. */
+		const char *s = pdf_to_name(ctx, obj);
+		h = dedup_hash_bytes(h, "/", 1);
+		return dedup_hash_bytes(h, s, strlen(s));
+	}
+	if (pdf_is_int(ctx, obj))
+	{
+		v = pdf_to_int(ctx, obj);
+		h = dedup_hash_bytes(h, "i", 1);
+		return dedup_hash_bytes(h, &v, sizeof v);
+	}
+	if (pdf_is_real(ctx, obj))
+	{
+		f = pdf_to_real(ctx, obj);
+		if (f == 0)
+			f = 0; /* -0 and 0 compare equal */
+		h = dedup_hash_bytes(h, "f", 1);
+		return dedup_hash_bytes(h, &f, sizeof f);
+	}
+	if (pdf_is_string(ctx, obj))
+	{
+		h = dedup_hash_bytes(h, "(", 1);
+		return dedup_hash_bytes(h, pdf_to_str_buf(ctx, obj), pdf_to_str_len(ctx, obj));
+	}
+	if (pdf_is_array(ctx, obj))
+	{
+		n = pdf_array_len(ctx, obj);
+		h = dedup_hash_bytes(h, "[", 1);
+		h = dedup_hash_bytes(h, &n, sizeof n);
+		for (i = 0; i < n; i++)
+			h = dedup_hash_obj(ctx, pdf_array_get(ctx, obj, i), h);
+		return h;
+	}
+	if (pdf_is_dict(ctx, obj))
+	{
+		/* pdf_objcmp compares dictionary entries in order. */
+		n = pdf_dict_len(ctx, obj);
+		h = dedup_hash_bytes(h, "<", 1);
+		h = dedup_hash_bytes(h, &n, sizeof n);
+		for (i = 0; i < n; i++)
+		{
+			h = dedup_hash_obj(ctx, pdf_dict_get_key(ctx, obj, i), h);
+			h = dedup_hash_obj(ctx, pdf_dict_get_val(ctx, obj, i), h);
+		}
+		return h;
+	}
+	if (pdf_is_bool(ctx, obj))
+		return dedup_hash_bytes(h, pdf_to_bool(ctx, obj) ? "t" : "f", 1);
+	return dedup_hash_bytes(h, "n", 1);
+}
+
+static int dedup_cmp(const void *a_, const void *b_)
+{
+	const dedup_entry *a = a_;
+	const dedup_entry *b = b_;
+	if (a->hash != b->hash)
+		return a->hash < b->hash ? -1 : 1;
+	return a->num - b->num;
+}
+
+static void dedup_digest_stream(fz_context *ctx, pdf_document *doc, int num, dedup_digest *d)
+{
+	fz_buffer *buf;
+	unsigned char *data;
+	fz_md5 md5;
+
+	if (d->digested)
+		return;
+
+	buf = pdf_load_raw_stream_number(ctx, doc, num);
+	d->len = fz_buffer_storage(ctx, buf, &data);
+	fz_md5_init(&md5);
+	fz_md5_update(&md5, data, d->len);
+	fz_md5_final(&md5, d->digest);
+	fz_drop_buffer(ctx, buf);
+	d->digested = 1;
+}
+
+static int dedup_streams_differ(fz_context *ctx, pdf_document *doc, int num, int other, dedup_digest *digests)
+{
+	fz_buffer *sa = NULL;
+	fz_buffer *sb = NULL;
+	int differ = 1;
+
+	dedup_digest_stream(ctx, doc, num, &digests[num]);
+	dedup_digest_stream(ctx, doc, other, &digests[other]);
+	if (digests[num].len != digests[other].len)
+		return 1;
+	if (memcmp(digests[num].digest, digests[other].digest, 16))
+		return 1;
+
+	/* Digests match; confirm that the stream contents are identical. */
+	fz_var(sa);
+	fz_var(sb);
+	fz_try(ctx)
+	{
+		unsigned char *dataa, *datab;
+		size_t lena, lenb;
+		sa = pdf_load_raw_stream_number(ctx, doc, num);
+		sb = pdf_load_raw_stream_number(ctx, doc, other);
+		lena = fz_buffer_storage(ctx, sa, &dataa);
+		lenb = fz_buffer_storage(ctx, sb, &datab);
+		if (lena == lenb && memcmp(dataa, datab, lena) == 0)
+			differ = 0;
+	}
+	fz_always(ctx)
+	{
+		fz_drop_buffer(ctx, sa);
+		fz_drop_buffer(ctx, sb);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+	return differ;
+}
+
 static void removeduplicateobjs(fz_context *ctx, pdf_document *doc, pdf_write_state *opts)
 {
-	int num, other;
+	int num, other, i, j, start, n;
 	int xref_len = pdf_xref_len(ctx, doc);
+	dedup_entry *entries = NULL;
+	dedup_digest *digests = NULL;
+	unsigned char *is_stream = NULL;
 
-	for (num = 1; num < xref_len; num++)
+	fz_var(entries);
+	fz_var(digests);
+	fz_var(is_stream);
+
+	fz_try(ctx)
 	{
-		/* Only compare an object to objects preceding it */
-		for (other = 1; other < num; other++)
+		entries = fz_malloc_array(ctx, xref_len, sizeof(*entries));
+		is_stream = fz_calloc(ctx, xref_len, 1);
+
+		/* Hash every object that is a candidate for deduplication. */
+		n = 0;
+		for (num = 1; num < xref_len; num++)
 		{
-			pdf_obj *a, *b;
-			int newnum, streama = 0, streamb = 0, differ = 0;
+			int streama = 0;
 
-			if (num == other || !opts->use_list[num] || !opts->use_list[other])
+			if (!opts->use_list[num])
 				continue;
 
 			/* TODO: resolve indirect references to see if we can omit them */
 
 			/*
-			 * Comparing stream objects data contents would take too long.
+			 * Comparing stream objects data contents is expensive, so only
+			 * do it at the highest garbage collection level.
 			 *
 			 * pdf_obj_num_is_stream calls pdf_cache_object and ensures
 			 * that the xref table has the objects loaded.
@@ -658,70 +838,82 @@ static void removeduplicateobjs(fz_context *ctx, pdf_document *doc, pdf_write_st
 			fz_try(ctx)
 			{
 				streama = pdf_obj_num_is_stream(ctx, doc, num);
-				streamb = pdf_obj_num_is_stream(ctx, doc, other);
-				differ = streama || streamb;
-				if (streama && streamb && opts->do_garbage >= 4)
-					differ = 0;
 			}
 			fz_catch(ctx)
 			{
-				/* Assume different */
-				differ = 1;
+				/* Assume different from everything */
+				continue;
 			}
-			if (differ)
+			if (streama && opts->do_garbage < 4)
 				continue;
 
-			a = pdf_get_xref_entry(ctx, doc, num)->obj;
-			b = pdf_get_xref_entry(ctx, doc, other)->obj;
+			is_stream[num] = streama;
+			entries[n].hash = dedup_hash_obj(ctx, pdf_get_xref_entry(ctx, doc, num)->obj, 2166136261U);
+			entries[n].num = num;
+			n++;
+		}
 
-			if (pdf_objcmp(ctx, a, b))
-				continue;
+		qsort(entries, n, sizeof(*entries), dedup_cmp);
+
+		if (opts->do_garbage >= 4)
+			digests = fz_calloc(ctx, xref_len, sizeof(*digests));
 
-			if (streama && streamb)
+		/*
+		 * Within each bucket, entries are sorted by object number, so
+		 * comparing each object against the entries preceding it in its
+		 * bucket visits the same candidates, in the same order, as
+		 * comparing against every preceding object in the file.
+		 */
+		start = 0;
+		for (i = 0; i < n; i++)
+		{
+			if (entries[i].hash != entries[start].hash)
+				start = i;
+
+			num = entries[i].num;
+			for (j = start; j < i; j++)
 			{
-				/* Check to see if streams match too. */
-				fz_buffer *sa = NULL;
-				fz_buffer *sb = NULL;
+				pdf_obj *a, *b;
+				int newnum;
 
-				fz_var(sa);
-				fz_var(sb);
+				other = entries[j].num;
+				if (!opts->use_list[other])
+					continue;
+				if (is_stream[num] != is_stream[other])
+					continue;
 
-				differ = 1;
-				fz_try(ctx)
-				{
-					unsigned char *dataa, *datab;
-					size_t lena, lenb;
-					sa = pdf_load_raw_stream_number(ctx, doc, num);
-					sb = pdf_load_raw_stream_number(ctx, doc, other);
-					lena = fz_buffer_storage(ctx, sa, &dataa);
-					lenb = fz_buffer_storage(ctx, sb, &datab);
-					if (lena == lenb && memcmp(dataa, datab, lena) == 0)
-						differ = 0;
-				}
-				fz_always(ctx)
-				{
-					fz_drop_buffer(ctx, sa);
-					fz_drop_buffer(ctx, sb);
-				}
-				fz_catch(ctx)
-				{
-					fz_rethrow(ctx);
-				}
-				if (differ)
+				a = pdf_get_xref_entry(ctx, doc, num)->obj;
+				b = pdf_get_xref_entry(ctx, doc, other)->obj;
+
+				if (pdf_objcmp(ctx, a, b))
+					continue;
+
+				/* Check to see if streams match too. */
+				if (is_stream[num] && dedup_streams_differ(ctx, doc, num, other, digests))
 					continue;
-			}
 
-			/* Keep the lowest numbered object */
-			newnum = fz_mini(num, other);
-			opts->renumber_map[num] = newnum;
-			opts->renumber_map[other] = newnum;
-			opts->rev_renumber_map[newnum] = num; /* Either will do */
-			opts->use_list[fz_maxi(num, other)] = 0;
+				/* Keep the lowest numbered object */
+				newnum = fz_mini(num, other);
+				opts->renumber_map[num] = newnum;
+				opts->renumber_map[other] = newnum;
+				opts->rev_renumber_map[newnum] = num; /* Either will do */
+				opts->use_list[fz_maxi(num, other)] = 0;
 
-			/* One duplicate was found, do not look for another */
-			break;
+				/* One duplicate was found, do not look for another */
+				break;
+			}
 		}
 	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, entries);
+		fz_free(ctx, digests);
+		fz_free(ctx, is_stream);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
 }
 
 /*
@@ -1816,6 +2008,11 @@ static int is_xml_metadata(fz_context *ctx, pdf_obj *obj)
 	return 0;
 }
 
+static int is_new_objstm(pdf_write_state *opts, int num)
+{
+	return num >= opts->objstm_first && num < opts->objstm_first + opts->objstm_count;
+}
+
 static void writeobject(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int num, int gen, int skip_xrefs)
 {
 	pdf_xref_entry *entry;
@@ -1841,11 +2038,11 @@ static void writeobject(fz_context *ctx, pdf_document *doc, pdf_write_state *opt
 			fz_rethrow(ctx);
 	}
 
-	/* skip ObjStm and XRef objects */
+	/* skip ObjStm and XRef objects (other than the object streams we are writing) */
 	if (pdf_is_dict(ctx, obj))
 	{
 		type = pdf_dict_get(ctx, obj, PDF_NAME_Type);
-		if (pdf_name_eq(ctx, type, PDF_NAME_ObjStm))
+		if (pdf_name_eq(ctx, type, PDF_NAME_ObjStm) && !is_new_objstm(opts, num))
 		{
 			opts->use_list[num] = 0;
 			pdf_drop_obj(ctx, obj);
@@ -1884,6 +2081,8 @@ static void writeobject(fz_context *ctx, pdf_document *doc, pdf_write_state *opt
 				do_deflate = 1, do_expand = 0;
 			if (is_xml_metadata(ctx, obj))
 				do_deflate = 0, do_expand = 0;
+			if (is_new_objstm(opts, num))
+				do_deflate = !opts->do_expand, do_expand = 0;
 			if (do_expand)
 				expandstream(ctx, doc, opts, obj, num, gen, do_deflate);
 			else
@@ -2016,12 +2215,25 @@ static void writexrefstreamsubsect(fz_context *ctx, pdf_document *doc, pdf_write
 	pdf_array_push_drop(ctx, index, pdf_new_int(ctx, doc, to - from));
 	for (num = from; num < to; num++)
 	{
-		fz_append_byte(ctx, fzbuf, opts->use_list[num] ? 1 : 0);
-		fz_append_byte(ctx, fzbuf, opts->ofs_list[num]>>24);
-		fz_append_byte(ctx, fzbuf, opts->ofs_list[num]>>16);
-		fz_append_byte(ctx, fzbuf, opts->ofs_list[num]>>8);
-		fz_append_byte(ctx, fzbuf, opts->ofs_list[num]);
-		fz_append_byte(ctx, fzbuf, opts->gen_list[num]);
+		int type = opts->use_list[num] ? 1 : 0;
+		fz_off_t f2 = opts->ofs_list[num];
+		int f3 = opts->gen_list[num];
+
+		/* Objects packed into an object stream */
+		if (opts->objstm_list && opts->objstm_list[num])
+		{
+			type = 2;
+			f2 = opts->objstm_list[num];
+			f3 = opts->objstm_index[num];
+		}
+
+		fz_append_byte(ctx, fzbuf, type);
+		fz_append_byte(ctx, fzbuf, f2>>24);
+		fz_append_byte(ctx, fzbuf, f2>>16);
+		fz_append_byte(ctx, fzbuf, f2>>8);
+		fz_append_byte(ctx, fzbuf, f2);
+		fz_append_byte(ctx, fzbuf, f3>>8);
+		fz_append_byte(ctx, fzbuf, f3);
 	}
 }
 
@@ -2088,7 +2300,7 @@ static void writexrefstream(fz_context *ctx, pdf_document *doc, pdf_write_state
 		pdf_dict_put(ctx, dict, PDF_NAME_W, w);
 		pdf_array_push_drop(ctx, w, pdf_new_int(ctx, doc, 1));
 		pdf_array_push_drop(ctx, w, pdf_new_int(ctx, doc, 4));
-		pdf_array_push_drop(ctx, w, pdf_new_int(ctx, doc, 1));
+		pdf_array_push_drop(ctx, w, pdf_new_int(ctx, doc, 2));
 
 		index = pdf_new_array(ctx, doc, 2);
 		pdf_dict_put_drop(ctx, dict, PDF_NAME_Index, index);
@@ -2097,7 +2309,7 @@ static void writexrefstream(fz_context *ctx, pdf_document *doc, pdf_write_state
 		opts->use_list[num] = 1;
 		opts->ofs_list[num] = opts->first_xref_entry_offset;
 
-		fzbuf = fz_new_buffer(ctx, (1 + 4 + 1) * (to-from));
+		fzbuf = fz_new_buffer(ctx, (1 + 4 + 2) * (to-from));
 
 		if (opts->do_incremental)
 		{
@@ -2128,6 +2340,8 @@ static void writexrefstream(fz_context *ctx, pdf_document *doc, pdf_write_state
 
 		writeobject(ctx, doc, opts, num, 0, 0);
 		fz_write_printf(ctx, opts->out, "startxref\n%Zd\n%%%%EOF\n", startxref);
+
+		doc->has_xref_streams = 1;
 	}
 	fz_always(ctx)
 	{
@@ -2176,6 +2390,10 @@ dowriteobject(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int num
 	if (opts->do_garbage && !opts->use_list[num])
 		return;
 
+	/* Objects packed into object streams are written as part of those */
+	if (opts->objstm_list && opts->objstm_list[num])
+		return;
+
 	if (entry->type == 'n' || entry->type == 'o')
 	{
 		if (pass > 0)
@@ -2198,7 +2416,11 @@ writeobjects(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int pass
 
 	if (!opts->do_incremental)
 	{
-		fz_write_printf(ctx, opts->out, "%%PDF-%d.%d\n", doc->version / 10, doc->version % 10);
+		int version = doc->version;
+		/* Object and cross reference streams require PDF 1.5 */
+		if (opts->do_objstms && version < 15)
+			version = 15;
+		fz_write_printf(ctx, opts->out, "%%PDF-%d.%d\n", version / 10, version % 10);
 		fz_write_string(ctx, opts->out, "%\xC2\xB5\xC2\xB6\n\n");
 	}
 
@@ -2229,6 +2451,192 @@ writeobjects(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int pass
 	}
 }
 
+/*
+ * Pack objects into object streams.
+ *
+ * Only non-stream objects with a generation number of zero may be stored in
+ * an object stream. We allocate the object streams at the end of the xref,
+ * and record which stream (and index within it) each packed object ends up
+ * in, so that the cross reference stream can refer to them.
+ */
+
+#define OBJSTM_MAXOBJS 100
+
+static int
+can_pack_object(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int num)
+{
+	pdf_xref_entry *entry;
+	int is_stream = 1;
+
+	if (!opts->use_list[num])
+		return 0;
+
+	entry = pdf_get_xref_entry(ctx, doc, num);
+	if (entry->type != 'n' && entry->type != 'o')
+		return 0;
+	if (entry->type == 'n' && entry->gen != 0 && opts->do_garbage < 2)
+		return 0;
+
+	fz_try(ctx)
+	{
+		is_stream = pdf_obj_num_is_stream(ctx, doc, num);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow_if(ctx, FZ_ERROR_TRYLATER);
+		/* Leave it to writeobject to report the error */
+		return 0;
+	}
+
+	return !is_stream;
+}
+
+static void
+expand_write_state(fz_context *ctx, pdf_write_state *opts, int old_len, int new_len)
+{
+	int num;
+
+	opts->use_list = fz_resize_array(ctx, opts->use_list, new_len + 3, sizeof(int));
+	opts->ofs_list = fz_resize_array(ctx, opts->ofs_list, new_len + 3, sizeof(fz_off_t));
+	opts->gen_list = fz_resize_array(ctx, opts->gen_list, new_len + 3, sizeof(int));
+	opts->renumber_map = fz_resize_array(ctx, opts->renumber_map, new_len + 3, sizeof(int));
+	opts->rev_renumber_map = fz_resize_array(ctx, opts->rev_renumber_map, new_len + 3, sizeof(int));
+	opts->objstm_list = fz_resize_array(ctx, opts->objstm_list, new_len + 3, sizeof(int));
+	opts->objstm_index = fz_resize_array(ctx, opts->objstm_index, new_len + 3, sizeof(int));
+
+	for (num = old_len; num < new_len + 3; num++)
+	{
+		opts->use_list[num] = 0;
+		opts->ofs_list[num] = 0;
+		opts->gen_list[num] = 0;
+		opts->renumber_map[num] = num;
+		opts->rev_renumber_map[num] = num;
+		opts->objstm_list[num] = 0;
+		opts->objstm_index[num] = 0;
+	}
+}
+
+static void
+writeobjstm(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int stm, const int *list, int n)
+{
+	fz_buffer *buf = NULL;
+	fz_buffer *body = NULL;
+	fz_output *out = NULL;
+	pdf_obj *dict = NULL;
+	pdf_obj *obj;
+	int i;
+
+	fz_var(buf);
+	fz_var(body);
+	fz_var(out);
+	fz_var(dict);
+
+	fz_try(ctx)
+	{
+		buf = fz_new_buffer(ctx, 12 * n);
+		body = fz_new_buffer(ctx, 256 * n);
+		out = fz_new_output_with_buffer(ctx, body);
+
+		for (i = 0; i < n; i++)
+		{
+			int num = list[i];
+
+			fz_append_printf(ctx, buf, "%d %d ", num, (int)fz_tell_output(ctx, out));
+
+			fz_try(ctx)
+			{
+				obj = pdf_load_object(ctx, doc, num);
+			}
+			fz_catch(ctx)
+			{
+				fz_rethrow_if(ctx, FZ_ERROR_TRYLATER);
+				if (!opts->continue_on_error)
+					fz_rethrow(ctx);
+				if (opts->errors)
+					(*opts->errors)++;
+				fz_warn(ctx, "%s", fz_caught_message(ctx));
+				obj = NULL;
+			}
+			if (obj)
+			{
+				fz_try(ctx)
+					pdf_print_obj(ctx, out, obj, opts->do_tight);
+				fz_always(ctx)
+					pdf_drop_obj(ctx, obj);
+				fz_catch(ctx)
+					fz_rethrow(ctx);
+			}
+			else
+				fz_write_string(ctx, out, "null");
+			fz_write_byte(ctx, out, '\n');
+
+			opts->objstm_list[num] = stm;
+			opts->objstm_index[num] = i;
+		}
+
+		dict = pdf_new_dict(ctx, doc, 4);
+		pdf_dict_put_drop(ctx, dict, PDF_NAME_Type, PDF_NAME_ObjStm);
+		pdf_dict_put_drop(ctx, dict, PDF_NAME_N, pdf_new_int(ctx, doc, n));
+		pdf_dict_put_drop(ctx, dict, PDF_NAME_First, pdf_new_int(ctx, doc, (int)fz_buffer_storage(ctx, buf, NULL)));
+		pdf_update_object(ctx, doc, stm, dict);
+
+		fz_append_buffer(ctx, buf, body);
+		pdf_update_stream(ctx, doc, dict, buf, 0);
+
+		opts->use_list[stm] = 1;
+	}
+	fz_always(ctx)
+	{
+		fz_drop_output(ctx, out);
+		fz_drop_buffer(ctx, body);
+		fz_drop_buffer(ctx, buf);
+		pdf_drop_obj(ctx, dict);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+static int
+makeobjstms(fz_context *ctx, pdf_document *doc, pdf_write_state *opts, int xref_len)
+{
+	int *list;
+	int num, count, i, n, old_len, new_len;
+
+	list = fz_malloc_array(ctx, xref_len, sizeof(int));
+
+	fz_try(ctx)
+	{
+		count = 0;
+		for (num = 1; num < xref_len; num++)
+			if (can_pack_object(ctx, doc, opts, num))
+				list[count++] = num;
+
+		old_len = pdf_xref_len(ctx, doc);
+		opts->objstm_first = old_len;
+		opts->objstm_count = (count + OBJSTM_MAXOBJS - 1) / OBJSTM_MAXOBJS;
+		new_len = old_len + opts->objstm_count;
+		expand_write_state(ctx, opts, xref_len, new_len);
+
+		for (i = 0; i < count; i += OBJSTM_MAXOBJS)
+		{
+			n = fz_mini(OBJSTM_MAXOBJS, count - i);
+			writeobjstm(ctx, doc, opts, pdf_create_object(ctx, doc), list + i, n);
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, list);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+
+	return pdf_xref_len(ctx, doc);
+}
+
 static int
 my_log2(int x)
 {
@@ -2713,6 +3121,7 @@ static void initialise_write_state(fz_context *ctx, pdf_document *doc, const pdf
 	opts->do_garbage = in_opts->do_garbage;
 	opts->do_linear = in_opts->do_linear;
 	opts->do_clean = in_opts->do_clean;
+	opts->do_objstms = in_opts->do_objstms;
 	opts->start = 0;
 	opts->main_xref_offset = INT_MIN;
 
@@ -2726,6 +3135,11 @@ static void initialise_write_state(fz_context *ctx, pdf_document *doc, const pdf
 	opts->rev_renumber_map = fz_malloc_array(ctx, xref_len + 3, sizeof(int));
 	opts->continue_on_error = in_opts->continue_on_error;
 	opts->errors = in_opts->errors;
+	if (opts->do_objstms)
+	{
+		opts->objstm_list = fz_calloc(ctx, xref_len + 3, sizeof(int));
+		opts->objstm_index = fz_calloc(ctx, xref_len + 3, sizeof(int));
+	}
 
 	for (num = 0; num < xref_len; num++)
 	{
@@ -2744,6 +3158,8 @@ static void finalise_write_state(fz_context *ctx, pdf_write_state *opts)
 	fz_free(ctx, opts->gen_list);
 	fz_free(ctx, opts->renumber_map);
 	fz_free(ctx, opts->rev_renumber_map);
+	fz_free(ctx, opts->objstm_list);
+	fz_free(ctx, opts->objstm_index);
 	pdf_drop_obj(ctx, opts->linear_l);
 	pdf_drop_obj(ctx, opts->linear_h0);
 	pdf_drop_obj(ctx, opts->linear_h1);
@@ -2769,6 +3185,7 @@ const char *fz_pdf_write_options_usage =
 	"\tgarbage: garbage collect unused objects\n"
 	"\tor garbage=compact: ... and compact cross reference table\n"
 	"\tor garbage=deduplicate: ... and remove duplicate objects\n"
+	"\tobjstms: pack objects into object streams and write a cross reference stream\n"
 	"\n";
 
 pdf_write_options *
@@ -2798,6 +3215,8 @@ pdf_parse_write_options(fz_context *ctx, pdf_write_options *opts, const char *ar
 		opts->do_incremental = fz_option_eq(val, "yes");
 	if (fz_has_option(ctx, args, "continue-on-error", &val))
 		opts->continue_on_error = fz_option_eq(val, "yes");
+	if (fz_has_option(ctx, args, "objstms", &val))
+		opts->do_objstms = fz_option_eq(val, "yes");
 	if (fz_has_option(ctx, args, "garbage", &val))
 	{
 		if (fz_option_eq(val, "yes"))
@@ -2934,6 +3353,9 @@ do_pdf_save_document(fz_context *ctx, pdf_document *doc, pdf_write_state *opts,
 		}
 		else
 		{
+			if (opts->do_objstms)
+				xref_len = makeobjstms(ctx, doc, opts, xref_len);
+
 			writeobjects(ctx, doc, opts, 0);
 
 #ifdef DEBUG_WRITING
@@ -2976,7 +3398,10 @@ do_pdf_save_document(fz_context *ctx, pdf_document *doc, pdf_write_state *opts,
 			else
 			{
 				opts->first_xref_offset = fz_tell_output(ctx, opts->out);
-				writexref(ctx, doc, opts, 0, xref_len, 1, 0, opts->first_xref_offset);
+				if (opts->do_objstms)
+					writexrefstream(ctx, doc, opts, 0, xref_len, 1, 0, opts->first_xref_offset);
+				else
+					writexref(ctx, doc, opts, 0, xref_len, 1, 0, opts->first_xref_offset);
 			}
 
 			doc->xref_sections[0].end_ofs = fz_tell_output(ctx, opts->out);
@@ -3030,6 +3455,10 @@ void pdf_write_document(fz_context *ctx, pdf_document *doc, fz_output *out, pdf_
 		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't do incremental writes with garbage collection");
 	if (in_opts->do_incremental && in_opts->do_linear)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't do incremental writes with linearisation");
+	if (in_opts->do_incremental && in_opts->do_objstms)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't do incremental writes with object streams");
+	if (in_opts->do_linear && in_opts->do_objstms)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't do linearisation with object streams");
 	if (pdf_has_unsaved_sigs(ctx, doc))
 		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't write pdf that has unsaved sigs to a fz_output!");
 
@@ -3059,6 +3488,10 @@ void pdf_save_document(fz_context *ctx, pdf_document *doc, const char *filename,
 		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't do incremental writes with garbage collection");
 	if (in_opts->do_incremental && in_opts->do_linear)
 		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't do incremental writes with linearisation");
+	if (in_opts->do_incremental && in_opts->do_objstms)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't do incremental writes with object streams");
+	if (in_opts->do_linear && in_opts->do_objstms)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "Can't do linearisation with object streams");
 
 	prepare_for_save(ctx, doc, in_opts);
 
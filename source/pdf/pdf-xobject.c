@@ -1,5 +1,6 @@
 #include "mupdf/fitz.h"
 #include "mupdf/pdf.h"
+#include "pdf-imp.h"
 
 pdf_xobject *
 pdf_keep_xobject(fz_context *ctx, pdf_xobject *xobj)
@@ -13,7 +14,7 @@ pdf_drop_xobject(fz_context *ctx, pdf_xobject *xobj)
 	fz_drop_storable(ctx, &xobj->storable);
 }
 
-static void
+void
 pdf_drop_xobject_imp(fz_context *ctx, fz_storable *xobj_)
 {
 	pdf_xobject *xobj = (pdf_xobject *)xobj_;
@@ -92,8 +93,8 @@ pdf_xobject_colorspace(fz_context *ctx, pdf_xobject *xobj)
 	return NULL;
 }
 
-pdf_xobject *
-pdf_load_xobject(fz_context *ctx, pdf_document *doc, pdf_obj *dict)
+static pdf_xobject *
+pdf_load_xobject_imp(fz_context *ctx, pdf_document *doc, pdf_obj *dict)
 {
 	pdf_xobject *form;
 
@@ -113,6 +114,23 @@ pdf_load_xobject(fz_context *ctx, pdf_document *doc, pdf_obj *dict)
 	return form;
 }
 
+pdf_xobject *
+pdf_load_xobject(fz_context *ctx, pdf_document *doc, pdf_obj *dict)
+{
+	pdf_xobject *form = NULL;
+
+	/* Other threads must not find the form before it is filled in. */
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+		form = pdf_load_xobject_imp(ctx, doc, dict);
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return form;
+}
+
 pdf_obj *
 pdf_new_xobject(fz_context *ctx, pdf_document *doc, const fz_rect *bbox, const fz_matrix *mat)
 {
@@ -1911,8 +1911,8 @@ read_hinted_object(fz_context *ctx, pdf_document *doc, int num)
 	return expected != 0;
 }
 
-pdf_xref_entry *
-pdf_cache_object(fz_context *ctx, pdf_document *doc, int num)
+static pdf_xref_entry *
+pdf_cache_object_imp(fz_context *ctx, pdf_document *doc, int num)
 {
 	pdf_xref_entry *x;
 	int rnum, rgen, try_repair;
@@ -1962,6 +1962,15 @@ object_updated:
 			try_repair = (doc->repair_attempted == 0);
 		}
 
+		if (try_repair && doc->threaded)
+		{
+			/* Repairing would free objects other threads are using */
+			if (rnum == num)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "cannot parse object (%d 0 R) in shared document", num);
+			else
+				fz_throw(ctx, FZ_ERROR_GENERIC, "found object (%d 0 R) instead of (%d 0 R) in shared document", rnum, num);
+		}
+
 		if (try_repair)
 		{
 			fz_try(ctx)
@@ -2011,6 +2020,26 @@ object_updated:
 	return x;
 }
 
+pdf_xref_entry *
+pdf_cache_object(fz_context *ctx, pdf_document *doc, int num)
+{
+	pdf_xref_entry *x = NULL;
+
+	/* Avoid the cost of the fz_try on this hot path when we can. */
+	if (!doc->threaded)
+		return pdf_cache_object_imp(ctx, doc, num);
+
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+		x = pdf_cache_object_imp(ctx, doc, num);
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	return x;
+}
+
 pdf_obj *
 pdf_load_object(fz_context *ctx, pdf_document *doc, int num)
 {
@@ -2080,7 +2109,12 @@ pdf_create_object(fz_context *ctx, pdf_document *doc)
 {
 	/* TODO: reuse free object slots by properly linking free object chains in the ofs field */
 	pdf_xref_entry *entry;
-	int num = pdf_xref_len(ctx, doc);
+	int num;
+
+	if (doc->threaded)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot edit a document shared between threads");
+
+	num = pdf_xref_len(ctx, doc);
 	entry = pdf_get_incremental_xref_entry(ctx, doc, num);
 	entry->type = 'f';
 	entry->ofs = -1;
@@ -2097,6 +2131,9 @@ pdf_delete_object(fz_context *ctx, pdf_document *doc, int num)
 {
 	pdf_xref_entry *x;
 
+	if (doc->threaded)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot edit a document shared between threads");
+
 	if (num <= 0 || num >= pdf_xref_len(ctx, doc))
 	{
 		fz_warn(ctx, "object out of range (%d 0 R); xref size %d", num, pdf_xref_len(ctx, doc));
@@ -2122,6 +2159,9 @@ pdf_update_object(fz_context *ctx, pdf_document *doc, int num, pdf_obj *newobj)
 {
 	pdf_xref_entry *x;
 
+	if (doc->threaded)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot edit a document shared between threads");
+
 	if (num <= 0 || num >= pdf_xref_len(ctx, doc))
 	{
 		fz_warn(ctx, "object out of range (%d 0 R); xref size %d", num, pdf_xref_len(ctx, doc));
@@ -2148,9 +2188,13 @@ pdf_update_object(fz_context *ctx, pdf_document *doc, int num, pdf_obj *newobj)
 void
 pdf_update_stream(fz_context *ctx, pdf_document *doc, pdf_obj *obj, fz_buffer *newbuf, int compressed)
 {
+	pdf_obj *ref;
 	int num;
 	pdf_xref_entry *x;
 
+	if (doc->threaded)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot edit a document shared between threads");
+
 	if (pdf_is_indirect(ctx, obj))
 		num = pdf_to_num(ctx, obj);
 	else
@@ -2166,6 +2210,14 @@ pdf_update_stream(fz_context *ctx, pdf_document *doc, pdf_obj *obj, fz_buffer *n
 	fz_drop_buffer(ctx, x->stm_buf);
 	x->stm_buf = fz_keep_buffer(ctx, newbuf);
 
+	/* Forget any tokenised copy of the old contents. */
+	if (pdf_is_indirect(ctx, obj))
+		ref = pdf_keep_obj(ctx, obj);
+	else
+		ref = pdf_new_indirect(ctx, doc, num, x->type == 'o' ? 0 : x->gen);
+	pdf_remove_item(ctx, pdf_drop_content_ops_imp, ref);
+	pdf_drop_obj(ctx, ref);
+
 	pdf_dict_puts_drop(ctx, obj, "Length", pdf_new_int(ctx, doc, (int)fz_buffer_storage(ctx, newbuf, NULL)));
 	if (!compressed)
 	{
@@ -2215,6 +2267,71 @@ pdf_lookup_metadata(fz_context *ctx, pdf_document *doc, const char *key, char *b
 	return -1;
 }
 
+/*
+	The fingerprint is made from the file length, the first and last
+	kilobyte of the file (which hold the header, the linearization
+	dictionary if any, and the last trailer and xref) and the trailer
+	/ID. An incremental update changes the length and the tail, so
+	each revision of a file has its own. Edited documents no longer
+	match their file, so they have none; a repair counts as an edit.
+*/
+static int
+pdf_fingerprint(fz_context *ctx, pdf_document *doc, unsigned char digest[16])
+{
+	unsigned char buf[1024];
+	pdf_obj *id;
+	fz_md5 md5;
+	fz_off_t len;
+	size_t n;
+	int i;
+
+	if (doc->dirty)
+		return 0;
+
+	pdf_lock_document(ctx, doc);
+	fz_try(ctx)
+	{
+		if (!doc->has_fingerprint)
+		{
+			fz_md5_init(&md5);
+			fz_md5_update(&md5, (const unsigned char *)"pdf 1", 5);
+
+			fz_seek(ctx, doc->file, 0, SEEK_END);
+			len = fz_tell(ctx, doc->file);
+			for (i = 0; i < 8; i++)
+				buf[i] = (unsigned char)(len >> (i * 8));
+			fz_md5_update(&md5, buf, 8);
+
+			fz_seek(ctx, doc->file, 0, SEEK_SET);
+			n = fz_read(ctx, doc->file, buf, sizeof buf);
+			fz_md5_update(&md5, buf, n);
+			fz_seek(ctx, doc->file, len > (fz_off_t)sizeof buf ? len - (fz_off_t)sizeof buf : 0, SEEK_SET);
+			n = fz_read(ctx, doc->file, buf, sizeof buf);
+			fz_md5_update(&md5, buf, n);
+
+			id = pdf_dict_get(ctx, pdf_trailer(ctx, doc), PDF_NAME_ID);
+			for (i = 0; i < pdf_array_len(ctx, id); i++)
+			{
+				pdf_obj *s = pdf_array_get(ctx, id, i);
+				fz_md5_update(&md5, (const unsigned char *)pdf_to_str_buf(ctx, s), pdf_to_str_len(ctx, s));
+			}
+
+			fz_md5_final(&md5, doc->fingerprint);
+			doc->has_fingerprint = 1;
+		}
+		memcpy(digest, doc->fingerprint, 16);
+	}
+	fz_always(ctx)
+		pdf_unlock_document(ctx, doc);
+	fz_catch(ctx)
+	{
+		fz_warn(ctx, "cannot fingerprint document: %s", fz_caught_message(ctx));
+		return 0;
+	}
+
+	return 1;
+}
+
 /*
 	Initializers for the fz_document interface.
 
@@ -2240,6 +2357,7 @@ pdf_new_document(fz_context *ctx, fz_stream *file)
 	doc->super.count_pages = (fz_document_count_pages_fn*)pdf_count_pages;
 	doc->super.load_page = (fz_document_load_page_fn*)pdf_load_page;
 	doc->super.lookup_metadata = (fz_document_lookup_metadata_fn*)pdf_lookup_metadata;
+	doc->super.fingerprint = (fz_document_fingerprint_fn*)pdf_fingerprint;
 	doc->update_appearance = pdf_update_appearance;
 
 	pdf_lexbuf_init(ctx, &doc->lexbuf.base, PDF_LEXBUF_LARGE);
@@ -2641,6 +2759,105 @@ pdf_document *pdf_specifics(fz_context *ctx, fz_document *doc)
 	return pdf_document_from_fz_document(ctx, doc);
 }
 
+/* Check that every object not yet loaded starts where the xref says. */
+static int
+pdf_xref_offsets_valid(fz_context *ctx, pdf_document *doc)
+{
+	pdf_lexbuf *buf = &doc->lexbuf.base;
+	int num, len = pdf_xref_len(ctx, doc);
+	int ok = 1;
+
+	fz_try(ctx)
+	{
+		for (num = 1; ok && num < len; num++)
+		{
+			pdf_xref_entry *x = pdf_get_xref_entry(ctx, doc, num);
+			if (x->type != 'n' || x->obj)
+				continue;
+			fz_seek(ctx, doc->file, x->ofs, FZ_SEEK_SET);
+			ok = (pdf_lex(ctx, doc->file, buf) == PDF_TOK_INT && buf->i == num &&
+				pdf_lex(ctx, doc->file, buf) == PDF_TOK_INT &&
+				pdf_lex(ctx, doc->file, buf) == PDF_TOK_OBJ);
+		}
+	}
+	fz_catch(ctx)
+		ok = 0;
+
+	return ok;
+}
+
+void
+pdf_enable_threading(fz_context *ctx, pdf_document *doc)
+{
+	pdf_page *page = NULL;
+	int i, n;
+
+	fz_var(page);
+
+	if (!doc || doc->threaded)
+		return;
+
+	/* A repair replaces the xref, freeing objects that other threads
+	 * may be using, so it cannot be done once the document is shared.
+	 * Do it now if the xref does not match the file. */
+	if (!doc->repair_attempted && !pdf_xref_offsets_valid(ctx, doc))
+	{
+		fz_warn(ctx, "repairing document before sharing it between threads");
+		pdf_repair_xref(ctx, doc);
+		pdf_prime_xref_index(ctx, doc);
+		pdf_repair_obj_stms(ctx, doc);
+	}
+
+	/* Loading a page synthesises appearance streams for annotations
+	 * that lack them, creating objects and editing the annotations.
+	 * Load every page once now, so that none of that happens later. */
+	if (doc->update_appearance)
+	{
+		n = pdf_count_pages(ctx, doc);
+		for (i = 0; i < n; i++)
+		{
+			fz_try(ctx)
+				page = pdf_load_page(ctx, doc, i);
+			fz_always(ctx)
+			{
+				fz_drop_page(ctx, (fz_page *)page);
+				page = NULL;
+			}
+			fz_catch(ctx)
+				fz_warn(ctx, "cannot make annotation appearances on page %d", i + 1);
+		}
+		doc->update_appearance = NULL;
+	}
+
+	doc->threaded = 1;
+}
+
+/*
+	All shared documents use the one FZ_LOCK_PDF, so the lock is
+	recursive across documents as well as within one: loading an
+	object or resource often loads others, perhaps from another
+	document. The depth is kept in the calling thread's own context,
+	so no other thread ever reads it.
+*/
+void
+pdf_lock_document(fz_context *ctx, pdf_document *doc)
+{
+	if (!doc || !doc->threaded)
+		return;
+	if (ctx->pdf_lock_depth++ == 0)
+		fz_lock(ctx, FZ_LOCK_PDF);
+}
+
+void
+pdf_unlock_document(fz_context *ctx, pdf_document *doc)
+{
+	if (!doc || !doc->threaded)
+		return;
+	assert(ctx->pdf_lock_depth > 0);
+	if (--ctx->pdf_lock_depth == 0)
+		fz_unlock(ctx, FZ_LOCK_PDF);
+}
+
 pdf_obj *
 pdf_add_object(fz_context *ctx, pdf_document *doc, pdf_obj *obj)
 {
@@ -32,7 +32,7 @@ enum {
 	OUT_PNG, OUT_TGA, OUT_PNM, OUT_PGM, OUT_PPM, OUT_PAM,
 	OUT_PBM, OUT_PKM, OUT_PWG, OUT_PCL, OUT_PS, OUT_PSD,
 	OUT_TEXT, OUT_HTML, OUT_XHTML, OUT_STEXT, OUT_PCLM,
-	OUT_TRACE, OUT_SVG,
+	OUT_TRACE, OUT_SVG, OUT_LIST,
 #if FZ_ENABLE_PDF
 	OUT_PDF,
 #endif
@@ -77,6 +77,7 @@ static const suffix_t suffix_table[] =
 	{ ".stext", OUT_STEXT, 0 },
 
 	{ ".trace", OUT_TRACE, 0 },
+	{ ".list", OUT_LIST, 0 },
 	{ ".gproof", OUT_GPROOF, 0 },
 };
 
@@ -129,6 +130,7 @@ static const format_cs_table_t format_cs_table[] =
 
 	{ OUT_TRACE, CS_RGB, { CS_RGB } },
 	{ OUT_SVG, CS_RGB, { CS_RGB } },
+	{ OUT_LIST, CS_RGB, { CS_RGB } },
 #if FZ_ENABLE_PDF
 	{ OUT_PDF, CS_RGB, { CS_RGB } },
 #endif
@@ -208,6 +210,25 @@ typedef struct worker_t {
 #endif
 } worker_t;
 
+#ifndef DISABLE_MUTHREADS
+typedef struct pageworker_t {
+	fz_context *ctx;
+	int num;
+	fz_document *doc; /* shared or private copy of the current document */
+	int pagenum; /* -1 to shutdown, or page to render */
+	fz_pixmap *pix;
+	fz_bitmap *bit;
+	fz_cookie cookie;
+	int interptime;
+	int rendertime;
+	int failed;
+	char message[256];
+	mu_semaphore start;
+	mu_semaphore stop;
+	mu_thread thread;
+} pageworker_t;
+#endif
+
 static char *output = NULL;
 static fz_output *out = NULL;
 static int output_pagenum = 0;
@@ -235,6 +256,7 @@ static int showfeatures = 0;
 static int showtime = 0;
 static int showmemory = 0;
 static int showmd5 = 0;
+static int showstore = 0;
 
 #if FZ_ENABLE_PDF
 static pdf_document *pdfout = NULL;
@@ -242,6 +264,7 @@ static pdf_document *pdfout = NULL;
 
 static int ignore_errors = 0;
 static int uselist = 1;
+static int list_pages_written = 0;
 static int alphabits_text = 8;
 static int alphabits_graphics = 8;
 
@@ -259,6 +282,11 @@ static char *filename;
 static int files = 0;
 static int num_workers = 0;
 static worker_t *workers;
+static int num_page_workers = 0;
+#ifndef DISABLE_MUTHREADS
+static pageworker_t *page_workers;
+static int num_scale_threads = 0;
+#endif
 static fz_band_writer *bander = NULL;
 
 #ifdef NO_ICC
@@ -268,6 +296,9 @@ static fz_cmm_engine *icc_engine = &fz_cmm_engine_lcms;
 #endif
 
 static const char *layer_config = NULL;
+static const char *disk_store = NULL;
+static const char *png_options = NULL;
+static fz_png_options png_opts;
 
 static struct {
 	int active;
@@ -306,6 +337,7 @@ static void usage(void)
 		"\t-F -\toutput format (default inferred from output file name)\n"
 		"\t\traster: png, tga, pnm, pam, pbm, pkm, pwg, pcl, ps\n"
 		"\t\tvector: svg, pdf, trace\n"
+		"\t\tdisplay list: list (one page per file)\n"
 		"\t\ttext: txt, html, stext\n"
 		"\n"
 		"\t-s -\tshow extra information:\n"
@@ -313,6 +345,7 @@ static void usage(void)
 		"\t\tt - show timings\n"
 		"\t\tf - show page features\n"
 		"\t\t5 - show md5 checksum of rendered image\n"
+		"\t\ts - show store (cache) statistics after each file\n"
 		"\n"
 		"\t-R -\trotate clockwise (default: 0 degrees)\n"
 		"\t-r -\tresolution in dpi (default: 72)\n"
@@ -320,10 +353,15 @@ static void usage(void)
 		"\t-h -\theight (in pixels) (maximum height if -r is specified)\n"
 		"\t-f -\tfit width and/or height exactly; ignore original aspect ratio\n"
 		"\t-B -\tmaximum band_height (pgm, ppm, pam, png output only)\n"
+		"\t-Z -\tpng options (compression=0-9, filter=none/sub/up/average/paeth)\n"
 #ifndef DISABLE_MUTHREADS
 		"\t-T -\tnumber of threads to use for rendering (banded mode only)\n"
+		"\t-j -\tnumber of pages to render in parallel (raster output only)\n"
+		"\t-J -\tnumber of threads to use for decoding, scaling and png compressing large images\n"
 #else
 		"\t-T -\tnumber of threads to use for rendering (disabled in this non-threading build)\n"
+		"\t-j -\tnumber of pages to render in parallel (disabled in this non-threading build)\n"
+		"\t-J -\tnumber of threads to use for decoding, scaling and png compressing large images (disabled in this non-threading build)\n"
 #endif
 		"\n"
 		"\t-W -\tpage width for EPUB layout\n"
@@ -342,6 +380,7 @@ static void usage(void)
 		"\t-D\tdisable use of display list\n"
 		"\t-i\tignore errors\n"
 		"\t-L\tlow memory mode (avoid caching, clear objects after each page)\n"
+		"\t-K -\tdirectory to keep display lists and decoded images in for later runs (up to 1GB)\n"
 #ifndef DISABLE_MUTHREADS
 		"\t-P\tparallel interpretation/rendering\n"
 #else
@@ -446,6 +485,155 @@ file_level_trailers(fz_context *ctx)
 
 }
 
+/* Work out the transform and bounds to render a page into a pixmap */
+static void raster_transform(const fz_rect *mediabox, fz_matrix *ctm, fz_rect *tbounds, fz_irect *ibounds)
+{
+	float zoom;
+	int w, h;
+
+	zoom = resolution / 72;
+	fz_pre_scale(fz_rotate(ctm, rotation), zoom, zoom);
+
+	if (output_format == OUT_TGA)
+	{
+		fz_pre_scale(fz_pre_translate(ctm, 0, -height), 1, -1);
+	}
+
+	*tbounds = *mediabox;
+	fz_round_rect(ibounds, fz_transform_rect(tbounds, ctm));
+
+	/* Make local copies of our width/height */
+	w = width;
+	h = height;
+
+	/* If a resolution is specified, check to see whether w/h are
+	 * exceeded; if not, unset them. */
+	if (res_specified)
+	{
+		int t;
+		t = ibounds->x1 - ibounds->x0;
+		if (w && t <= w)
+			w = 0;
+		t = ibounds->y1 - ibounds->y0;
+		if (h && t <= h)
+			h = 0;
+	}
+
+	/* Now w or h will be 0 unless they need to be enforced. */
+	if (w || h)
+	{
+		float scalex = w / (tbounds->x1 - tbounds->x0);
+		float scaley = h / (tbounds->y1 - tbounds->y0);
+		fz_matrix scale_mat;
+
+		if (fit)
+		{
+			if (w == 0)
+				scalex = 1.0f;
+			if (h == 0)
+				scaley = 1.0f;
+		}
+		else
+		{
+			if (w == 0)
+				scalex = scaley;
+			if (h == 0)
+				scaley = scalex;
+		}
+		if (!fit)
+		{
+			if (scalex > scaley)
+				scalex = scaley;
+			else
+				scaley = scalex;
+		}
+		fz_scale(&scale_mat, scalex, scaley);
+		fz_concat(ctm, ctm, &scale_mat);
+		*tbounds = *mediabox;
+		fz_transform_rect(tbounds, ctm);
+	}
+	fz_round_rect(ibounds, tbounds);
+	fz_rect_from_irect(tbounds, ibounds);
+}
+
+/* Create the band writer for a page (PCLM uses one for the whole file) */
+static void new_page_band_writer(fz_context *ctx)
+{
+	if (output_format == OUT_PGM || output_format == OUT_PPM || output_format == OUT_PNM)
+		bander = fz_new_pnm_band_writer(ctx, out);
+	else if (output_format == OUT_PAM)
+		bander = fz_new_pam_band_writer(ctx, out);
+	else if (output_format == OUT_PNG)
+		bander = fz_new_png_band_writer_with_options(ctx, out, &png_opts);
+	else if (output_format == OUT_PBM)
+		bander = fz_new_pbm_band_writer(ctx, out);
+	else if (output_format == OUT_PKM)
+		bander = fz_new_pkm_band_writer(ctx, out);
+	else if (output_format == OUT_PS)
+		bander = fz_new_ps_band_writer(ctx, out);
+	else if (output_format == OUT_PSD)
+		bander = fz_new_psd_band_writer(ctx, out);
+	else if (output_format == OUT_TGA)
+		bander = fz_new_tga_band_writer(ctx, out, colorspace == fz_device_bgr(ctx));
+	else if (output_format == OUT_PWG)
+	{
+		if (out_cs == CS_MONO)
+			bander = fz_new_mono_pwg_band_writer(ctx, out, NULL);
+		else
+			bander = fz_new_pwg_band_writer(ctx, out, NULL);
+	}
+	else if (output_format == OUT_PCL)
+	{
+		if (out_cs == CS_MONO)
+			bander = fz_new_mono_pcl_band_writer(ctx, out, NULL);
+		else
+			bander = fz_new_color_pcl_band_writer(ctx, out, NULL);
+	}
+}
+
+static void report_timing(int pagenum, int diff, int interptime, int bg)
+{
+	if (bg)
+	{
+		if (diff + interptime < timing.min)
+		{
+			timing.min = diff + interptime;
+			timing.mininterp = interptime;
+			timing.minpage = pagenum;
+			timing.minfilename = filename;
+		}
+		if (diff + interptime > timing.max)
+		{
+			timing.max = diff + interptime;
+			timing.maxinterp = interptime;
+			timing.maxpage = pagenum;
+			timing.maxfilename = filename;
+		}
+		timing.count ++;
+
+		fprintf(stderr, " %dms (interpretation) %dms (rendering) %dms (total)", interptime, diff, diff + interptime);
+	}
+	else
+	{
+		if (diff < timing.min)
+		{
+			timing.min = diff;
+			timing.minpage = pagenum;
+			timing.minfilename = filename;
+		}
+		if (diff > timing.max)
+		{
+			timing.max = diff;
+			timing.maxpage = pagenum;
+			timing.maxfilename = filename;
+		}
+		timing.total += diff;
+		timing.count ++;
+
+		fprintf(stderr, " %dms", diff);
+	}
+}
+
 static void drawband(fz_context *ctx, fz_page *page, fz_display_list *list, const fz_matrix *ctm, const fz_rect *tbounds, fz_cookie *cookie, int band_start, fz_pixmap *pix, fz_bitmap **bit)
 {
 	fz_device *dev = NULL;
@@ -545,6 +733,35 @@ static void dodrawpage(fz_context *ctx, fz_page *page, fz_display_list *list, in
 		}
 	}
 
+	else if (output_format == OUT_LIST)
+	{
+		fz_buffer *buf = NULL;
+		unsigned char *data;
+		size_t len;
+
+		fz_var(buf);
+
+		fz_try(ctx)
+		{
+			if (!output_file_per_page && list_pages_written++ > 0)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "a display list file holds one page; use %%d in the output name");
+			buf = fz_serialize_display_list(ctx, list);
+			len = fz_buffer_storage(ctx, buf, &data);
+			fz_write_data(ctx, out, data, len);
+		}
+		fz_always(ctx)
+		{
+			fz_drop_buffer(ctx, buf);
+		}
+		fz_catch(ctx)
+		{
+			fz_drop_display_list(ctx, list);
+			fz_drop_separations(ctx, seps);
+			fz_drop_page(ctx, page);
+			fz_rethrow(ctx);
+		}
+	}
+
 	else if (output_format == OUT_TEXT || output_format == OUT_HTML || output_format == OUT_XHTML || output_format == OUT_STEXT)
 	{
 		fz_stext_page *text = NULL;
@@ -690,81 +907,17 @@ static void dodrawpage(fz_context *ctx, fz_page *page, fz_display_list *list, in
 	}
 	else
 	{
-		float zoom;
 		fz_matrix ctm;
 		fz_rect tbounds;
 		fz_irect ibounds;
 		fz_pixmap *pix = NULL;
-		int w, h;
 		fz_bitmap *bit = NULL;
 
 		fz_var(pix);
 		fz_var(bander);
 		fz_var(bit);
 
-		zoom = resolution / 72;
-		fz_pre_scale(fz_rotate(&ctm, rotation), zoom, zoom);
-
-		if (output_format == OUT_TGA)
-		{
-			fz_pre_scale(fz_pre_translate(&ctm, 0, -height), 1, -1);
-		}
-
-		tbounds = mediabox;
-		fz_round_rect(&ibounds, fz_transform_rect(&tbounds, &ctm));
-
-		/* Make local copies of our width/height */
-		w = width;
-		h = height;
-
-		/* If a resolution is specified, check to see whether w/h are
-		 * exceeded; if not, unset them. */
-		if (res_specified)
-		{
-			int t;
-			t = ibounds.x1 - ibounds.x0;
-			if (w && t <= w)
-				w = 0;
-			t = ibounds.y1 - ibounds.y0;
-			if (h && t <= h)
-				h = 0;
-		}
-
-		/* Now w or h will be 0 unless they need to be enforced. */
-		if (w || h)
-		{
-			float scalex = w / (tbounds.x1 - tbounds.x0);
-			float scaley = h / (tbounds.y1 - tbounds.y0);
-			fz_matrix scale_mat;
-
-			if (fit)
-			{
-				if (w == 0)
-					scalex = 1.0f;
-				if (h == 0)
-					scaley = 1.0f;
-			}
-			else
-			{
-				if (w == 0)
-					scalex = scaley;
-				if (h == 0)
-					scaley = scalex;
-			}
-			if (!fit)
-			{
-				if (scalex > scaley)
-					scalex = scaley;
-				else
-					scaley = scalex;
-			}
-			fz_scale(&scale_mat, scalex, scaley);
-			fz_concat(&ctm, &ctm, &scale_mat);
-			tbounds = mediabox;
-			fz_transform_rect(&tbounds, &ctm);
-		}
-		fz_round_rect(&ibounds, &tbounds);
-		fz_rect_from_irect(&tbounds, &ibounds);
+		raster_transform(&mediabox, &ctm, &tbounds, &ibounds);
 
 		fz_try(ctx)
 		{
@@ -813,36 +966,7 @@ static void dodrawpage(fz_context *ctx, fz_page *page, fz_display_list *list, in
 			/* Output any page level headers (for banded formats) */
 			if (output)
 			{
-				if (output_format == OUT_PGM || output_format == OUT_PPM || output_format == OUT_PNM)
-					bander = fz_new_pnm_band_writer(ctx, out);
-				else if (output_format == OUT_PAM)
-					bander = fz_new_pam_band_writer(ctx, out);
-				else if (output_format == OUT_PNG)
-					bander = fz_new_png_band_writer(ctx, out);
-				else if (output_format == OUT_PBM)
-					bander = fz_new_pbm_band_writer(ctx, out);
-				else if (output_format == OUT_PKM)
-					bander = fz_new_pkm_band_writer(ctx, out);
-				else if (output_format == OUT_PS)
-					bander = fz_new_ps_band_writer(ctx, out);
-				else if (output_format == OUT_PSD)
-					bander = fz_new_psd_band_writer(ctx, out);
-				else if (output_format == OUT_TGA)
-					bander = fz_new_tga_band_writer(ctx, out, colorspace == fz_device_bgr(ctx));
-				else if (output_format == OUT_PWG)
-				{
-					if (out_cs == CS_MONO)
-						bander = fz_new_mono_pwg_band_writer(ctx, out, NULL);
-					else
-						bander = fz_new_pwg_band_writer(ctx, out, NULL);
-				}
-				else if (output_format == OUT_PCL)
-				{
-					if (out_cs == CS_MONO)
-						bander = fz_new_mono_pcl_band_writer(ctx, out, NULL);
-					else
-						bander = fz_new_color_pcl_band_writer(ctx, out, NULL);
-				}
+				new_page_band_writer(ctx);
 				if (bander)
 				{
 					fz_write_header(ctx, bander, pix->w, totalheight, pix->n, pix->alpha, pix->xres, pix->yres, output_pagenum++, pix->colorspace, pix->seps);
@@ -935,50 +1059,7 @@ static void dodrawpage(fz_context *ctx, fz_page *page, fz_display_list *list, in
 	fz_drop_page(ctx, page);
 
 	if (showtime)
-	{
-		int end = gettime();
-		int diff = end - start;
-
-		if (bg)
-		{
-			if (diff + interptime < timing.min)
-			{
-				timing.min = diff + interptime;
-				timing.mininterp = interptime;
-				timing.minpage = pagenum;
-				timing.minfilename = filename;
-			}
-			if (diff + interptime > timing.max)
-			{
-				timing.max = diff + interptime;
-				timing.maxinterp = interptime;
-				timing.maxpage = pagenum;
-				timing.maxfilename = filename;
-			}
-			timing.count ++;
-
-			fprintf(stderr, " %dms (interpretation) %dms (rendering) %dms (total)", interptime, diff, diff + interptime);
-		}
-		else
-		{
-			if (diff < timing.min)
-			{
-				timing.min = diff;
-				timing.minpage = pagenum;
-				timing.minfilename = filename;
-			}
-			if (diff > timing.max)
-			{
-				timing.max = diff;
-				timing.maxpage = pagenum;
-				timing.maxfilename = filename;
-			}
-			timing.total += diff;
-			timing.count ++;
-
-			fprintf(stderr, " %dms", diff);
-		}
-	}
+		report_timing(pagenum, gettime() - start, interptime, bg);
 
 	fprintf(stderr, "\n");
 
@@ -1005,6 +1086,22 @@ static void bgprint_flush(void)
 	bgprint.started = 0;
 }
 
+static fz_separations *page_separations(fz_context *ctx, fz_page *page)
+{
+	fz_separations *seps = fz_page_separations(ctx, page);
+	if (seps)
+	{
+		int i, n = fz_count_separations(ctx, seps);
+		if (spots == SPOTS_FULL)
+			for (i = 0; i < n; i++)
+				fz_set_separation_behavior(ctx, seps, i, FZ_SEPARATION_SPOT);
+		else
+			for (i = 0; i < n; i++)
+				fz_set_separation_behavior(ctx, seps, i, FZ_SEPARATION_COMPOSITE);
+	}
+	return seps;
+}
+
 static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 {
 	fz_page *page;
@@ -1026,19 +1123,7 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 	if (spots)
 	{
 		fz_try(ctx)
-		{
-			seps = fz_page_separations(ctx, page);
-			if (seps)
-			{
-				int i, n = fz_count_separations(ctx, seps);
-				if (spots == SPOTS_FULL)
-					for (i = 0; i < n; i++)
-						fz_set_separation_behavior(ctx, seps, i, FZ_SEPARATION_SPOT);
-				else
-					for (i = 0; i < n; i++)
-						fz_set_separation_behavior(ctx, seps, i, FZ_SEPARATION_COMPOSITE);
-			}
-		}
+			seps = page_separations(ctx, page);
 		fz_catch(ctx)
 		{
 			fz_drop_page(ctx, page);
@@ -1050,12 +1135,18 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 	{
 		fz_try(ctx)
 		{
-			list = fz_new_display_list(ctx, fz_bound_page(ctx, page, &bounds));
-			dev = fz_new_list_device(ctx, list);
-			if (lowmemory)
-				fz_enable_device_hints(ctx, dev, FZ_NO_CACHE);
-			fz_run_page(ctx, page, dev, &fz_identity, &cookie);
-			fz_close_device(ctx, dev);
+			list = fz_load_display_list_from_disk_store(ctx, doc, pagenum - 1);
+			if (!list)
+			{
+				list = fz_new_display_list(ctx, fz_bound_page(ctx, page, &bounds));
+				dev = fz_new_list_device(ctx, list);
+				if (lowmemory)
+					fz_enable_device_hints(ctx, dev, FZ_NO_CACHE);
+				fz_run_page(ctx, page, dev, &fz_identity, &cookie);
+				fz_close_device(ctx, dev);
+				if (!cookie.errors && !cookie.incomplete)
+					fz_save_display_list_to_disk_store(ctx, doc, pagenum - 1, list);
+			}
 		}
 		fz_always(ctx)
 		{
@@ -1146,10 +1237,269 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 	}
 }
 
+#ifndef DISABLE_MUTHREADS
+/*
+	Page level parallelism. Each page worker interprets and renders
+	whole pages, while the main thread writes the finished pages out in
+	order. PDF documents are shared between the workers; other document
+	types may not be shared between threads, so each worker opens its
+	own copy.
+*/
+static void drawpage_worker(pageworker_t *w)
+{
+	fz_context *ctx = w->ctx;
+	fz_page *page = NULL;
+	fz_display_list *list = NULL;
+	fz_device *dev = NULL;
+	fz_separations *seps = NULL;
+	fz_rect mediabox, tbounds;
+	fz_irect ibounds;
+	fz_matrix ctm;
+	int start;
+
+	fz_var(page);
+	fz_var(list);
+	fz_var(dev);
+	fz_var(seps);
+
+	w->pix = NULL;
+	w->bit = NULL;
+	w->failed = 0;
+	w->interptime = 0;
+	w->rendertime = 0;
+	memset(&w->cookie, 0, sizeof(fz_cookie));
+
+	start = (showtime ? gettime() : 0);
+
+	fz_try(ctx)
+	{
+		page = fz_load_page(ctx, w->doc, w->pagenum - 1);
+		if (spots)
+			seps = page_separations(ctx, page);
+
+		fz_bound_page(ctx, page, &mediabox);
+		list = fz_load_display_list_from_disk_store(ctx, w->doc, w->pagenum - 1);
+		if (!list)
+		{
+			list = fz_new_display_list(ctx, &mediabox);
+			dev = fz_new_list_device(ctx, list);
+			if (lowmemory)
+				fz_enable_device_hints(ctx, dev, FZ_NO_CACHE);
+			fz_run_page(ctx, page, dev, &fz_identity, &w->cookie);
+			fz_close_device(ctx, dev);
+			fz_drop_device(ctx, dev);
+			dev = NULL;
+			if (!w->cookie.errors && !w->cookie.incomplete)
+				fz_save_display_list_to_disk_store(ctx, w->doc, w->pagenum - 1, list);
+		}
+
+		if (showtime)
+		{
+			int end = gettime();
+			w->interptime = end - start;
+			start = end;
+		}
+
+		raster_transform(&mediabox, &ctm, &tbounds, &ibounds);
+		w->pix = fz_new_pixmap_with_bbox(ctx, colorspace, &ibounds, seps, alpha);
+		fz_set_pixmap_resolution(ctx, w->pix, resolution, resolution);
+		drawband(ctx, page, list, &ctm, &tbounds, &w->cookie, 0, w->pix, &w->bit);
+
+		if (showtime)
+			w->rendertime = gettime() - start;
+	}
+	fz_always(ctx)
+	{
+		fz_drop_device(ctx, dev);
+		fz_drop_display_list(ctx, list);
+		fz_drop_separations(ctx, seps);
+		fz_drop_page(ctx, page);
+		fz_flush_warnings(ctx);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, w->pix);
+		w->pix = NULL;
+		w->failed = 1;
+		fz_strlcpy(w->message, fz_caught_message(ctx), sizeof w->message);
+	}
+}
+
+static void output_page_worker(fz_context *ctx, pageworker_t *w)
+{
+	fz_pixmap *pix = w->pix;
+	fz_bitmap *bit = w->bit;
+
+	if (w->failed)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "%s", w->message);
+
+	fprintf(stderr, "page %s %d", filename, w->pagenum);
+
+	if (output_file_per_page)
+	{
+		char text_buffer[512];
+
+		fz_drop_output(ctx, out);
+		fz_snprintf(text_buffer, sizeof(text_buffer), output, w->pagenum);
+		out = fz_new_output_with_path(ctx, text_buffer, output_append);
+		output_append = 1;
+		file_level_headers(ctx);
+	}
+
+	fz_var(bander);
+
+	fz_try(ctx)
+	{
+		if (output)
+		{
+			new_page_band_writer(ctx);
+			if (bander)
+			{
+				fz_write_header(ctx, bander, pix->w, pix->h, pix->n, pix->alpha, pix->xres, pix->yres, output_pagenum++, pix->colorspace, pix->seps);
+				fz_write_band(ctx, bander, bit ? bit->stride : pix->stride, pix->h, bit ? bit->samples : pix->samples);
+			}
+		}
+
+		if (showmd5)
+		{
+			unsigned char digest[16];
+			int i;
+
+			fz_md5_pixmap(ctx, pix, digest);
+			fprintf(stderr, " ");
+			for (i = 0; i < 16; i++)
+				fprintf(stderr, "%02x", digest[i]);
+		}
+	}
+	fz_always(ctx)
+	{
+		if (output_format != OUT_PCLM)
+			fz_drop_band_writer(ctx, bander);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+
+	if (output_file_per_page)
+		file_level_trailers(ctx);
+
+	if (showtime)
+		report_timing(w->pagenum, w->rendertime, w->interptime, 1);
+
+	fprintf(stderr, "\n");
+
+	if (lowmemory)
+		fz_empty_store(ctx);
+
+	if (showmemory)
+		fz_dump_glyph_cache_stats(ctx);
+
+	fz_flush_warnings(ctx);
+
+	if (w->cookie.errors)
+		errored = 1;
+}
+
+static void drop_page_worker_output(fz_context *ctx, pageworker_t *w)
+{
+	fz_drop_bitmap(ctx, w->bit);
+	w->bit = NULL;
+	fz_drop_pixmap(ctx, w->pix);
+	w->pix = NULL;
+}
+
+static void drawrange_parallel(fz_context *ctx, fz_document *doc, const char *range)
+{
+	int page, spage, epage, pagecount, step;
+	int *pages = NULL;
+	int count = 0, max = 0;
+	int i, next = 0, done = 0;
+	pageworker_t *w;
+
+	fz_var(pages);
+	fz_var(next);
+	fz_var(done);
+
+	pagecount = fz_count_pages(ctx, doc);
+
+	fz_try(ctx)
+	{
+		while ((range = fz_parse_page_range(ctx, range, &spage, &epage, pagecount)))
+		{
+			step = (spage < epage ? 1 : -1);
+			for (page = spage; page != epage + step; page += step)
+			{
+				if (count == max)
+				{
+					max = (max ? max * 2 : 64);
+					pages = fz_resize_array(ctx, pages, max, sizeof(*pages));
+				}
+				pages[count++] = page;
+			}
+		}
+
+		/* Keep at most one page in flight per worker */
+		for (next = 0; next < fz_mini(num_page_workers, count); next++)
+		{
+			w = &page_workers[next];
+			w->pagenum = pages[next];
+			DEBUG_THREADS(("Page worker %d, pre-triggering page %d\n", w->num, w->pagenum));
+			mu_trigger_semaphore(&w->start);
+		}
+
+		for (done = 0; done < count; done++)
+		{
+			w = &page_workers[done % num_page_workers];
+			DEBUG_THREADS(("Waiting for page worker %d to complete page %d\n", w->num, w->pagenum));
+			mu_wait_semaphore(&w->stop);
+
+			fz_try(ctx)
+				output_page_worker(ctx, w);
+			fz_always(ctx)
+				drop_page_worker_output(ctx, w);
+			fz_catch(ctx)
+			{
+				if (ignore_errors)
+					fz_warn(ctx, "ignoring error on page %d in '%s'", w->pagenum, filename);
+				else
+					fz_rethrow(ctx);
+			}
+
+			if (next < count)
+			{
+				w->pagenum = pages[next++];
+				DEBUG_THREADS(("Triggering page worker %d for page %d\n", w->num, w->pagenum));
+				mu_trigger_semaphore(&w->start);
+			}
+		}
+	}
+	fz_always(ctx)
+		fz_free(ctx, pages);
+	fz_catch(ctx)
+	{
+		/* Let any pages still in flight finish before giving up */
+		for (i = done + 1; i < next; i++)
+		{
+			w = &page_workers[i % num_page_workers];
+			mu_wait_semaphore(&w->stop);
+			drop_page_worker_output(ctx, w);
+		}
+		fz_rethrow(ctx);
+	}
+}
+#endif
+
 static void drawrange(fz_context *ctx, fz_document *doc, const char *range)
 {
 	int page, spage, epage, pagecount;
 
+#ifndef DISABLE_MUTHREADS
+	if (num_page_workers > 0)
+	{
+		drawrange_parallel(ctx, doc, range);
+		return;
+	}
+#endif
+
 	pagecount = fz_count_pages(ctx, doc);
 
 	while ((range = fz_parse_page_range(ctx, range, &spage, &epage, pagecount)))
@@ -1287,6 +1637,78 @@ static void worker_thread(void *arg)
 	while (me->band >= 0);
 }
 
+#define MAX_SCALE_THREADS 16
+
+typedef struct
+{
+	fz_parallel_job_fn *fn;
+	void *job;
+	int index, step, count;
+	mu_thread thread;
+} scale_thread_t;
+
+static void run_scale_parts(scale_thread_t *me)
+{
+	int i;
+
+	for (i = me->index; i < me->count; i += me->step)
+		me->fn(me->job, i);
+}
+
+static void scale_thread(void *arg)
+{
+	run_scale_parts((scale_thread_t *)arg);
+}
+
+/* Run the parts of a job on up to MAX_SCALE_THREADS short lived
+ * threads, each taking every nthreads'th part. We do the first
+ * thread's share (and that of any we fail to start) ourselves. */
+static void parallel_scale(void *arg, int count, fz_parallel_job_fn *fn, void *job)
+{
+	scale_thread_t threads[MAX_SCALE_THREADS];
+	int i, nthreads;
+
+	memset(threads, 0, sizeof threads);
+	nthreads = fz_mini(count, MAX_SCALE_THREADS);
+	for (i = 0; i < nthreads; i++)
+	{
+		threads[i].fn = fn;
+		threads[i].job = job;
+		threads[i].index = i;
+		threads[i].step = nthreads;
+		threads[i].count = count;
+	}
+	for (i = 1; i < nthreads; i++)
+	{
+		if (mu_create_thread(&threads[i].thread, scale_thread, &threads[i]))
+		{
+			memset(&threads[i].thread, 0, sizeof threads[i].thread);
+			run_scale_parts(&threads[i]);
+		}
+	}
+	if (nthreads > 0)
+		run_scale_parts(&threads[0]);
+	for (i = 1; i < nthreads; i++)
+		mu_destroy_thread(&threads[i].thread);
+}
+
+static void page_worker_thread(void *arg)
+{
+	pageworker_t *me = (pageworker_t *)arg;
+
+	do
+	{
+		DEBUG_THREADS(("Page worker %d waiting\n", me->num));
+		mu_wait_semaphore(&me->start);
+		DEBUG_THREADS(("Page worker %d woken for page %d\n", me->num, me->pagenum));
+		if (me->pagenum >= 0)
+			drawpage_worker(me);
+		DEBUG_THREADS(("Page worker %d completed page %d\n", me->num, me->pagenum));
+		mu_trigger_semaphore(&me->stop);
+	}
+	while (me->pagenum >= 0);
+}
+
 static void bgprint_worker(void *arg)
 {
 	fz_cookie cookie = { 0 };
@@ -1320,7 +1742,7 @@ static inline int iswhite(int ch)
 		ch == '\014' || ch == '\015' || ch == '\040';
 }
 
-static void apply_layer_config(fz_context *ctx, fz_document *doc, const char *lc)
+static void apply_layer_config(fz_context *ctx, fz_document *doc, const char *lc, int verbose)
 {
 #if FZ_ENABLE_PDF
 	pdf_document *pdoc = pdf_specifics(ctx, doc);
@@ -1330,7 +1752,8 @@ static void apply_layer_config(fz_context *ctx, fz_document *doc, const char *lc
 
 	if (!pdoc)
 	{
-		fz_warn(ctx, "Only PDF files have layers");
+		if (verbose)
+			fz_warn(ctx, "Only PDF files have layers");
 		return;
 	}
 
@@ -1339,7 +1762,12 @@ static void apply_layer_config(fz_context *ctx, fz_document *doc, const char *lc
 
 	if (*lc == 0 || *lc == 'l')
 	{
-		int num_configs = pdf_count_layer_configs(ctx, pdoc);
+		int num_configs;
+
+		if (!verbose)
+			return;
+
+		num_configs = pdf_count_layer_configs(ctx, pdoc);
 
 		fprintf(stderr, "Layer configs:\n");
 		for (config = 0; config < num_configs; config++)
@@ -1387,6 +1815,9 @@ static void apply_layer_config(fz_context *ctx, fz_document *doc, const char *lc
 		}
 	}
 
+	if (!verbose)
+		return;
+
 	/* Now list the final state of the config */
 	fprintf(stderr, "Layer Config %d:\n", config);
 	pdf_layer_config_info(ctx, pdoc, config, &info);
@@ -1420,6 +1851,47 @@ static void apply_layer_config(fz_context *ctx, fz_document *doc, const char *lc
 #endif
 }
 
+#ifndef DISABLE_MUTHREADS
+static void open_page_worker_documents(fz_context *ctx, fz_document *shared, const char *password)
+{
+	pdf_document *pdoc = pdf_specifics(ctx, shared);
+	int i;
+
+	if (pdoc)
+	{
+		pdf_enable_threading(ctx, pdoc);
+		for (i = 0; i < num_page_workers; i++)
+			page_workers[i].doc = fz_keep_document(ctx, shared);
+		return;
+	}
+
+	for (i = 0; i < num_page_workers; i++)
+	{
+		fz_document *doc = fz_open_document(ctx, filename);
+		page_workers[i].doc = doc;
+		if (fz_needs_password(ctx, doc))
+		{
+			if (!fz_authenticate_password(ctx, doc, password))
+				fz_throw(ctx, FZ_ERROR_GENERIC, "cannot authenticate password: %s", filename);
+		}
+		fz_layout_document(ctx, doc, layout_w, layout_h, layout_em);
+		if (layer_config)
+			apply_layer_config(ctx, doc, layer_config, 0);
+	}
+}
+
+static void drop_page_worker_documents(fz_context *ctx)
+{
+	int i;
+
+	for (i = 0; i < num_page_workers; i++)
+	{
+		fz_drop_document(ctx, page_workers[i].doc);
+		page_workers[i].doc = NULL;
+	}
+}
+#endif
+
 #ifdef MUDRAW_STANDALONE
 int main(int argc, char **argv)
 #else
@@ -1437,7 +1909,7 @@ int mudraw_main(int argc, char **argv)
 
 	fz_var(doc);
 
-	while ((c = fz_getopt(argc, argv, "p:o:F:R:r:w:h:fB:c:G:Is:A:DiW:H:S:T:U:XLvPl:y:NO:")) != -1)
+	while ((c = fz_getopt(argc, argv, "p:o:F:R:r:w:h:fB:c:G:Is:A:DiW:H:S:T:j:J:U:XLK:vPl:y:NO:Z:")) != -1)
 	{
 		switch (c)
 		{
@@ -1477,6 +1949,7 @@ int mudraw_main(int argc, char **argv)
 			if (strchr(fz_optarg, 'm')) ++showmemory;
 			if (strchr(fz_optarg, 'f')) ++showfeatures;
 			if (strchr(fz_optarg, '5')) ++showmd5;
+			if (strchr(fz_optarg, 's')) ++showstore;
 			break;
 
 		case 'A':
@@ -1501,8 +1974,23 @@ int mudraw_main(int argc, char **argv)
 #else
 			fprintf(stderr, "Threads not enabled in this build\n");
 			break;
+#endif
+		case 'j':
+#ifndef DISABLE_MUTHREADS
+			num_page_workers = atoi(fz_optarg); break;
+#else
+			fprintf(stderr, "Threads not enabled in this build\n");
+			break;
+#endif
+		case 'J':
+#ifndef DISABLE_MUTHREADS
+			num_scale_threads = fz_clampi(atoi(fz_optarg), 0, MAX_SCALE_THREADS); break;
+#else
+			fprintf(stderr, "Threads not enabled in this build\n");
+			break;
 #endif
 		case 'L': lowmemory = 1; break;
+		case 'K': disk_store = fz_optarg; break;
 		case 'P':
 #ifndef DISABLE_MUTHREADS
 			bgprint.active = 1; break;
@@ -1511,6 +1999,7 @@ int mudraw_main(int argc, char **argv)
 			break;
 #endif
 		case 'y': layer_config = fz_optarg; break;
+		case 'Z': png_options = fz_optarg; break;
 
 		case 'v': fprintf(stderr, "mudraw version %s\n", FZ_VERSION); return 1;
 		}
@@ -1542,6 +2031,25 @@ int mudraw_main(int argc, char **argv)
 		}
 	}
 
+	if (num_page_workers > 0)
+	{
+		if (uselist == 0)
+		{
+			fprintf(stderr, "cannot render pages in parallel without using display list\n");
+			exit(1);
+		}
+		if (bgprint.active || num_workers > 0 || band_height != 0)
+		{
+			fprintf(stderr, "cannot combine parallel pages with -P, -T or -B\n");
+			exit(1);
+		}
+		if (showfeatures)
+		{
+			fprintf(stderr, "cannot show page features when rendering pages in parallel\n");
+			exit(1);
+		}
+	}
+
 #ifndef DISABLE_MUTHREADS
 	locks = init_mudraw_locks();
 	if (locks == NULL)
@@ -1563,7 +2071,31 @@ int mudraw_main(int argc, char **argv)
 	fz_set_graphics_min_line_width(ctx, min_line_width);
 	fz_set_cmm_engine(ctx, icc_engine);
 
+	fz_try(ctx)
+		fz_parse_png_options(ctx, &png_opts, png_options);
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "%s\n", fz_caught_message(ctx));
+		fz_drop_context(ctx);
+		exit(1);
+	}
+
+	if (disk_store)
+	{
+		fz_try(ctx)
+			fz_enable_disk_store(ctx, disk_store, (size_t)1 << 30);
+		fz_catch(ctx)
+		{
+			fprintf(stderr, "cannot use disk store: %s\n", fz_caught_message(ctx));
+			fz_drop_context(ctx);
+			exit(1);
+		}
+	}
+
 #ifndef DISABLE_MUTHREADS
+	if (num_scale_threads > 1)
+		fz_tune_parallel(ctx, parallel_scale, NULL, num_scale_threads);
+
 	if (bgprint.active)
 	{
 		int fail = 0;
@@ -1597,6 +2129,30 @@ int mudraw_main(int argc, char **argv)
 			exit(1);
 		}
 	}
+
+	if (num_page_workers > 0)
+	{
+		int i;
+		int fail = 0;
+
+		/* Start the clock before any threads can race to do so */
+		(void)gettime();
+
+		page_workers = fz_calloc(ctx, num_page_workers, sizeof(*page_workers));
+		for (i = 0; i < num_page_workers; i++)
+		{
+			page_workers[i].ctx = fz_clone_context(ctx);
+			page_workers[i].num = i;
+			fail |= mu_create_semaphore(&page_workers[i].start);
+			fail |= mu_create_semaphore(&page_workers[i].stop);
+			fail |= mu_create_thread(&page_workers[i].thread, page_worker_thread, &page_workers[i]);
+		}
+		if (fail)
+		{
+			fprintf(stderr, "page worker startup failed\n");
+			exit(1);
+		}
+	}
 #endif /* DISABLE_MUTHREADS */
 
 	if (layout_css)
@@ -1662,6 +2218,21 @@ int mudraw_main(int argc, char **argv)
 		}
 	}
 
+	if (output_format == OUT_LIST && uselist == 0)
+	{
+		fprintf(stderr, "cannot write display lists without using display list\n");
+		exit(1);
+	}
+
+	if (num_page_workers > 0)
+	{
+		if (output_format != OUT_PAM && output_format != OUT_PGM && output_format != OUT_PPM && output_format != OUT_PNM && output_format != OUT_PNG && output_format != OUT_PBM && output_format != OUT_PKM && output_format != OUT_PWG && output_format != OUT_PCL && output_format != OUT_PCLM && output_format != OUT_PS && output_format != OUT_PSD && output_format != OUT_TGA)
+		{
+			fprintf(stderr, "Parallel page rendering only possible with raster outputs\n");
+			exit(1);
+		}
+	}
+
 	if (band_height)
 	{
 		if (output_format != OUT_PAM && output_format != OUT_PGM && output_format != OUT_PPM && output_format != OUT_PNM && output_format != OUT_PNG && output_format != OUT_PBM && output_format != OUT_PKM && output_format != OUT_PCL && output_format != OUT_PCLM && output_format != OUT_PS && output_format != OUT_PSD)
@@ -1760,7 +2331,7 @@ int mudraw_main(int argc, char **argv)
 	timing.maxpage = 0;
 	timing.minfilename = "";
 	timing.maxfilename = "";
-	if (showtime && bgprint.active)
+	if (showtime && (bgprint.active || num_page_workers > 0))
 		timing.total = gettime();
 
 	fz_try(ctx)
@@ -1796,7 +2367,7 @@ int mudraw_main(int argc, char **argv)
 				fz_layout_document(ctx, doc, layout_w, layout_h, layout_em);
 
 				if (layer_config)
-					apply_layer_config(ctx, doc, layer_config);
+					apply_layer_config(ctx, doc, layer_config, 1);
 
 				if (output_format == OUT_GPROOF)
 				{
@@ -1804,6 +2375,10 @@ int mudraw_main(int argc, char **argv)
 				}
 				else
 				{
+#ifndef DISABLE_MUTHREADS
+					if (num_page_workers > 0)
+						open_page_worker_documents(ctx, doc, password);
+#endif
 					if (fz_optind == argc || !fz_is_page_range(ctx, argv[fz_optind]))
 						drawrange(ctx, doc, "1-N");
 					if (fz_optind < argc && fz_is_page_range(ctx, argv[fz_optind]))
@@ -1811,11 +2386,22 @@ int mudraw_main(int argc, char **argv)
 				}
 
 				bgprint_flush();
+				if (showstore)
+				{
+					fprintf(stderr, "after %s\n", filename);
+					fz_print_store_stats(ctx, fz_stderr(ctx));
+				}
+#ifndef DISABLE_MUTHREADS
+				drop_page_worker_documents(ctx);
+#endif
 				fz_drop_document(ctx, doc);
 				doc = NULL;
 			}
 			fz_catch(ctx)
 			{
+#ifndef DISABLE_MUTHREADS
+				drop_page_worker_documents(ctx);
+#endif
 				fz_drop_document(ctx, doc);
 				doc = NULL;
 
@@ -1860,14 +2446,14 @@ int mudraw_main(int argc, char **argv)
 
 	if (showtime && timing.count > 0)
 	{
-		if (bgprint.active)
+		if (bgprint.active || num_page_workers > 0)
 			timing.total = gettime() - timing.total;
 
 		if (files == 1)
 		{
 			fprintf(stderr, "total %dms / %d pages for an average of %dms\n",
 				timing.total, timing.count, timing.total / timing.count);
-			if (bgprint.active)
+			if (bgprint.active || num_page_workers > 0)
 			{
 				fprintf(stderr, "fastest page %d: %dms (interpretation) %dms (rendering) %dms(total)\n",
 					timing.minpage, timing.mininterp, timing.min - timing.mininterp, timing.min);
@@ -1906,6 +2492,22 @@ int mudraw_main(int argc, char **argv)
 		fz_free(ctx, workers);
 	}
 
+	if (num_page_workers > 0)
+	{
+		int i;
+		for (i = 0; i < num_page_workers; i++)
+		{
+			page_workers[i].pagenum = -1;
+			mu_trigger_semaphore(&page_workers[i].start);
+			mu_wait_semaphore(&page_workers[i].stop);
+			mu_destroy_semaphore(&page_workers[i].start);
+			mu_destroy_semaphore(&page_workers[i].stop);
+			mu_destroy_thread(&page_workers[i].thread);
+			fz_drop_context(page_workers[i].ctx);
+		}
+		fz_free(ctx, page_workers);
+	}
+
 	if (bgprint.active)
 	{
 		bgprint.pagenum = -1;
@@ -374,6 +374,7 @@ static int layout_use_doc_css = 1;
 
 static int showtime = 0;
 static int showmemory = 0;
+static int showstore = 0;
 
 static int ignore_errors = 0;
 static int alphabits_text = 8;
@@ -480,6 +481,7 @@ static void usage(void)
 		"\t-s -\tshow extra information:\n"
 		"\t\tm - show memory use\n"
 		"\t\tt - show timings\n"
+		"\t\ts - show store (cache) statistics after each file\n"
 		"\n"
 		"\t-R {auto,0,90,180,270}\n"
 		"\t\trotate clockwise (default: auto)\n"
@@ -1451,6 +1453,7 @@ int main(int argc, char **argv)
 		case 's':
 			if (strchr(fz_optarg, 't')) ++showtime;
 			if (strchr(fz_optarg, 'm')) ++showmemory;
+			if (strchr(fz_optarg, 's')) ++showstore;
 			break;
 
 		case 'A':
@@ -1659,6 +1662,12 @@ int main(int argc, char **argv)
 				if (fz_optind < argc && fz_is_page_range(ctx, argv[fz_optind]))
 					drawrange(ctx, doc, argv[fz_optind++]);
 
+				if (showstore)
+				{
+					fprintf(stderr, "after %s\n", filename);
+					fz_print_store_stats(ctx, fz_stderr(ctx));
+				}
+
 				fz_drop_document(ctx, doc);
 				doc = NULL;
 			}
@@ -32,6 +32,7 @@ static void usage(void)
 		"\t-f\tcompress font streams\n"
 		"\t-i\tcompress image streams\n"
 		"\t-s\tclean content streams\n"
+		"\t-Z\tpack objects into compressed object streams\n"
 		"\tpages\tcomma separated list of page numbers and ranges\n"
 		);
 	exit(1);
@@ -50,7 +51,7 @@ int pdfclean_main(int argc, char **argv)
 	opts.continue_on_error = 1;
 	opts.errors = &errors;
 
-	while ((c = fz_getopt(argc, argv, "adfgilp:sz")) != -1)
+	while ((c = fz_getopt(argc, argv, "adfgilp:szZ")) != -1)
 	{
 		switch (c)
 		{
@@ -64,6 +65,7 @@ int pdfclean_main(int argc, char **argv)
 		case 'g': opts.do_garbage += 1; break;
 		case 'l': opts.do_linear += 1; break;
 		case 's': opts.do_clean += 1; break;
+		case 'Z': opts.do_objstms += 1; break;
 		default: usage(); break;
 		}
 	}